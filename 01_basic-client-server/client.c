@@ -9,11 +9,61 @@ struct connection {
 
   char *recv_region;
   char *send_region;
+  struct hugebuf recv_buf;
+  struct hugebuf send_buf;
 
   int num_completions;
+
+  size_t buffer_size; // 与服务端协商后的缓冲区大小
+  int mode;
+
+  // 消息大小扫描（MODE_ECHO / MODE_STREAM）的进度
+  size_t msg_size;
+  int iters_left; // 当前大小还需完成的 ping-pong / 发送次数
+  int to_post;    // MODE_STREAM：当前大小还未发布的发送数
+  int outstanding; // MODE_STREAM：已发布但未完成的发送数
+  struct timespec t_size_start;
+
+  // 连接建立各阶段的时间戳（CLOCK_MONOTONIC），用于连接速率测试
+  struct timespec t_start;       // 调用 rdma_resolve_addr
+  struct timespec t_addr;        // ADDR_RESOLVED
+  struct timespec t_qp;          // QP 创建完成
+  struct timespec t_mr;          // 内存注册完成
+  struct timespec t_route_start; // 调用 rdma_resolve_route
+  struct timespec t_route;       // ROUTE_RESOLVED
+  struct timespec t_connect;     // 调用 rdma_connect
+  struct timespec t_established; // ESTABLISHED
+};
+
+// 每个连接各阶段的耗时（ms）
+enum {
+  PHASE_ADDR,
+  PHASE_ROUTE,
+  PHASE_QP,
+  PHASE_MR,
+  PHASE_ACCEPT,
+  PHASE_TOTAL,
+  NUM_PHASES
+};
+
+static const char *s_phase_names[NUM_PHASES] = {
+  "addr resolve", "route resolve", "qp create", "mr register", "accept", "total setup"
 };
 
 static void build_context(struct ibv_context *verbs);
+static void post_message(struct connection *conn, size_t length);
+static void start_size(struct connection *conn);
+static void on_echo_completion(struct connection *conn, struct ibv_wc *wc);
+static void on_stream_completion(struct connection *conn, struct ibv_wc *wc);
+static void fill_window(struct connection *conn);
+static void finish_size(struct connection *conn);
+static int run_sweep(struct addrinfo *addr);
+static void print_mr_stats(void);
+static void launch_connection(struct rdma_event_channel *ec, struct addrinfo *addr);
+static double elapsed_ms(const struct timespec *from, const struct timespec *to);
+static void record_sample(struct connection *conn);
+static void report_benchmark(double seconds);
+static int run_benchmark(struct addrinfo *addr);
 static void build_qp_attr(struct ibv_qp_init_attr *qp_attr);
 static void * poll_cq(void *);
 static void post_receives(struct connection *conn);
@@ -21,37 +71,121 @@ static void register_memory(struct connection *conn);
 
 static int on_addr_resolved(struct rdma_cm_id *id);
 static void on_completion(struct ibv_wc *wc);
-static int on_connection(void *context);
+static int on_connection(struct rdma_cm_id *id, const struct conn_pdata *pdata);
 static int on_disconnect(struct rdma_cm_id *id);
 static int on_event(struct rdma_cm_event *event);
 static int on_route_resolved(struct rdma_cm_id *id);
 
+struct odp_implicit_mr odp_implicit[ODP_MAX_IMPLICIT]; // odp_mr.h 的隐式 MR 表，每个程序只定义一次
+
 static struct context *s_ctx = NULL;
 
+// 连接速率测试模式（-n）：同时保持 s_parallelism 个连接在建立中，共建立 s_connections 个
+static int s_bench = 0;
+static int s_connections = 0;
+static int s_parallelism = 16;
+static int s_launched = 0;
+static int s_finished = 0;
+static double *s_samples[NUM_PHASES];
+static struct rdma_event_channel *s_bench_ec = NULL;
+static struct addrinfo *s_bench_addr = NULL;
+
+// 测试模式下每个连接的打印会拖慢事件循环，只在默认模式下输出
+#define LOG(...) do { if (!s_bench) printf(__VA_ARGS__); } while (0)
+
+// 请求的缓冲区大小（-b），以及消息大小扫描模式（-s / -w）的参数
+static size_t s_buffer_size = 0;
+static int s_mode = MODE_HELLO;
+static int s_iterations = 0; // 0 表示按模式取默认值
+static int s_window = 0; // 流式模式（-w）下未完成发送的上限
+
+const size_t SWEEP_MIN_SIZE = 64;
+const size_t SWEEP_BYTES_PER_SIZE = 1073741824; // 大消息减少迭代次数，每个大小最多传输这么多字节
+
+struct sweep_result {
+  size_t size;
+  int iterations;
+  double elapsed_ms;
+};
+
+static struct sweep_result s_sweep[64];
+static int s_num_sweep = 0;
+
+// 收发缓冲区的注册方式（RDMA_MR_MODE=pinned|odp|implicit）
+static int s_mr_mode = MR_MODE_PINNED;
+
 int main(int argc, char **argv)
 {
   struct addrinfo *addr;
   struct rdma_cm_event *event = NULL;
-  struct rdma_cm_id *conn= NULL;
   struct rdma_event_channel *ec = NULL;
+  int op;
+
+  const char *usage = "usage: client [-b <buffer-bytes>] [-n <connections> [-p <parallelism>] | -s [-i <iterations>] | -w <window> [-i <messages>]] <server-address> <server-port>";
+
+  while ((op = getopt(argc, argv, "n:p:b:si:w:")) != -1) {
+    if (op == 'n')
+      s_connections = atoi(optarg);
+    else if (op == 'p')
+      s_parallelism = atoi(optarg);
+    else if (op == 'b')
+      s_buffer_size = strtoul(optarg, NULL, 0);
+    else if (op == 's')
+      s_mode = MODE_ECHO;
+    else if (op == 'i')
+      s_iterations = atoi(optarg);
+    else if (op == 'w') {
+      s_mode = MODE_STREAM;
+      s_window = atoi(optarg);
+    } else
+      die(usage);
+  }
 
-  if (argc != 3)
-    die("usage: client <server-address> <server-port>");
+  if (argc - optind != 2)
+    die(usage);
 
-  TEST_NZ(getaddrinfo(argv[1], argv[2], NULL, &addr));
+  // 扫描模式默认一直扫到最大缓冲区，其它模式只需要放得下一条问候消息
+  if (s_buffer_size == 0)
+    s_buffer_size = (s_mode == MODE_HELLO) ? DEFAULT_BUFFER_SIZE : BUFFER_SIZE;
+  if (s_buffer_size < SWEEP_MIN_SIZE || s_buffer_size > BUFFER_SIZE)
+    die("client: buffer size must be between 64 bytes and 1 GiB.");
+  if (s_mode == MODE_STREAM && (s_window < 1 || s_window > MAX_STREAM_WINDOW))
+    die("client: window must be between 1 and 256.");
+  if (s_iterations < 1)
+    s_iterations = (s_mode == MODE_STREAM) ? 100000 : 1000; // 流式模式每条消息开销小，默认多发一些
+
+  s_mr_mode = mr_mode_from_env();
+
+  TEST_NZ(getaddrinfo(argv[optind], argv[optind + 1], NULL, &addr));
+
+  if (s_mode == MODE_ECHO || s_mode == MODE_STREAM) {
+    int r = run_sweep(addr);
+
+    print_mr_stats();
+    freeaddrinfo(addr);
+    return r;
+  }
+
+  if (s_connections > 0) {
+    int r = run_benchmark(addr);
+
+    print_mr_stats();
+    freeaddrinfo(addr);
+    return r;
+  }
 
   struct timeval timestart;
   struct timeval timeend;
   double meanTotalTime = 0.0f;
   for (int i = 0; i < 20; i++) {
     TEST_Z(ec = rdma_create_event_channel());
-    TEST_NZ(rdma_create_id(ec, &conn, NULL, RDMA_PS_TCP));
-    TEST_NZ(rdma_resolve_addr(conn, NULL, addr->ai_addr, TIMEOUT_IN_MS));
     gettimeofday(&timestart, NULL);
+    launch_connection(ec, addr);
     while (rdma_get_cm_event(ec, &event) == 0) {
       struct rdma_cm_event event_copy;
+      struct conn_pdata pdata;
 
-      memcpy(&event_copy, event, sizeof(*event));
+      copy_cm_event(&event_copy, event, &pdata);
       rdma_ack_cm_event(event);
 
       if (on_event(&event_copy))
@@ -74,16 +208,24 @@ int main(int argc, char **argv)
   }
 
   // 写入数据
-  fprintf(outFile, "%d, %f\n", BUFFER_SIZE, meanTotalTime);
+  fprintf(outFile, "%zu, %f\n", s_buffer_size, meanTotalTime);
 
   // 关闭文件
   fclose(outFile);
   printf("mean time = %lf ms\n", meanTotalTime);
+  print_mr_stats();
   rdma_destroy_event_channel(ec);
   freeaddrinfo(addr);
   return 0;
 }
 
+// ODP 模式下打印缺页计数，便于和锁定内存的注册方式对比
+void print_mr_stats(void)
+{
+  if (s_mr_mode != MR_MODE_PINNED && s_ctx)
+    odp_print_stats(s_ctx->ctx);
+}
+
 void build_context(struct ibv_context *verbs)
 {
   if (s_ctx) {
@@ -96,13 +238,191 @@ void build_context(struct ibv_context *verbs)
   s_ctx = (struct context *)malloc(sizeof(struct context));
 
   s_ctx->ctx = verbs;
+  s_ctx->comp_vector = -1;
+  s_ctx->poller_cpu = -1;
+
+  nic_resolve_affinity(s_ctx->ctx, &s_ctx->comp_vector, &s_ctx->poller_cpu);
 
   TEST_Z(s_ctx->pd = ibv_alloc_pd(s_ctx->ctx));
   TEST_Z(s_ctx->comp_channel = ibv_create_comp_channel(s_ctx->ctx));
-  TEST_Z(s_ctx->cq = ibv_create_cq(s_ctx->ctx, 10, NULL, s_ctx->comp_channel, 0)); /* cqe=10 is arbitrary */
+  TEST_Z(s_ctx->cq = ibv_create_cq(s_ctx->ctx, CQ_DEPTH, NULL, s_ctx->comp_channel, s_ctx->comp_vector)); // 所有连接共享一个 CQ
   TEST_NZ(ibv_req_notify_cq(s_ctx->cq, 0));
 
   TEST_NZ(pthread_create(&s_ctx->cq_poller_thread, NULL, poll_cq, NULL));
+  nic_pin_thread(s_ctx->cq_poller_thread, s_ctx->poller_cpu);
+}
+
+// 分配连接并发起地址解析，id->context 从一开始就指向连接，以便记录每个阶段的时间
+void launch_connection(struct rdma_event_channel *ec, struct addrinfo *addr)
+{
+  struct connection *conn;
+  struct rdma_cm_id *id;
+
+  TEST_Z(conn = (struct connection *)calloc(1, sizeof(struct connection)));
+  conn->buffer_size = s_buffer_size;
+  conn->mode = s_mode;
+
+  clock_gettime(CLOCK_MONOTONIC, &conn->t_start);
+  TEST_NZ(rdma_create_id(ec, &id, conn, RDMA_PS_TCP));
+  conn->id = id;
+  TEST_NZ(rdma_resolve_addr(id, NULL, addr->ai_addr, TIMEOUT_IN_MS));
+}
+
+double elapsed_ms(const struct timespec *from, const struct timespec *to)
+{
+  return (to->tv_sec - from->tv_sec) * 1e3 + (to->tv_nsec - from->tv_nsec) / 1e6;
+}
+
+void record_sample(struct connection *conn)
+{
+  int i = s_finished;
+
+  s_samples[PHASE_ADDR][i] = elapsed_ms(&conn->t_start, &conn->t_addr);
+  s_samples[PHASE_ROUTE][i] = elapsed_ms(&conn->t_route_start, &conn->t_route);
+  s_samples[PHASE_QP][i] = elapsed_ms(&conn->t_addr, &conn->t_qp);
+  s_samples[PHASE_MR][i] = elapsed_ms(&conn->t_qp, &conn->t_mr);
+  s_samples[PHASE_ACCEPT][i] = elapsed_ms(&conn->t_connect, &conn->t_established);
+  s_samples[PHASE_TOTAL][i] = elapsed_ms(&conn->t_start, &conn->t_established);
+}
+
+static int compare_double(const void *a, const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+
+  return (x > y) - (x < y);
+}
+
+void report_benchmark(double seconds)
+{
+  int n = s_connections;
+
+  printf("%d connections, parallelism %d: %.3f s, %.1f conn/s\n",
+         n, s_parallelism, seconds, n / seconds);
+  printf("%-14s %10s %10s %10s %10s\n", "phase (ms)", "mean", "p50", "p99", "max");
+
+  for (int p = 0; p < NUM_PHASES; p++) {
+    double *v = s_samples[p];
+    double sum = 0.0;
+
+    qsort(v, n, sizeof(double), compare_double);
+    for (int i = 0; i < n; i++)
+      sum += v[i];
+
+    printf("%-14s %10.3f %10.3f %10.3f %10.3f\n", s_phase_names[p],
+           sum / n, v[(n - 1) * 50 / 100], v[(n - 1) * 99 / 100], v[n - 1]);
+  }
+}
+
+// 连接速率测试：在同一个事件通道上并发建立连接，每个连接完成一次收发后断开，并立即补上新的连接
+int run_benchmark(struct addrinfo *addr)
+{
+  struct rdma_cm_event *event = NULL;
+  struct timespec begin, end;
+
+  if (s_parallelism < 1)
+    s_parallelism = 1;
+  if (s_parallelism > s_connections)
+    s_parallelism = s_connections;
+  if (s_parallelism > CQ_DEPTH / 2)
+    s_parallelism = CQ_DEPTH / 2; // 每个在建的连接在共享 CQ 上最多占一个发送和一个接收完成
+
+  for (int p = 0; p < NUM_PHASES; p++)
+    TEST_Z(s_samples[p] = (double *)malloc(s_connections * sizeof(double)));
+
+  s_bench = 1;
+  s_bench_addr = addr;
+  TEST_Z(s_bench_ec = rdma_create_event_channel());
+
+  clock_gettime(CLOCK_MONOTONIC, &begin);
+
+  for (s_launched = 0; s_launched < s_parallelism; s_launched++)
+    launch_connection(s_bench_ec, addr);
+
+  while (rdma_get_cm_event(s_bench_ec, &event) == 0) {
+    struct rdma_cm_event event_copy;
+    struct conn_pdata pdata;
+
+    copy_cm_event(&event_copy, event, &pdata);
+    rdma_ack_cm_event(event);
+
+    if (on_event(&event_copy))
+      break;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  if (s_finished != s_connections)
+    die("benchmark: event channel closed before all connections finished.");
+
+  report_benchmark(elapsed_ms(&begin, &end) / 1e3);
+
+  for (int p = 0; p < NUM_PHASES; p++)
+    free(s_samples[p]);
+
+  rdma_destroy_event_channel(s_bench_ec);
+
+  return 0;
+}
+
+// 消息大小扫描：单个连接上从 64 字节开始逐次翻倍。
+// MODE_ECHO 每个大小做若干次 ping-pong，记录往返时间；MODE_STREAM 保持一个窗口的未完成发送，记录吞吐量和消息速率
+int run_sweep(struct addrinfo *addr)
+{
+  struct rdma_cm_event *event = NULL;
+  struct rdma_event_channel *ec = NULL;
+  FILE *outFile;
+
+  TEST_Z(ec = rdma_create_event_channel());
+  launch_connection(ec, addr);
+
+  while (rdma_get_cm_event(ec, &event) == 0) {
+    struct rdma_cm_event event_copy;
+    struct conn_pdata pdata;
+
+    copy_cm_event(&event_copy, event, &pdata);
+    rdma_ack_cm_event(event);
+
+    if (on_event(&event_copy))
+      break;
+  }
+
+  rdma_destroy_event_channel(ec);
+
+  if (s_mode == MODE_STREAM) {
+    printf("%12s %10s %14s %14s\n", "size (B)", "messages", "bw (MB/s)", "rate (Mmsg/s)");
+
+    for (int i = 0; i < s_num_sweep; i++) {
+      struct sweep_result *r = &s_sweep[i];
+      double seconds = r->elapsed_ms / 1e3;
+
+      printf("%12zu %10d %14.2f %14.3f\n", r->size, r->iterations,
+             (double)r->size * r->iterations / seconds / 1e6, r->iterations / seconds / 1e6);
+    }
+
+    return 0;
+  }
+
+  // 追加到 logfile.csv：消息大小, 单程延迟 (ms), 带宽 (MB/s)
+  outFile = fopen("./logfile.csv", "a");
+  if (outFile == NULL) {
+    perror("Error opening file");
+    return -1;
+  }
+
+  printf("%12s %8s %14s %14s\n", "size (B)", "iters", "latency (us)", "bw (MB/s)");
+
+  for (int i = 0; i < s_num_sweep; i++) {
+    struct sweep_result *r = &s_sweep[i];
+    double latency_ms = r->elapsed_ms / r->iterations / 2.0; // ping-pong 往返时间的一半
+    double bandwidth = 2.0 * r->size * r->iterations / (r->elapsed_ms / 1e3) / 1e6;
+
+    printf("%12zu %8d %14.3f %14.2f\n", r->size, r->iterations, latency_ms * 1e3, bandwidth);
+    fprintf(outFile, "%zu, %f, %f\n", r->size, latency_ms, bandwidth);
+  }
+
+  fclose(outFile);
+
+  return 0;
 }
 
 void build_qp_attr(struct ibv_qp_init_attr *qp_attr)
@@ -113,7 +433,7 @@ void build_qp_attr(struct ibv_qp_init_attr *qp_attr)
   qp_attr->recv_cq = s_ctx->cq;
   qp_attr->qp_type = IBV_QPT_RC;
 
-  qp_attr->cap.max_send_wr = 10;
+  qp_attr->cap.max_send_wr = (s_mode == MODE_STREAM) ? s_window : 10;
   qp_attr->cap.max_recv_wr = 10;
   qp_attr->cap.max_send_sge = 1;
   qp_attr->cap.max_recv_sge = 1;
@@ -147,7 +467,7 @@ void post_receives(struct connection *conn)
   wr.num_sge = 1;
 
   sge.addr = (uintptr_t)conn->recv_region;
-  sge.length = BUFFER_SIZE;
+  sge.length = conn->buffer_size;
   sge.lkey = conn->recv_mr->lkey;
 
   TEST_NZ(ibv_post_recv(conn->qp, &wr, &bad_wr));
@@ -155,43 +475,50 @@ void post_receives(struct connection *conn)
 
 void register_memory(struct connection *conn)
 {
-  conn->send_region = malloc(BUFFER_SIZE);
-  conn->recv_region = malloc(BUFFER_SIZE);
+  // ODP 模式下不预先触碰缓冲区，由网卡在首次访问时按需缺页
+  TEST_NZ(hugebuf_alloc_ex(&conn->send_buf, conn->buffer_size, s_mr_mode == MR_MODE_PINNED));
+  TEST_NZ(hugebuf_alloc_ex(&conn->recv_buf, conn->buffer_size, s_mr_mode == MR_MODE_PINNED));
+  conn->send_region = conn->send_buf.addr;
+  conn->recv_region = conn->recv_buf.addr;
 
-  TEST_Z(conn->send_mr = ibv_reg_mr(
+  TEST_Z(conn->send_mr = odp_reg_mr(
     s_ctx->pd, 
     conn->send_region, 
-    BUFFER_SIZE, 
-    0));
+    conn->buffer_size, 
+    0,
+    s_mr_mode));
 
-  TEST_Z(conn->recv_mr = ibv_reg_mr(
+  TEST_Z(conn->recv_mr = odp_reg_mr(
     s_ctx->pd, 
     conn->recv_region, 
-    BUFFER_SIZE, 
-    IBV_ACCESS_LOCAL_WRITE));
+    conn->buffer_size, 
+    IBV_ACCESS_LOCAL_WRITE,
+    s_mr_mode));
 }
 
 int on_addr_resolved(struct rdma_cm_id *id)
 {
   struct ibv_qp_init_attr qp_attr;
-  struct connection *conn;
+  struct connection *conn = (struct connection *)id->context;
 
-  printf("address resolved.\n");
+  clock_gettime(CLOCK_MONOTONIC, &conn->t_addr);
+  LOG("address resolved.\n");
 
   build_context(id->verbs);
   build_qp_attr(&qp_attr);
 
   TEST_NZ(rdma_create_qp(id, s_ctx->pd, &qp_attr));
 
-  id->context = conn = (struct connection *)malloc(sizeof(struct connection));
-
-  conn->id = id;
   conn->qp = id->qp;
   conn->num_completions = 0;
+  clock_gettime(CLOCK_MONOTONIC, &conn->t_qp);
 
   register_memory(conn);
+  clock_gettime(CLOCK_MONOTONIC, &conn->t_mr);
+
   post_receives(conn);
 
+  clock_gettime(CLOCK_MONOTONIC, &conn->t_route_start);
   TEST_NZ(rdma_resolve_route(id, TIMEOUT_IN_MS));
 
   return 0;
@@ -204,10 +531,20 @@ void on_completion(struct ibv_wc *wc)
   if (wc->status != IBV_WC_SUCCESS)
     die("on_completion: status is not IBV_WC_SUCCESS.");
 
+  if (conn->mode == MODE_ECHO) {
+    on_echo_completion(conn, wc);
+    return;
+  }
+
+  if (conn->mode == MODE_STREAM) {
+    on_stream_completion(conn, wc);
+    return;
+  }
+
   if (wc->opcode & IBV_WC_RECV)
-    printf("received message: %s\n", conn->recv_region);
+    LOG("received message: %s\n", conn->recv_region);
   else if (wc->opcode == IBV_WC_SEND)
-    printf("send completed successfully.\n");
+    LOG("send completed successfully.\n");
   else
     die("on_completion: completion isn't a send or a receive.");
 
@@ -215,16 +552,12 @@ void on_completion(struct ibv_wc *wc)
     rdma_disconnect(conn->id);
 }
 
-int on_connection(void *context)
+// 发送时只携带实际写入的 length 字节，而不是整个缓冲区
+void post_message(struct connection *conn, size_t length)
 {
-  struct connection *conn = (struct connection *)context;
   struct ibv_send_wr wr, *bad_wr = NULL;
   struct ibv_sge sge;
 
-  snprintf(conn->send_region, BUFFER_SIZE, "message from active/client side with pid %d", getpid());
-
-  printf("connected. posting send...\n");
-
   memset(&wr, 0, sizeof(wr));
 
   wr.wr_id = (uintptr_t)conn;
@@ -234,10 +567,115 @@ int on_connection(void *context)
   wr.send_flags = IBV_SEND_SIGNALED;
 
   sge.addr = (uintptr_t)conn->send_region;
-  sge.length = BUFFER_SIZE;
+  sge.length = length;
   sge.lkey = conn->send_mr->lkey;
 
   TEST_NZ(ibv_post_send(conn->qp, &wr, &bad_wr));
+}
+
+void start_size(struct connection *conn)
+{
+  conn->iters_left = s_iterations;
+  if ((size_t)s_iterations * conn->msg_size > SWEEP_BYTES_PER_SIZE)
+    conn->iters_left = SWEEP_BYTES_PER_SIZE / conn->msg_size;
+  if (conn->iters_left < 1)
+    conn->iters_left = 1;
+
+  s_sweep[s_num_sweep].size = conn->msg_size;
+  s_sweep[s_num_sweep].iterations = conn->iters_left;
+
+  clock_gettime(CLOCK_MONOTONIC, &conn->t_size_start);
+
+  if (conn->mode == MODE_STREAM) {
+    conn->to_post = conn->iters_left;
+    fill_window(conn);
+    return;
+  }
+
+  post_message(conn, conn->msg_size);
+}
+
+// 记录当前大小的耗时，然后换到下一个大小，扫完后断开连接
+void finish_size(struct connection *conn)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  s_sweep[s_num_sweep++].elapsed_ms = elapsed_ms(&conn->t_size_start, &now);
+
+  conn->msg_size *= 2;
+  if (conn->msg_size > conn->buffer_size) {
+    rdma_disconnect(conn->id);
+    return;
+  }
+
+  start_size(conn);
+}
+
+// 补满发送窗口。所有发送都从同一块缓冲区发出，内容无关紧要
+void fill_window(struct connection *conn)
+{
+  while (conn->outstanding < s_window && conn->to_post > 0) {
+    post_message(conn, conn->msg_size);
+    conn->outstanding++;
+    conn->to_post--;
+  }
+}
+
+// 流式模式下每个发送完成让出一个窗口位置；接收端的接收环由服务端分批补充
+void on_stream_completion(struct connection *conn, struct ibv_wc *wc)
+{
+  if (wc->opcode != IBV_WC_SEND)
+    return;
+
+  conn->outstanding--;
+
+  if (--conn->iters_left > 0) {
+    fill_window(conn);
+    return;
+  }
+
+  finish_size(conn);
+}
+
+// 扫描模式下服务端回送的消息到达即完成一次 ping-pong；发送完成事件不需要处理
+void on_echo_completion(struct connection *conn, struct ibv_wc *wc)
+{
+  if (!(wc->opcode & IBV_WC_RECV))
+    return;
+
+  post_receives(conn);
+
+  if (--conn->iters_left > 0) {
+    post_message(conn, conn->msg_size);
+    return;
+  }
+
+  finish_size(conn);
+}
+
+int on_connection(struct rdma_cm_id *id, const struct conn_pdata *pdata)
+{
+  struct connection *conn = (struct connection *)id->context;
+  size_t agreed = ntohl(pdata->buffer_size);
+
+  clock_gettime(CLOCK_MONOTONIC, &conn->t_established);
+
+  // 服务端可能同意比请求更小的缓冲区，此后的消息不能超过这个大小
+  if (agreed > 0 && agreed < conn->buffer_size)
+    conn->buffer_size = agreed;
+
+  if (conn->mode == MODE_ECHO || conn->mode == MODE_STREAM) {
+    printf("connected, buffer size %zu. starting message-size sweep...\n", conn->buffer_size);
+    conn->msg_size = SWEEP_MIN_SIZE;
+    start_size(conn);
+    return 0;
+  }
+
+  snprintf(conn->send_region, conn->buffer_size, "message from active/client side with pid %d", getpid());
+
+  LOG("connected. posting send...\n");
+  post_message(conn, strlen(conn->send_region) + 1);
 
   return 0;
 }
@@ -246,20 +684,33 @@ int on_disconnect(struct rdma_cm_id *id)
 {
   struct connection *conn = (struct connection *)id->context;
 
-  printf("disconnected.\n");
+  LOG("disconnected.\n");
+
+  if (s_bench)
+    record_sample(conn);
 
   rdma_destroy_qp(id);
 
-  ibv_dereg_mr(conn->send_mr);
-  ibv_dereg_mr(conn->recv_mr);
+  odp_dereg_mr(conn->send_mr);
+  odp_dereg_mr(conn->recv_mr);
 
-  free(conn->send_region);
-  free(conn->recv_region);
+  hugebuf_free(&conn->send_buf);
+  hugebuf_free(&conn->recv_buf);
 
   free(conn);
 
   rdma_destroy_id(id);
 
+  if (s_bench) {
+    // 测试模式下一个连接结束就补上一个，直到建立够 s_connections 个
+    if (s_launched < s_connections) {
+      launch_connection(s_bench_ec, s_bench_addr);
+      s_launched++;
+    }
+
+    return ++s_finished == s_connections;
+  }
+
   return 1; // 对于客户端而言，这里返回1，表示不再等待新的连接
 }
 
@@ -272,11 +723,14 @@ int on_event(struct rdma_cm_event *event)
   else if (event->event == RDMA_CM_EVENT_ROUTE_RESOLVED)
     r = on_route_resolved(event->id);
   else if (event->event == RDMA_CM_EVENT_ESTABLISHED)
-    r = on_connection(event->id->context);
+    r = on_connection(event->id, event->param.conn.private_data);
   else if (event->event == RDMA_CM_EVENT_DISCONNECTED)
     r = on_disconnect(event->id);
-  else
+  else {
+    // 连接风暴下服务端 backlog 或资源耗尽时会出现 REJECTED/UNREACHABLE 等事件
+    fprintf(stderr, "on_event: unexpected event %s.\n", rdma_event_str(event->event));
     die("on_event: unknown event.");
+  }
 
   return r;
 }
@@ -284,10 +738,21 @@ int on_event(struct rdma_cm_event *event)
 int on_route_resolved(struct rdma_cm_id *id)
 {
   struct rdma_conn_param cm_params;
+  struct conn_pdata pdata;
+  struct connection *conn = (struct connection *)id->context;
+
+  clock_gettime(CLOCK_MONOTONIC, &conn->t_route);
+  LOG("route resolved.\n");
 
-  printf("route resolved.\n");
+  pdata.buffer_size = htonl(conn->buffer_size);
+  pdata.mode = htonl(conn->mode);
+  pdata.window = htonl(s_window);
 
   memset(&cm_params, 0, sizeof(cm_params));
+  cm_params.private_data = &pdata;
+  cm_params.private_data_len = sizeof(pdata);
+  cm_params.rnr_retry_count = 7; // 接收环暂时补充不及时时（RNR）无限重试，而不是让连接出错
+  clock_gettime(CLOCK_MONOTONIC, &conn->t_connect);
   TEST_NZ(rdma_connect(id, &cm_params));
 
   return 0;
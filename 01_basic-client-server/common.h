@@ -1,17 +1,30 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <netdb.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/time.h>
+#include <time.h>
 #include <rdma/rdma_cma.h>
 
+#include "hugepage_alloc.h"
+#include "nic_affinity.h"
+#include "odp_mr.h"
+
 // 两个宏用于错误检查
 #define TEST_NZ(x) do { if ( (x)) die("error: " #x " failed (returned non-zero)." ); } while (0)
 #define TEST_Z(x)  do { if (!(x)) die("error: " #x " failed (returned zero/null)."); } while (0)
 
-const int BUFFER_SIZE = 1073741824;
+const int BUFFER_SIZE = 1073741824; // 每个连接可协商的最大缓冲区
+const int DEFAULT_BUFFER_SIZE = 4096; // 客户端未指定 -b 时请求的缓冲区大小
 const int TIMEOUT_IN_MS = 1000; /* ms */
+const int CQ_DEPTH = 1024; // 所有连接共享一个 CQ，每个连接最多同时有一个发送和一个接收未完成
+const int LISTEN_BACKLOG = 1024; // 客户端并发建连时，backlog 太小会导致连接被拒绝
+const int MAX_STREAM_WINDOW = 256; // 流式模式下服务端的接收环是窗口的两倍，需要放得进 CQ_DEPTH
 
 struct context {
   struct ibv_context *ctx; // 代表了一个与RDMA设备的特定上下文的连接。这个上下文包含了执行RDMA操作所需的所有资源和信息，如设备特性和配置。
@@ -20,6 +33,21 @@ struct context {
   struct ibv_comp_channel *comp_channel; // Completion Channel，完成通道，在完成队列中有新的完成事件时通知应用程序
 
   pthread_t cq_poller_thread; //记录 轮询线程 的线程ID，负责定期检查完成队列，处理完成事件。
+  int comp_vector; // CQ 使用的中断向量，与轮询线程绑定的 CPU 对应
+  int poller_cpu; // 轮询线程绑定的 CPU（位于网卡所在的 NUMA 节点上），-1 表示不绑定
+};
+
+// 连接时通过 rdma_conn_param.private_data 协商的参数，字段均为网络字节序
+struct conn_pdata {
+  uint32_t buffer_size; // 客户端请求 / 服务端同意的缓冲区大小（单条消息的上限）
+  uint32_t mode;        // MODE_HELLO、MODE_ECHO 或 MODE_STREAM
+  uint32_t window;      // MODE_STREAM：客户端未完成发送的上限，服务端据此确定接收环深度
+};
+
+enum {
+  MODE_HELLO = 0, // 双方各发送一条问候消息后断开
+  MODE_ECHO = 1,  // 服务端把收到的每条消息按原大小回送，用于消息大小扫描
+  MODE_STREAM = 2 // 客户端保持一个窗口的未完成发送，服务端只接收，用于测量吞吐量和消息速率
 };
 
 void die(const char *reason)
@@ -27,3 +55,18 @@ void die(const char *reason)
   fprintf(stderr, "%s\n", reason);
   exit(EXIT_FAILURE);
 }
+
+// rdma_ack_cm_event() 会连同 private_data 一起释放事件，因此在确认之前把协商参数复制到 pdata 中。
+// 复制出的事件的 private_data 总是指向 pdata，对端没有携带参数时 pdata 全为 0
+void copy_cm_event(struct rdma_cm_event *dst, struct rdma_cm_event *src, struct conn_pdata *pdata)
+{
+  memcpy(dst, src, sizeof(*src));
+  memset(pdata, 0, sizeof(*pdata));
+
+  if ((src->event == RDMA_CM_EVENT_CONNECT_REQUEST || src->event == RDMA_CM_EVENT_ESTABLISHED) &&
+      src->param.conn.private_data && src->param.conn.private_data_len >= sizeof(*pdata))
+    memcpy(pdata, src->param.conn.private_data, sizeof(*pdata));
+
+  dst->param.conn.private_data = pdata;
+  dst->param.conn.private_data_len = sizeof(*pdata);
+}
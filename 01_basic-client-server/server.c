@@ -8,21 +8,33 @@ struct connection {
 
   char *recv_region; // 接收数据的缓冲区，这块内存通常会被注册为一个内存区域（通过recv_mr），以便通过RDMA进行访问。
   char *send_region;
+  struct hugebuf recv_buf; // 缓冲区的实际映射（尽量使用大页），recv_region/send_region 指向其中
+  struct hugebuf send_buf;
+
+  size_t buffer_size; // 与客户端协商后的缓冲区大小
+  int mode; // MODE_HELLO、MODE_ECHO 或 MODE_STREAM
+  int window; // MODE_STREAM：客户端的发送窗口，接收环深度为它的两倍
+  int unreposted; // MODE_STREAM：已消耗但还未补充的接收请求数
 }; // conn->recv_region提供了数据接收的物理内存位置，conn->recv_mr代表了这块内存的注册状态，而struct ibv_sge则用于在RDMA操作中引用这块内存
 
 static void build_context(struct ibv_context *verbs);
 static void build_qp_attr(struct ibv_qp_init_attr *qp_attr);
 static void * poll_cq(void *);
 static void post_receives(struct connection *conn);
+static void post_receive_batch(struct connection *conn, int count);
 static void register_memory(struct connection *conn);
+static void post_message(struct connection *conn, size_t length);
 
 static void on_completion(struct ibv_wc *wc);
-static int on_connect_request(struct rdma_cm_id *id);
+static int on_connect_request(struct rdma_cm_id *id, const struct conn_pdata *pdata);
 static int on_connection(void *context);
 static int on_disconnect(struct rdma_cm_id *id);
 static int on_event(struct rdma_cm_event *event);
 
+struct odp_implicit_mr odp_implicit[ODP_MAX_IMPLICIT]; // odp_mr.h 的隐式 MR 表，每个程序只定义一次
+
 static struct context *s_ctx = NULL;
+static int s_mr_mode = MR_MODE_PINNED; // 收发缓冲区的注册方式（RDMA_MR_MODE=pinned|odp|implicit），ODP 模式下空闲连接不占用锁定内存
 
 int main(int argc, char **argv)
 {
@@ -36,6 +48,8 @@ int main(int argc, char **argv)
   struct rdma_event_channel *ec = NULL;
   uint16_t port = 0;
 
+  s_mr_mode = mr_mode_from_env();
+
   memset(&addr, 0, sizeof(addr));
 #if _USE_IPV6
   addr.sin6_family = AF_INET6;
@@ -46,7 +60,7 @@ int main(int argc, char **argv)
   TEST_Z(ec = rdma_create_event_channel()); // 创建一个 rdmacm 事件通道
   TEST_NZ(rdma_create_id(ec, &listener, NULL, RDMA_PS_TCP)); // 创建一个类似于Socket套接字的 rdmacm ID 指针，其中声明了使用面向连接的、可靠的队列对
   TEST_NZ(rdma_bind_addr(listener, (struct sockaddr *)&addr)); // 绑定地址
-  TEST_NZ(rdma_listen(listener, 10)); /* backlog=10 is arbitrary */
+  TEST_NZ(rdma_listen(listener, LISTEN_BACKLOG));
 
   port = ntohs(rdma_get_src_port(listener)); // 获取监听的端口号
 
@@ -54,8 +68,9 @@ int main(int argc, char **argv)
 
   while (rdma_get_cm_event(ec, &event) == 0) { // 循环监听RDMA连接管理（Connection Management, CM）事件
     struct rdma_cm_event event_copy;
+    struct conn_pdata pdata;
 
-    memcpy(&event_copy, event, sizeof(*event)); // 复制事件数据到本地变量event_copy
+    copy_cm_event(&event_copy, event, &pdata); // 复制事件数据（连同协商参数）到本地变量event_copy
     rdma_ack_cm_event(event); // 确认并释放原始事件对象
 
     if (on_event(&event_copy)) // 处理事件
@@ -81,13 +96,18 @@ void build_context(struct ibv_context *verbs) // 传入的参数是一个 verbs
   s_ctx = (struct context *)malloc(sizeof(struct context)); // 为上下文分配内存
 
   s_ctx->ctx = verbs; // 收到的第一个连接请求将在 id->verbs 处有一个有效的 verbs 上下文结构
+  s_ctx->comp_vector = -1;
+  s_ctx->poller_cpu = -1;
+
+  nic_resolve_affinity(s_ctx->ctx, &s_ctx->comp_vector, &s_ctx->poller_cpu); // 选择网卡本地 NUMA 节点上的 CPU 及对应的中断向量
   // 创建保护域、完成队列、完成通道
   TEST_Z(s_ctx->pd = ibv_alloc_pd(s_ctx->ctx));
   TEST_Z(s_ctx->comp_channel = ibv_create_comp_channel(s_ctx->ctx));
-  TEST_Z(s_ctx->cq = ibv_create_cq(s_ctx->ctx, 10, NULL, s_ctx->comp_channel, 0)); /* cqe=10 is arbitrary */
+  TEST_Z(s_ctx->cq = ibv_create_cq(s_ctx->ctx, CQ_DEPTH, NULL, s_ctx->comp_channel, s_ctx->comp_vector));
   TEST_NZ(ibv_req_notify_cq(s_ctx->cq, 0));  // 设置完成队列，0 表示每次完成队列发生事件时都会产生通知
 
   TEST_NZ(pthread_create(&s_ctx->cq_poller_thread, NULL, poll_cq, NULL)); // 创建一个线程，执行 poll_cq()，从队列中提取完成信息
+  nic_pin_thread(s_ctx->cq_poller_thread, s_ctx->poller_cpu); // 将轮询线程绑定到选定的 CPU
 }
 
 void build_qp_attr(struct ibv_qp_init_attr *qp_attr)
@@ -121,6 +141,26 @@ void * poll_cq(void *ctx)
   return NULL;
 }
 
+// 流式模式：一次 ibv_post_recv 发布 count 个链在一起的接收请求。它们都指向同一块接收缓冲区，数据本身不会被读取
+void post_receive_batch(struct connection *conn, int count)
+{
+  struct ibv_recv_wr wrs[2 * MAX_STREAM_WINDOW], *bad_wr = NULL;
+  struct ibv_sge sge;
+
+  sge.addr = (uintptr_t)conn->recv_region;
+  sge.length = conn->buffer_size;
+  sge.lkey = conn->recv_mr->lkey;
+
+  for (int i = 0; i < count; i++) {
+    wrs[i].wr_id = (uintptr_t)conn;
+    wrs[i].next = (i + 1 < count) ? &wrs[i + 1] : NULL;
+    wrs[i].sg_list = &sge;
+    wrs[i].num_sge = 1;
+  }
+
+  TEST_NZ(ibv_post_recv(conn->qp, wrs, &bad_wr));
+}
+
 // 预发布接收请求（接收必须先于发送发布），告诉RDMA硬件你的应用程序已经准备好接收数据。
 void post_receives(struct connection *conn)
 {
@@ -133,7 +173,7 @@ void post_receives(struct connection *conn)
   wr.num_sge = 1;
 
   sge.addr = (uintptr_t)conn->recv_region; // 数据将被写入的内存地址
-  sge.length = BUFFER_SIZE; // 内存区域的大小
+  sge.length = conn->buffer_size; // 内存区域的大小
   sge.lkey = conn->recv_mr->lkey; // 内存区域的本地key，用于在 RDMA 操作中标识内存区域
 
   TEST_NZ(ibv_post_recv(conn->qp, &wr, &bad_wr)); // 将工作请求发布到队列对的接收队列
@@ -141,20 +181,25 @@ void post_receives(struct connection *conn)
 
 void register_memory(struct connection *conn)
 {
-  conn->send_region = malloc(BUFFER_SIZE); // 为发送和接收缓冲区申请内存
-  conn->recv_region = malloc(BUFFER_SIZE);
+  // 为发送和接收缓冲区申请内存，大小为协商后的缓冲区大小，尽量用大页减少注册时需要锁定的页数；ODP 模式下不预先缺页
+  TEST_NZ(hugebuf_alloc_ex(&conn->send_buf, conn->buffer_size, s_mr_mode == MR_MODE_PINNED));
+  TEST_NZ(hugebuf_alloc_ex(&conn->recv_buf, conn->buffer_size, s_mr_mode == MR_MODE_PINNED));
+  conn->send_region = conn->send_buf.addr;
+  conn->recv_region = conn->recv_buf.addr;
 
-  TEST_Z(conn->send_mr = ibv_reg_mr( // 注册发送缓冲区
+  TEST_Z(conn->send_mr = odp_reg_mr( // 注册发送缓冲区，设备不支持所选的 ODP 模式时退回锁定内存的注册方式
     s_ctx->pd,
     conn->send_region,
-    BUFFER_SIZE,
-    0)); // 这块内存区域只在本地使用，不会被远程RDMA操作直接访问
+    conn->buffer_size,
+    0, // 这块内存区域只在本地使用，不会被远程RDMA操作直接访问
+    s_mr_mode));
 
-  TEST_Z(conn->recv_mr = ibv_reg_mr( // 注册接收缓冲区
+  TEST_Z(conn->recv_mr = odp_reg_mr( // 注册接收缓冲区
     s_ctx->pd,
     conn->recv_region,
-    BUFFER_SIZE,
-    IBV_ACCESS_LOCAL_WRITE)); // 允许本地写操作。这是在本地进程需要修改内存区域内容时常用的权限。
+    conn->buffer_size,
+    IBV_ACCESS_LOCAL_WRITE, // 允许本地写操作。这是在本地进程需要修改内存区域内容时常用的权限。
+    s_mr_mode));
 }
 
 void on_completion(struct ibv_wc *wc)
@@ -162,37 +207,77 @@ void on_completion(struct ibv_wc *wc)
   if (wc->status != IBV_WC_SUCCESS)
     die("on_completion: status is not IBV_WC_SUCCESS.");
 
+  struct connection *conn = (struct connection *)(uintptr_t)wc->wr_id;
+
   if (wc->opcode & IBV_WC_RECV) { // 如果是接收完成事件
-    struct connection *conn = (struct connection *)(uintptr_t)wc->wr_id;
+    if (conn->mode == MODE_ECHO) { // 扫描模式：重新发布接收请求，再按收到的字节数回送
+      post_receives(conn);
+      post_message(conn, wc->byte_len);
+      return;
+    }
+
+    if (conn->mode == MODE_STREAM) { // 流式模式：攒够一个窗口再批量补充接收环，接收环里始终至少留有一个窗口的接收请求
+      if (++conn->unreposted == conn->window) {
+        post_receive_batch(conn, conn->unreposted);
+        conn->unreposted = 0;
+      }
+      return;
+    }
 
     printf("received message: %s\n", conn->recv_region); // 打印接收到的消息
 
-  } else if (wc->opcode == IBV_WC_SEND) { // 如果是发送完成事件
+  } else if (wc->opcode == IBV_WC_SEND && conn->mode == MODE_HELLO) { // 如果是发送完成事件
     printf("send completed successfully.\n");
   }
 }
 
 // 当收到一个连接请求，创建队列对、构建上下文、注册内存、注册接收缓冲区、发送接收请求
-int on_connect_request(struct rdma_cm_id *id)
+int on_connect_request(struct rdma_cm_id *id, const struct conn_pdata *pdata)
 {
   struct ibv_qp_init_attr qp_attr;
   struct rdma_conn_param cm_params;
+  struct conn_pdata reply;
   struct connection *conn;
+  int mode = ntohl(pdata->mode);
+  int window = ntohl(pdata->window);
 
   printf("received connection request.\n");
 
+  if (mode == MODE_STREAM && (window < 1 || window > MAX_STREAM_WINDOW))
+    window = MAX_STREAM_WINDOW;
+
   build_context(id->verbs); // 自定义上下文创建函数，在这里创建保护域、完成队列、完成通道
   build_qp_attr(&qp_attr); // 设置队列对的属性
 
+  if (mode == MODE_STREAM)
+    qp_attr.cap.max_recv_wr = 2 * window; // 接收环深度为客户端窗口的两倍
+
   TEST_NZ(rdma_create_qp(id, s_ctx->pd, &qp_attr)); // 构建队列对
 
-  id->context = conn = (struct connection *)malloc(sizeof(struct connection));
+  id->context = conn = (struct connection *)calloc(1, sizeof(struct connection));
   conn->qp = id->qp;
 
+  // 按客户端请求的大小分配缓冲区，不超过 BUFFER_SIZE；没有携带私有数据的旧客户端沿用 BUFFER_SIZE
+  conn->buffer_size = ntohl(pdata->buffer_size);
+  if (conn->buffer_size == 0 || conn->buffer_size > (size_t)BUFFER_SIZE)
+    conn->buffer_size = BUFFER_SIZE;
+  conn->mode = mode;
+  conn->window = window;
+
   register_memory(conn); // 注册发送与接收的缓冲区
-  post_receives(conn);
+
+  if (mode == MODE_STREAM)
+    post_receive_batch(conn, 2 * window);
+  else
+    post_receives(conn);
+
+  reply.buffer_size = htonl(conn->buffer_size); // 把同意的缓冲区大小告诉客户端
+  reply.mode = htonl(conn->mode);
+  reply.window = htonl(conn->window);
 
   memset(&cm_params, 0, sizeof(cm_params));
+  cm_params.private_data = &reply;
+  cm_params.private_data_len = sizeof(reply);
   TEST_NZ(rdma_accept(id, &cm_params));
 
   return 0;
@@ -201,27 +286,43 @@ int on_connect_request(struct rdma_cm_id *id)
 int on_connection(void *context)
 {
   struct connection *conn = (struct connection *)context;
-  struct ibv_send_wr wr, *bad_wr = NULL;
-  struct ibv_sge sge;
 
-  snprintf(conn->send_region, BUFFER_SIZE, "message from passive/server side with pid %d", getpid()); // 向发送缓冲区写入发送给客户端的一串消息
+  if (conn->mode == MODE_ECHO) { // 扫描模式下由客户端先发送，服务端只负责回送
+    printf("connected. echoing messages up to %zu bytes...\n", conn->buffer_size);
+    return 0;
+  }
+
+  if (conn->mode == MODE_STREAM) { // 流式模式下服务端只接收
+    printf("connected. receiving a stream with window %d...\n", conn->window);
+    return 0;
+  }
+
+  snprintf(conn->send_region, conn->buffer_size, "message from passive/server side with pid %d", getpid()); // 向发送缓冲区写入发送给客户端的一串消息
 
   printf("connected. posting send...\n");
+  post_message(conn, strlen(conn->send_region) + 1); // 只发送实际写入的字节（含结尾的 '\0'）
+
+  return 0;
+}
+
+void post_message(struct connection *conn, size_t length)
+{
+  struct ibv_send_wr wr, *bad_wr = NULL;
+  struct ibv_sge sge;
 
   memset(&wr, 0, sizeof(wr));
 
+  wr.wr_id = (uintptr_t)conn;
   wr.opcode = IBV_WR_SEND; // IBV_WR_SEND表示发送请求必须与对等端相应的接收请求匹配。其他选项包括RDMA写、RDMA读和各种原子操作
   wr.sg_list = &sge;
   wr.num_sge = 1;
   wr.send_flags = IBV_SEND_SIGNALED; // 表示我们想要这个发送请求的完成通知，也就是说，当这个请求完成时，会产生一个完成事件
 
   sge.addr = (uintptr_t)conn->send_region;
-  sge.length = BUFFER_SIZE;
+  sge.length = length;
   sge.lkey = conn->send_mr->lkey;
 
   TEST_NZ(ibv_post_send(conn->qp, &wr, &bad_wr));
-
-  return 0;
 }
 
 int on_disconnect(struct rdma_cm_id *id)
@@ -230,13 +331,16 @@ int on_disconnect(struct rdma_cm_id *id)
 
   printf("peer disconnected.\n");
 
+  if (s_mr_mode != MR_MODE_PINNED)
+    odp_print_stats(s_ctx->ctx);
+
   rdma_destroy_qp(id);
 
-  ibv_dereg_mr(conn->send_mr);
-  ibv_dereg_mr(conn->recv_mr);
+  odp_dereg_mr(conn->send_mr);
+  odp_dereg_mr(conn->recv_mr);
 
-  free(conn->send_region);
-  free(conn->recv_region);
+  hugebuf_free(&conn->send_buf);
+  hugebuf_free(&conn->recv_buf);
 
   free(conn);
 
@@ -251,7 +355,7 @@ int on_event(struct rdma_cm_event *event)
   int r = 0;
 
   if (event->event == RDMA_CM_EVENT_CONNECT_REQUEST)
-    r = on_connect_request(event->id);
+    r = on_connect_request(event->id, event->param.conn.private_data);
   else if (event->event == RDMA_CM_EVENT_ESTABLISHED) // 连接建立后，调用 on_connection() 函数
     r = on_connection(event->id->context);
   else if (event->event == RDMA_CM_EVENT_DISCONNECTED)
@@ -0,0 +1,320 @@
+#define _GNU_SOURCE
+#include <endian.h>
+#include <pthread.h>
+#include <time.h>
+#include "rdma-common.h"
+
+/*
+ * Client side of the atomic mode. Every thread opens its own connection (own
+ * event channel, PD, busy-polled CQ and QP) to the server's shared array of
+ * ATOMIC_WORDS 8-byte words and runs ops against it:
+ *
+ *   A_FETCH_ADD  remote sequence counter: thread t does FETCH_ADD 1 on word t % words
+ *   A_LOCK       spin-lock: thread t takes lock t % words (word 2k) with
+ *                CMP_AND_SWP 0 -> t + 1, backing off exponentially on failure,
+ *                bumps the word next to it (2k + 1) with a plain READ + WRITE,
+ *                and releases with CMP_AND_SWP t + 1 -> 0
+ *
+ * The lock mode checks itself: if mutual exclusion holds, the unprotected
+ * READ + WRITE increments add up exactly.
+ */
+
+#define BACKOFF_MIN 16
+#define BACKOFF_MAX 16384
+
+extern const int TIMEOUT_IN_MS;
+
+struct atomic_thread {
+  pthread_t thread;
+  int index;
+  const char *host;
+  const char *port;
+  const struct atomic_params *params;
+
+  struct rdma_event_channel *ec;
+  struct rdma_cm_id *id;
+  struct ibv_pd *pd;
+  struct ibv_cq *cq;
+  struct ibv_qp *qp;
+  uint64_t *local;           /* result of the last atomic or READ */
+  struct ibv_mr *local_mr;
+  struct mr_desc local_desc; /* the server needs a descriptor, even an empty one */
+
+  uint64_t remote_addr;
+  uint32_t rkey;
+
+  long done;
+  long cas_attempts;
+  double *lat_us;
+  pthread_barrier_t *start;
+};
+
+static double elapsed_us(const struct timespec *from, const struct timespec *to)
+{
+  return (to->tv_sec - from->tv_sec) * 1e6 + (to->tv_nsec - from->tv_nsec) / 1e3;
+}
+
+static void wait_event(struct atomic_thread *t, enum rdma_cm_event_type expected, struct rdma_cm_event *copy,
+                       char *pdata)
+{
+  struct rdma_cm_event *event = NULL;
+
+  TEST_NZ(rdma_get_cm_event(t->ec, &event));
+  copy_cm_event(copy, event, pdata, MAX_PRIVATE_DATA);
+  rdma_ack_cm_event(event);
+
+  if (copy->event != expected) {
+    fprintf(stderr, "thread %d: unexpected event %s\n", t->index, rdma_event_str(copy->event));
+    exit(EXIT_FAILURE);
+  }
+}
+
+static void connect_thread(struct atomic_thread *t)
+{
+  struct addrinfo *addr;
+  struct rdma_cm_event event;
+  struct rdma_conn_param cm_params;
+  struct ibv_qp_init_attr qp_attr;
+  char pdata[MAX_PRIVATE_DATA];
+  const struct mr_desc *desc;
+
+  TEST_NZ(getaddrinfo(t->host, t->port, NULL, &addr));
+  TEST_Z(t->ec = rdma_create_event_channel());
+  TEST_NZ(rdma_create_id(t->ec, &t->id, NULL, RDMA_PS_TCP));
+  TEST_NZ(rdma_resolve_addr(t->id, NULL, addr->ai_addr, TIMEOUT_IN_MS));
+  freeaddrinfo(addr);
+  wait_event(t, RDMA_CM_EVENT_ADDR_RESOLVED, &event, pdata);
+
+  TEST_Z(t->pd = ibv_alloc_pd(t->id->verbs));
+  TEST_Z(t->cq = ibv_create_cq(t->id->verbs, 4, NULL, NULL, 0));
+
+  memset(&qp_attr, 0, sizeof(qp_attr));
+  qp_attr.send_cq = t->cq;
+  qp_attr.recv_cq = t->cq;
+  qp_attr.qp_type = IBV_QPT_RC;
+  qp_attr.cap.max_send_wr = 4;
+  qp_attr.cap.max_recv_wr = 1;
+  qp_attr.cap.max_send_sge = 1;
+  qp_attr.cap.max_recv_sge = 1;
+  TEST_NZ(rdma_create_qp(t->id, t->pd, &qp_attr));
+  t->qp = t->id->qp;
+
+  TEST_NZ(posix_memalign((void **)&t->local, 8, sizeof(uint64_t)));
+  TEST_Z(t->local_mr = ibv_reg_mr(t->pd, t->local, sizeof(uint64_t), IBV_ACCESS_LOCAL_WRITE));
+
+  TEST_NZ(rdma_resolve_route(t->id, TIMEOUT_IN_MS));
+  wait_event(t, RDMA_CM_EVENT_ROUTE_RESOLVED, &event, pdata);
+
+  memset(&t->local_desc, 0, sizeof(t->local_desc));
+  memset(&cm_params, 0, sizeof(cm_params));
+  cm_params.private_data = &t->local_desc;
+  cm_params.private_data_len = sizeof(t->local_desc);
+  cm_params.initiator_depth = 1; /* atomics and READs count against it; one op in flight per thread */
+  cm_params.rnr_retry_count = 7; /* infinite retry */
+  TEST_NZ(rdma_connect(t->id, &cm_params));
+  wait_event(t, RDMA_CM_EVENT_ESTABLISHED, &event, pdata);
+
+  if (event.param.conn.private_data_len < sizeof(*desc))
+    die("connect_thread: server sent no memory region descriptor.");
+
+  desc = (const struct mr_desc *)event.param.conn.private_data;
+  t->remote_addr = be64toh(desc->addr);
+  t->rkey = be32toh(desc->rkey);
+
+  if (be32toh(desc->length) < ATOMIC_WORDS * sizeof(uint64_t))
+    die("connect_thread: server is not in atomic mode.");
+}
+
+/* post one op on word and wait for it; the fetched/read value lands in *t->local */
+static uint64_t remote_op(struct atomic_thread *t, enum ibv_wr_opcode opcode, int word, uint64_t arg1, uint64_t arg2)
+{
+  struct ibv_send_wr wr, *bad_wr = NULL;
+  struct ibv_sge sge;
+  struct ibv_wc wc;
+  int n;
+
+  memset(&wr, 0, sizeof(wr));
+  wr.opcode = opcode;
+  wr.sg_list = &sge;
+  wr.num_sge = 1;
+  wr.send_flags = IBV_SEND_SIGNALED;
+
+  if (opcode == IBV_WR_ATOMIC_FETCH_AND_ADD || opcode == IBV_WR_ATOMIC_CMP_AND_SWP) {
+    wr.wr.atomic.remote_addr = t->remote_addr + word * sizeof(uint64_t);
+    wr.wr.atomic.rkey = t->rkey;
+    wr.wr.atomic.compare_add = arg1;
+    wr.wr.atomic.swap = arg2;
+  } else {
+    if (opcode == IBV_WR_RDMA_WRITE)
+      *t->local = arg1;
+    wr.wr.rdma.remote_addr = t->remote_addr + word * sizeof(uint64_t);
+    wr.wr.rdma.rkey = t->rkey;
+  }
+
+  sge.addr = (uintptr_t)t->local;
+  sge.length = sizeof(uint64_t);
+  sge.lkey = t->local_mr->lkey;
+
+  TEST_NZ(ibv_post_send(t->qp, &wr, &bad_wr));
+
+  while ((n = ibv_poll_cq(t->cq, 1, &wc)) == 0)
+    ;
+
+  if (n < 0 || wc.status != IBV_WC_SUCCESS) {
+    fprintf(stderr, "thread %d: %s\n", t->index, n < 0 ? "ibv_poll_cq failed" : ibv_wc_status_str(wc.status));
+    exit(EXIT_FAILURE);
+  }
+
+  return *t->local;
+}
+
+static void lock_remote(struct atomic_thread *t, int word, unsigned int *seed)
+{
+  uint64_t me = t->index + 1;
+  int backoff = BACKOFF_MIN;
+
+  while (1) {
+    t->cas_attempts++;
+    if (remote_op(t, IBV_WR_ATOMIC_CMP_AND_SWP, word, 0, me) == 0)
+      return;
+
+    /* randomized exponential backoff keeps the losers from hammering the word in lockstep */
+    for (volatile int i = rand_r(seed) % backoff; i > 0; i--)
+      ;
+    if (backoff < BACKOFF_MAX)
+      backoff *= 2;
+  }
+}
+
+static void unlock_remote(struct atomic_thread *t, int word)
+{
+  uint64_t me = t->index + 1;
+
+  if (remote_op(t, IBV_WR_ATOMIC_CMP_AND_SWP, word, me, 0) != me)
+    die("unlock_remote: lock was not held.");
+}
+
+static void * atomic_thread_main(void *arg)
+{
+  struct atomic_thread *t = (struct atomic_thread *)arg;
+  const struct atomic_params *p = t->params;
+  unsigned int seed = t->index * 7919 + 1;
+  int word = t->index % p->words;
+
+  pthread_barrier_wait(t->start);
+
+  for (t->done = 0; t->done < p->ops; t->done++) {
+    struct timespec t0, t1;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    if (p->op == A_FETCH_ADD) {
+      remote_op(t, IBV_WR_ATOMIC_FETCH_AND_ADD, word, 1, 0);
+    } else {
+      uint64_t v;
+
+      lock_remote(t, 2 * word, &seed);
+      v = remote_op(t, IBV_WR_RDMA_READ, 2 * word + 1, 0, 0);
+      remote_op(t, IBV_WR_RDMA_WRITE, 2 * word + 1, v + 1, 0);
+      unlock_remote(t, 2 * word);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    t->lat_us[t->done] = elapsed_us(&t0, &t1);
+  }
+
+  return NULL;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+
+  return (x > y) - (x < y);
+}
+
+static void sum_words(struct atomic_thread *t, const struct atomic_params *p, uint64_t *sum)
+{
+  *sum = 0;
+  for (int w = 0; w < p->words; w++)
+    *sum += remote_op(t, IBV_WR_RDMA_READ, p->op == A_FETCH_ADD ? w : 2 * w + 1, 0, 0);
+}
+
+void run_atomic(const char *host, const char *port, const struct atomic_params *p)
+{
+  struct atomic_thread *threads;
+  pthread_barrier_t start;
+  struct timespec t0, t1;
+  uint64_t before, after;
+  long total = (long)p->threads * p->ops, attempts = 0, k = 0;
+  double secs, *all;
+
+  TEST_Z(threads = calloc(p->threads, sizeof(struct atomic_thread)));
+  TEST_Z(all = malloc(total * sizeof(double)));
+  TEST_NZ(pthread_barrier_init(&start, NULL, p->threads + 1));
+
+  for (int i = 0; i < p->threads; i++) {
+    threads[i].index = i;
+    threads[i].host = host;
+    threads[i].port = port;
+    threads[i].params = p;
+    threads[i].start = &start;
+    TEST_Z(threads[i].lat_us = malloc(p->ops * sizeof(double)));
+    connect_thread(&threads[i]);
+  }
+
+  sum_words(&threads[0], p, &before);
+
+  printf("connected %d threads. %s on %d word%s, %ld ops per thread.\n", p->threads,
+         p->op == A_FETCH_ADD ? "FETCH_ADD counter" : "CMP_AND_SWP lock", p->words, p->words > 1 ? "s" : "",
+         p->ops);
+
+  for (int i = 0; i < p->threads; i++)
+    TEST_NZ(pthread_create(&threads[i].thread, NULL, atomic_thread_main, &threads[i]));
+
+  pthread_barrier_wait(&start);
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+
+  for (int i = 0; i < p->threads; i++)
+    pthread_join(threads[i].thread, NULL);
+
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  secs = elapsed_us(&t0, &t1) / 1e6;
+
+  sum_words(&threads[0], p, &after);
+
+  for (int i = 0; i < p->threads; i++) {
+    memcpy(all + k, threads[i].lat_us, p->ops * sizeof(double));
+    k += p->ops;
+    attempts += threads[i].cas_attempts;
+  }
+  qsort(all, total, sizeof(double), compare_double);
+
+  printf("%ld ops in %.3f s: %.0f ops/s, latency p50 %.2f us, p99 %.2f us, max %.2f us\n", total, secs,
+         total / secs, all[total / 2], all[(long)(total * 0.99)], all[total - 1]);
+
+  if (p->op == A_LOCK)
+    printf("%.2f CAS attempts per acquisition\n", (double)attempts / total);
+
+  /* exact only if no other client ran at the same time */
+  printf("words advanced by %llu, expected %ld%s\n", (unsigned long long)(after - before), total,
+         after - before == (uint64_t)total ? "" : " (concurrent clients, or mutual exclusion broken)");
+
+  for (int i = 0; i < p->threads; i++) {
+    struct atomic_thread *t = &threads[i];
+
+    rdma_disconnect(t->id);
+    rdma_destroy_qp(t->id);
+    ibv_dereg_mr(t->local_mr);
+    free(t->local);
+    ibv_destroy_cq(t->cq);
+    ibv_dealloc_pd(t->pd);
+    rdma_destroy_id(t->id);
+    rdma_destroy_event_channel(t->ec);
+    free(t->lat_us);
+  }
+
+  pthread_barrier_destroy(&start);
+  free(all);
+  free(threads);
+}
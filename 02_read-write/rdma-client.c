@@ -1,9 +1,10 @@
+#include <getopt.h>
 #include "rdma-common.h"
 
 const int TIMEOUT_IN_MS = 500; /* ms */
 
 static int on_addr_resolved(struct rdma_cm_id *id);
-static int on_connection(struct rdma_cm_id *id);
+static int on_connection(struct rdma_cm_event *event);
 static int on_disconnect(struct rdma_cm_id *id);
 static int on_event(struct rdma_cm_event *event);
 static int on_route_resolved(struct rdma_cm_id *id);
@@ -15,18 +16,94 @@ int main(int argc, char **argv)
   struct rdma_cm_event *event = NULL;
   struct rdma_cm_id *conn= NULL;
   struct rdma_event_channel *ec = NULL;
+  struct bench_params bench = {
+    .min_size = 64,
+    .max_size = 1 << 20,
+    .depth = 64,
+    .signal_every = 16,
+    .seconds = 1.0,
+    .bytes = 0,
+  };
+  struct atomic_params atomic = {
+    .threads = 1,
+    .words = 1,
+    .op = A_FETCH_ADD,
+    .ops = 100000,
+  };
+  struct mw_params mw = {
+    .grants = 100000,
+    .grant_size = 4096,
+    .region_size = 64 << 20,
+    .windows = 16,
+  };
+  int bench_enabled = 0;
+  int op, cpu = -1, comp_vector = -1;
+
+  while ((op = getopt(argc, argv, "Ir:C:V:t:n:m:s:q:c:T:w:o:i:W:g:R:")) != -1) {
+    switch (op) {
+    case 'I': set_imm(1); continue;
+    case 'r': set_rd_depth(atoi(optarg)); continue;
+    case 'C': cpu = atoi(optarg); continue;
+    case 'V': comp_vector = atoi(optarg); continue;
+    case 'T': atomic.threads = atoi(optarg); continue;
+    case 'w': atomic.words = atoi(optarg); continue;
+    case 'o': atomic.op = strcmp(optarg, "lock") == 0 ? A_LOCK : A_FETCH_ADD; continue;
+    case 'i': atomic.ops = atol(optarg); continue;
+    case 'W': mw.windows = atoi(optarg); continue;
+    case 'g': mw.grant_size = strtoull(optarg, NULL, 0); continue;
+    case 'R': mw.region_size = strtoull(optarg, NULL, 0); continue;
+    }
+
+    switch (op) {
+    case 't': bench.seconds = atof(optarg); break;
+    case 'n': bench.bytes = strtoull(optarg, NULL, 0); break;
+    case 'm': bench.min_size = strtoull(optarg, NULL, 0); break;
+    case 's': bench.max_size = strtoull(optarg, NULL, 0); break;
+    case 'q': bench.depth = atoi(optarg); break;
+    case 'c': bench.signal_every = atoi(optarg); break;
+    default: usage(argv[0]);
+    }
+    bench_enabled = 1;
+  }
+
+  set_affinity(comp_vector, cpu);
 
-  if (argc != 4)
+  if (argc - optind != 3)
     usage(argv[0]);
 
-  if (strcmp(argv[1], "write") == 0)
+  if (strcmp(argv[optind], "write") == 0)
     set_mode(M_WRITE);
-  else if (strcmp(argv[1], "read") == 0)
+  else if (strcmp(argv[optind], "read") == 0)
     set_mode(M_READ);
-  else
+  else if (strcmp(argv[optind], "ring") == 0) {
+    set_mode(M_RING);
+    set_ring_iterations(atomic.ops);
+  } else if (strcmp(argv[optind], "mw") == 0) {
+    mw.grants = atomic.ops;
+    if (mw.grants < 1 || mw.windows < 1 || mw.grant_size < 1 || mw.region_size < mw.grant_size || mw.region_size > BENCH_MAX_SIZE)
+      usage(argv[0]);
+
+    set_mode(M_MW);
+    set_mw(&mw);
+  } else if (strcmp(argv[optind], "atomic") == 0) {
+    if (atomic.threads < 1 || atomic.words < 1 || atomic.words > ATOMIC_WORDS / 2 || atomic.ops < 1)
+      usage(argv[0]);
+
+    run_atomic(argv[optind + 1], argv[optind + 2], &atomic);
+    return 0;
+  } else
     usage(argv[0]);
 
-  TEST_NZ(getaddrinfo(argv[2], argv[3], NULL, &addr));
+  if (bench_enabled) {
+    if (bench.min_size < 1 || bench.min_size > bench.max_size || bench.max_size > BENCH_MAX_SIZE ||
+        bench.signal_every < 1 || bench.depth < bench.signal_every || bench.seconds <= 0)
+      usage(argv[0]);
+
+    bench.depth -= bench.depth % bench.signal_every; /* whole batches only */
+    set_bench(&bench);
+  }
+
+  TEST_NZ(getaddrinfo(argv[optind + 1], argv[optind + 2], NULL, &addr));
 
   TEST_Z(ec = rdma_create_event_channel());
   TEST_NZ(rdma_create_id(ec, &conn, NULL, RDMA_PS_TCP));
@@ -36,8 +113,9 @@ int main(int argc, char **argv)
 
   while (rdma_get_cm_event(ec, &event) == 0) {
     struct rdma_cm_event event_copy;
+    char pdata[MAX_PRIVATE_DATA];
 
-    memcpy(&event_copy, event, sizeof(*event));
+    copy_cm_event(&event_copy, event, pdata, sizeof(pdata));
     rdma_ack_cm_event(event);
 
     if (on_event(&event_copy))
@@ -53,17 +131,19 @@ int on_addr_resolved(struct rdma_cm_id *id)
 {
   printf("address resolved.\n");
 
-  build_connection(id);
+  build_connection(id, NULL);
   sprintf(get_local_message_region(id->context), "message from active/client side with pid %d", getpid());
   TEST_NZ(rdma_resolve_route(id, TIMEOUT_IN_MS));
 
   return 0;
 }
 
-int on_connection(struct rdma_cm_id *id)
+int on_connection(struct rdma_cm_event *event)
 {
+  struct rdma_cm_id *id = event->id;
+
+  set_peer_params(id->context, &event->param.conn);
   on_connect(id->context);
-  send_mr(id->context);
 
   return 0;
 }
@@ -85,7 +165,7 @@ int on_event(struct rdma_cm_event *event)
   else if (event->event == RDMA_CM_EVENT_ROUTE_RESOLVED)
     r = on_route_resolved(event->id);
   else if (event->event == RDMA_CM_EVENT_ESTABLISHED)
-    r = on_connection(event->id);
+    r = on_connection(event);
   else if (event->event == RDMA_CM_EVENT_DISCONNECTED)
     r = on_disconnect(event->id);
   else {
@@ -101,7 +181,7 @@ int on_route_resolved(struct rdma_cm_id *id)
   struct rdma_conn_param cm_params;
 
   printf("route resolved.\n");
-  build_params(&cm_params);
+  build_params(&cm_params, id->context);
   TEST_NZ(rdma_connect(id, &cm_params));
 
   return 0;
@@ -109,6 +189,13 @@ int on_route_resolved(struct rdma_cm_id *id)
 
 void usage(const char *argv0)
 {
-  fprintf(stderr, "usage: %s <mode> <server-address> <server-port>\n  mode = \"read\", \"write\"\n", argv0);
+  fprintf(stderr, "usage: %s [-I] [-r <read depth>] [-C <poller cpu>] [-V <comp vector>] [-t <seconds> | -n <bytes>] [-m <min size>] [-s <max size>] [-q <depth>] [-c <signal every>]\n"
+                  "          [-T <threads>] [-w <words>] [-o fadd|lock] [-i <ops>]\n"
+                  "          [-W <windows>] [-g <grant bytes>] [-R <region bytes>]\n"
+                  "          <mode> <server-address> <server-port>\n  mode = \"read\", \"write\", \"atomic\", \"ring\", \"mw\"\n"
+                  "  -t/-n/-m/-s/-q/-c run the bandwidth benchmark instead of the single message\n"
+                  "  -T/-w/-o/-i configure the atomic mode, -i is also the ring mode's round trips\n"
+                  "  -W/-g/-R configure the mw mode, -i is its number of grants\n"
+                  "  -I signals the single message with write-with-imm instead of MSG_DONE\n", argv0);
   exit(1);
 }
@@ -1,16 +1,38 @@
+#define _GNU_SOURCE
+#include <endian.h>
+#include <time.h>
+#include <sys/resource.h>
 #include "rdma-common.h"
+#include "nic_affinity.h"
+#include "hugepage_alloc.h"
+#include "odp_mr.h"
+#include "rdma-ring.h"
+#include "rdma-mw.h"
 
 static const int RDMA_BUFFER_SIZE = 1024;
 
 struct message {
   enum {
-    MSG_MR,
-    MSG_DONE
+    MSG_DONE,
+    MSG_MW_GRANT,   /* mw mode: read through `window` */
+    MSG_MW_READ,    /* mw mode: done reading through it */
+    MSG_MW_REVOKED  /* mw mode: it was invalidated, reading through it again must fail */
   } type;
+  struct mr_desc window; /* big endian */
+};
 
-  union {
-    struct ibv_mr mr;
-  } data;
+#define MW_PATTERN_LEN 64 /* what the mw mode writes into the granted window for the peer to check */
+
+struct bench_state {
+  size_t size;
+  uint64_t posted;
+  uint64_t total;      /* ops to post for this size, 0 = until the deadline */
+  int outstanding;
+  int depth;           /* s_bench's, capped by the read depth for reads */
+  int signal_every;
+  struct timespec start;
+  struct timespec deadline;
+  struct rusage ru_start;
 };
 
 struct context {
@@ -20,52 +42,98 @@ struct context {
   struct ibv_comp_channel *comp_channel;
 
   pthread_t cq_poller_thread;
+  int max_qp_rd_atom;      /* RDMA READs a QP can serve */
+  int max_qp_init_rd_atom; /* RDMA READs a QP can issue */
+  int comp_vector;
+  int poller_cpu;
 };
 
 struct connection {
   struct rdma_cm_id *id;
   struct ibv_qp *qp;
 
-  int connected;
-
   struct ibv_mr *recv_mr;
   struct ibv_mr *send_mr;
   struct ibv_mr *rdma_local_mr;
   struct ibv_mr *rdma_remote_mr;
 
-  struct ibv_mr peer_mr;
+  struct mr_desc local_desc; /* wire format, must outlive rdma_connect()/rdma_accept() */
+  struct mr_desc peer_mr;    /* host order */
+
+  size_t buffer_size;        /* of both RDMA regions */
+  int initiator_depth;       /* RDMA READs we may have outstanding, after negotiation */
+  int responder_resources;   /* RDMA READs we serve for the peer */
+  int peer_initiator_depth;  /* the peer's params in our view: READs it lets us issue, -1 until known */
+  int peer_responder_resources; /* and READs it may issue to us */
+  int bench_peer;            /* passive side of a benchmark: expose the buffer and wait */
+  int atomic_peer;           /* passive side of the atomic mode: expose the shared words and wait */
+  int passive;
+  int imm;                   /* completion rides on the data: write-with-imm instead of MSG_DONE */
+
+  struct ring_channel *ring; /* ring mode: records travel through rdma_remote_region */
+  pthread_t ring_thread;     /* passive side: echoes records back */
+  volatile int ring_stop;
+
+  struct mw_bench *mw;       /* mw mode: grants cycling through windows on rdma_remote_mr */
+  int mw_peer;               /* passive side of the mw mode: read through the window the peer grants */
+  struct mr_desc mw_window;  /* host order, the window granted last */
+  enum {
+    MWC_NONE,
+    MWC_GRANTED,
+    MWC_REVOKED
+  } mw_check;                /* both sides of the mw mode, once the benchmark is done */
+  struct bench_state bench;
+  struct ibv_send_wr *bench_wr; /* one chained batch of signal_every ops */
+  struct ibv_sge *bench_sge;
 
   struct message *recv_msg;
   struct message *send_msg;
 
   char *rdma_local_region;
   char *rdma_remote_region;
+  struct hugebuf rdma_local_buf;
+  struct hugebuf rdma_remote_buf;
 
   enum {
     SS_INIT,
-    SS_MR_SENT,
     SS_RDMA_SENT,
     SS_DONE_SENT
   } send_state;
 
   enum {
     RS_INIT,
-    RS_MR_RECV,
     RS_DONE_RECV
   } recv_state;
 };
 
+static void bench_completion(struct connection *conn);
+static void * ring_echo_thread(void *context);
+static void bench_start_size(struct connection *conn, size_t size);
 static void build_context(struct ibv_context *verbs);
 static void build_qp_attr(struct ibv_qp_init_attr *qp_attr);
 static char * get_peer_message_region(struct connection *conn);
 static void on_completion(struct ibv_wc *);
+static void mw_check_completion(struct connection *conn, struct ibv_wc *wc);
 static void * poll_cq(void *);
 static void post_receives(struct connection *conn);
 static void register_memory(struct connection *conn);
 static void send_message(struct connection *conn);
 
+struct odp_implicit_mr odp_implicit[ODP_MAX_IMPLICIT]; /* odp_mr.h keeps its implicit MRs here */
+
 static struct context *s_ctx = NULL;
 static enum mode s_mode = M_WRITE;
+static int s_comp_vector = -1;
+static int s_poller_cpu = -1;
+static int s_mr_mode = MR_MODE_PINNED; /* for the RDMA regions, from RDMA_MR_MODE */
+static struct bench_params s_bench;
+static int s_bench_enabled = 0;
+static struct hugebuf s_atomic_buf; /* ATOMIC_WORDS words shared by every atomic-mode connection */
+static struct ibv_mr *s_atomic_mr = NULL;
+static long s_ring_iterations = 100000;
+static struct mw_params s_mw;
+static int s_rd_depth = 0; /* 0 = device limit */
+static int s_imm = 0;
 
 void die(const char *reason)
 {
@@ -73,7 +141,115 @@ void die(const char *reason)
   exit(EXIT_FAILURE);
 }
 
-void build_connection(struct rdma_cm_id *id)
+static double elapsed_s(const struct timespec *from, const struct timespec *to)
+{
+  return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+static double cpu_s(const struct rusage *ru)
+{
+  return ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1e6 + ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1e6;
+}
+
+static int bench_more(struct connection *conn)
+{
+  struct timespec now;
+
+  if (conn->bench.total)
+    return conn->bench.posted < conn->bench.total;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return elapsed_s(&now, &conn->bench.deadline) > 0;
+}
+
+/* keep up to depth ops outstanding, posted as chained batches whose last op is signaled */
+static void bench_fill(struct connection *conn)
+{
+  struct ibv_send_wr *bad_wr = NULL;
+
+  while (conn->bench.outstanding + conn->bench.signal_every <= conn->bench.depth && bench_more(conn)) {
+    TEST_NZ(ibv_post_send(conn->qp, conn->bench_wr, &bad_wr));
+    conn->bench.posted += conn->bench.signal_every;
+    conn->bench.outstanding += conn->bench.signal_every;
+  }
+}
+
+void bench_start_size(struct connection *conn, size_t size)
+{
+  int n = conn->bench.signal_every;
+
+  for (int i = 0; i < n; i++) {
+    struct ibv_send_wr *wr = &conn->bench_wr[i];
+
+    memset(wr, 0, sizeof(*wr));
+    wr->wr_id = (uintptr_t)conn;
+    wr->next = (i + 1 < n) ? &conn->bench_wr[i + 1] : NULL;
+    wr->opcode = (s_mode == M_WRITE) ? IBV_WR_RDMA_WRITE : IBV_WR_RDMA_READ;
+    wr->sg_list = &conn->bench_sge[i];
+    wr->num_sge = 1;
+    wr->send_flags = (i + 1 == n) ? IBV_SEND_SIGNALED : 0;
+    wr->wr.rdma.remote_addr = conn->peer_mr.addr;
+    wr->wr.rdma.rkey = conn->peer_mr.rkey;
+
+    conn->bench_sge[i].addr = (uintptr_t)conn->rdma_local_region;
+    conn->bench_sge[i].length = size;
+    conn->bench_sge[i].lkey = conn->rdma_local_mr->lkey;
+  }
+
+  conn->bench.size = size;
+  conn->bench.posted = 0;
+  conn->bench.outstanding = 0;
+  conn->bench.total = 0;
+  if (s_bench.bytes) {
+    uint64_t ops = (s_bench.bytes + size - 1) / size;
+
+    conn->bench.total = (ops + n - 1) / n * n;
+  }
+
+  getrusage(RUSAGE_SELF, &conn->bench.ru_start);
+  clock_gettime(CLOCK_MONOTONIC, &conn->bench.start);
+  conn->bench.deadline = conn->bench.start;
+  conn->bench.deadline.tv_sec += (time_t)s_bench.seconds;
+  conn->bench.deadline.tv_nsec += (long)((s_bench.seconds - (time_t)s_bench.seconds) * 1e9);
+  if (conn->bench.deadline.tv_nsec >= 1000000000L) {
+    conn->bench.deadline.tv_sec++;
+    conn->bench.deadline.tv_nsec -= 1000000000L;
+  }
+
+  bench_fill(conn);
+}
+
+/* a signaled completion retires its whole batch: completions on a QP arrive in order */
+void bench_completion(struct connection *conn)
+{
+  struct timespec end;
+  struct rusage ru_end;
+  double secs, cpu;
+
+  conn->bench.outstanding -= conn->bench.signal_every;
+  bench_fill(conn);
+
+  if (conn->bench.outstanding > 0)
+    return;
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  getrusage(RUSAGE_SELF, &ru_end);
+  secs = elapsed_s(&conn->bench.start, &end);
+  cpu = cpu_s(&ru_end) - cpu_s(&conn->bench.ru_start);
+
+  printf("%10zu %12llu %12.2f %12.3f %8.1f\n", conn->bench.size, (unsigned long long)conn->bench.posted,
+         conn->bench.posted * conn->bench.size / secs / 1e6, conn->bench.posted / secs / 1e6,
+         100.0 * cpu / secs);
+
+  if (conn->bench.size * 2 <= s_bench.max_size) {
+    bench_start_size(conn, conn->bench.size * 2);
+  } else {
+    printf("benchmark done.\n");
+    rdma_disconnect(conn->id);
+  }
+}
+
+void build_connection(struct rdma_cm_id *id, const struct rdma_conn_param *peer)
 {
   struct connection *conn;
   struct ibv_qp_init_attr qp_attr;
@@ -83,7 +259,7 @@ void build_connection(struct rdma_cm_id *id)
 
   TEST_NZ(rdma_create_qp(id, s_ctx->pd, &qp_attr));
 
-  id->context = conn = (struct connection *)malloc(sizeof(struct connection));
+  id->context = conn = (struct connection *)calloc(1, sizeof(struct connection));
 
   conn->id = id;
   conn->qp = id->qp;
@@ -91,14 +267,60 @@ void build_connection(struct rdma_cm_id *id)
   conn->send_state = SS_INIT;
   conn->recv_state = RS_INIT;
 
-  conn->connected = 0;
+  conn->buffer_size = RDMA_BUFFER_SIZE;
+  conn->peer_initiator_depth = -1;
+
+  if (s_mode == M_RING && conn->buffer_size < sizeof(struct ring_region))
+    conn->buffer_size = sizeof(struct ring_region);
+
+  if (peer) {
+    conn->passive = 1;
+
+    /* passive side: mirror the size of the buffer the peer exposes */
+    set_peer_params(conn, peer);
+
+    if (conn->peer_mr.length > BENCH_MAX_SIZE)
+      die("build_connection: peer asked for a buffer larger than BENCH_MAX_SIZE.");
+    if (conn->peer_mr.length > conn->buffer_size)
+      conn->buffer_size = conn->peer_mr.length;
+
+    conn->imm = (conn->peer_mr.flags & DESC_F_IMM) != 0;
+
+    if (s_mode == M_ATOMIC)
+      conn->atomic_peer = 1;
+    else if (conn->peer_mr.flags & DESC_F_BENCH) {
+      conn->bench_peer = 1;
+      conn->mw_peer = (conn->peer_mr.flags & DESC_F_MW) != 0;
+      getrusage(RUSAGE_SELF, &conn->bench.ru_start);
+      clock_gettime(CLOCK_MONOTONIC, &conn->bench.start);
+    }
+  } else if (s_mode == M_MW) {
+    if (s_mw.region_size > conn->buffer_size)
+      conn->buffer_size = s_mw.region_size;
+  } else if (s_bench_enabled) {
+    if (s_bench.max_size > conn->buffer_size)
+      conn->buffer_size = s_bench.max_size;
+
+    TEST_Z(conn->bench_wr = calloc(s_bench.signal_every, sizeof(struct ibv_send_wr)));
+    TEST_Z(conn->bench_sge = calloc(s_bench.signal_every, sizeof(struct ibv_sge)));
+  } else
+    conn->imm = s_imm;
 
   register_memory(conn);
-  post_receives(conn);
+
+  /*
+   * No MSG_DONE in a benchmark, and a posted receive would be flushed with an
+   * error on disconnect. The mw mode's check messages each consume one.
+   */
+  if (s_mode == M_MW || conn->mw_peer ||
+      (!s_bench_enabled && !conn->bench_peer && !conn->atomic_peer && s_mode != M_RING))
+    post_receives(conn);
 }
 
 void build_context(struct ibv_context *verbs)
 {
+  struct ibv_device_attr dev_attr;
+
   if (s_ctx) {
     if (s_ctx->ctx != verbs)
       die("cannot handle events in more than one context.");
@@ -109,20 +331,82 @@ void build_context(struct ibv_context *verbs)
   s_ctx = (struct context *)malloc(sizeof(struct context));
 
   s_ctx->ctx = verbs;
+  s_mr_mode = mr_mode_from_env();
+
+  if (s_mode == M_MW && !mw_supported(s_ctx->ctx))
+    die("build_context: device has no type-2 memory windows.");
+
+  TEST_NZ(ibv_query_device(s_ctx->ctx, &dev_attr));
+  s_ctx->max_qp_rd_atom = dev_attr.max_qp_rd_atom;
+  s_ctx->max_qp_init_rd_atom = dev_attr.max_qp_init_rd_atom;
+  s_ctx->comp_vector = s_comp_vector;
+  s_ctx->poller_cpu = s_poller_cpu;
+
+  nic_resolve_affinity(s_ctx->ctx, &s_ctx->comp_vector, &s_ctx->poller_cpu);
 
   TEST_Z(s_ctx->pd = ibv_alloc_pd(s_ctx->ctx));
   TEST_Z(s_ctx->comp_channel = ibv_create_comp_channel(s_ctx->ctx));
-  TEST_Z(s_ctx->cq = ibv_create_cq(s_ctx->ctx, 10, NULL, s_ctx->comp_channel, 0)); /* cqe=10 is arbitrary */
+  TEST_Z(s_ctx->cq = ibv_create_cq(s_ctx->ctx, 10 + (s_bench_enabled ? s_bench.depth : 0), NULL,
+                                   s_ctx->comp_channel, s_ctx->comp_vector)); /* cqe=10 is arbitrary */
   TEST_NZ(ibv_req_notify_cq(s_ctx->cq, 0));
 
+  if (s_mode == M_ATOMIC) {
+    /* atomics need 8-byte aligned targets; the mapping is page aligned */
+    TEST_NZ(hugebuf_alloc_ex(&s_atomic_buf, ATOMIC_WORDS * sizeof(uint64_t), s_mr_mode == MR_MODE_PINNED));
+    memset(s_atomic_buf.addr, 0, ATOMIC_WORDS * sizeof(uint64_t));
+    TEST_Z(s_atomic_mr = odp_reg_mr(
+      s_ctx->pd,
+      s_atomic_buf.addr,
+      ATOMIC_WORDS * sizeof(uint64_t),
+      IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_REMOTE_ATOMIC,
+      s_mr_mode));
+  }
+
   TEST_NZ(pthread_create(&s_ctx->cq_poller_thread, NULL, poll_cq, NULL));
+  nic_pin_thread(s_ctx->cq_poller_thread, s_ctx->poller_cpu);
 }
 
-void build_params(struct rdma_conn_param *params)
+void build_params(struct rdma_conn_param *params, void *context)
 {
+  struct connection *conn = (struct connection *)context;
+
   memset(params, 0, sizeof(*params));
 
-  params->initiator_depth = params->responder_resources = 1;
+  conn->local_desc.addr = htobe64((uintptr_t)conn->rdma_remote_mr->addr);
+  conn->local_desc.rkey = htobe32(conn->rdma_remote_mr->rkey);
+  conn->local_desc.length = htobe32(conn->rdma_remote_mr->length);
+  conn->local_desc.flags = htobe32(((s_bench_enabled || s_mode == M_MW) ? DESC_F_BENCH : 0) |
+                                   (s_mode == M_MW ? DESC_F_MW : 0) | (conn->imm ? DESC_F_IMM : 0));
+
+  params->private_data = &conn->local_desc;
+  params->private_data_len = sizeof(conn->local_desc);
+
+  /*
+   * The active side offers what its device allows (or set_rd_depth()); the
+   * passive side answers with no more than the peer offered, so each side's
+   * initiator depth fits in the other's responder resources. rdma_cm hands
+   * the peer's params over already swapped into our view.
+   */
+  conn->initiator_depth = s_ctx->max_qp_init_rd_atom;
+  conn->responder_resources = s_ctx->max_qp_rd_atom;
+
+  if (s_rd_depth > 0) {
+    if (conn->initiator_depth > s_rd_depth)
+      conn->initiator_depth = s_rd_depth;
+    if (conn->responder_resources > s_rd_depth)
+      conn->responder_resources = s_rd_depth;
+  }
+
+  if (conn->peer_initiator_depth >= 0) {
+    if (conn->initiator_depth > conn->peer_initiator_depth)
+      conn->initiator_depth = conn->peer_initiator_depth;
+    if (conn->responder_resources > conn->peer_responder_resources)
+      conn->responder_resources = conn->peer_responder_resources;
+  }
+
+  /* rdma_conn_param carries them in a byte */
+  params->initiator_depth = conn->initiator_depth > 255 ? 255 : conn->initiator_depth;
+  params->responder_resources = conn->responder_resources > 255 ? 255 : conn->responder_resources;
   params->rnr_retry_count = 7; /* infinite retry */
 }
 
@@ -134,27 +418,67 @@ void build_qp_attr(struct ibv_qp_init_attr *qp_attr)
   qp_attr->recv_cq = s_ctx->cq;
   qp_attr->qp_type = IBV_QPT_RC;
 
-  qp_attr->cap.max_send_wr = 10;
+  qp_attr->cap.max_send_wr = 10 + (s_bench_enabled ? s_bench.depth : 0) + (s_mode == M_RING ? RING_SQ_DEPTH : 0) +
+                            (s_mode == M_MW ? 2 * s_mw.windows : 0);
   qp_attr->cap.max_recv_wr = 10;
   qp_attr->cap.max_send_sge = 1;
   qp_attr->cap.max_recv_sge = 1;
+
+  if (s_mode == M_RING)
+    qp_attr->cap.max_inline_data = sizeof(struct ring_record);
 }
 
 void destroy_connection(void *context)
 {
   struct connection *conn = (struct connection *)context;
 
+  if (conn->ring && conn->passive) {
+    conn->ring_stop = 1;
+    ring_abort(conn->ring);
+    pthread_join(conn->ring_thread, NULL);
+  }
+  ring_destroy(conn->ring);
+  mw_bench_destroy(conn->mw);
+
   rdma_destroy_qp(conn->id);
 
+  if (conn->bench_peer) {
+    struct timespec end;
+    struct rusage ru_end;
+    double secs;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    getrusage(RUSAGE_SELF, &ru_end);
+    secs = elapsed_s(&conn->bench.start, &end);
+    printf("benchmark peer done: %.2f s cpu over %.2f s connected (%.1f%%).\n",
+           cpu_s(&ru_end) - cpu_s(&conn->bench.ru_start), secs,
+           100.0 * (cpu_s(&ru_end) - cpu_s(&conn->bench.ru_start)) / secs);
+  }
+
+  if (conn->atomic_peer) {
+    uint64_t *words = (uint64_t *)s_atomic_buf.addr;
+
+    printf("atomic peer done. words[0..3] = %llu %llu %llu %llu\n", (unsigned long long)words[0],
+           (unsigned long long)words[1], (unsigned long long)words[2], (unsigned long long)words[3]);
+  }
+
+  if (s_mr_mode != MR_MODE_PINNED)
+    odp_print_stats(s_ctx->ctx);
+
   ibv_dereg_mr(conn->send_mr);
   ibv_dereg_mr(conn->recv_mr);
-  ibv_dereg_mr(conn->rdma_local_mr);
-  ibv_dereg_mr(conn->rdma_remote_mr);
+  odp_dereg_mr(conn->rdma_local_mr);
+  if (s_mode == M_MW)
+    ibv_dereg_mr(conn->rdma_remote_mr);
+  else if (!conn->atomic_peer) /* the shared words outlive the connection */
+    odp_dereg_mr(conn->rdma_remote_mr);
 
   free(conn->send_msg);
   free(conn->recv_msg);
-  free(conn->rdma_local_region);
-  free(conn->rdma_remote_region);
+  hugebuf_free(&conn->rdma_local_buf);
+  hugebuf_free(&conn->rdma_remote_buf);
+  free(conn->bench_wr);
+  free(conn->bench_sge);
 
   rdma_destroy_id(conn->id);
 
@@ -163,7 +487,7 @@ void destroy_connection(void *context)
 
 void * get_local_message_region(void *context)
 {
-  if (s_mode == M_WRITE)
+  if (s_mode == M_WRITE || s_mode == M_RING || s_mode == M_MW) /* ring and windows use the remote region */
     return ((struct connection *)context)->rdma_local_region;
   else
     return ((struct connection *)context)->rdma_remote_region;
@@ -181,76 +505,353 @@ void on_completion(struct ibv_wc *wc)
 {
   struct connection *conn = (struct connection *)(uintptr_t)wc->wr_id;
 
+  if (wc->status == IBV_WC_WR_FLUSH_ERR && s_mode == M_RING) {
+    /* records and credits still queued when the peer disconnected */
+    if (conn->ring)
+      ring_abort(conn->ring);
+    return;
+  }
+
+  if (conn->mw_peer || conn->mw_check != MWC_NONE) {
+    mw_check_completion(conn, wc);
+    return;
+  }
+
   if (wc->status != IBV_WC_SUCCESS)
     die("on_completion: status is not IBV_WC_SUCCESS.");
 
-  if (wc->opcode & IBV_WC_RECV) {
-    conn->recv_state++;
+  if (conn->ring) {
+    ring_on_completion(conn->ring);
+    return;
+  }
 
-    if (conn->recv_msg->type == MSG_MR) {
-      memcpy(&conn->peer_mr, &conn->recv_msg->data.mr, sizeof(conn->peer_mr));
-      post_receives(conn); /* only rearm for MSG_MR */
+  if (conn->mw) {
+    if (mw_bench_on_completion(conn->mw)) {
+      uint64_t addr;
 
-      if (conn->send_state == SS_INIT) /* received peer's MR before sending ours, so send ours back */
-        send_mr(conn);
+      /* now grant one window for real; the peer disconnects once it has checked it */
+      conn->mw_window.rkey = mw_bench_grant(conn->mw, &addr);
+      conn->mw_window.addr = addr;
+      conn->mw_window.length = s_mw.grant_size;
+      conn->mw_check = MWC_GRANTED;
     }
+    return;
+  }
+
+  if (s_bench_enabled) {
+    bench_completion(conn);
+    return;
+  }
+
+  if (wc->opcode == IBV_WC_RECV_RDMA_WITH_IMM) {
+    /* the immediate carries the length the peer wrote into, or read from, our buffer */
+    printf("peer %s %u bytes.\n", (s_mode == M_WRITE) ? "wrote" : "read", be32toh(wc->imm_data));
+    conn->recv_state = RS_DONE_RECV;
+
+  } else if (wc->opcode & IBV_WC_RECV) {
+    conn->recv_state++; /* MSG_DONE is the only message */
 
   } else {
-    conn->send_state++;
+    /* with imm the one signaled WR is the whole transfer */
+    conn->send_state = conn->imm ? SS_DONE_SENT : conn->send_state + 1;
     printf("send completed successfully.\n");
   }
 
-  if (conn->send_state == SS_MR_SENT && conn->recv_state == RS_MR_RECV) {
-    struct ibv_send_wr wr, *bad_wr = NULL;
-    struct ibv_sge sge;
+  if (conn->send_state == SS_DONE_SENT && conn->recv_state == RS_DONE_RECV) {
+    printf("remote buffer: %s\n", get_peer_message_region(conn));
+    rdma_disconnect(conn->id);
+  }
+}
 
-    if (s_mode == M_WRITE)
-      printf("received MSG_MR. writing message to remote memory...\n");
-    else
-      printf("received MSG_MR. reading message from remote memory...\n");
+/* the same MW_PATTERN_LEN (or window length) bytes on both sides of the mw check */
+static size_t mw_pattern(char *buf, const struct mr_desc *window)
+{
+  size_t len = window->length < MW_PATTERN_LEN ? window->length : MW_PATTERN_LEN;
 
-    memset(&wr, 0, sizeof(wr));
+  memset(buf, 0, len);
+  snprintf(buf, len, "granted through rkey 0x%08x", window->rkey);
+  return len;
+}
 
-    wr.wr_id = (uintptr_t)conn;
-    wr.opcode = (s_mode == M_WRITE) ? IBV_WR_RDMA_WRITE : IBV_WR_RDMA_READ;
-    wr.sg_list = &sge;
-    wr.num_sge = 1;
-    wr.send_flags = IBV_SEND_SIGNALED;
-    wr.wr.rdma.remote_addr = (uintptr_t)conn->peer_mr.addr;
-    wr.wr.rdma.rkey = conn->peer_mr.rkey;
+static void mw_send(struct connection *conn, int type)
+{
+  conn->send_msg->type = type;
+  conn->send_msg->window.addr = htobe64(conn->mw_window.addr);
+  conn->send_msg->window.rkey = htobe32(conn->mw_window.rkey);
+  conn->send_msg->window.length = htobe32(conn->mw_window.length);
+  send_message(conn);
+}
 
-    sge.addr = (uintptr_t)conn->rdma_local_region;
-    sge.length = RDMA_BUFFER_SIZE;
-    sge.lkey = conn->rdma_local_mr->lkey;
+static void mw_peer_read(struct connection *conn)
+{
+  struct ibv_send_wr wr, *bad_wr = NULL;
+  struct ibv_sge sge;
 
-    TEST_NZ(ibv_post_send(conn->qp, &wr, &bad_wr));
+  memset(&wr, 0, sizeof(wr));
 
-    conn->send_msg->type = MSG_DONE;
-    send_message(conn);
+  wr.wr_id = (uintptr_t)conn;
+  wr.opcode = IBV_WR_RDMA_READ;
+  wr.sg_list = &sge;
+  wr.num_sge = 1;
+  wr.send_flags = IBV_SEND_SIGNALED;
+  wr.wr.rdma.remote_addr = conn->mw_window.addr;
+  wr.wr.rdma.rkey = conn->mw_window.rkey;
 
-  } else if (conn->send_state == SS_DONE_SENT && conn->recv_state == RS_DONE_RECV) {
-    printf("remote buffer: %s\n", get_peer_message_region(conn));
-    rdma_disconnect(conn->id);
+  sge.addr = (uintptr_t)conn->rdma_local_region;
+  sge.length = conn->mw_window.length;
+  sge.lkey = conn->rdma_local_mr->lkey;
+
+  TEST_NZ(ibv_post_send(conn->qp, &wr, &bad_wr));
+}
+
+/*
+ * After the benchmark the active side binds one window and sends it over.
+ * The peer reads through it and checks what it got. The active side then
+ * invalidates the window, and the peer's second read must come back with a
+ * remote access error, which also ends the connection.
+ */
+void mw_check_completion(struct connection *conn, struct ibv_wc *wc)
+{
+  char expected[MW_PATTERN_LEN];
+  size_t len;
+
+  if (wc->status != IBV_WC_SUCCESS) {
+    if (conn->mw_peer && conn->mw_check == MWC_REVOKED && wc->status == IBV_WC_REM_ACCESS_ERR) {
+      printf("read through revoked rkey 0x%08x refused, as expected.\n", conn->mw_window.rkey);
+      rdma_disconnect(conn->id);
+      return;
+    }
+    die("mw_check_completion: status is not IBV_WC_SUCCESS.");
+  }
+
+  if (conn->mw) {
+    if (wc->opcode == IBV_WC_BIND_MW) {
+      mw_pattern((char *)(uintptr_t)conn->mw_window.addr, &conn->mw_window);
+      printf("granting rkey 0x%08x to the peer...\n", conn->mw_window.rkey);
+      mw_send(conn, MSG_MW_GRANT);
+
+    } else if (wc->opcode & IBV_WC_RECV) { /* MSG_MW_READ */
+      conn->mw_check = MWC_REVOKED;
+      mw_bench_revoke(conn->mw);
+
+    } else if (wc->opcode == IBV_WC_LOCAL_INV) {
+      mw_send(conn, MSG_MW_REVOKED);
+    }
+    return;
+  }
+
+  if (wc->opcode & IBV_WC_RECV) {
+    conn->mw_window.addr = be64toh(conn->recv_msg->window.addr);
+    conn->mw_window.rkey = be32toh(conn->recv_msg->window.rkey);
+    conn->mw_window.length = be32toh(conn->recv_msg->window.length);
+    if (conn->mw_window.length > conn->buffer_size)
+      die("mw_check_completion: granted window is larger than our buffer.");
+
+    if (conn->recv_msg->type == MSG_MW_GRANT) {
+      conn->mw_check = MWC_GRANTED;
+      post_receives(conn); /* for MSG_MW_REVOKED */
+    } else
+      conn->mw_check = MWC_REVOKED;
+
+    mw_peer_read(conn);
+
+  } else if (wc->opcode == IBV_WC_RDMA_READ) {
+    if (conn->mw_check == MWC_REVOKED) {
+      printf("FAIL: read through revoked rkey 0x%08x succeeded.\n", conn->mw_window.rkey);
+      rdma_disconnect(conn->id);
+      return;
+    }
+
+    len = mw_pattern(expected, &conn->mw_window);
+    printf("read %u bytes through rkey 0x%08x: %s.\n", conn->mw_window.length, conn->mw_window.rkey,
+           memcmp(conn->rdma_local_region, expected, len) == 0 ? "contents match" : "FAIL: contents differ");
+    mw_send(conn, MSG_MW_READ);
   }
 }
 
 void on_connect(void *context)
 {
-  ((struct connection *)context)->connected = 1;
+  struct connection *conn = (struct connection *)context;
+  struct ibv_send_wr wr, ack, *bad_wr = NULL;
+  struct ibv_sge sge;
+
+  if (conn->bench_peer) {
+    printf("connected. peer is running a benchmark against our buffer...\n");
+    return;
+  }
+
+  if (conn->atomic_peer) {
+    printf("connected. peer is running atomics on our words...\n");
+    return;
+  }
+
+  if (s_mode == M_MW) {
+    printf("connected. granting and revoking memory windows...\n");
+    TEST_Z(conn->mw = mw_bench_create(s_ctx->pd, conn->qp, conn->rdma_remote_mr, (uintptr_t)conn, &s_mw));
+    mw_bench_start(conn->mw);
+    return;
+  }
+
+  if (s_mode == M_RING) {
+    if (conn->peer_mr.length < sizeof(struct ring_region))
+      die("on_connect: peer's buffer is too small for a ring.");
+
+    TEST_Z(conn->ring = ring_create(conn->qp, (uintptr_t)conn, (struct ring_region *)conn->rdma_remote_region,
+                                    conn->peer_mr.addr, conn->peer_mr.rkey));
+
+    if (conn->passive) {
+      printf("connected. echoing ring records...\n");
+      TEST_NZ(pthread_create(&conn->ring_thread, NULL, ring_echo_thread, conn));
+    } else {
+      printf("connected. ring channel, %d slots of %d byte records, %ld round trips...\n",
+             RING_SLOTS, RING_PAYLOAD, s_ring_iterations);
+      ring_bench(conn->ring, s_ring_iterations);
+      rdma_disconnect(conn->id);
+    }
+    return;
+  }
+
+  printf("read depth: %d outstanding, %d served.\n", conn->initiator_depth, conn->responder_resources);
+
+  if (s_bench_enabled) {
+    conn->bench.depth = s_bench.depth;
+    conn->bench.signal_every = s_bench.signal_every;
+
+    if (s_mode == M_READ && conn->initiator_depth < 1)
+      die("on_connect: the peer serves no RDMA READs, can't run the read benchmark.");
+
+    if (s_mode == M_READ && conn->bench.depth > conn->initiator_depth) {
+      /* more would just queue behind the QP's read limit */
+      conn->bench.depth = conn->initiator_depth;
+      if (conn->bench.signal_every > conn->bench.depth)
+        conn->bench.signal_every = conn->bench.depth;
+      conn->bench.depth -= conn->bench.depth % conn->bench.signal_every;
+    }
+
+    printf("connected. %s benchmark, %d in flight, 1 signaled per %d, ",
+           (s_mode == M_WRITE) ? "RDMA write" : "RDMA read", conn->bench.depth, conn->bench.signal_every);
+    if (s_bench.bytes)
+      printf("%llu bytes per size\n", (unsigned long long)s_bench.bytes);
+    else
+      printf("%.1f s per size\n", s_bench.seconds);
+    printf("%10s %12s %12s %12s %8s\n", "size", "ops", "MB/s", "Mops/s", "cpu %");
+
+    bench_start_size(conn, s_bench.min_size);
+    return;
+  }
+
+  if (s_mode == M_WRITE)
+    printf("connected. writing message to remote memory...\n");
+  else
+    printf("connected. reading message from remote memory...\n");
+
+  memset(&wr, 0, sizeof(wr));
+
+  wr.wr_id = (uintptr_t)conn;
+  wr.opcode = (s_mode == M_WRITE) ? IBV_WR_RDMA_WRITE : IBV_WR_RDMA_READ;
+  wr.sg_list = &sge;
+  wr.num_sge = 1;
+  wr.send_flags = IBV_SEND_SIGNALED;
+  wr.wr.rdma.remote_addr = conn->peer_mr.addr;
+  wr.wr.rdma.rkey = conn->peer_mr.rkey;
+
+  sge.addr = (uintptr_t)conn->rdma_local_region;
+  sge.length = RDMA_BUFFER_SIZE;
+  sge.lkey = conn->rdma_local_mr->lkey;
+
+  if (conn->imm && s_mode == M_WRITE) {
+    /* the data lands and the peer's receive completes in one operation */
+    wr.opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
+    wr.imm_data = htobe32(RDMA_BUFFER_SIZE);
+
+  } else if (conn->imm) {
+    /*
+     * A zero-length write-with-imm rides behind the read in the same post. The
+     * fence holds it until the read's data is back, so its arrival tells the
+     * peer its buffer is free. Only the ack is signaled.
+     */
+    memset(&ack, 0, sizeof(ack));
+    ack.wr_id = (uintptr_t)conn;
+    ack.opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
+    ack.send_flags = IBV_SEND_SIGNALED | IBV_SEND_FENCE;
+    ack.imm_data = htobe32(RDMA_BUFFER_SIZE);
+    ack.wr.rdma.remote_addr = conn->peer_mr.addr;
+    ack.wr.rdma.rkey = conn->peer_mr.rkey;
+
+    wr.next = &ack;
+    wr.send_flags = 0;
+  }
+
+  TEST_NZ(ibv_post_send(conn->qp, &wr, &bad_wr));
+
+  if (conn->imm)
+    return;
+
+  conn->send_msg->type = MSG_DONE;
+  send_message(conn);
+}
+
+void copy_cm_event(struct rdma_cm_event *dst, struct rdma_cm_event *src, void *pdata, size_t len)
+{
+  memcpy(dst, src, sizeof(*src));
+
+  if ((src->event == RDMA_CM_EVENT_CONNECT_REQUEST || src->event == RDMA_CM_EVENT_ESTABLISHED) &&
+      src->param.conn.private_data) {
+    if (len > src->param.conn.private_data_len)
+      len = src->param.conn.private_data_len;
+
+    memcpy(pdata, src->param.conn.private_data, len);
+    dst->param.conn.private_data = pdata;
+    dst->param.conn.private_data_len = len;
+  }
+}
+
+void set_peer_params(void *context, const struct rdma_conn_param *peer)
+{
+  struct connection *conn = (struct connection *)context;
+  const struct mr_desc *desc = (const struct mr_desc *)peer->private_data;
+
+  if (!desc || peer->private_data_len < sizeof(*desc))
+    die("set_peer_params: peer sent no memory region descriptor.");
+
+  conn->peer_initiator_depth = peer->initiator_depth;
+  conn->peer_responder_resources = peer->responder_resources;
+
+  /* active side: the accept carries the final values, in our view */
+  if (conn->initiator_depth > peer->initiator_depth)
+    conn->initiator_depth = peer->initiator_depth;
+  if (conn->responder_resources > peer->responder_resources)
+    conn->responder_resources = peer->responder_resources;
+
+  conn->peer_mr.addr = be64toh(desc->addr);
+  conn->peer_mr.rkey = be32toh(desc->rkey);
+  conn->peer_mr.length = be32toh(desc->length);
+  conn->peer_mr.flags = be32toh(desc->flags);
+}
+
+void * ring_echo_thread(void *context)
+{
+  struct connection *conn = (struct connection *)context;
+
+  ring_echo(conn->ring, &conn->ring_stop);
+
+  return NULL;
 }
 
 void * poll_cq(void *ctx)
 {
   struct ibv_cq *cq;
-  struct ibv_wc wc;
+  struct ibv_wc wc[16];
+  int n;
 
   while (1) {
     TEST_NZ(ibv_get_cq_event(s_ctx->comp_channel, &cq, &ctx));
     ibv_ack_cq_events(cq, 1);
     TEST_NZ(ibv_req_notify_cq(cq, 0));
 
-    while (ibv_poll_cq(cq, 1, &wc))
-      on_completion(&wc);
+    while ((n = ibv_poll_cq(cq, 16, wc)) > 0)
+      for (int i = 0; i < n; i++)
+        on_completion(&wc[i]);
   }
 
   return NULL;
@@ -278,9 +879,6 @@ void register_memory(struct connection *conn)
   conn->send_msg = malloc(sizeof(struct message));
   conn->recv_msg = malloc(sizeof(struct message));
 
-  conn->rdma_local_region = malloc(RDMA_BUFFER_SIZE);
-  conn->rdma_remote_region = malloc(RDMA_BUFFER_SIZE);
-
   TEST_Z(conn->send_mr = ibv_reg_mr(
     s_ctx->pd, 
     conn->send_msg, 
@@ -293,17 +891,40 @@ void register_memory(struct connection *conn)
     sizeof(struct message), 
     IBV_ACCESS_LOCAL_WRITE));
 
-  TEST_Z(conn->rdma_local_mr = ibv_reg_mr(
+  if (conn->atomic_peer) {
+    conn->rdma_remote_region = s_atomic_buf.addr;
+    conn->rdma_remote_mr = s_atomic_mr;
+    return;
+  }
+
+  TEST_NZ(hugebuf_alloc_ex(&conn->rdma_local_buf, conn->buffer_size, s_mr_mode == MR_MODE_PINNED));
+  TEST_NZ(hugebuf_alloc_ex(&conn->rdma_remote_buf, conn->buffer_size, s_mr_mode == MR_MODE_PINNED));
+  conn->rdma_local_region = conn->rdma_local_buf.addr;
+  conn->rdma_remote_region = conn->rdma_remote_buf.addr;
+
+  TEST_Z(conn->rdma_local_mr = odp_reg_mr(
     s_ctx->pd, 
     conn->rdma_local_region, 
-    RDMA_BUFFER_SIZE, 
-    ((s_mode == M_WRITE) ? 0 : IBV_ACCESS_LOCAL_WRITE)));
+    conn->buffer_size, 
+    ((s_mode == M_WRITE && !conn->mw_peer) ? 0 : IBV_ACCESS_LOCAL_WRITE), /* the mw peer reads into it */
+    s_mr_mode));
+
+  if (s_mode == M_MW) {
+    /* windows bind to the real MR, not an odp_reg_mr() wrapper */
+    TEST_Z(conn->rdma_remote_mr = ibv_reg_mr(
+      s_ctx->pd,
+      conn->rdma_remote_region,
+      conn->buffer_size,
+      IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_MW_BIND));
+    return;
+  }
 
-  TEST_Z(conn->rdma_remote_mr = ibv_reg_mr(
+  TEST_Z(conn->rdma_remote_mr = odp_reg_mr(
     s_ctx->pd, 
     conn->rdma_remote_region, 
-    RDMA_BUFFER_SIZE, 
-    ((s_mode == M_WRITE) ? (IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE) : IBV_ACCESS_REMOTE_READ)));
+    conn->buffer_size, 
+    ((s_mode == M_WRITE || s_mode == M_RING) ? (IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE) : IBV_ACCESS_REMOTE_READ),
+    s_mr_mode));
 }
 
 void send_message(struct connection *conn)
@@ -323,19 +944,39 @@ void send_message(struct connection *conn)
   sge.length = sizeof(struct message);
   sge.lkey = conn->send_mr->lkey;
 
-  while (!conn->connected);
-
   TEST_NZ(ibv_post_send(conn->qp, &wr, &bad_wr));
 }
 
-void send_mr(void *context)
+void set_affinity(int comp_vector, int cpu)
 {
-  struct connection *conn = (struct connection *)context;
+  s_comp_vector = comp_vector;
+  s_poller_cpu = cpu;
+}
 
-  conn->send_msg->type = MSG_MR;
-  memcpy(&conn->send_msg->data.mr, conn->rdma_remote_mr, sizeof(struct ibv_mr));
+void set_bench(const struct bench_params *params)
+{
+  s_bench = *params;
+  s_bench_enabled = 1;
+}
 
-  send_message(conn);
+void set_mw(const struct mw_params *params)
+{
+  s_mw = *params;
+}
+
+void set_ring_iterations(long iterations)
+{
+  s_ring_iterations = iterations;
+}
+
+void set_imm(int imm)
+{
+  s_imm = imm;
+}
+
+void set_rd_depth(int depth)
+{
+  s_rd_depth = depth;
 }
 
 void set_mode(enum mode m)
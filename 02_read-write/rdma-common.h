@@ -5,25 +5,76 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <rdma/rdma_cma.h>
+#include "rdma-mw.h"
 
 #define TEST_NZ(x) do { if ( (x)) die("error: " #x " failed (returned non-zero)." ); } while (0)
 #define TEST_Z(x)  do { if (!(x)) die("error: " #x " failed (returned zero/null)."); } while (0)
 
+#define MAX_PRIVATE_DATA 256
+#define BENCH_MAX_SIZE (1UL << 30) /* largest message / buffer a benchmark may ask for */
+#define ATOMIC_WORDS 1024          /* 8-byte words the server shares in atomic mode */
+
 enum mode {
   M_WRITE,
-  M_READ
+  M_READ,
+  M_ATOMIC,
+  M_RING,    /* one-sided message channel, see rdma-ring.h */
+  M_MW       /* memory-window grant benchmark, see rdma-mw.h */
+};
+
+/* what each side exposes to its peer, carried in the connect/accept private data (big endian) */
+struct mr_desc {
+  uint64_t addr;
+  uint32_t rkey;
+  uint32_t length;
+  uint32_t flags;
+};
+
+#define DESC_F_BENCH 1 /* the active side runs a benchmark against this buffer */
+#define DESC_F_IMM 2   /* signal completion with write-with-imm instead of MSG_DONE */
+#define DESC_F_MW 4    /* the active side grants a memory window to read through after its benchmark */
+
+/* sustained one-sided throughput, run by the client; the server only exposes its buffer */
+struct bench_params {
+  size_t min_size;
+  size_t max_size;     /* message sizes double from min_size up to max_size */
+  int depth;           /* RDMA ops kept outstanding */
+  int signal_every;    /* one signaled op per this many */
+  double seconds;      /* per message size, when bytes is 0 */
+  uint64_t bytes;      /* per message size */
+};
+
+/* contention benchmark on the server's shared words, run by the client (rdma-atomic.c) */
+struct atomic_params {
+  int threads;         /* one connection each */
+  int words;           /* words contended on, threads spread over them */
+  enum {
+    A_FETCH_ADD,       /* remote sequence counter */
+    A_LOCK             /* CMP_AND_SWP spin-lock with backoff */
+  } op;
+  long ops;            /* per thread */
 };
 
 void die(const char *reason);
 
-void build_connection(struct rdma_cm_id *id);
-void build_params(struct rdma_conn_param *params);
+void build_connection(struct rdma_cm_id *id, const struct rdma_conn_param *peer); /* peer: passive side only */
+void build_params(struct rdma_conn_param *params, void *context); /* carries our MR descriptor and read depth */
+void copy_cm_event(struct rdma_cm_event *dst, struct rdma_cm_event *src, void *pdata, size_t len); /* private data is freed on ack */
 void destroy_connection(void *context);
 void * get_local_message_region(void *context);
-void on_connect(void *context);
-void send_mr(void *context);
+void on_connect(void *context); /* starts the RDMA op, the peer's MR is already known */
+void set_peer_params(void *context, const struct rdma_conn_param *peer); /* MR descriptor and read depth */
+void set_affinity(int comp_vector, int cpu); /* -1 = pick near the NIC */
+void set_bench(const struct bench_params *params);
+void set_imm(int imm); /* active side; the passive side follows DESC_F_IMM */
+void set_rd_depth(int depth); /* outstanding RDMA READs per QP, 0 = as many as the device allows */
+void set_ring_iterations(long iterations); /* active side of the ring mode */
+void set_mw(const struct mw_params *params); /* active side of the mw mode */
 void set_mode(enum mode m);
 
+void run_atomic(const char *host, const char *port, const struct atomic_params *params);
+
 #endif
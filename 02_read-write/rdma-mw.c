@@ -0,0 +1,260 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "rdma-mw.h"
+
+struct mw_bench {
+  struct ibv_pd *pd;
+  struct ibv_qp *qp;
+  struct ibv_mr *mr;
+  uint64_t wr_id;
+  struct mw_params params;
+
+  struct ibv_mw **mws;
+  uint32_t *rkeys;           /* rkey of each window's current binding */
+  struct timespec *posted;   /* when each window's cycle was posted */
+  int *fifo;                 /* windows in flight, in posting order */
+  int fifo_head;
+  int in_flight;
+
+  long issued;
+  long completed;
+  double *lat_us;
+  uint64_t rng;
+  struct timespec start;
+};
+
+static double elapsed_us(const struct timespec *from, const struct timespec *to)
+{
+  return (to->tv_sec - from->tv_sec) * 1e6 + (to->tv_nsec - from->tv_nsec) / 1e3;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+
+  return (x > y) - (x < y);
+}
+
+static uint64_t random_offset(struct mw_bench *b)
+{
+  uint64_t slots = b->params.region_size / b->params.grant_size;
+
+  /* xorshift64 */
+  b->rng ^= b->rng << 13;
+  b->rng ^= b->rng >> 7;
+  b->rng ^= b->rng << 17;
+
+  return (b->rng % slots) * b->params.grant_size;
+}
+
+int mw_supported(struct ibv_context *ctx)
+{
+  struct ibv_device_attr attr;
+
+  if (ibv_query_device(ctx, &attr))
+    return 0;
+
+  return attr.max_mw > 0 &&
+         (attr.device_cap_flags & (IBV_DEVICE_MEM_WINDOW_TYPE_2A | IBV_DEVICE_MEM_WINDOW_TYPE_2B));
+}
+
+struct mw_bench * mw_bench_create(struct ibv_pd *pd, struct ibv_qp *qp, struct ibv_mr *mr, uint64_t wr_id,
+                                  const struct mw_params *params)
+{
+  struct mw_bench *b = calloc(1, sizeof(*b));
+  int n = params->windows;
+
+  if (!b)
+    return NULL;
+
+  b->pd = pd;
+  b->qp = qp;
+  b->mr = mr;
+  b->wr_id = wr_id;
+  b->params = *params;
+  b->rng = 0x9e3779b97f4a7c15ULL;
+
+  b->mws = calloc(n, sizeof(*b->mws));
+  b->rkeys = calloc(n, sizeof(*b->rkeys));
+  b->posted = calloc(n, sizeof(*b->posted));
+  b->fifo = calloc(n, sizeof(*b->fifo));
+  b->lat_us = malloc(params->grants * sizeof(double));
+  if (!b->mws || !b->rkeys || !b->posted || !b->fifo || !b->lat_us) {
+    mw_bench_destroy(b);
+    return NULL;
+  }
+
+  for (int i = 0; i < n; i++) {
+    if (!(b->mws[i] = ibv_alloc_mw(pd, IBV_MW_TYPE_2))) {
+      mw_bench_destroy(b);
+      return NULL;
+    }
+    b->rkeys[i] = b->mws[i]->rkey;
+  }
+
+  return b;
+}
+
+void mw_bench_destroy(struct mw_bench *b)
+{
+  if (!b)
+    return;
+
+  for (int i = 0; b->mws && i < b->params.windows; i++)
+    if (b->mws[i])
+      ibv_dealloc_mw(b->mws[i]);
+
+  free(b->mws);
+  free(b->rkeys);
+  free(b->posted);
+  free(b->fifo);
+  free(b->lat_us);
+  free(b);
+}
+
+/* bind window i to a random sub-range under a fresh key, so a revoked one stays dead */
+static void prepare_bind(struct mw_bench *b, int i, struct ibv_send_wr *bind)
+{
+  b->rkeys[i] = ibv_inc_rkey(b->rkeys[i]);
+
+  memset(bind, 0, sizeof(*bind));
+  bind->wr_id = b->wr_id;
+  bind->opcode = IBV_WR_BIND_MW;
+  bind->bind_mw.mw = b->mws[i];
+  bind->bind_mw.rkey = b->rkeys[i];
+  bind->bind_mw.bind_info.mr = b->mr;
+  bind->bind_mw.bind_info.addr = (uintptr_t)b->mr->addr + random_offset(b);
+  bind->bind_mw.bind_info.length = b->params.grant_size;
+  bind->bind_mw.bind_info.mw_access_flags = IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_REMOTE_READ;
+}
+
+static void prepare_inv(struct mw_bench *b, int i, struct ibv_send_wr *inv)
+{
+  memset(inv, 0, sizeof(*inv));
+  inv->wr_id = b->wr_id;
+  inv->opcode = IBV_WR_LOCAL_INV;
+  inv->invalidate_rkey = b->rkeys[i];
+  inv->send_flags = IBV_SEND_SIGNALED;
+}
+
+/* grant a random sub-range through window i and revoke it again, one chain, one completion */
+static void post_cycle(struct mw_bench *b, int i)
+{
+  struct ibv_send_wr bind, inv, *bad_wr = NULL;
+
+  prepare_bind(b, i, &bind);
+  prepare_inv(b, i, &inv);
+  bind.next = &inv;
+
+  clock_gettime(CLOCK_MONOTONIC, &b->posted[i]);
+
+  if (ibv_post_send(b->qp, &bind, &bad_wr)) {
+    fprintf(stderr, "mw: ibv_post_send failed.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  b->fifo[(b->fifo_head + b->in_flight) % b->params.windows] = i;
+  b->in_flight++;
+  b->issued++;
+}
+
+void mw_bench_start(struct mw_bench *b)
+{
+  clock_gettime(CLOCK_MONOTONIC, &b->start);
+
+  for (int i = 0; i < b->params.windows && b->issued < b->params.grants; i++)
+    post_cycle(b, i);
+}
+
+static void report(const char *name, double *lat_us, long n, double secs)
+{
+  qsort(lat_us, n, sizeof(double), compare_double);
+  printf("%-22s %10.0f grants/s   p50 %8.2f us   p99 %8.2f us   max %8.2f us\n", name, n / secs,
+         lat_us[n / 2], lat_us[(long)(n * 0.99)], lat_us[n - 1]);
+}
+
+static void run_reregistration(struct mw_bench *b)
+{
+  struct timespec start, end, t0, t1;
+  int access = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_REMOTE_READ;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  for (long i = 0; i < b->params.grants; i++) {
+    struct ibv_mr *mr;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (!(mr = ibv_reg_mr(b->pd, (char *)b->mr->addr + random_offset(b), b->params.grant_size, access))) {
+      fprintf(stderr, "mw: ibv_reg_mr failed.\n");
+      exit(EXIT_FAILURE);
+    }
+    ibv_dereg_mr(mr);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    b->lat_us[i] = elapsed_us(&t0, &t1);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  report("reg_mr + dereg_mr", b->lat_us, b->params.grants, elapsed_us(&start, &end) / 1e6);
+}
+
+/* completions arrive in posting order, one per cycle */
+int mw_bench_on_completion(struct mw_bench *b)
+{
+  struct timespec now, end;
+  int i = b->fifo[b->fifo_head];
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  b->lat_us[b->completed++] = elapsed_us(&b->posted[i], &now);
+  b->fifo_head = (b->fifo_head + 1) % b->params.windows;
+  b->in_flight--;
+
+  if (b->issued < b->params.grants) {
+    post_cycle(b, i);
+    return 0;
+  }
+
+  if (b->in_flight > 0)
+    return 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  printf("%ld grants of %zu bytes in a %zu byte region, %d windows in flight\n", b->params.grants,
+         b->params.grant_size, b->params.region_size, b->params.windows);
+  report("bind_mw + local_inv", b->lat_us, b->params.grants, elapsed_us(&b->start, &end) / 1e6);
+
+  run_reregistration(b);
+
+  return 1;
+}
+
+/* only once the benchmark is done: window 0 is idle then */
+uint32_t mw_bench_grant(struct mw_bench *b, uint64_t *addr)
+{
+  struct ibv_send_wr bind, *bad_wr = NULL;
+
+  prepare_bind(b, 0, &bind);
+  bind.send_flags = IBV_SEND_SIGNALED;
+
+  if (ibv_post_send(b->qp, &bind, &bad_wr)) {
+    fprintf(stderr, "mw: ibv_post_send failed.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  *addr = bind.bind_mw.bind_info.addr;
+  return b->rkeys[0];
+}
+
+void mw_bench_revoke(struct mw_bench *b)
+{
+  struct ibv_send_wr inv, *bad_wr = NULL;
+
+  prepare_inv(b, 0, &inv);
+
+  if (ibv_post_send(b->qp, &inv, &bad_wr)) {
+    fprintf(stderr, "mw: ibv_post_send failed.\n");
+    exit(EXIT_FAILURE);
+  }
+}
@@ -0,0 +1,41 @@
+#ifndef RDMA_MW_H
+#define RDMA_MW_H
+
+#include <stdint.h>
+#include <infiniband/verbs.h>
+
+/*
+ * Fine-grained access grants with type-2 memory windows. One large MR is
+ * registered once with IBV_ACCESS_MW_BIND. A grant is a window bound to a
+ * sub-range of it with IBV_WR_BIND_MW, and revoked with IBV_WR_LOCAL_INV.
+ * Both are work requests on the connection's QP, so they cost a trip through
+ * the send queue rather than a system call and page-table walk.
+ *
+ * The benchmark keeps `windows` grants cycling. Each cycle is a chained bind
+ * (unsignaled) and invalidate (signaled) on a random sub-range. It then does
+ * the same number of ibv_reg_mr()/ibv_dereg_mr() pairs on the same sizes
+ * for comparison.
+ *
+ * Afterwards mw_bench_grant() binds one window for real: the peer reads
+ * through its rkey, and again after mw_bench_revoke(), when it must fail.
+ */
+
+struct mw_params {
+  long grants;         /* bind/invalidate cycles */
+  size_t grant_size;
+  size_t region_size;  /* of the MR windows are bound into */
+  int windows;         /* grants in flight */
+};
+
+struct mw_bench;
+
+int mw_supported(struct ibv_context *ctx);
+struct mw_bench * mw_bench_create(struct ibv_pd *pd, struct ibv_qp *qp, struct ibv_mr *mr, uint64_t wr_id,
+                                  const struct mw_params *params);
+void mw_bench_destroy(struct mw_bench *b);
+void mw_bench_start(struct mw_bench *b);
+int mw_bench_on_completion(struct mw_bench *b); /* 1 once both runs are done */
+uint32_t mw_bench_grant(struct mw_bench *b, uint64_t *addr); /* signaled bind of a random sub-range, returns the rkey */
+void mw_bench_revoke(struct mw_bench *b);                    /* signaled invalidate of what mw_bench_grant() bound */
+
+#endif
@@ -0,0 +1,234 @@
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "rdma-ring.h"
+
+struct ring_channel {
+  struct ibv_qp *qp;
+  uint64_t wr_id;
+  struct ring_region *local;
+  uint64_t peer_addr;
+  uint32_t peer_rkey;
+
+  uint64_t tail;        /* records sent */
+  uint64_t head;        /* records received */
+  uint64_t credit_sent; /* head last written back to the peer */
+
+  uint64_t posted;      /* send WRs posted */
+  uint64_t completed;   /* send WRs known to be done, advanced by ring_on_completion() */
+  int aborted;          /* set by ring_abort(): nothing will complete any more */
+};
+
+struct ring_channel * ring_create(struct ibv_qp *qp, uint64_t wr_id, struct ring_region *local,
+                                  uint64_t peer_addr, uint32_t peer_rkey)
+{
+  struct ring_channel *ch = calloc(1, sizeof(*ch));
+
+  if (!ch)
+    return NULL;
+
+  ch->qp = qp;
+  ch->wr_id = wr_id;
+  ch->local = local;
+  ch->peer_addr = peer_addr;
+  ch->peer_rkey = peer_rkey;
+
+  return ch;
+}
+
+void ring_destroy(struct ring_channel *ch)
+{
+  free(ch);
+}
+
+void ring_on_completion(struct ring_channel *ch)
+{
+  __atomic_add_fetch(&ch->completed, RING_SIGNAL_EVERY, __ATOMIC_RELEASE);
+}
+
+void ring_abort(struct ring_channel *ch)
+{
+  /* flushed WRs are done too, whether or not they were signaled */
+  __atomic_store_n(&ch->completed, __atomic_load_n(&ch->posted, __ATOMIC_RELAXED), __ATOMIC_RELEASE);
+  __atomic_store_n(&ch->aborted, 1, __ATOMIC_RELEASE);
+}
+
+int ring_aborted(struct ring_channel *ch)
+{
+  return __atomic_load_n(&ch->aborted, __ATOMIC_ACQUIRE);
+}
+
+/* inline RDMA WRITE of len bytes to offset in the peer's region; -1 once the channel is aborted */
+static int post_write(struct ring_channel *ch, const void *buf, uint32_t len, size_t offset)
+{
+  struct ibv_send_wr wr, *bad_wr = NULL;
+  struct ibv_sge sge;
+
+  /* send queue full, wait for the next signaled completion */
+  while (ch->posted - __atomic_load_n(&ch->completed, __ATOMIC_ACQUIRE) >= RING_SQ_DEPTH)
+    if (ring_aborted(ch))
+      return -1;
+
+  if (ring_aborted(ch))
+    return -1;
+
+  memset(&wr, 0, sizeof(wr));
+  wr.wr_id = ch->wr_id;
+  wr.opcode = IBV_WR_RDMA_WRITE;
+  wr.sg_list = &sge;
+  wr.num_sge = 1;
+  wr.send_flags = IBV_SEND_INLINE;
+  if (__atomic_add_fetch(&ch->posted, 1, __ATOMIC_RELAXED) % RING_SIGNAL_EVERY == 0)
+    wr.send_flags |= IBV_SEND_SIGNALED;
+  wr.wr.rdma.remote_addr = ch->peer_addr + offset;
+  wr.wr.rdma.rkey = ch->peer_rkey;
+
+  sge.addr = (uintptr_t)buf;
+  sge.length = len;
+  sge.lkey = 0; /* inline */
+
+  if (ibv_post_send(ch->qp, &wr, &bad_wr)) {
+    fprintf(stderr, "ring: ibv_post_send failed.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  return 0;
+}
+
+int ring_send(struct ring_channel *ch, const void *buf, uint32_t len)
+{
+  struct ring_record rec;
+
+  if (len > RING_PAYLOAD)
+    len = RING_PAYLOAD;
+
+  if (ch->tail - __atomic_load_n(&ch->local->credit, __ATOMIC_ACQUIRE) >= RING_SLOTS || ring_aborted(ch))
+    return -1;
+
+  memcpy(rec.payload, buf, len);
+  rec.len = len;
+  rec.seq = ch->tail + 1;
+
+  /* the seq is the highest-addressed word, placed last by the write */
+  if (post_write(ch, &rec, sizeof(rec), (ch->tail % RING_SLOTS) * sizeof(struct ring_record)))
+    return -1;
+  ch->tail++;
+
+  return 0;
+}
+
+int ring_poll(struct ring_channel *ch, void *buf)
+{
+  struct ring_record *rec = &ch->local->ring[ch->head % RING_SLOTS];
+  uint32_t len;
+
+  if (__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) != ch->head + 1)
+    return -1;
+
+  /* the length is the peer's word, never trust it with our buffer */
+  if ((len = rec->len) > RING_PAYLOAD) {
+    fprintf(stderr, "ring: record of %u bytes from the peer, at most %d fit.\n", len, RING_PAYLOAD);
+    exit(EXIT_FAILURE);
+  }
+
+  memcpy(buf, rec->payload, len);
+  ch->head++;
+
+  if (ch->head - ch->credit_sent >= RING_SLOTS / 4 &&
+      !post_write(ch, &ch->head, sizeof(ch->head), offsetof(struct ring_region, credit)))
+    ch->credit_sent = ch->head;
+
+  return len;
+}
+
+static double elapsed_us(const struct timespec *from, const struct timespec *to)
+{
+  return (to->tv_sec - from->tv_sec) * 1e6 + (to->tv_nsec - from->tv_nsec) / 1e3;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+
+  return (x > y) - (x < y);
+}
+
+/* ping-pong latency, then streaming rate, against a peer running ring_echo() */
+void ring_bench(struct ring_channel *ch, long iterations)
+{
+  char buf[RING_PAYLOAD];
+  struct timespec start, end;
+  long sent = 0, received = 0;
+  double *rtt, secs;
+
+  if (!(rtt = malloc(iterations * sizeof(double)))) {
+    fprintf(stderr, "ring: out of memory.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  memset(buf, 0, sizeof(buf));
+
+  for (long i = 0; i < iterations; i++) {
+    struct timespec t0, t1;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    while (ring_send(ch, buf, RING_PAYLOAD) < 0 && !ring_aborted(ch))
+      ;
+    while (ring_poll(ch, buf) < 0 && !ring_aborted(ch))
+      ;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    if (ring_aborted(ch)) {
+      fprintf(stderr, "ring: connection failed after %ld round trips.\n", i);
+      free(rtt);
+      return;
+    }
+
+    rtt[i] = elapsed_us(&t0, &t1);
+  }
+
+  qsort(rtt, iterations, sizeof(double), compare_double);
+  printf("ping-pong: %ld round trips, rtt p50 %.2f us, p99 %.2f us, max %.2f us (one way ~%.2f us)\n",
+         iterations, rtt[iterations / 2], rtt[(long)(iterations * 0.99)], rtt[iterations - 1],
+         rtt[iterations / 2] / 2);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  while (received < iterations) {
+    if (ring_aborted(ch)) {
+      fprintf(stderr, "ring: connection failed after %ld of %ld records.\n", received, iterations);
+      free(rtt);
+      return;
+    }
+    if (sent < iterations && ring_send(ch, buf, RING_PAYLOAD) == 0)
+      sent++;
+    while (ring_poll(ch, buf) >= 0)
+      received++;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  secs = elapsed_us(&start, &end) / 1e6;
+
+  printf("streaming: %ld records echoed in %.3f s, %.0f records/s each way (%.2f MB/s payload)\n",
+         iterations, secs, iterations / secs, iterations * RING_PAYLOAD / secs / 1e6);
+
+  free(rtt);
+}
+
+/* send every record back until *stop is set */
+void ring_echo(struct ring_channel *ch, volatile int *stop)
+{
+  char buf[RING_PAYLOAD];
+  int len;
+
+  while (!*stop && !ring_aborted(ch)) {
+    if ((len = ring_poll(ch, buf)) < 0)
+      continue;
+
+    while (ring_send(ch, buf, len) < 0 && !*stop && !ring_aborted(ch))
+      ;
+  }
+}
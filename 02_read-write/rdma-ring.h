@@ -0,0 +1,53 @@
+#ifndef RDMA_RING_H
+#define RDMA_RING_H
+
+#include <stdint.h>
+#include <infiniband/verbs.h>
+
+/*
+ * One-sided message channel. Each side exposes a struct ring_region. The
+ * sender RDMA-WRITEs fixed-size records into the peer's ring, and each record
+ * ends with its sequence number. The receiver polls the next slot's sequence
+ * in its own memory: no receive WRs and no receive-side CQEs. After every
+ * quarter ring consumed, the receiver writes its head back into the sender's
+ * credit word, which bounds how far the sender may run ahead.
+ *
+ * Records and credits go out inline and only every RING_SIGNAL_EVERY-th WR
+ * is signaled. The owner of the CQ reports those completions with
+ * ring_on_completion() so the sender knows how much of the send queue is free,
+ * and calls ring_abort() on a flushed completion or before tearing the
+ * connection down, so nobody keeps waiting for room or records.
+ */
+
+#define RING_SLOTS 256
+#define RING_PAYLOAD 52
+#define RING_SIGNAL_EVERY 16
+#define RING_SQ_DEPTH 64 /* send WRs a channel keeps outstanding */
+
+struct ring_record {
+  char payload[RING_PAYLOAD];
+  uint32_t len;
+  uint64_t seq;        /* last in the record: 1 + the sender's count when this slot is valid */
+};
+
+struct ring_region {
+  struct ring_record ring[RING_SLOTS]; /* written by the peer */
+  uint64_t credit;                     /* records the peer has consumed from the ring we write into */
+};
+
+struct ring_channel;
+
+struct ring_channel * ring_create(struct ibv_qp *qp, uint64_t wr_id, struct ring_region *local,
+                                  uint64_t peer_addr, uint32_t peer_rkey);
+void ring_destroy(struct ring_channel *ch);
+void ring_on_completion(struct ring_channel *ch);
+void ring_abort(struct ring_channel *ch);
+int ring_aborted(struct ring_channel *ch);
+
+int ring_send(struct ring_channel *ch, const void *buf, uint32_t len); /* 0, or -1 without credit or once aborted */
+int ring_poll(struct ring_channel *ch, void *buf);                     /* length, or -1 if nothing arrived */
+
+void ring_bench(struct ring_channel *ch, long iterations);
+void ring_echo(struct ring_channel *ch, volatile int *stop);
+
+#endif
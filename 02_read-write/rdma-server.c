@@ -1,11 +1,14 @@
+#include <getopt.h>
 #include "rdma-common.h"
 
-static int on_connect_request(struct rdma_cm_id *id);
+static int on_connect_request(struct rdma_cm_event *event);
 static int on_connection(struct rdma_cm_id *id);
 static int on_disconnect(struct rdma_cm_id *id);
 static int on_event(struct rdma_cm_event *event);
 static void usage(const char *argv0);
 
+static int s_atomic = 0; /* the buffer is the shared atomic words, no message */
+
 int main(int argc, char **argv)
 {
   struct sockaddr_in6 addr;
@@ -13,14 +16,34 @@ int main(int argc, char **argv)
   struct rdma_cm_id *listener = NULL;
   struct rdma_event_channel *ec = NULL;
   uint16_t port = 0;
+  int op, cpu = -1, comp_vector = -1;
+
+  while ((op = getopt(argc, argv, "r:C:V:")) != -1) {
+    if (op == 'r')
+      set_rd_depth(atoi(optarg));
+    else if (op == 'C')
+      cpu = atoi(optarg);
+    else if (op == 'V')
+      comp_vector = atoi(optarg);
+    else
+      usage(argv[0]);
+  }
 
-  if (argc != 2)
+  set_affinity(comp_vector, cpu);
+
+  if (argc - optind != 1)
     usage(argv[0]);
 
-  if (strcmp(argv[1], "write") == 0)
+  if (strcmp(argv[optind], "write") == 0)
     set_mode(M_WRITE);
-  else if (strcmp(argv[1], "read") == 0)
+  else if (strcmp(argv[optind], "read") == 0)
     set_mode(M_READ);
+  else if (strcmp(argv[optind], "ring") == 0)
+    set_mode(M_RING);
+  else if (strcmp(argv[optind], "atomic") == 0) {
+    set_mode(M_ATOMIC);
+    s_atomic = 1;
+  }
   else
     usage(argv[0]);
 
@@ -38,8 +61,9 @@ int main(int argc, char **argv)
 
   while (rdma_get_cm_event(ec, &event) == 0) {
     struct rdma_cm_event event_copy;
+    char pdata[MAX_PRIVATE_DATA];
 
-    memcpy(&event_copy, event, sizeof(*event));
+    copy_cm_event(&event_copy, event, pdata, sizeof(pdata));
     rdma_ack_cm_event(event);
 
     if (on_event(&event_copy))
@@ -52,14 +76,16 @@ int main(int argc, char **argv)
   return 0;
 }
 
-int on_connect_request(struct rdma_cm_id *id)
+int on_connect_request(struct rdma_cm_event *event)
 {
+  struct rdma_cm_id *id = event->id;
   struct rdma_conn_param cm_params;
 
   printf("received connection request.\n");
-  build_connection(id);
-  build_params(&cm_params);
-  sprintf(get_local_message_region(id->context), "message from passive/server side with pid %d", getpid());
+  build_connection(id, &event->param.conn);
+  build_params(&cm_params, id->context);
+  if (!s_atomic)
+    sprintf(get_local_message_region(id->context), "message from passive/server side with pid %d", getpid());
   TEST_NZ(rdma_accept(id, &cm_params));
 
   return 0;
@@ -85,7 +111,7 @@ int on_event(struct rdma_cm_event *event)
   int r = 0;
 
   if (event->event == RDMA_CM_EVENT_CONNECT_REQUEST)
-    r = on_connect_request(event->id);
+    r = on_connect_request(event);
   else if (event->event == RDMA_CM_EVENT_ESTABLISHED)
     r = on_connection(event->id);
   else if (event->event == RDMA_CM_EVENT_DISCONNECTED)
@@ -98,6 +124,6 @@ int on_event(struct rdma_cm_event *event)
 
 void usage(const char *argv0)
 {
-  fprintf(stderr, "usage: %s <mode>\n  mode = \"read\", \"write\"\n", argv0);
+  fprintf(stderr, "usage: %s [-r <read depth>] [-C <poller cpu>] [-V <comp vector>] <mode>\n  mode = \"read\", \"write\", \"atomic\", \"ring\"\n", argv0);
   exit(1);
 }
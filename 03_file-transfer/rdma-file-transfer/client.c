@@ -2,11 +2,16 @@
 #include <libgen.h>
 
 #include "common.h"
+#include "hugepage_alloc.h"
+#include "odp_mr.h"
 #include "messages.h"
 
+struct odp_implicit_mr odp_implicit[ODP_MAX_IMPLICIT]; /* odp_mr.h keeps its implicit MRs here */
+
 struct client_context
 {
   char *buffer;
+  struct hugebuf buffer_mem;
   struct ibv_mr *buffer_mr;
 
   struct message *msg;
@@ -17,6 +22,8 @@ struct client_context
 
   int fd;
   const char *file_name;
+
+  uint32_t acked; /* chunks (file name included) acknowledged with MSG_READY */
 };
 
 static void write_remote(struct rdma_cm_id *id, uint32_t len)
@@ -94,8 +101,11 @@ static void on_pre_conn(struct rdma_cm_id *id)
 {
   struct client_context *ctx = (struct client_context *)id->context;
 
-  posix_memalign((void **)&ctx->buffer, sysconf(_SC_PAGESIZE), BUFFER_SIZE);
-  TEST_Z(ctx->buffer_mr = ibv_reg_mr(rc_get_pd(), ctx->buffer, BUFFER_SIZE, 0));
+  int mr_mode = mr_mode_from_env();
+
+  TEST_NZ(hugebuf_alloc_ex(&ctx->buffer_mem, BUFFER_SIZE, mr_mode == MR_MODE_PINNED));
+  ctx->buffer = ctx->buffer_mem.addr;
+  TEST_Z(ctx->buffer_mr = odp_reg_mr(rc_get_pd(), ctx->buffer, BUFFER_SIZE, 0, mr_mode));
 
   posix_memalign((void **)&ctx->msg, sysconf(_SC_PAGESIZE), sizeof(*ctx->msg));
   TEST_Z(ctx->msg_mr = ibv_reg_mr(rc_get_pd(), ctx->msg, sizeof(*ctx->msg), IBV_ACCESS_LOCAL_WRITE));
@@ -117,6 +127,7 @@ static void on_completion(struct ibv_wc *wc)
       send_file_name(id);
     } else if (ctx->msg->id == MSG_READY) {
       printf("received READY, sending chunk\n");
+      rc_set_seq(id, ++ctx->acked);
       send_next_chunk(id);
     } else if (ctx->msg->id == MSG_DONE) {
       printf("received DONE, disconnecting\n");
@@ -128,6 +139,33 @@ static void on_completion(struct ibv_wc *wc)
   }
 }
 
+static void on_resume(struct rdma_cm_id *id, uint32_t peer_seq)
+{
+  struct client_context *ctx = (struct client_context *)id->context;
+
+  post_receive(id);
+
+  /* with nothing received yet (or the session expired there) the server
+   * re-sends MSG_MR and we start over */
+  if (peer_seq == 0) {
+    ctx->acked = 0;
+
+    if (lseek(ctx->fd, 0, SEEK_SET) == -1)
+      rc_die("lseek() failed\n");
+
+    return;
+  }
+
+  printf("resumed, server has %u chunk(s), continuing\n", peer_seq);
+
+  ctx->acked = peer_seq;
+
+  if (lseek(ctx->fd, (off_t)(peer_seq - 1) * BUFFER_SIZE, SEEK_SET) == -1)
+    rc_die("lseek() failed\n");
+
+  send_next_chunk(id);
+}
+
 int main(int argc, char **argv)
 {
   struct client_context ctx;
@@ -138,6 +176,8 @@ int main(int argc, char **argv)
   }
 
   ctx.file_name = basename(argv[2]);
+  ctx.acked = 0;
+  ctx.buffer_mr = NULL;
   ctx.fd = open(argv[2], O_RDONLY);
 
   if (ctx.fd == -1) {
@@ -151,8 +191,17 @@ int main(int argc, char **argv)
     on_completion,
     NULL); // on disconnect
 
+  rc_enable_resume(on_resume, RESUME_MAX_RETRIES, RESUME_LINGER_SEC);
+
+  /* RDMA_POLLER_CPU / RDMA_COMP_VECTOR override the placement near the NIC */
+  rc_set_affinity(getenv("RDMA_COMP_VECTOR") ? atoi(getenv("RDMA_COMP_VECTOR")) : -1,
+                  getenv("RDMA_POLLER_CPU") ? atoi(getenv("RDMA_POLLER_CPU")) : -1);
+
   rc_client_loop(argv[1], DEFAULT_PORT, &ctx);
 
+  if (mr_mode_from_env() != MR_MODE_PINNED && ctx.buffer_mr)
+    odp_print_stats(ctx.buffer_mr->context);
+
   close(ctx.fd);
 
   return 0;
@@ -1,6 +1,13 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+
 #include "common.h"
+#include "nic_affinity.h"
 
 const int TIMEOUT_IN_MS = 500;
+const int SESSION_MAGIC = 0x52534d31; /* "RSM1" */
 
 struct context {
   struct ibv_context *ctx;
@@ -9,6 +16,39 @@ struct context {
   struct ibv_comp_channel *comp_channel;
 
   pthread_t cq_poller_thread;
+  int comp_vector;
+  int poller_cpu;
+};
+
+/* carried in rdma_conn_param.private_data on connect and accept */
+struct session_pdata {
+  uint32_t magic;
+  uint32_t seq; /* last sequence number completed by the sender */
+  uint64_t id;
+};
+
+/* per-session state; outlives the rdma_cm_id and QP it is currently bound to */
+struct session {
+  uint64_t id;
+  uint32_t local_seq;
+  uint32_t peer_seq;
+
+  struct rdma_cm_id *cm_id;
+  uint32_t qp_num; /* of cm_id's QP, 0 while it has none; the poller matches completions by it */
+  void *context;
+
+  enum {
+    SS_ACTIVE,
+    SS_PARKED,
+    SS_CLOSING
+  } state;
+
+  int resumed;
+  int restarted; /* the peer presented a session id this side no longer has */
+  int retries;
+  time_t parked_at;
+
+  struct session *next;
 };
 
 static struct context *s_ctx = NULL;
@@ -16,11 +56,31 @@ static pre_conn_cb_fn s_on_pre_conn_cb = NULL;
 static connect_cb_fn s_on_connect_cb = NULL;
 static completion_cb_fn s_on_completion_cb = NULL;
 static disconnect_cb_fn s_on_disconnect_cb = NULL;
+static resume_cb_fn s_on_resume_cb = NULL;
+
+static int s_comp_vector = -1;
+static int s_poller_cpu = -1;
+static int s_resume_max_retries = 0;
+static int s_resume_linger_sec = 0;
+static struct sockaddr_storage s_peer_addr;
+static struct session *s_sessions = NULL;
+static uint64_t s_next_session_id = 0;
+static pthread_mutex_t s_sessions_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t s_poll_lock = PTHREAD_MUTEX_INITIALIZER; /* held by the poller around each completion */
+static char s_stale_id; /* context of ids superseded by a resumed connection */
 
 static void build_context(struct ibv_context *verbs);
 static void build_qp_attr(struct ibv_qp_init_attr *qp_attr);
 static void event_loop(struct rdma_event_channel *ec, int exit_on_disconnect);
 static void * poll_cq(void *);
+static void reap_sessions(int force);
+static void reconnect(struct rdma_event_channel *ec, struct session *s);
+static struct session * session_create(struct rdma_cm_id *id, uint64_t session_id);
+static void session_destroy(struct session *s);
+static struct session * session_find(struct rdma_cm_id *id);
+static struct session * session_find_by_id(uint64_t session_id);
+static struct session * session_find_by_qp(uint32_t qp_num);
+static void session_destroy_qp(struct session *s, struct rdma_cm_id *id);
 
 void build_connection(struct rdma_cm_id *id)
 {
@@ -44,13 +104,18 @@ void build_context(struct ibv_context *verbs)
   s_ctx = (struct context *)malloc(sizeof(struct context));
 
   s_ctx->ctx = verbs;
+  s_ctx->comp_vector = s_comp_vector;
+  s_ctx->poller_cpu = s_poller_cpu;
+
+  nic_resolve_affinity(s_ctx->ctx, &s_ctx->comp_vector, &s_ctx->poller_cpu);
 
   TEST_Z(s_ctx->pd = ibv_alloc_pd(s_ctx->ctx));
   TEST_Z(s_ctx->comp_channel = ibv_create_comp_channel(s_ctx->ctx));
-  TEST_Z(s_ctx->cq = ibv_create_cq(s_ctx->ctx, 10, NULL, s_ctx->comp_channel, 0)); /* cqe=10 is arbitrary */
+  TEST_Z(s_ctx->cq = ibv_create_cq(s_ctx->ctx, 10, NULL, s_ctx->comp_channel, s_ctx->comp_vector)); /* cqe=10 is arbitrary */
   TEST_NZ(ibv_req_notify_cq(s_ctx->cq, 0));
 
   TEST_NZ(pthread_create(&s_ctx->cq_poller_thread, NULL, poll_cq, NULL));
+  nic_pin_thread(s_ctx->cq_poller_thread, s_ctx->poller_cpu);
 }
 
 void build_params(struct rdma_conn_param *params)
@@ -82,46 +147,202 @@ void event_loop(struct rdma_event_channel *ec, int exit_on_disconnect)
 
   build_params(&cm_params);
 
-  while (rdma_get_cm_event(ec, &event) == 0) {
+  while (1) {
     struct rdma_cm_event event_copy;
+    struct session_pdata pdata;
+    int have_pdata = 0;
+    struct session *s;
+
+    if (s_on_resume_cb && !exit_on_disconnect) {
+      struct pollfd pfd = { .fd = ec->fd, .events = POLLIN };
+
+      reap_sessions(0);
+
+      if (poll(&pfd, 1, 1000) == 0)
+        continue;
+    }
+
+    if (rdma_get_cm_event(ec, &event))
+      break;
 
     memcpy(&event_copy, event, sizeof(*event));
+
+    /* private data is owned by the event, so copy it out before the ack */
+    if (event->param.conn.private_data && event->param.conn.private_data_len >= sizeof(pdata)) {
+      memcpy(&pdata, event->param.conn.private_data, sizeof(pdata));
+      have_pdata = (pdata.magic == SESSION_MAGIC);
+    }
+
     rdma_ack_cm_event(event);
 
     if (event_copy.event == RDMA_CM_EVENT_ADDR_RESOLVED) {
       build_connection(event_copy.id);
 
-      if (s_on_pre_conn_cb)
+      s = session_find(event_copy.id);
+
+      if (s) {
+        pthread_mutex_lock(&s_sessions_lock);
+        s->qp_num = event_copy.id->qp->qp_num;
+        pthread_mutex_unlock(&s_sessions_lock);
+      }
+
+      if (s_on_pre_conn_cb && !(s && s->resumed))
         s_on_pre_conn_cb(event_copy.id);
 
       TEST_NZ(rdma_resolve_route(event_copy.id, TIMEOUT_IN_MS));
 
     } else if (event_copy.event == RDMA_CM_EVENT_ROUTE_RESOLVED) {
+      if ((s = session_find(event_copy.id))) {
+        pthread_mutex_lock(&s_sessions_lock);
+        pdata.magic = SESSION_MAGIC;
+        pdata.seq = s->local_seq;
+        pdata.id = s->id;
+        pthread_mutex_unlock(&s_sessions_lock);
+
+        cm_params.private_data = &pdata;
+        cm_params.private_data_len = sizeof(pdata);
+      }
+
       TEST_NZ(rdma_connect(event_copy.id, &cm_params));
 
+      cm_params.private_data = NULL;
+      cm_params.private_data_len = 0;
+
     } else if (event_copy.event == RDMA_CM_EVENT_CONNECT_REQUEST) {
       build_connection(event_copy.id);
 
-      if (s_on_pre_conn_cb)
+      s = NULL;
+
+      if (s_on_resume_cb) {
+        s = have_pdata ? session_find_by_id(pdata.id) : NULL;
+
+        if (s && s->state != SS_CLOSING) {
+          printf("resuming session %llu (peer seq %u)\n", (unsigned long long)s->id, pdata.seq);
+
+          /* the poller stays out while the session moves to the new QP: once its qp_num
+           * has moved on, whatever the old QP still completes is dropped */
+          pthread_mutex_lock(&s_poll_lock);
+
+          if (s->state == SS_PARKED) {
+            /* the old id was kept only to carry the session across the gap */
+            rdma_destroy_id(s->cm_id);
+          } else {
+            /* peer noticed the drop before we did, retire the old connection */
+            s->cm_id->context = &s_stale_id;
+            rdma_disconnect(s->cm_id);
+          }
+
+          pthread_mutex_lock(&s_sessions_lock);
+          s->cm_id = event_copy.id;
+          s->qp_num = event_copy.id->qp->qp_num;
+          s->state = SS_ACTIVE;
+          s->resumed = 1;
+          s->peer_seq = pdata.seq;
+          pthread_mutex_unlock(&s_sessions_lock);
+
+          pthread_mutex_unlock(&s_poll_lock);
+
+          event_copy.id->context = s->context;
+
+        } else {
+          if (s_on_pre_conn_cb)
+            s_on_pre_conn_cb(event_copy.id);
+
+          s = session_create(event_copy.id, ++s_next_session_id);
+          s->peer_seq = have_pdata ? pdata.seq : 0;
+          s->restarted = have_pdata && pdata.id;
+        }
+
+        pthread_mutex_lock(&s_sessions_lock);
+        pdata.magic = SESSION_MAGIC;
+        pdata.seq = s->local_seq;
+        pdata.id = s->id;
+        pthread_mutex_unlock(&s_sessions_lock);
+
+        cm_params.private_data = &pdata;
+        cm_params.private_data_len = sizeof(pdata);
+
+      } else if (s_on_pre_conn_cb) {
         s_on_pre_conn_cb(event_copy.id);
+      }
 
       TEST_NZ(rdma_accept(event_copy.id, &cm_params));
 
+      cm_params.private_data = NULL;
+      cm_params.private_data_len = 0;
+
     } else if (event_copy.event == RDMA_CM_EVENT_ESTABLISHED) {
-      if (s_on_connect_cb)
+      s = session_find(event_copy.id);
+
+      if (s && exit_on_disconnect && have_pdata) {
+        /* active side: the accept carries the peer's view of the session,
+         * a peer that lost it hands out a fresh id with seq 0 */
+        pthread_mutex_lock(&s_sessions_lock);
+        s->id = pdata.id;
+        s->peer_seq = pdata.seq;
+        s->retries = 0;
+        pthread_mutex_unlock(&s_sessions_lock);
+      }
+
+      if (s && s->resumed) {
+        if (s_on_resume_cb)
+          s_on_resume_cb(event_copy.id, s->peer_seq);
+
+      } else if (s_on_connect_cb) {
         s_on_connect_cb(event_copy.id);
+      }
+
+    } else if (event_copy.event == RDMA_CM_EVENT_DISCONNECTED && event_copy.id->context == &s_stale_id) {
+      session_destroy_qp(NULL, event_copy.id);
+      rdma_destroy_id(event_copy.id);
 
     } else if (event_copy.event == RDMA_CM_EVENT_DISCONNECTED) {
-      rdma_destroy_qp(event_copy.id);
+      s = session_find(event_copy.id);
+
+      session_destroy_qp(s, event_copy.id);
+
+      if (s && s->state == SS_ACTIVE) {
+        /* unexpected drop: keep buffers and context, only the QP is gone */
+        printf("connection lost, session %llu parked at seq %u\n", (unsigned long long)s->id, s->local_seq);
+
+        pthread_mutex_lock(&s_sessions_lock);
+        s->state = SS_PARKED;
+        s->parked_at = time(NULL);
+        pthread_mutex_unlock(&s_sessions_lock);
+
+        if (exit_on_disconnect) {
+          rdma_destroy_id(event_copy.id);
+          reconnect(ec, s);
+        }
+
+        continue;
+      }
 
       if (s_on_disconnect_cb)
         s_on_disconnect_cb(event_copy.id);
 
+      if (s)
+        session_destroy(s);
+
       rdma_destroy_id(event_copy.id);
 
       if (exit_on_disconnect)
         break;
 
+    } else if (exit_on_disconnect && (s = session_find(event_copy.id)) && s->resumed && (
+               event_copy.event == RDMA_CM_EVENT_ADDR_ERROR ||
+               event_copy.event == RDMA_CM_EVENT_ROUTE_ERROR ||
+               event_copy.event == RDMA_CM_EVENT_CONNECT_ERROR ||
+               event_copy.event == RDMA_CM_EVENT_UNREACHABLE ||
+               event_copy.event == RDMA_CM_EVENT_REJECTED)) {
+      fprintf(stderr, "reconnect attempt failed: %s\n", rdma_event_str(event_copy.event));
+
+      if (event_copy.id->qp)
+        session_destroy_qp(s, event_copy.id);
+
+      rdma_destroy_id(event_copy.id);
+      reconnect(ec, s);
+
     } else {
       rc_die("unknown event\n");
     }
@@ -139,16 +360,169 @@ void * poll_cq(void *ctx)
     TEST_NZ(ibv_req_notify_cq(cq, 0));
 
     while (ibv_poll_cq(cq, 1, &wc)) {
-      if (wc.status == IBV_WC_SUCCESS)
+      struct session *s = NULL;
+
+      pthread_mutex_lock(&s_poll_lock);
+
+      if (s_on_resume_cb) {
+        pthread_mutex_lock(&s_sessions_lock);
+        s = session_find_by_qp(wc.qp_num);
+
+        /* the QP is in error; tear the connection down and let the event loop resume it */
+        if (s && wc.status != IBV_WC_SUCCESS && s->state == SS_ACTIVE)
+          rdma_disconnect(s->cm_id);
+
+        pthread_mutex_unlock(&s_sessions_lock);
+      }
+
+      /* with resume on, a QP no session owns any more was retired and its completions are stale */
+      if (wc.status == IBV_WC_SUCCESS && (s || !s_on_resume_cb))
         s_on_completion_cb(&wc);
-      else
+      else if (wc.status != IBV_WC_SUCCESS && !s_on_resume_cb)
         rc_die("poll_cq: status is not IBV_WC_SUCCESS");
+
+      pthread_mutex_unlock(&s_poll_lock);
     }
   }
 
   return NULL;
 }
 
+void reap_sessions(int force)
+{
+  struct session *s = s_sessions, *next;
+  time_t now = time(NULL);
+
+  for (; s; s = next) {
+    next = s->next;
+
+    if (s->state != SS_PARKED || (!force && now - s->parked_at < s_resume_linger_sec))
+      continue;
+
+    printf("session %llu expired\n", (unsigned long long)s->id);
+
+    if (s_on_disconnect_cb)
+      s_on_disconnect_cb(s->cm_id);
+
+    rdma_destroy_id(s->cm_id);
+    session_destroy(s);
+  }
+}
+
+void reconnect(struct rdma_event_channel *ec, struct session *s)
+{
+  struct rdma_cm_id *id = NULL;
+  int backoff_ms;
+
+  if (++s->retries > s_resume_max_retries)
+    rc_die("reconnect: out of retries");
+
+  /* first attempt goes out immediately, then 10 ms doubling up to 1 s */
+  if (s->retries > 1) {
+    backoff_ms = 10 << (s->retries - 2);
+    usleep(1000 * (backoff_ms > 1000 ? 1000 : backoff_ms));
+  }
+
+  TEST_NZ(rdma_create_id(ec, &id, NULL, RDMA_PS_TCP));
+
+  pthread_mutex_lock(&s_sessions_lock);
+  s->cm_id = id;
+  s->state = SS_ACTIVE;
+  s->resumed = 1;
+  pthread_mutex_unlock(&s_sessions_lock);
+
+  id->context = s->context;
+
+  TEST_NZ(rdma_resolve_addr(id, NULL, (struct sockaddr *)&s_peer_addr, TIMEOUT_IN_MS));
+}
+
+struct session * session_create(struct rdma_cm_id *id, uint64_t session_id)
+{
+  struct session *s = (struct session *)calloc(1, sizeof(struct session));
+
+  TEST_Z(s);
+
+  s->id = session_id;
+  s->cm_id = id;
+  s->qp_num = id->qp ? id->qp->qp_num : 0;
+  s->context = id->context;
+  s->state = SS_ACTIVE;
+
+  pthread_mutex_lock(&s_sessions_lock);
+  s->next = s_sessions;
+  s_sessions = s;
+  pthread_mutex_unlock(&s_sessions_lock);
+
+  return s;
+}
+
+void session_destroy(struct session *s)
+{
+  struct session **p;
+
+  pthread_mutex_lock(&s_sessions_lock);
+  for (p = &s_sessions; *p; p = &(*p)->next) {
+    if (*p == s) {
+      *p = s->next;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&s_sessions_lock);
+
+  free(s);
+}
+
+struct session * session_find(struct rdma_cm_id *id)
+{
+  struct session *s;
+
+  pthread_mutex_lock(&s_sessions_lock);
+  for (s = s_sessions; s && s->cm_id != id; s = s->next);
+  pthread_mutex_unlock(&s_sessions_lock);
+
+  return s;
+}
+
+struct session * session_find_by_id(uint64_t session_id)
+{
+  struct session *s;
+
+  if (!session_id)
+    return NULL;
+
+  pthread_mutex_lock(&s_sessions_lock);
+  for (s = s_sessions; s && s->id != session_id; s = s->next);
+  pthread_mutex_unlock(&s_sessions_lock);
+
+  return s;
+}
+
+/* call with s_sessions_lock held */
+struct session * session_find_by_qp(uint32_t qp_num)
+{
+  struct session *s;
+
+  for (s = s_sessions; s && s->qp_num != qp_num; s = s->next);
+
+  return s;
+}
+
+/* waits out a completion the poller may be handing to the app for this QP */
+void session_destroy_qp(struct session *s, struct rdma_cm_id *id)
+{
+  pthread_mutex_lock(&s_poll_lock);
+
+  if (s) {
+    pthread_mutex_lock(&s_sessions_lock);
+    s->qp_num = 0;
+    pthread_mutex_unlock(&s_sessions_lock);
+  }
+
+  rdma_destroy_qp(id);
+
+  pthread_mutex_unlock(&s_poll_lock);
+}
+
 void rc_init(pre_conn_cb_fn pc, connect_cb_fn conn, completion_cb_fn comp, disconnect_cb_fn disc)
 {
   s_on_pre_conn_cb = pc;
@@ -157,6 +531,58 @@ void rc_init(pre_conn_cb_fn pc, connect_cb_fn conn, completion_cb_fn comp, disco
   s_on_disconnect_cb = disc;
 }
 
+void rc_set_affinity(int comp_vector, int cpu)
+{
+  s_comp_vector = comp_vector;
+  s_poller_cpu = cpu;
+}
+
+void rc_enable_resume(resume_cb_fn resume, int max_retries, int linger_sec)
+{
+  s_on_resume_cb = resume;
+  s_resume_max_retries = max_retries;
+  s_resume_linger_sec = linger_sec;
+
+  /* session ids only need to be unique per server run */
+  s_next_session_id = ((uint64_t)getpid() << 32) | (uint32_t)time(NULL);
+}
+
+void rc_set_seq(struct rdma_cm_id *id, uint32_t seq)
+{
+  struct session *s;
+
+  pthread_mutex_lock(&s_sessions_lock);
+  for (s = s_sessions; s && s->cm_id != id; s = s->next);
+  if (s)
+    s->local_seq = seq;
+  pthread_mutex_unlock(&s_sessions_lock);
+}
+
+int rc_session_restarted(struct rdma_cm_id *id)
+{
+  struct session *s;
+  int restarted;
+
+  pthread_mutex_lock(&s_sessions_lock);
+  for (s = s_sessions; s && s->cm_id != id; s = s->next);
+  restarted = s && s->restarted;
+  pthread_mutex_unlock(&s_sessions_lock);
+
+  return restarted;
+}
+
+void rc_set_closing(struct rdma_cm_id *id)
+{
+  struct session *s;
+
+  /* the transfer is over: the next disconnect ends the session instead of parking it */
+  pthread_mutex_lock(&s_sessions_lock);
+  for (s = s_sessions; s && s->cm_id != id; s = s->next);
+  if (s)
+    s->state = SS_CLOSING;
+  pthread_mutex_unlock(&s_sessions_lock);
+}
+
 void rc_client_loop(const char *host, const char *port, void *context)
 {
   struct addrinfo *addr;
@@ -170,10 +596,14 @@ void rc_client_loop(const char *host, const char *port, void *context)
   TEST_NZ(rdma_create_id(ec, &conn, NULL, RDMA_PS_TCP));
   TEST_NZ(rdma_resolve_addr(conn, NULL, addr->ai_addr, TIMEOUT_IN_MS));
 
+  memcpy(&s_peer_addr, addr->ai_addr, addr->ai_addrlen);
   freeaddrinfo(addr);
 
   conn->context = context;
 
+  if (s_on_resume_cb)
+    session_create(conn, 0); /* server assigns the id on first accept */
+
   build_params(&cm_params);
 
   event_loop(ec, 1); // exit on disconnect
@@ -198,12 +628,17 @@ void rc_server_loop(const char *port)
 
   event_loop(ec, 0); // don't exit on disconnect
 
+  reap_sessions(1);
+
   rdma_destroy_id(listener);
   rdma_destroy_event_channel(ec);
 }
 
 void rc_disconnect(struct rdma_cm_id *id)
 {
+  /* an explicit disconnect ends the session for good */
+  rc_set_closing(id);
+
   rdma_disconnect(id);
 }
 
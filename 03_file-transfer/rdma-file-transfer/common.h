@@ -15,12 +15,18 @@ typedef void (*pre_conn_cb_fn)(struct rdma_cm_id *id);
 typedef void (*connect_cb_fn)(struct rdma_cm_id *id);
 typedef void (*completion_cb_fn)(struct ibv_wc *wc);
 typedef void (*disconnect_cb_fn)(struct rdma_cm_id *id);
+typedef void (*resume_cb_fn)(struct rdma_cm_id *id, uint32_t peer_seq);
 
 void rc_init(pre_conn_cb_fn, connect_cb_fn, completion_cb_fn, disconnect_cb_fn);
 void rc_client_loop(const char *host, const char *port, void *context);
 void rc_disconnect(struct rdma_cm_id *id);
 void rc_die(const char *message);
+void rc_enable_resume(resume_cb_fn, int max_retries, int linger_sec);
 struct ibv_pd * rc_get_pd();
 void rc_server_loop(const char *port);
+int rc_session_restarted(struct rdma_cm_id *id); // the peer's session had expired here, it starts over
+void rc_set_affinity(int comp_vector, int cpu); // -1 = pick near the NIC, call before connecting
+void rc_set_closing(struct rdma_cm_id *id); // the next disconnect ends the session instead of parking it
+void rc_set_seq(struct rdma_cm_id *id, uint32_t seq);
 
 #endif
@@ -3,6 +3,8 @@
 
 const char *DEFAULT_PORT = "12345";
 const size_t BUFFER_SIZE = 10 * 1024 * 1024;
+const int RESUME_MAX_RETRIES = 10;
+const int RESUME_LINGER_SEC = 10; /* how long the server keeps a dropped session */
 
 enum message_id
 {
@@ -2,13 +2,18 @@
 #include <sys/stat.h>
 
 #include "common.h"
+#include "hugepage_alloc.h"
+#include "odp_mr.h"
 #include "messages.h"
 
+struct odp_implicit_mr odp_implicit[ODP_MAX_IMPLICIT]; /* odp_mr.h keeps its implicit MRs here */
+
 #define MAX_FILE_NAME 256
 
 struct conn_context
 {
   char *buffer;
+  struct hugebuf buffer_mem;
   struct ibv_mr *buffer_mr;
 
   struct message *msg;
@@ -16,6 +21,8 @@ struct conn_context
 
   int fd;
   char file_name[MAX_FILE_NAME];
+
+  uint32_t received; /* chunks (file name included) written out */
 };
 
 static void send_message(struct rdma_cm_id *id)
@@ -60,9 +67,13 @@ static void on_pre_conn(struct rdma_cm_id *id)
   id->context = ctx;
 
   ctx->file_name[0] = '\0'; // take this to mean we don't have the file name
+  ctx->received = 0;
 
-  posix_memalign((void **)&ctx->buffer, sysconf(_SC_PAGESIZE), BUFFER_SIZE);
-  TEST_Z(ctx->buffer_mr = ibv_reg_mr(rc_get_pd(), ctx->buffer, BUFFER_SIZE, IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE));
+  int mr_mode = mr_mode_from_env();
+
+  TEST_NZ(hugebuf_alloc_ex(&ctx->buffer_mem, BUFFER_SIZE, mr_mode == MR_MODE_PINNED));
+  ctx->buffer = ctx->buffer_mem.addr;
+  TEST_Z(ctx->buffer_mr = odp_reg_mr(rc_get_pd(), ctx->buffer, BUFFER_SIZE, IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE, mr_mode));
 
   posix_memalign((void **)&ctx->msg, sysconf(_SC_PAGESIZE), sizeof(*ctx->msg));
   TEST_Z(ctx->msg_mr = ibv_reg_mr(rc_get_pd(), ctx->msg, sizeof(*ctx->msg), 0));
@@ -93,6 +104,8 @@ static void on_completion(struct ibv_wc *wc)
       ctx->msg->id = MSG_DONE;
       send_message(id);
 
+      rc_set_closing(id);
+
       // don't need post_receive() since we're done with this connection
 
     } else if (ctx->file_name[0]) {
@@ -105,6 +118,8 @@ static void on_completion(struct ibv_wc *wc)
       if (ret != size)
         rc_die("write() failed");
 
+      rc_set_seq(id, ++ctx->received);
+
       post_receive(id);
 
       ctx->msg->id = MSG_READY;
@@ -117,11 +132,15 @@ static void on_completion(struct ibv_wc *wc)
 
       printf("opening file %s\n", ctx->file_name);
 
-      ctx->fd = open(ctx->file_name, O_WRONLY | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+      /* a client whose session expired here starts over, and the partial file is ours */
+      ctx->fd = open(ctx->file_name, O_WRONLY | O_CREAT | (rc_session_restarted(id) ? O_TRUNC : O_EXCL),
+                     S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
 
       if (ctx->fd == -1)
         rc_die("open() failed");
 
+      rc_set_seq(id, ++ctx->received);
+
       post_receive(id);
 
       ctx->msg->id = MSG_READY;
@@ -130,16 +149,30 @@ static void on_completion(struct ibv_wc *wc)
   }
 }
 
+static void on_resume(struct rdma_cm_id *id, uint32_t peer_seq)
+{
+  struct conn_context *ctx = (struct conn_context *)id->context;
+
+  post_receive(id);
+
+  /* the client can't have our MR yet if we never got the file name */
+  if (!ctx->file_name[0])
+    on_connection(id);
+}
+
 static void on_disconnect(struct rdma_cm_id *id)
 {
   struct conn_context *ctx = (struct conn_context *)id->context;
 
   close(ctx->fd);
 
-  ibv_dereg_mr(ctx->buffer_mr);
+  if (mr_mode_from_env() != MR_MODE_PINNED)
+    odp_print_stats(ctx->buffer_mr->context);
+
+  odp_dereg_mr(ctx->buffer_mr);
   ibv_dereg_mr(ctx->msg_mr);
 
-  free(ctx->buffer);
+  hugebuf_free(&ctx->buffer_mem);
   free(ctx->msg);
 
   printf("finished transferring %s\n", ctx->file_name);
@@ -155,6 +188,12 @@ int main(int argc, char **argv)
     on_completion,
     on_disconnect);
 
+  rc_enable_resume(on_resume, RESUME_MAX_RETRIES, RESUME_LINGER_SEC);
+
+  /* RDMA_POLLER_CPU / RDMA_COMP_VECTOR override the placement near the NIC */
+  rc_set_affinity(getenv("RDMA_COMP_VECTOR") ? atoi(getenv("RDMA_COMP_VECTOR")) : -1,
+                  getenv("RDMA_POLLER_CPU") ? atoi(getenv("RDMA_POLLER_CPU")) : -1);
+
   printf("waiting for connections. interrupt (^C) to exit.\n");
 
   rc_server_loop(DEFAULT_PORT);
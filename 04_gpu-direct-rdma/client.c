@@ -46,6 +46,7 @@
 
 #include "utils.h"
 #include "gpu_mem_util.h"
+#include "odp_mr.h"
 #include "gpu_direct_rdma_access.h"
 
 extern int debug;
@@ -57,16 +58,24 @@ extern int debug_fast_path;
 #define FDEBUG_LOG_FAST_PATH if (debug_fast_path) fprintf
 
 #define ACK_MSG "rdma_task completed"
+#define MAX_STREAM_DEPTH NOTIFY_RECV_DEPTH /* no more notifications in flight than the DCT's SRQ has receives */
+#define MAX_STREAM_THREADS 64
 
 struct user_params {
 
     uint32_t  		    task;
+    int                     stream;
+    int                     depth;
+    int                     threads;
     int                     port;
     unsigned long           size;
     int                     iters;
     int                     use_cuda;
     char                   *bdf;
     char                   *servername;
+    int                     cpu;
+    int                     comp_vector;
+    int                     rc;
     struct sockaddr         hostaddr;
 };
 
@@ -120,18 +129,19 @@ static int open_client_socket(const char *servername,
     return sockfd;
 }
 
-enum payload_t { RDMA_BUF_DESC, TASK_ATTRS };
+enum payload_t { RDMA_BUF_DESC, TASK_ATTRS, RDMA_BUF_DESC_BIN, STREAM_ATTRS };
 
 struct payload_attr {
 	enum payload_t data_t;
 	char *payload_str;
+	uint16_t payload_size; /* for binary payloads, 0 - payload_str is a string */
 };
 
 /************************************************************************************
  * Simple package protocol which packs payload string into allocated memory.
  * Protocol consist of:
  * 		uint8_t payload_t - type of the payload data
- *  	uint16_t payload_size - strlen of the payload_str
+ *  	uint16_t payload_size - strlen of the payload_str (with the null), or the binary payload_size
  *  	char * payload_str - payload to pack
  * 
  * returns: an integer equal to the size of the copied into package data in bytes
@@ -144,7 +154,7 @@ struct payload_attr {
 int pack_payload_data(void *package, size_t package_size, struct payload_attr *attr)
 {
     uint8_t data_t = attr->data_t;
-    uint16_t payload_size = strlen(attr->payload_str) + 1;
+    uint16_t payload_size = attr->payload_size ? attr->payload_size : strlen(attr->payload_str) + 1;
     size_t req_size = sizeof(data_t) + sizeof(payload_size) + payload_size * sizeof(char) ;
     if (req_size > package_size) {
         fprintf(stderr, "package size (%lu) is less than required (%lu) for sending payload with attributes\n",
@@ -185,6 +195,53 @@ int rdma_task_attr_flags_get_desc_str(uint32_t flags, char *desc_str, size_t des
     return strlen(desc_str) + 1; /*including the terminating null character*/
 }
 
+/****************************************************************************************
+ * Stream mode: wait for the server's RDMA notifications of iters tasks, which carry the
+ * task number. Several submitter threads on the server complete tasks out of order, so
+ * each number is only checked to arrive once. The socket is only checked (for a server
+ * which gave up) while nothing arrives.
+ * Return value: 0 - success, 1 - error
+ ****************************************************************************************/
+static int wait_notifications(struct rdma_device *rdma_dev, int sockfd, int iters)
+{
+    uint32_t    notify_data[16];
+    int         cnt = 0, idle = 0, ret_val = 1;
+    char        c;
+    uint8_t    *seen = calloc((iters + 7) / 8, 1);
+
+    if (!seen) {
+        fprintf(stderr, "FAILURE: Couldn't allocate the notification bitmap\n");
+        return 1;
+    }
+    while (cnt < iters) {
+        int i, n = rdma_poll_notifications(rdma_dev, notify_data, 16);
+
+        if (n < 0) {
+            goto out;
+        }
+        for (i = 0; i < n; i++, cnt++) {
+            uint32_t k = notify_data[i];
+
+            if (k >= (uint32_t)iters || seen[k / 8] & (1 << (k % 8))) {
+                fprintf(stderr, "FAILURE: unexpected notification for task %u\n", k);
+                goto out;
+            }
+            seen[k / 8] |= 1 << (k % 8);
+        }
+        if (n) {
+            idle = 0;
+        } else if (++idle % 100000 == 0 && recv(sockfd, &c, 1, MSG_DONTWAIT | MSG_PEEK) == 0) {
+            fprintf(stderr, "FAILURE: server closed the connection after %d of %d tasks\n", cnt, iters);
+            goto out;
+        }
+    }
+    DEBUG_LOG_FAST_PATH("Received %d notifications\n", cnt);
+    ret_val = 0;
+out:
+    free(seen);
+    return ret_val;
+}
+
 static void usage(const char *argv0)
 {
     printf("Usage:\n");
@@ -193,12 +250,19 @@ static void usage(const char *argv0)
     printf("Options:\n");
     printf("  -t, --task_flags=<flags>  rdma task attrs bitmask: bit 0 - rdma operation type: 0 - \"WRITE\"(default),\n"
            "                                                                                  1 - \"READ\"\n");
+    printf("  -S, --stream              send the buffer description once, the server streams <iters> tasks\n"
+           "                            and notifies each one through RDMA instead of a TCP ack\n");
+    printf("  -q, --queue-depth=<n>     stream mode: tasks in flight, each on its own <size> slot of the buffer (default 1)\n");
+    printf("  -T, --threads=<n>         stream mode: server threads submitting the tasks concurrently (default 1)\n");
     printf("  -a, --addr=<ipaddr>       ip address of the local host net device <ipaddr v4> (mandatory)\n");
     printf("  -p, --port=<port>         listen on/connect to port <port> (default 18515)\n");
     printf("  -s, --size=<size>         size of message to exchange (default 4096)\n");
     printf("  -n, --iters=<iters>       number of exchanges (default 1000)\n");
     printf("  -u, --use-cuda=<BDF>      use CUDA pacage (work with GPU memoty),\n"
            "                            BDF corresponding to CUDA device, for example, \"3e:02.0\"\n");
+    printf("  -c, --cpu=<cpu>           pin the polling thread to <cpu> (default: a CPU on the NIC's NUMA node)\n");
+    printf("  -v, --comp-vector=<vec>   CQ completion vector (default: the one matching the polling CPU)\n");
+    printf("  -R, --rc                  use RC connections instead of DC (default: DC on mlx5 devices, RC otherwise)\n");
     printf("  -D, --debug-mask=<mask>   debug bitmask: bit 0 - debug print enable,\n"
            "                                           bit 1 - fast path debug print enable\n");
 }
@@ -210,23 +274,33 @@ static int parse_command_line(int argc, char *argv[], struct user_params *usr_pa
     usr_par->port       = 18515;
     usr_par->size       = 4096;
     usr_par->iters      = 1000;
+    usr_par->cpu        = -1;
+    usr_par->comp_vector = -1;
     usr_par->task       = 0;
+    usr_par->depth      = 1;
+    usr_par->threads    = 1;
 
     while (1) {
         int c;
 
         static struct option long_options[] = {
             { .name = "task-flags",    .has_arg = 1, .val = 't' },
+            { .name = "stream",        .has_arg = 0, .val = 'S' },
+            { .name = "queue-depth",   .has_arg = 1, .val = 'q' },
+            { .name = "threads",       .has_arg = 1, .val = 'T' },
             { .name = "addr",          .has_arg = 1, .val = 'a' },
             { .name = "port",          .has_arg = 1, .val = 'p' },
             { .name = "size",          .has_arg = 1, .val = 's' },
             { .name = "iters",         .has_arg = 1, .val = 'n' },
             { .name = "use-cuda",      .has_arg = 1, .val = 'u' },
+            { .name = "cpu",           .has_arg = 1, .val = 'c' },
+            { .name = "comp-vector",   .has_arg = 1, .val = 'v' },
+            { .name = "rc",            .has_arg = 0, .val = 'R' },
             { .name = "debug-mask",    .has_arg = 1, .val = 'D' },
             { 0 }
         };
 
-        c = getopt_long(argc, argv, "t:a:p:s:n:u:D:",
+        c = getopt_long(argc, argv, "t:Sq:T:a:p:s:n:u:c:v:RD:",
                         long_options, NULL);
         if (c == -1)
             break;
@@ -237,6 +311,26 @@ static int parse_command_line(int argc, char *argv[], struct user_params *usr_pa
             usr_par->task = (strtol(optarg, NULL, 0) >> 0) & 1; /*bit 0*/
             break;
 
+        case 'S':
+            usr_par->stream = 1;
+            break;
+
+        case 'q':
+            usr_par->depth = strtol(optarg, NULL, 0);
+            if (usr_par->depth < 1 || usr_par->depth > MAX_STREAM_DEPTH) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+
+        case 'T':
+            usr_par->threads = strtol(optarg, NULL, 0);
+            if (usr_par->threads < 1 || usr_par->threads > MAX_STREAM_THREADS) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+
         case 'a':
             get_addr(optarg, (struct sockaddr *) &usr_par->hostaddr);
             break;
@@ -267,6 +361,18 @@ static int parse_command_line(int argc, char *argv[], struct user_params *usr_pa
             strcpy(usr_par->bdf, optarg);
             break;
         
+        case 'c':
+            usr_par->cpu = strtol(optarg, NULL, 0);
+            break;
+
+        case 'v':
+            usr_par->comp_vector = strtol(optarg, NULL, 0);
+            break;
+
+        case 'R':
+            usr_par->rc = 1;
+            break;
+
         case 'D':
             debug           = (strtol(optarg, NULL, 0) >> 0) & 1; /*bit 0*/
             debug_fast_path = (strtol(optarg, NULL, 0) >> 1) & 1; /*bit 1*/
@@ -307,6 +413,7 @@ int main(int argc, char *argv[])
     struct user_params      usr_par;
     int                     ret_val = 0;
     int                     sockfd;
+    int                     ret_size;
 
     srand48(getpid() * time(NULL));
 
@@ -335,16 +442,22 @@ int main(int argc, char *argv[])
     }
 
     printf("Opening rdma device\n");
+    rdma_set_affinity(usr_par.comp_vector, usr_par.cpu);
+    if (usr_par.rc) {
+        rdma_set_transport(RDMA_TRANSPORT_RC, 0);
+    }
     rdma_dev = rdma_open_device_client(&usr_par.hostaddr);
 
     if (!rdma_dev) {
         ret_val = 1;
         goto clean_socket;
     }
+    rdma_device_pin_thread(rdma_dev);
     
-    /* CPU or GPU memory buffer allocation */
+    /* CPU or GPU memory buffer allocation, one slot per task in flight in stream mode */
+    unsigned long buff_size = usr_par.size * (usr_par.stream ? usr_par.depth : 1);
     void    *buff;
-    buff = work_buffer_alloc(usr_par.size, usr_par.use_cuda, usr_par.bdf);
+    buff = work_buffer_alloc(buff_size, usr_par.use_cuda, usr_par.bdf);
     if (!buff) {
         ret_val = 1;
         goto clean_device;
@@ -359,15 +472,19 @@ int main(int argc, char *argv[])
     /* RDMA buffer registration */
     struct rdma_buffer *rdma_buff;
 
-    rdma_buff = rdma_buffer_reg(rdma_dev, buff, usr_par.size);
+    /* CPU buffers may use on-demand paging (RDMA_MR_MODE=odp|implicit), GPU memory is always pinned */
+    rdma_buff = rdma_buffer_reg_mode(rdma_dev, buff, buff_size,
+                                     usr_par.use_cuda ? MR_MODE_PINNED : mr_mode_from_env());
     if (!rdma_buff) {
         ret_val = 1;
         goto clean_mem_buff;
     }
 
-    char desc_str[256], task_opt_str[16];
+    struct rdma_buffer_desc desc_bin;
+    char task_opt_str[16], stream_opt_str[24];
 
-    int ret_desc_str_size = rdma_buffer_get_desc_str(rdma_buff, desc_str, sizeof(desc_str)); // 将rdma_buff(addr+size+rkey+lid+dctn+g)的描述信息写入desc_str
+    /* the server imports this once, so it is sent in binary rather than as a string to parse */
+    int ret_desc_str_size = rdma_buffer_get_desc_bin(rdma_buff, &desc_bin); // 将rdma_buff(addr+size+rkey+lid+dctn+g)的描述信息写入desc_bin
     int ret_task_opt_str_size = rdma_task_attr_flags_get_desc_str(usr_par.task, task_opt_str, sizeof(task_opt_str)); // 将usr_par.task的信息写入task_opt_str
      
     if (!ret_desc_str_size || !ret_task_opt_str_size) {
@@ -375,23 +492,49 @@ int main(int argc, char *argv[])
         goto clean_rdma_buff;
     }
 
+    /* stream mode: the number of tasks, the depth and the submitter threads, sent ahead of the description */
+    int ret_stream_opt_str_size = 0;
+    if (usr_par.stream) {
+        ret_stream_opt_str_size = sprintf(stream_opt_str, "%x:%x:%x", usr_par.iters, usr_par.depth,
+                                          usr_par.threads) + 1;
+    }
+
     /* Package memory allocation */
-    const int package_size = (ret_desc_str_size + ret_task_opt_str_size) * sizeof(char) + 2 * sizeof(uint16_t) + 2 * sizeof(uint8_t);
+    const int package_size = (ret_desc_str_size + ret_task_opt_str_size + ret_stream_opt_str_size) * sizeof(char) + 3 * sizeof(uint16_t) + 3 * sizeof(uint8_t);
     void *package = malloc(package_size);
     memset(package, 0, package_size);
 
-    /* Packing RDMA buff desc str */
-    struct payload_attr pl_attr = { .data_t = RDMA_BUF_DESC, .payload_str = desc_str };
-    int buff_package_size = pack_payload_data(package, package_size, &pl_attr); //将buffer描述信息写入package
-    if (!buff_package_size) {
+    struct payload_attr pl_attr;
+    int buff_package_size = 0;
+
+    /* Packing stream attrs */
+    if (usr_par.stream) {
+        pl_attr.data_t = STREAM_ATTRS;
+        pl_attr.payload_str = stream_opt_str;
+        pl_attr.payload_size = 0;
+        buff_package_size = pack_payload_data(package, package_size, &pl_attr);
+        if (!buff_package_size) {
+            ret_val = 1;
+            goto clean_package_data;
+        }
+    }
+
+    /* Packing RDMA buff desc */
+    pl_attr.data_t = RDMA_BUF_DESC_BIN;
+    pl_attr.payload_str = (char *)&desc_bin;
+    pl_attr.payload_size = sizeof(desc_bin);
+    int desc_package_size = pack_payload_data(package + buff_package_size, package_size - buff_package_size, &pl_attr); //将buffer描述信息写入package
+    if (!desc_package_size) {
         ret_val = 1;
         goto clean_package_data;
     }
+    buff_package_size += desc_package_size;
     
     /* Packing RDMA task attrs desc str */
     pl_attr.data_t = TASK_ATTRS;
     pl_attr.payload_str = task_opt_str;
-    buff_package_size += pack_payload_data(package + buff_package_size, package_size, &pl_attr); //将task描述信息写入package
+    pl_attr.payload_size = 0;
+    buff_package_size += pack_payload_data(package + buff_package_size, package_size - buff_package_size, &pl_attr); //将task描述信息写入package
      if (!buff_package_size) {
         ret_val = 1;
         goto clean_package_data;
@@ -404,16 +547,29 @@ int main(int argc, char *argv[])
         goto clean_package_data;
     }
 
+    if (usr_par.stream) {
+        /* one package, then nothing but RDMA until the last task */
+        ret_size = write(sockfd, package, buff_package_size);
+        if (ret_size != buff_package_size) {
+            fprintf(stderr, "FAILURE: Couldn't send RDMA data, write data size %d (errno=%d '%m')\n", ret_size, errno);
+            ret_val = 1;
+            goto clean_package_data;
+        }
+        if (wait_notifications(rdma_dev, sockfd, usr_par.iters)) {
+            ret_val = 1;
+            goto clean_package_data;
+        }
+    }
+
     /****************************************************************************************************
      * The main loop where client and server send and receive "iters" number of messages
      */
-    for (cnt = 0; cnt < usr_par.iters; cnt++) {
+    for (cnt = 0; cnt < usr_par.iters && !usr_par.stream; cnt++) {
 
         char ackmsg[sizeof ACK_MSG];
-        int  ret_size;
         
         // Sending RDMA data (address and rkey) by socket as a triger to start RDMA read/write operation
-        DEBUG_LOG_FAST_PATH("Send message N %d: buffer desc \"%s\" of size %d with task opt \"%s\" of size %d\n", cnt, desc_str, strlen(desc_str), task_opt_str, strlen(task_opt_str));
+        DEBUG_LOG_FAST_PATH("Send message N %d: buffer desc of size %d with task opt \"%s\" of size %d\n", cnt, ret_desc_str_size, task_opt_str, strlen(task_opt_str));
         ret_size = write(sockfd, package, buff_package_size);
         if (ret_size != buff_package_size) {
             fprintf(stderr, "FAILURE: Couldn't send RDMA data for iteration, write data size %d (errno=%d '%m')\n", ret_size, errno);
@@ -47,16 +47,42 @@
 #include <getopt.h>
 #include <arpa/inet.h>
 #include <time.h>
+#include <endian.h>
+#include <pthread.h>
+#include <poll.h>
+#include <fcntl.h>
 
 #include <rdma/rdma_cma.h>
 #include <infiniband/mlx5dv.h>
 
 #include "khash.h"
 #include "ibv_helper.h"
+#include "nic_affinity.h"
+#include "odp_mr.h"
+#include "lat_hist.h"
 #include "gpu_direct_rdma_access.h"
 
+#define AH_CACHE_DEFAULT_SIZE 1024
+#define RC_MAX_PEERS_DEFAULT  16
+#define RC_RESOLVE_TIMEOUT_MS 2000
+#define RC_MAX_RD_ATOMIC      16   /* RDMA READs in flight on an RC connection */
+#define RC_LISTEN_BACKLOG     64
+
 int debug = 0;
 int debug_fast_path = 0;
+struct odp_implicit_mr odp_implicit[ODP_MAX_IMPLICIT]; /* odp_mr.h keeps its implicit MRs here */
+
+static int s_comp_vector = -1; /* -1 - choose automatically */
+static int s_poller_cpu  = -1;
+static int s_num_dcis    = 1;
+static enum rdma_dci_policy s_dci_policy = RDMA_DCI_POLICY_HASH;
+static int s_ah_cache_size = AH_CACHE_DEFAULT_SIZE;
+static enum rdma_transport s_transport = RDMA_TRANSPORT_AUTO;
+static int s_max_rc_peers = RC_MAX_PEERS_DEFAULT;
+
+/* RDMA_DCI_POLICY_PER_THREAD: the DCI this thread was given by the device it last submitted on */
+static __thread struct rdma_device *t_dci_dev;
+static __thread int t_dci_idx;
 
 #define DEBUG_LOG if (debug) printf
 #define DEBUG_LOG_FAST_PATH if (debug_fast_path) printf
@@ -68,31 +94,76 @@ int debug_fast_path = 0;
 #define DC_KEY          0xffeeddcc  /*this is defined for both sides: client and server*/
 #define COMP_ARRAY_SIZE 16
 #define TC_PRIO         3
+#define MAX_DCIS        64
 
 #define WR_ID_FLUSH_MARKER UINT64_MAX  
 
-#define mmin(a, b)      a < b ? a : b
+#define mmin(a, b)      ((a) < (b) ? (a) : (b))
+
+/* what tells apart the AHs of one device's peers, in place of the whole struct ibv_ah_attr */
+struct ah_key {
+    uint64_t    gid_prefix;     /* dgid, 0 if not global */
+    uint64_t    gid_iid;
+    uint16_t    lid;
+    uint8_t     sgid_index;
+    uint8_t     tc;
+};
+
+struct ah_entry {
+    struct ah_key   key;
+    struct ibv_ah  *ah;         /* NULL - a free entry */
+    int             refcnt;     /* remote buffers and tasks holding ah, it isn't evicted meanwhile */
+    int             referenced; /* CLOCK bit, set on a hit */
+};
 
-KHASH_TYPE(kh_ib_ah, struct ibv_ah_attr, struct ibv_ah*);
+KHASH_TYPE(kh_ib_ah, struct ah_key, int); /* index in the device's ah_entry[] */
 
 enum wr_id_flags {
-	WR_ID_FLAGS_ACTIVE = 1 << 0
+	WR_ID_FLAGS_ACTIVE  = 1 << 0,
+	WR_ID_FLAGS_SAMPLED = 1 << 1  /* start_ts is valid */
 };
 
 struct wr_id_reported {
     uint64_t 	wr_id;
     uint16_t	num_wrs;
     uint16_t	flags; /* enum wr_id_flags */
+    uint64_t	start_ts; /* HCA clock at submit, for a sampled task */
+};
+
+/*
+ * A completion of another DCI, polled while rdma_reset_device() drains one. Its
+ * WRs are given back to its DCI only when the event is handed out, so no more
+ * can be posted on it meanwhile and the stash never holds more than
+ * num_dcis * SEND_Q_DEPTH events.
+ */
+struct stashed_event {
+    struct rdma_completion_event event;
+    struct rdma_dci            *dci;
+    int                         num_wrs;
 };
 
-#ifdef PRINT_LATENCY
-struct wr_latency {
-    uint64_t    wr_start_ts;
-    uint64_t    wr_complete_ts;
-    uint64_t    completion_ts;
-    uint64_t    read_comp_ts;
+/*
+ * One DCI of the server's pool, with its own send queue, wr_id slots and lock.
+ * All DCIs share the device's CQ: the virtual wr_id of a CQE is
+ * dci index * SEND_Q_DEPTH + slot.
+ * With RC, the same slots hold one connected QP per peer, qp is NULL while
+ * a slot is unconnected and mqpex is always NULL.
+ */
+struct rdma_dci {
+    struct ibv_qp          *qp;
+    struct ibv_qp_ex       *qpex;
+    struct mlx5dv_qp_ex    *mqpex;
+    struct rdma_cm_id      *cm_id;      /* RC only, and the peer's GID and port below */
+    union ibv_gid           peer_gid;
+    uint16_t                peer_port;
+    int                     refcnt;     /* RC only: remote buffers using the connection, under rc_lock */
+    pthread_spinlock_t      sq_lock;    /* posting on the QP and allocating app_wr_id[] slots */
+    struct wr_id_reported   app_wr_id[SEND_Q_DEPTH];
+    int                     app_wr_id_idx;
+    int                     qp_available_wr;
+    int                     in_error;   /* a completion failed: skipped until rdma_reset_device() */
+    uint32_t                lat_cnt;    /* tasks since the last sampled one */
 };
-#endif /*PRINT_LATENCY*/
 
 struct rdma_device {
 
@@ -101,45 +172,80 @@ struct rdma_device {
 
     struct ibv_context *context;
     struct ibv_pd      *pd;
-#ifdef PRINT_LATENCY
-    struct ibv_cq_ex   *cq;
-#else
-    struct ibv_cq      *cq;
-#endif
+    struct ibv_cq_ex   *cq_ex; /* server only, NULL if the device has no completion timestamps */
+    struct ibv_cq      *cq;    /* ibv_cq_ex_to_cq(cq_ex) when there is one */
     struct ibv_srq     *srq; /* for DCT (client) only, for DCI (server) this is NULL */
-    struct ibv_qp      *qp;
-    struct ibv_qp_ex       *qpex;  /* DCI (server) only */
-    struct mlx5dv_qp_ex    *mqpex; /* DCI (server) only */
+    struct ibv_qp      *qp;  /* DCT (client) only */
+    struct rdma_dci    *dci; /* DCI pool (server) only, the RC connections with RC */
+    int                 num_dcis;
+    enum rdma_transport transport; /* DC or RC */
+
+    /* RC only: rdma_cm connections, the client's listener or the server's peers (under rc_lock) */
+    struct rdma_event_channel *rc_channel;
+    struct rdma_cm_id  *rc_listen_id;
+    uint16_t            rc_port;        /* client: the port it listens on */
+    pthread_t           rc_thread;      /* client: accepts the server's connections */
+    int                 rc_stop;
+    pthread_mutex_t     rc_lock;
+    uint8_t             rc_rd_atomic;
+    enum rdma_dci_policy dci_policy;
+    int                 next_thread_dci; /* RDMA_DCI_POLICY_PER_THREAD: handed to the next new submitter */
     
     /* Address handler (port info) relateed fields */
     int                 ib_port;
+    int                 comp_vector;
+    int                 poller_cpu; /* CPU local to the NIC for the polling thread, -1 if unknown */
     int                 is_global;
     int                 gidx;
     union ibv_gid       gid;
     uint16_t            lid;
     enum ibv_mtu        mtu;
 
-    struct wr_id_reported       app_wr_id[SEND_Q_DEPTH];
-    int                 app_wr_id_idx;
-    int                 qp_available_wr;
+    /*
+     * Submission and completion may run on different threads, and several of
+     * each. Each DCI's sq_lock serializes posting on it and allocating its
+     * app_wr_id[] slots; cq_lock serializes polling. qp_available_wr is atomic
+     * so the pollers give WRs back without taking sq_lock. Slots are handed out
+     * in ring order and each holds at least one WR, so an active slot is never
+     * reused before its completion is polled.
+     */
+    pthread_spinlock_t  cq_lock;
+    pthread_mutex_t     ah_lock;    /* AH cache, taken by imports and string-described tasks */
+    /* completions of other DCIs, polled while rdma_reset_device() drains one */
+    struct stashed_event *stash;
+    int                 stash_cnt;
+    /* batched polling, under cq_lock */
+    uint32_t            poll_batch;
+    uint32_t            cq_depth;
+    struct ibv_wc      *wc;         /* poll_batch entries */
+    struct rdma_completion_event *batch_events; /* poll_batch entries, for the callback */
+    rdma_completion_cb  comp_cb;
+    void               *comp_cb_ctx;
     int                 rdma_buff_cnt;
+    int                 remote_buff_cnt;
 
-    /* AH hash */
+    /*
+     * AH cache, under ah_lock. At most ah_capacity entries, found through
+     * ah_hash; when full, a miss evicts the first unpinned entry the CLOCK
+     * hand finds without its reference bit.
+     */
     khash_t(kh_ib_ah)   ah_hash;
-#ifdef PRINT_LATENCY
+    struct ah_entry    *ah_entry;
+    int                 ah_capacity;
+    int                 ah_used;    /* ah_entry[] filled so far */
+    int                 ah_hand;
+    struct rdma_ah_cache_stats ah_stats;
+
+    /*
+     * Latency sampling: every lat_every-th task of a DCI gets its HCA clock
+     * recorded at submit. Its CQE adds submit->CQE and CQE->poll to the
+     * histograms, in nSec, under cq_lock.
+     */
     uint64_t            hca_core_clock_kHz;
-    struct wr_latency   latency[SEND_Q_DEPTH];
-    uint64_t    measure_index;
-    uint64_t    wr_complete_latency_sum; /*from wr_start_ts*/
-    uint64_t    completion_latency_sum; /*from wr_start_ts*/
-    uint64_t    read_comp_latency_sum; /*from completion_ts*/
-    uint64_t    min_wr_complete_latency;
-    uint64_t    min_completion_latency;
-    uint64_t    min_read_comp_latency;
-    uint64_t    max_wr_complete_latency;
-    uint64_t    max_completion_latency;
-    uint64_t    max_read_comp_latency;
-#endif /*PRINT_LATENCY*/
+    uint64_t            ts_mask;    /* completion_timestamp_mask, the clock wraps there */
+    uint32_t            lat_every;  /* 0 - off */
+    struct lat_hist     lat_submit_to_cqe;
+    struct lat_hist     lat_cqe_to_poll;
 };
 
 struct rdma_buffer {
@@ -149,12 +255,26 @@ struct rdma_buffer {
     /* MR Related fields */
     struct ibv_mr      *mr;
     uint32_t            rkey;
+    int                 mr_mode;    /* MR_MODE_* requested, see odp_mr.h */
+    /* Linked rdma_device */
+    struct rdma_device *rdma_dev;
+};
+
+struct rdma_remote_buffer {
+    uint64_t            addr;
+    uint64_t            size;
+    uint32_t            rkey;
+    uint32_t            dctn;
+    struct ibv_ah      *ah;         /* owned by the device's AH cache */
+    int                 ah_idx;     /* its AH cache entry, pinned until release */
+    int                 rc_peer;    /* RC: its connection in the device's dci[], pinned until release */
     /* Linked rdma_device */
     struct rdma_device *rdma_dev;
 };
 
 struct rdma_exec_params {
 	struct rdma_device 	*device;
+	struct rdma_dci 	*dci;
 	uint64_t 		 wr_id;
 	unsigned long		 rem_buf_rkey;
 	unsigned long long 	 rem_buf_addr;
@@ -166,6 +286,7 @@ struct rdma_exec_params {
 	struct iovec            *local_buf_iovec;
 	int                      local_buf_iovcnt;
 	uint32_t 		 flags; /*enum rdma_task_attr_flags*/
+	uint32_t 		 notify_data;
 };
 
 static inline
@@ -176,20 +297,20 @@ int is_server(struct rdma_device *device)
 
 /* use both gid + lid data for key generarion (lid - ib based, gid - RoCE) */
 static inline
-khint32_t kh_ib_ah_hash_func(struct ibv_ah_attr attr)
+khint32_t kh_ib_ah_hash_func(struct ah_key key)
 {
-    return kh_int64_hash_func(attr.grh.dgid.global.subnet_prefix ^
-                              attr.grh.dgid.global.interface_id  ^
-                              attr.dlid);
+    return kh_int64_hash_func(key.gid_prefix ^ key.gid_iid ^ ((uint64_t)key.lid << 16) ^
+                              ((uint64_t)key.sgid_index << 8) ^ key.tc);
 }
 
 static inline
-int kh_ib_ah_hash_equal(struct ibv_ah_attr a, struct ibv_ah_attr b)
+int kh_ib_ah_hash_equal(struct ah_key a, struct ah_key b)
 {
-    return !memcmp(&a, &b, sizeof(a));
+    return a.gid_iid == b.gid_iid && a.gid_prefix == b.gid_prefix && a.lid == b.lid &&
+           a.sgid_index == b.sgid_index && a.tc == b.tc;
 }
 
-KHASH_IMPL(kh_ib_ah, struct ibv_ah_attr, struct ibv_ah*, 1,
+KHASH_IMPL(kh_ib_ah, struct ah_key, int, 1,
            kh_ib_ah_hash_func, kh_ib_ah_hash_equal)
 
 
@@ -421,7 +542,7 @@ static int modify_target_qp_to_rtr(struct rdma_device *rdma_dev)
  * Modify source QP state to RTR and then to RTS (on the server side)
  * Return value: 0 - success, 1 - error
  ****************************************************************************************/
-static int modify_source_qp_to_rtr_and_rts(struct rdma_device *rdma_dev)
+static int modify_source_qp_to_rtr_and_rts(struct rdma_device *rdma_dev, struct ibv_qp *qp)
 {
     struct ibv_qp_attr      qp_attr;
     enum ibv_qp_attr_mask   attr_mask;
@@ -444,12 +565,12 @@ static int modify_source_qp_to_rtr_and_rts(struct rdma_device *rdma_dev)
                 IBV_QP_PATH_MTU ;
 
     DEBUG_LOG("ibv_modify_qp(qp = %p, qp_attr.qp_state = %d, attr_mask = 0x%x)\n",
-               rdma_dev->qp, qp_attr.qp_state, attr_mask);
-    if (ibv_modify_qp(rdma_dev->qp, &qp_attr, attr_mask)) {
+               qp, qp_attr.qp_state, attr_mask);
+    if (ibv_modify_qp(qp, &qp_attr, attr_mask)) {
         fprintf(stderr, "Failed to modify QP to RTR\n");
         return 1;
     }
-    DEBUG_LOG ("ibv_modify_qp to state %d completed: qp_num = 0x%lx\n", qp_attr.qp_state, rdma_dev->qp->qp_num);
+    DEBUG_LOG ("ibv_modify_qp to state %d completed: qp_num = 0x%lx\n", qp_attr.qp_state, qp->qp_num);
 
     /* - - - - - - -  Modify QP to RTS  - - - - - - - */
     qp_attr.qp_state       = IBV_QPS_RTS;
@@ -465,19 +586,19 @@ static int modify_source_qp_to_rtr_and_rts(struct rdma_device *rdma_dev)
                 IBV_QP_SQ_PSN           |
                 IBV_QP_MAX_QP_RD_ATOMIC ;
     DEBUG_LOG("ibv_modify_qp(qp = %p, qp_attr.qp_state = %d, attr_mask = 0x%x)\n",
-               rdma_dev->qp, qp_attr.qp_state, attr_mask);
-    if (ibv_modify_qp(rdma_dev->qp, &qp_attr, attr_mask)) {
+               qp, qp_attr.qp_state, attr_mask);
+    if (ibv_modify_qp(qp, &qp_attr, attr_mask)) {
         fprintf(stderr, "Failed to modify QP to RTS\n");
         return 1;
     }
-    DEBUG_LOG ("ibv_modify_qp to state %d completed: qp_num = 0x%lx\n", qp_attr.qp_state, rdma_dev->qp->qp_num);
+    DEBUG_LOG ("ibv_modify_qp to state %d completed: qp_num = 0x%lx\n", qp_attr.qp_state, qp->qp_num);
     
     return 0;
 }
 
 static int destroy_qp(struct ibv_qp *qp) 
 {
-	int ret;
+	int ret = 0;
 	if (qp) {
 		DEBUG_LOG("ibv_destroy_qp(%p)\n", qp);
 		ret = ibv_destroy_qp(qp);
@@ -488,7 +609,7 @@ static int destroy_qp(struct ibv_qp *qp)
 	return ret;
 }
 
-static int modify_source_qp_rst2rts(struct rdma_device *rdma_dev) 
+static int modify_source_qp_rst2rts(struct rdma_device *rdma_dev, struct rdma_dci *dci) 
 {
     int ret_val;
     /* - - - - - - - - - -  Modify QP to INIT  - - - - - - - - - - - - - */
@@ -503,99 +624,55 @@ static int modify_source_qp_rst2rts(struct rdma_device *rdma_dev)
                                       IBV_QP_PORT       |
                                       0 /*IBV_QP_ACCESS_FLAGS*/; /*we must zero this bit for DCI QP*/
     DEBUG_LOG("ibv_modify_qp(qp = %p, qp_attr.qp_state = %d, attr_mask = 0x%x)\n",
-               rdma_dev->qp, qp_attr.qp_state, attr_mask);
-    ret_val = ibv_modify_qp(rdma_dev->qp, &qp_attr, attr_mask);
+               dci->qp, qp_attr.qp_state, attr_mask);
+    ret_val = ibv_modify_qp(dci->qp, &qp_attr, attr_mask);
     if (ret_val) {
         fprintf(stderr, "Failed to modify QP to INIT, error %d\n", ret_val);
         return 1;
     }
-    DEBUG_LOG("ibv_modify_qp to state %d completed: qp_num = 0x%lx\n", qp_attr.qp_state, rdma_dev->qp->qp_num);
+    DEBUG_LOG("ibv_modify_qp to state %d completed: qp_num = 0x%lx\n", qp_attr.qp_state, dci->qp->qp_num);
     
     /* - - - - - - - - - - - - -  Modify QP to RTS  - - - - - - - - - - - - */
-    ret_val = modify_source_qp_to_rtr_and_rts(rdma_dev);
+    ret_val = modify_source_qp_to_rtr_and_rts(rdma_dev, dci->qp);
     if (ret_val) {
         return 1;
     }
 
-    rdma_dev->qpex->wr_flags = IBV_SEND_SIGNALED;
+    dci->qpex->wr_flags = IBV_SEND_SIGNALED;
 
     return 0;
 }
 
-//============================================================================================
-struct rdma_device *rdma_open_device_client(struct sockaddr *addr)
+/****************************************************************************************
+ * Post zero-length receives to the DCT's SRQ, consumed by the server's write-with-imm
+ * notifications
+ * Return value: 0 - success, errno - error
+ ****************************************************************************************/
+static int post_notify_recvs(struct rdma_device *rdma_dev, int num)
 {
-    struct rdma_device *rdma_dev;
-    int                 ret_val;
+    struct ibv_recv_wr  wr, *bad_wr;
+    int                 i, ret_val;
 
-    rdma_dev = calloc(1, sizeof *rdma_dev);
-    if (!rdma_dev) {
-        fprintf(stderr, "rdma_device memory allocation failed\n");
-        return NULL;
-    }
-
-    /****************************************************************************************************
-     * In the next function we let rdma_cm find a IB device that matches the IP address of a the local netdev,
-     * if yes, we return a pointer to that ib context
-     * The result of this function is ib_dev - initialized pointer to the relevant struct ibv_device
-     ****************************************************************************************************/
-    rdma_dev->context = open_ib_device_by_addr(rdma_dev, addr);
-    if (!rdma_dev->context){
-        goto clean_rdma_dev;
-    }
-
-    ret_val = rdma_set_lid_gid_from_port_info(rdma_dev);
-    if (ret_val) {
-        goto clean_device;
-    }
-
-    /****************************************************************************************************/
-    
-    DEBUG_LOG ("ibv_alloc_pd(ibv_context = %p)\n", rdma_dev->context);
-    rdma_dev->pd = ibv_alloc_pd(rdma_dev->context);
-    if (!rdma_dev->pd) {
-        fprintf(stderr, "Couldn't allocate PD\n");
-        goto clean_device;
-    }
-    DEBUG_LOG("created pd %p\n", rdma_dev->pd);
-
-    /* **********************************  Create CQ  ********************************** */
-#ifdef PRINT_LATENCY
-	struct ibv_cq_init_attr_ex cq_attr_ex;
-	
-    memset(&cq_attr_ex, 0, sizeof(cq_attr_ex));
-	cq_attr_ex.cqe = CQ_DEPTH;
-	cq_attr_ex.cq_context = rdma_dev;
-	cq_attr_ex.channel = NULL;
-	cq_attr_ex.comp_vector = 0;
-	cq_attr_ex.wc_flags = IBV_WC_EX_WITH_COMPLETION_TIMESTAMP;
-
-    DEBUG_LOG ("ibv_create_cq_ex(rdma_dev->context = %p, &cq_attr_ex)\n", rdma_dev->context);
-	rdma_dev->cq = ibv_create_cq_ex(rdma_dev->context, &cq_attr_ex);
-#else /*PRINT_LATENCY*/
-    DEBUG_LOG ("ibv_create_cq(%p, %d, NULL, NULL, 0)\n", rdma_dev->context, CQ_DEPTH);
-    rdma_dev->cq = ibv_create_cq(rdma_dev->context, CQ_DEPTH, NULL, NULL /*comp. events channel*/, 0);
-#endif /*PRINT_LATENCY*/
-    if (!rdma_dev->cq) {
-        fprintf(stderr, "Couldn't create CQ\n");
-        goto clean_pd;
+    memset(&wr, 0, sizeof wr);
+    for (i = 0; i < num; i++) {
+        ret_val = ibv_post_srq_recv(rdma_dev->srq, &wr, &bad_wr);
+        if (ret_val) {
+            fprintf(stderr, "ibv_post_srq_recv failed, error %d\n", ret_val);
+            return ret_val;
+        }
     }
-    DEBUG_LOG("created cq %p\n", rdma_dev->cq);
+    return 0;
+}
 
-    /* **********************************  Create SRQ  ********************************** */
-    struct ibv_srq_init_attr srq_attr;
-    memset(&srq_attr, 0, sizeof(srq_attr));
-    srq_attr.attr.max_wr = 2;
-    srq_attr.attr.max_sge = 1;
-    DEBUG_LOG ("ibv_create_srq(%p, %d, NULL, NULL, 0)\n", rdma_dev->context, CQ_DEPTH);
-    rdma_dev->srq = ibv_create_srq(rdma_dev->pd, &srq_attr);
-    if (!rdma_dev->srq) {
-        fprintf(stderr, "ibv_create_srq failed\n");
-        goto clean_cq;
-    }
-    DEBUG_LOG("created srq %p\n", rdma_dev->srq);
+/****************************************************************************************
+ * Create the client's DCT on the device's SRQ and bring it to RTR.
+ * On failure, the caller destroys rdma_dev->qp if it was created.
+ * Return value: 0 - success, 1 - error
+ ****************************************************************************************/
+static int create_dct(struct rdma_device *rdma_dev)
+{
+    int ret_val;
 
-    /* **********************************  Create QP  ********************************** */
     struct ibv_qp_init_attr_ex attr_ex;
     struct mlx5dv_qp_init_attr attr_dv;
 
@@ -603,13 +680,8 @@ struct rdma_device *rdma_open_device_client(struct sockaddr *addr)
     memset(&attr_dv, 0, sizeof(attr_dv));
 
     attr_ex.qp_type = IBV_QPT_DRIVER;
-#ifdef PRINT_LATENCY
-    attr_ex.send_cq = ibv_cq_ex_to_cq(rdma_dev->cq);
-    attr_ex.recv_cq = ibv_cq_ex_to_cq(rdma_dev->cq);
-#else /*PRINT_LATENCY*/
     attr_ex.send_cq = rdma_dev->cq;
     attr_ex.recv_cq = rdma_dev->cq;
-#endif /*PRINT_LATENCY*/
 
     attr_ex.comp_mask |= IBV_QP_INIT_ATTR_PD;
     attr_ex.pd = rdma_dev->pd;
@@ -625,7 +697,7 @@ struct rdma_device *rdma_open_device_client(struct sockaddr *addr)
 
     if (!rdma_dev->qp)  {
         fprintf(stderr, "Couldn't create QP\n");
-        goto clean_srq;
+        return 1;
     }
     DEBUG_LOG ("mlx5dv_create_qp %p completed: qp_num = 0x%lx\n", rdma_dev->qp, rdma_dev->qp->qp_num);
 
@@ -645,73 +717,405 @@ struct rdma_device *rdma_open_device_client(struct sockaddr *addr)
     ret_val = ibv_modify_qp(rdma_dev->qp, &qp_attr, attr_mask);
     if (ret_val) {
         fprintf(stderr, "Failed to modify QP to INIT, error %d\n", ret_val);
-        goto clean_qp;
+        return 1;
     }
     DEBUG_LOG ("ibv_modify_qp to state %d completed: qp_num = 0x%lx\n", qp_attr.qp_state, rdma_dev->qp->qp_num);
 
-    ret_val = modify_target_qp_to_rtr(rdma_dev);
-    if (ret_val) {
-        goto clean_qp;
+    return modify_target_qp_to_rtr(rdma_dev);
+}
+
+static enum rdma_transport resolve_transport(struct rdma_device *rdma_dev)
+{
+    if (s_transport != RDMA_TRANSPORT_AUTO) {
+        return s_transport;
     }
-    
-    DEBUG_LOG("init AH cache\n");
-    kh_init_inplace(kh_ib_ah, &rdma_dev->ah_hash);
+    return mlx5dv_is_supported(rdma_dev->context->device) ? RDMA_TRANSPORT_DC : RDMA_TRANSPORT_RC;
+}
 
-#ifdef PRINT_LATENCY
-    struct ibv_device_attr_ex           device_attr_ex = {};
-    //struct ibv_query_device_ex_input    query_device_ex_input = {
-    //    .comp_masc = ...
-    //}
-    
-    ret_val = ibv_query_device_ex(rdma_dev->context, /*struct ibv_query_device_ex_input*/NULL, &device_attr_ex);
-    if (ret_val) {
-        fprintf(stderr, "ibv_query_device_ex failed\n");
-        goto clean_qp;
+/* the device's own address, with the port cleared, for the RC rdma_cm ids */
+static void rc_local_addr(struct rdma_device *rdma_dev, struct sockaddr_storage *ss)
+{
+    memcpy(ss, &rdma_dev->cm_id->route.addr.src_storage, sizeof *ss);
+    if (ss->ss_family == AF_INET) {
+        ((struct sockaddr_in *)ss)->sin_port = 0;
+    } else {
+        ((struct sockaddr_in6 *)ss)->sin6_port = 0;
+    }
+}
+
+/* RC peers are reached through rdma_cm at the IP address their GID carries */
+static void rc_peer_addr(const union ibv_gid *gid, uint16_t port, struct sockaddr_storage *ss)
+{
+    static const uint8_t v4_mapped[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+
+    memset(ss, 0, sizeof *ss);
+    if (!memcmp(gid->raw, v4_mapped, sizeof v4_mapped)) {
+        struct sockaddr_in *sin = (struct sockaddr_in *)ss;
+
+        sin->sin_family = AF_INET;
+        sin->sin_port   = htons(port);
+        memcpy(&sin->sin_addr, gid->raw + 12, 4);
+    } else {
+        struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)ss;
+
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_port   = htons(port);
+        memcpy(&sin6->sin6_addr, gid->raw, 16);
+    }
+}
+
+static uint8_t rc_max_rd_atomic(struct rdma_device *rdma_dev)
+{
+    struct ibv_device_attr attr;
+    int                    depth;
+
+    if (ibv_query_device(rdma_dev->context, &attr)) {
+        return 1;
+    }
+    depth = mmin(attr.max_qp_init_rd_atom, attr.max_qp_rd_atom);
+    return mmin(depth, RC_MAX_RD_ATOMIC); /* fits the byte of rdma_conn_param */
+}
+
+/*
+ * Client side: accept the server's connections, each an RC QP receiving on
+ * the device's SRQ like the DCT does. The accepted ids belong to this thread.
+ */
+static void *rc_accept_thread(void *arg)
+{
+    struct rdma_device     *rdma_dev = arg;
+    struct rdma_cm_id     **ids = NULL, *id;
+    int                     num_ids = 0, i;
+    struct rdma_cm_event   *event;
+    struct pollfd           pfd = { .fd = rdma_dev->rc_channel->fd, .events = POLLIN };
+
+    while (!__atomic_load_n(&rdma_dev->rc_stop, __ATOMIC_RELAXED)) {
+        if (poll(&pfd, 1, 100) <= 0 || rdma_get_cm_event(rdma_dev->rc_channel, &event)) {
+            continue;
+        }
+        id = event->id;
+        switch (event->event) {
+        case RDMA_CM_EVENT_CONNECT_REQUEST: {
+            struct ibv_qp_init_attr init_attr;
+            struct rdma_conn_param  conn_param;
+            struct rdma_cm_id     **new_ids = realloc(ids, (num_ids + 1) * sizeof *ids);
+
+            memset(&init_attr, 0, sizeof init_attr);
+            init_attr.send_cq = rdma_dev->cq;
+            init_attr.recv_cq = rdma_dev->cq;
+            init_attr.srq     = rdma_dev->srq;
+            init_attr.qp_type = IBV_QPT_RC;
+            init_attr.cap.max_send_wr  = 1;
+            init_attr.cap.max_send_sge = 1;
+
+            memset(&conn_param, 0, sizeof conn_param);
+            /* the event is in our view: its responder_resources is the server's initiator_depth */
+            conn_param.responder_resources = mmin(event->param.conn.responder_resources, rdma_dev->rc_rd_atomic);
+            conn_param.rnr_retry_count     = 7;
+
+            rdma_ack_cm_event(event);
+            if (!new_ids || id->verbs != rdma_dev->context || rdma_create_qp(id, rdma_dev->pd, &init_attr)) {
+                fprintf(stderr, "Couldn't create a QP for an RC connection request\n");
+                ids = new_ids ? new_ids : ids;
+                rdma_reject(id, NULL, 0);
+                rdma_destroy_id(id);
+                continue;
+            }
+            ids = new_ids;
+            if (rdma_accept(id, &conn_param)) {
+                perror("rdma_accept");
+                rdma_destroy_qp(id);
+                rdma_destroy_id(id);
+                continue;
+            }
+            DEBUG_LOG("accepted RC connection, qp_num = 0x%x\n", id->qp->qp_num);
+            ids[num_ids++] = id;
+            break;
+        }
+        case RDMA_CM_EVENT_DISCONNECTED:
+            rdma_ack_cm_event(event);
+            for (i = 0; i < num_ids && ids[i] != id; i++)
+                ;
+            if (i < num_ids) {
+                DEBUG_LOG("RC connection closed, qp_num = 0x%x\n", id->qp->qp_num);
+                ids[i] = ids[--num_ids];
+                rdma_destroy_qp(id);
+                rdma_destroy_id(id);
+            }
+            break;
+        default:
+            rdma_ack_cm_event(event);
+            break;
+        }
+    }
+
+    for (i = 0; i < num_ids; i++) {
+        rdma_disconnect(ids[i]);
+        rdma_destroy_qp(ids[i]);
+        rdma_destroy_id(ids[i]);
+    }
+    free(ids);
+    return NULL;
+}
+
+/****************************************************************************************
+ * Client side of RC: listen on an ephemeral rdma_cm port of the device's address,
+ * the buffer descriptions carry it in place of the DCT number.
+ * Return value: 0 - success, 1 - error
+ ****************************************************************************************/
+static int rc_listen(struct rdma_device *rdma_dev)
+{
+    struct sockaddr_storage addr;
+
+    rdma_dev->rc_rd_atomic = rc_max_rd_atomic(rdma_dev);
+    rdma_dev->rc_channel = rdma_create_event_channel();
+    if (!rdma_dev->rc_channel) {
+        perror("rdma_create_event_channel");
+        return 1;
+    }
+    fcntl(rdma_dev->rc_channel->fd, F_SETFL, fcntl(rdma_dev->rc_channel->fd, F_GETFL) | O_NONBLOCK);
+    if (rdma_create_id(rdma_dev->rc_channel, &rdma_dev->rc_listen_id, rdma_dev, RDMA_PS_TCP)) {
+        perror("rdma_create_id");
+        goto clean_channel;
+    }
+    rc_local_addr(rdma_dev, &addr);
+    if (rdma_bind_addr(rdma_dev->rc_listen_id, (struct sockaddr *)&addr) ||
+        rdma_listen(rdma_dev->rc_listen_id, RC_LISTEN_BACKLOG)) {
+        perror("rdma_listen");
+        goto clean_id;
+    }
+    rdma_dev->rc_port = ntohs(rdma_get_src_port(rdma_dev->rc_listen_id));
+    DEBUG_LOG("RC transport: listening on rdma_cm port %d\n", rdma_dev->rc_port);
+
+    if (pthread_create(&rdma_dev->rc_thread, NULL, rc_accept_thread, rdma_dev)) {
+        fprintf(stderr, "Couldn't start the RC accept thread\n");
+        goto clean_id;
+    }
+    return 0;
+
+clean_id:
+    rdma_destroy_id(rdma_dev->rc_listen_id);
+    rdma_dev->rc_listen_id = NULL;
+clean_channel:
+    rdma_destroy_event_channel(rdma_dev->rc_channel);
+    rdma_dev->rc_channel = NULL;
+    return 1;
+}
+
+static void rc_stop_listen(struct rdma_device *rdma_dev)
+{
+    if (!rdma_dev->rc_listen_id) {
+        return;
+    }
+    __atomic_store_n(&rdma_dev->rc_stop, 1, __ATOMIC_RELAXED);
+    pthread_join(rdma_dev->rc_thread, NULL);
+    rdma_destroy_id(rdma_dev->rc_listen_id);
+    rdma_destroy_event_channel(rdma_dev->rc_channel);
+    rdma_dev->rc_listen_id = NULL;
+    rdma_dev->rc_channel   = NULL;
+}
+
+/*
+ * Server side, called with rc_lock held: wait for the next event of id. A
+ * peer's disconnect seen meanwhile puts its connection in error.
+ */
+static int rc_wait_event(struct rdma_device *rdma_dev, struct rdma_cm_id *id, enum rdma_cm_event_type expected)
+{
+    struct rdma_cm_event *event;
+    int                   ret;
+
+    while (!rdma_get_cm_event(rdma_dev->rc_channel, &event)) {
+        if (event->id != id) {
+            if (event->event == RDMA_CM_EVENT_DISCONNECTED) {
+                __atomic_store_n(&((struct rdma_dci *)event->id->context)->in_error, 1, __ATOMIC_RELAXED);
+            }
+            rdma_ack_cm_event(event);
+            continue;
+        }
+        ret = event->event != expected;
+        if (ret) {
+            fprintf(stderr, "RC connect: %s (status %d) while waiting for %s\n",
+                    rdma_event_str(event->event), event->status, rdma_event_str(expected));
+        }
+        rdma_ack_cm_event(event);
+        return ret;
+    }
+    perror("rdma_get_cm_event");
+    return 1;
+}
+
+/****************************************************************************************
+ * Server side, called with rc_lock held: connect the free slot peer to the client
+ * listening at gid/port
+ * Return value: 0 - success, 1 - error
+ ****************************************************************************************/
+static int rc_connect(struct rdma_device *rdma_dev, struct rdma_dci *peer, const union ibv_gid *gid, uint16_t port)
+{
+    struct sockaddr_storage     src, dst;
+    struct ibv_qp_init_attr_ex  attr_ex;
+    struct rdma_conn_param      conn_param;
+    struct rdma_cm_id          *id;
+
+    rc_local_addr(rdma_dev, &src);
+    rc_peer_addr(gid, port, &dst);
+
+    if (rdma_create_id(rdma_dev->rc_channel, &id, peer, RDMA_PS_TCP)) {
+        perror("rdma_create_id");
+        return 1;
+    }
+    if (rdma_resolve_addr(id, (struct sockaddr *)&src, (struct sockaddr *)&dst, RC_RESOLVE_TIMEOUT_MS) ||
+        rc_wait_event(rdma_dev, id, RDMA_CM_EVENT_ADDR_RESOLVED) ||
+        rdma_resolve_route(id, RC_RESOLVE_TIMEOUT_MS) ||
+        rc_wait_event(rdma_dev, id, RDMA_CM_EVENT_ROUTE_RESOLVED)) {
+        fprintf(stderr, "Couldn't resolve the RC peer at port %d\n", port);
+        goto clean_id;
+    }
+    if (id->verbs != rdma_dev->context) {
+        fprintf(stderr, "The RC peer is reached through another RDMA device\n");
+        goto clean_id;
+    }
+
+    memset(&attr_ex, 0, sizeof(attr_ex));
+    attr_ex.qp_type = IBV_QPT_RC;
+    attr_ex.send_cq = rdma_dev->cq;
+    attr_ex.recv_cq = rdma_dev->cq;
+    attr_ex.comp_mask |= IBV_QP_INIT_ATTR_PD;
+    attr_ex.pd = rdma_dev->pd;
+    attr_ex.cap.max_send_wr  = SEND_Q_DEPTH;
+    attr_ex.cap.max_send_sge = MAX_SEND_SGE;
+    attr_ex.cap.max_recv_wr  = 1;
+    attr_ex.cap.max_recv_sge = 1;
+    attr_ex.comp_mask |= IBV_QP_INIT_ATTR_SEND_OPS_FLAGS;
+    attr_ex.send_ops_flags = IBV_QP_EX_WITH_RDMA_WRITE | IBV_QP_EX_WITH_RDMA_WRITE_WITH_IMM | IBV_QP_EX_WITH_RDMA_READ;
+
+    DEBUG_LOG ("rdma_create_qp_ex(%p)\n", id);
+    if (rdma_create_qp_ex(id, &attr_ex)) {
+        perror("rdma_create_qp_ex");
+        goto clean_id;
     }
-    if (!device_attr_ex.hca_core_clock) {
-        fprintf(stderr, "hca_core_clock = 0\n");
+
+    memset(&conn_param, 0, sizeof conn_param);
+    conn_param.initiator_depth = rdma_dev->rc_rd_atomic;
+    conn_param.retry_count     = 7;
+    conn_param.rnr_retry_count = 7;
+    if (rdma_connect(id, &conn_param) || rc_wait_event(rdma_dev, id, RDMA_CM_EVENT_ESTABLISHED)) {
+        fprintf(stderr, "Couldn't connect to the RC peer at port %d\n", port);
         goto clean_qp;
     }
 
-    rdma_dev->hca_core_clock_kHz = device_attr_ex.hca_core_clock;
-    DEBUG_LOG("hca_core_clock = %d kHz\n", rdma_dev->hca_core_clock_kHz);
-#endif /*PRINT_LATENCY*/
-    
-    return rdma_dev;
+    pthread_spin_lock(&peer->sq_lock);
+    peer->cm_id     = id;
+    peer->qp        = id->qp;
+    peer->qpex      = ibv_qp_to_qp_ex(id->qp);
+    peer->peer_gid  = *gid;
+    peer->peer_port = port;
+    memset(peer->app_wr_id, 0, sizeof(peer->app_wr_id));
+    peer->app_wr_id_idx = 0;
+    __atomic_store_n(&peer->qp_available_wr, SEND_Q_DEPTH, __ATOMIC_RELAXED);
+    __atomic_store_n(&peer->in_error, 0, __ATOMIC_RELAXED);
+    pthread_spin_unlock(&peer->sq_lock);
+    DEBUG_LOG("RC connection %d established, qp_num = 0x%x\n", (int)(peer - rdma_dev->dci), id->qp->qp_num);
+
+    return 0;
 
 clean_qp:
-    destroy_qp(rdma_dev->qp);
+    rdma_destroy_qp(id);
+clean_id:
+    rdma_destroy_id(id);
+    return 1;
+}
 
-clean_srq:
-    if (rdma_dev->srq) {
-        ibv_destroy_srq(rdma_dev->srq);
+/* server side, with no WR outstanding on the peer's QP */
+static void rc_disconnect(struct rdma_device *rdma_dev, struct rdma_dci *peer)
+{
+    struct rdma_cm_id *id = peer->cm_id;
+
+    if (!id) {
+        return;
     }
+    DEBUG_LOG("rdma_disconnect(RC connection %d)\n", (int)(peer - rdma_dev->dci));
+    pthread_spin_lock(&peer->sq_lock);
+    peer->cm_id = NULL;
+    peer->qp    = NULL;
+    peer->qpex  = NULL;
+    pthread_spin_unlock(&peer->sq_lock);
+    rdma_disconnect(id);
+    rdma_destroy_qp(id);
+    rdma_destroy_id(id);
+}
 
-clean_cq:
-    if (rdma_dev->cq) {
-#ifdef PRINT_LATENCY
-        ibv_destroy_cq(ibv_cq_ex_to_cq(rdma_dev->cq));
-#else /*PRINT_LATENCY*/
-        ibv_destroy_cq(rdma_dev->cq);
-#endif /*PRINT_LATENCY*/
+/*
+ * Server side: the connection to the client listening at gid/port, connected
+ * on first use and pinned for the caller. Returns its index in dci[], or -1.
+ */
+static int rc_peer_get(struct rdma_device *rdma_dev, const union ibv_gid *gid, uint16_t port)
+{
+    struct rdma_dci *peer;
+    int              i, free_idx = -1, idle_idx = -1;
+
+    pthread_mutex_lock(&rdma_dev->rc_lock);
+    for (i = 0; i < rdma_dev->num_dcis; i++) {
+        peer = &rdma_dev->dci[i];
+        if (peer->qp && !__atomic_load_n(&peer->in_error, __ATOMIC_RELAXED) &&
+            peer->peer_port == port && !memcmp(&peer->peer_gid, gid, sizeof *gid)) {
+            peer->refcnt++;
+            pthread_mutex_unlock(&rdma_dev->rc_lock);
+            return i;
+        }
+        if (!peer->refcnt && free_idx < 0 && !peer->qp) {
+            free_idx = i;
+        }
+        if (!peer->refcnt && idle_idx < 0 && peer->qp &&
+            __atomic_load_n(&peer->qp_available_wr, __ATOMIC_ACQUIRE) == SEND_Q_DEPTH) {
+            idle_idx = i;
+        }
+    }
+    if (free_idx < 0 && idle_idx >= 0) {
+        /* no buffer of that peer is imported any more, its connection makes room */
+        rc_disconnect(rdma_dev, &rdma_dev->dci[idle_idx]);
+        free_idx = idle_idx;
     }
+    if (free_idx < 0) {
+        fprintf(stderr, "All %d RC connections are in use by remote buffers\n", rdma_dev->num_dcis);
+    } else if (rc_connect(rdma_dev, &rdma_dev->dci[free_idx], gid, port)) {
+        free_idx = -1;
+    } else {
+        rdma_dev->dci[free_idx].refcnt = 1;
+    }
+    pthread_mutex_unlock(&rdma_dev->rc_lock);
 
-clean_pd:
-    if (rdma_dev->pd) {
-        ibv_dealloc_pd(rdma_dev->pd);
+    return free_idx;
+}
+
+/*
+ * Server side: connect again the slot reset_dci() dropped, to the same peer, for
+ * the remote buffers still pinned to it
+ * Return value: 0 - success, 1 - error
+ */
+static int rc_reconnect(struct rdma_device *rdma_dev, struct rdma_dci *peer)
+{
+    union ibv_gid gid;
+    int           ret_val = 0;
+
+    pthread_mutex_lock(&rdma_dev->rc_lock);
+    if (!peer->qp) {
+        gid = peer->peer_gid;
+        DEBUG_LOG("Reconnecting RC connection %d\n", (int)(peer - rdma_dev->dci));
+        ret_val = rc_connect(rdma_dev, peer, &gid, peer->peer_port);
     }
+    pthread_mutex_unlock(&rdma_dev->rc_lock);
 
-clean_device:
-    close_ib_device(rdma_dev);
-    
-clean_rdma_dev:
-    free(rdma_dev);
+    return ret_val;
+}
 
-    return NULL;
+static void rc_peer_put(struct rdma_device *rdma_dev, int rc_peer)
+{
+    pthread_mutex_lock(&rdma_dev->rc_lock);
+    rdma_dev->dci[rc_peer].refcnt--;
+    pthread_mutex_unlock(&rdma_dev->rc_lock);
 }
 
 //============================================================================================
-struct rdma_device *rdma_open_device_server(struct sockaddr *addr)
+struct rdma_device *rdma_open_device_client(struct sockaddr *addr)
 {
     struct rdma_device *rdma_dev;
     int                 ret_val;
@@ -731,14 +1135,18 @@ struct rdma_device *rdma_open_device_server(struct sockaddr *addr)
     if (!rdma_dev->context){
         goto clean_rdma_dev;
     }
-    
+
     ret_val = rdma_set_lid_gid_from_port_info(rdma_dev);
     if (ret_val) {
         goto clean_device;
     }
 
-    /****************************************************************************************************/
+    rdma_dev->comp_vector = s_comp_vector;
+    rdma_dev->poller_cpu  = s_poller_cpu;
+    nic_resolve_affinity(rdma_dev->context, &rdma_dev->comp_vector, &rdma_dev->poller_cpu);
 
+    /****************************************************************************************************/
+    
     DEBUG_LOG ("ibv_alloc_pd(ibv_context = %p)\n", rdma_dev->context);
     rdma_dev->pd = ibv_alloc_pd(rdma_dev->context);
     if (!rdma_dev->pd) {
@@ -747,48 +1155,136 @@ struct rdma_device *rdma_open_device_server(struct sockaddr *addr)
     }
     DEBUG_LOG("created pd %p\n", rdma_dev->pd);
 
-    /* We don't create completion events channel (ibv_create_comp_channel), we prefer working in polling mode */
-    
     /* **********************************  Create CQ  ********************************** */
-#ifdef PRINT_LATENCY
-	struct ibv_cq_init_attr_ex cq_attr_ex;
-	
-    memset(&cq_attr_ex, 0, sizeof(cq_attr_ex));
-	cq_attr_ex.cqe = CQ_DEPTH;
-	cq_attr_ex.cq_context = rdma_dev;
-	cq_attr_ex.channel = NULL;
-	cq_attr_ex.comp_vector = 0;
-	cq_attr_ex.wc_flags = IBV_WC_EX_WITH_COMPLETION_TIMESTAMP;
-
-    DEBUG_LOG ("ibv_create_cq_ex(rdma_dev->context = %p, &cq_attr_ex)\n", rdma_dev->context);
-	rdma_dev->cq = ibv_create_cq_ex(rdma_dev->context, &cq_attr_ex);
-#else /*PRINT_LATENCY*/
-    DEBUG_LOG ("ibv_create_cq(%p, %d, NULL, NULL, 0)\n", rdma_dev->context, CQ_DEPTH);
-    rdma_dev->cq = ibv_create_cq(rdma_dev->context, CQ_DEPTH, NULL, NULL /*comp. events channel*/, 0);
-#endif /*PRINT_LATENCY*/
+    DEBUG_LOG ("ibv_create_cq(%p, %d, NULL, NULL, %d)\n", rdma_dev->context, CQ_DEPTH, rdma_dev->comp_vector);
+    rdma_dev->cq = ibv_create_cq(rdma_dev->context, CQ_DEPTH, NULL, NULL /*comp. events channel*/, rdma_dev->comp_vector);
     if (!rdma_dev->cq) {
         fprintf(stderr, "Couldn't create CQ\n");
         goto clean_pd;
     }
     DEBUG_LOG("created cq %p\n", rdma_dev->cq);
 
-    /* We don't create SRQ for DCI (server) side */
-
-    /* **********************************  Create QP  ********************************** */
-    struct ibv_qp_init_attr_ex attr_ex;
-    struct mlx5dv_qp_init_attr attr_dv;
-
-    memset(&attr_ex, 0, sizeof(attr_ex));
-    memset(&attr_dv, 0, sizeof(attr_dv));
-
+    /* **********************************  Create SRQ  ********************************** */
+    struct ibv_srq_init_attr srq_attr;
+    memset(&srq_attr, 0, sizeof(srq_attr));
+    srq_attr.attr.max_wr = NOTIFY_RECV_DEPTH;
+    srq_attr.attr.max_sge = 1;
+    DEBUG_LOG ("ibv_create_srq(%p, %d, NULL, NULL, 0)\n", rdma_dev->context, CQ_DEPTH);
+    rdma_dev->srq = ibv_create_srq(rdma_dev->pd, &srq_attr);
+    if (!rdma_dev->srq) {
+        fprintf(stderr, "ibv_create_srq failed\n");
+        goto clean_cq;
+    }
+    DEBUG_LOG("created srq %p\n", rdma_dev->srq);
+
+    /* **********************************  Create QP  ********************************** */
+    rdma_dev->transport = resolve_transport(rdma_dev);
+    if (rdma_dev->transport == RDMA_TRANSPORT_DC) {
+        ret_val = create_dct(rdma_dev);
+    } else {
+        ret_val = rc_listen(rdma_dev);
+    }
+    if (ret_val) {
+        goto clean_qp;
+    }
+
+    ret_val = post_notify_recvs(rdma_dev, NOTIFY_RECV_DEPTH);
+    if (ret_val) {
+        goto clean_qp;
+    }
+    
+    DEBUG_LOG("init AH cache\n");
+    kh_init_inplace(kh_ib_ah, &rdma_dev->ah_hash);
+    rdma_dev->ah_capacity = s_ah_cache_size;
+    rdma_dev->ah_entry = calloc(rdma_dev->ah_capacity, sizeof *rdma_dev->ah_entry);
+    if (!rdma_dev->ah_entry) {
+        fprintf(stderr, "AH cache memory allocation failed\n");
+        goto clean_qp;
+    }
+    pthread_spin_init(&rdma_dev->cq_lock, PTHREAD_PROCESS_PRIVATE);
+    pthread_mutex_init(&rdma_dev->ah_lock, NULL);
+
+    
+    return rdma_dev;
+
+clean_qp:
+    rc_stop_listen(rdma_dev);
+    destroy_qp(rdma_dev->qp);
+
+    if (rdma_dev->srq) {
+        ibv_destroy_srq(rdma_dev->srq);
+    }
+
+clean_cq:
+    if (rdma_dev->cq) {
+        ibv_destroy_cq(rdma_dev->cq);
+    }
+
+clean_pd:
+    if (rdma_dev->pd) {
+        ibv_dealloc_pd(rdma_dev->pd);
+    }
+
+clean_device:
+    close_ib_device(rdma_dev);
+    
+clean_rdma_dev:
+    free(rdma_dev);
+
+    return NULL;
+}
+
+/****************************************************************************************
+ * Create one DCI of the server's pool on the device's PD and CQ, and bring it to RTS.
+ * On failure, the caller destroys dci->qp if it was created.
+ * Return value: 0 - success, 1 - error
+ ****************************************************************************************/
+/*
+ * The server's CQ is created extended, with completion timestamps, when the
+ * device has an HCA clock, so latency sampling can be turned on at runtime.
+ * Everything but the sampled poll path uses it as a plain CQ.
+ */
+static void create_server_cq(struct rdma_device *rdma_dev, int cqe)
+{
+    struct ibv_device_attr_ex   device_attr_ex;
+    struct ibv_cq_init_attr_ex  cq_attr_ex;
+
+    memset(&device_attr_ex, 0, sizeof(device_attr_ex));
+    if (!ibv_query_device_ex(rdma_dev->context, NULL, &device_attr_ex) &&
+        device_attr_ex.hca_core_clock && device_attr_ex.completion_timestamp_mask) {
+        memset(&cq_attr_ex, 0, sizeof(cq_attr_ex));
+        cq_attr_ex.cqe = cqe;
+        cq_attr_ex.cq_context = rdma_dev;
+        cq_attr_ex.channel = NULL;
+        cq_attr_ex.comp_vector = rdma_dev->comp_vector;
+        cq_attr_ex.wc_flags = IBV_WC_EX_WITH_COMPLETION_TIMESTAMP;
+
+        DEBUG_LOG ("ibv_create_cq_ex(%p, %d, NULL, NULL, %d)\n", rdma_dev->context, cqe, rdma_dev->comp_vector);
+        rdma_dev->cq_ex = ibv_create_cq_ex(rdma_dev->context, &cq_attr_ex);
+        if (rdma_dev->cq_ex) {
+            rdma_dev->cq = ibv_cq_ex_to_cq(rdma_dev->cq_ex);
+            rdma_dev->hca_core_clock_kHz = device_attr_ex.hca_core_clock;
+            rdma_dev->ts_mask = device_attr_ex.completion_timestamp_mask;
+            DEBUG_LOG("hca_core_clock = %lu kHz\n", rdma_dev->hca_core_clock_kHz);
+            return;
+        }
+    }
+    DEBUG_LOG ("ibv_create_cq(%p, %d, NULL, NULL, %d), no completion timestamps\n",
+               rdma_dev->context, cqe, rdma_dev->comp_vector);
+    rdma_dev->cq = ibv_create_cq(rdma_dev->context, cqe, NULL, NULL /*comp. events channel*/, rdma_dev->comp_vector);
+}
+
+static int create_dci(struct rdma_device *rdma_dev, struct rdma_dci *dci)
+{
+    struct ibv_qp_init_attr_ex attr_ex;
+    struct mlx5dv_qp_init_attr attr_dv;
+
+    memset(&attr_ex, 0, sizeof(attr_ex));
+    memset(&attr_dv, 0, sizeof(attr_dv));
+
     attr_ex.qp_type = IBV_QPT_DRIVER;
-#ifdef PRINT_LATENCY
-    attr_ex.send_cq = ibv_cq_ex_to_cq(rdma_dev->cq);
-    attr_ex.recv_cq = ibv_cq_ex_to_cq(rdma_dev->cq);
-#else /*PRINT_LATENCY*/
     attr_ex.send_cq = rdma_dev->cq;
     attr_ex.recv_cq = rdma_dev->cq;
-#endif /*PRINT_LATENCY*/
 
     attr_ex.comp_mask |= IBV_QP_INIT_ATTR_PD;
     attr_ex.pd = rdma_dev->pd;
@@ -799,79 +1295,170 @@ struct rdma_device *rdma_open_device_server(struct sockaddr *addr)
     
     attr_ex.cap.max_send_wr  = SEND_Q_DEPTH;
     attr_ex.cap.max_send_sge = MAX_SEND_SGE;
-    rdma_dev->qp_available_wr = SEND_Q_DEPTH;
+    dci->qp_available_wr = SEND_Q_DEPTH;
 
     attr_ex.comp_mask |= IBV_QP_INIT_ATTR_SEND_OPS_FLAGS;
-    attr_ex.send_ops_flags = IBV_QP_EX_WITH_RDMA_WRITE | IBV_QP_EX_WITH_RDMA_READ;
+    attr_ex.send_ops_flags = IBV_QP_EX_WITH_RDMA_WRITE | IBV_QP_EX_WITH_RDMA_WRITE_WITH_IMM | IBV_QP_EX_WITH_RDMA_READ;
 
     attr_dv.comp_mask |= MLX5DV_QP_INIT_ATTR_MASK_QP_CREATE_FLAGS;
     attr_dv.create_flags |= MLX5DV_QP_CREATE_DISABLE_SCATTER_TO_CQE; /*driver doesnt support scatter2cqe data-path on DCI yet*/
     
     DEBUG_LOG ("mlx5dv_create_qp(%p)\n", rdma_dev->context);
-    rdma_dev->qp = mlx5dv_create_qp(rdma_dev->context, &attr_ex, &attr_dv);
-    DEBUG_LOG ("mlx5dv_create_qp %p completed: qp_num = 0x%lx\n", rdma_dev->qp, rdma_dev->qp->qp_num);
-
-    if (!rdma_dev->qp)  {
+    dci->qp = mlx5dv_create_qp(rdma_dev->context, &attr_ex, &attr_dv);
+    if (!dci->qp)  {
         fprintf(stderr, "Couldn't create QP\n");
-        goto clean_cq;
+        return 1;
     }
-    rdma_dev->qpex = ibv_qp_to_qp_ex(rdma_dev->qp);
-    if (!rdma_dev->qpex)  {
+    DEBUG_LOG ("mlx5dv_create_qp %p completed: qp_num = 0x%lx\n", dci->qp, dci->qp->qp_num);
+
+    dci->qpex = ibv_qp_to_qp_ex(dci->qp);
+    if (!dci->qpex)  {
         fprintf(stderr, "Couldn't create QPEX\n");
-        goto clean_qp;
+        return 1;
     }
-    rdma_dev->mqpex = mlx5dv_qp_ex_from_ibv_qp_ex(rdma_dev->qpex);
-    if (!rdma_dev->mqpex)  {
+    dci->mqpex = mlx5dv_qp_ex_from_ibv_qp_ex(dci->qpex);
+    if (!dci->mqpex)  {
         fprintf(stderr, "Couldn't create MQPEX\n");
-        goto clean_qp;
+        return 1;
     }
-    ret_val = modify_source_qp_rst2rts(rdma_dev);
-    if (ret_val) {
-        goto clean_qp;
+    if (modify_source_qp_rst2rts(rdma_dev, dci)) {
+        return 1;
     }
+    pthread_spin_init(&dci->sq_lock, PTHREAD_PROCESS_PRIVATE);
 
-    DEBUG_LOG("init AH cache\n");
-    kh_init_inplace(kh_ib_ah, &rdma_dev->ah_hash);
-    
-#ifdef PRINT_LATENCY
-    struct ibv_device_attr_ex           device_attr_ex = {};
-    //struct ibv_query_device_ex_input    query_device_ex_input = {
-    //    .comp_masc = ...
-    //}
+    return 0;
+}
+
+
+//============================================================================================
+struct rdma_device *rdma_open_device_server(struct sockaddr *addr)
+{
+    struct rdma_device *rdma_dev;
+    int                 i, ret_val;
+
+    rdma_dev = calloc(1, sizeof *rdma_dev);
+    if (!rdma_dev) {
+        fprintf(stderr, "rdma_device memory allocation failed\n");
+        return NULL;
+    }
+
+    /****************************************************************************************************
+     * In the next function we let rdma_cm find a IB device that matches the IP address of a the local netdev,
+     * if yes, we return a pointer to that ib context
+     * The result of this function is ib_dev - initialized pointer to the relevant struct ibv_device
+     ****************************************************************************************************/
+    rdma_dev->context = open_ib_device_by_addr(rdma_dev, addr);
+    if (!rdma_dev->context){
+        goto clean_rdma_dev;
+    }
+    rdma_dev->transport = resolve_transport(rdma_dev);
     
-    ret_val = ibv_query_device_ex(rdma_dev->context, /*struct ibv_query_device_ex_input*/NULL, &device_attr_ex);
+    ret_val = rdma_set_lid_gid_from_port_info(rdma_dev);
     if (ret_val) {
-        fprintf(stderr, "ibv_query_device_ex failed\n");
-        goto clean_qp;
+        goto clean_device;
     }
-    if (!device_attr_ex.hca_core_clock) {
-        fprintf(stderr, "hca_core_clock = 0\n");
+
+    rdma_dev->comp_vector = s_comp_vector;
+    rdma_dev->poller_cpu  = s_poller_cpu;
+    nic_resolve_affinity(rdma_dev->context, &rdma_dev->comp_vector, &rdma_dev->poller_cpu);
+    rdma_dev->num_dcis    = s_num_dcis;
+    rdma_dev->dci_policy  = s_dci_policy;
+
+    /****************************************************************************************************/
+
+    DEBUG_LOG ("ibv_alloc_pd(ibv_context = %p)\n", rdma_dev->context);
+    rdma_dev->pd = ibv_alloc_pd(rdma_dev->context);
+    if (!rdma_dev->pd) {
+        fprintf(stderr, "Couldn't allocate PD\n");
+        goto clean_device;
+    }
+    DEBUG_LOG("created pd %p\n", rdma_dev->pd);
+
+    /* We don't create completion events channel (ibv_create_comp_channel), we prefer working in polling mode */
+    
+    /* **********************************  Create CQ  ********************************** */
+    if (rdma_dev->transport == RDMA_TRANSPORT_RC) {
+        /* the slots of the DCI pool hold the RC connections instead */
+        rdma_dev->num_dcis     = s_max_rc_peers;
+        rdma_dev->rc_rd_atomic = rc_max_rd_atomic(rdma_dev);
+        pthread_mutex_init(&rdma_dev->rc_lock, NULL);
+        rdma_dev->rc_channel = rdma_create_event_channel();
+        if (!rdma_dev->rc_channel) {
+            perror("rdma_create_event_channel");
+            goto clean_pd;
+        }
+    }
+
+    /* shared by the DCIs, each may have a full send queue of signaled WRs */
+    int cq_depth = CQ_DEPTH * rdma_dev->num_dcis;
+    rdma_dev->cq_depth = cq_depth;
+    create_server_cq(rdma_dev, cq_depth);
+    if (!rdma_dev->cq) {
+        fprintf(stderr, "Couldn't create CQ\n");
+        goto clean_pd;
+    }
+    DEBUG_LOG("created cq %p\n", rdma_dev->cq);
+
+    /* We don't create SRQ for DCI (server) side */
+
+    /* **********************************  Create DCI pool  ********************************** */
+    rdma_dev->dci = calloc(rdma_dev->num_dcis, sizeof *rdma_dev->dci);
+    rdma_dev->stash = calloc(rdma_dev->num_dcis * SEND_Q_DEPTH, sizeof *rdma_dev->stash);
+    if (!rdma_dev->dci || !rdma_dev->stash) {
+        fprintf(stderr, "DCI pool memory allocation failed\n");
         goto clean_qp;
     }
+    for (i = 0; i < rdma_dev->num_dcis; i++) {
+        if (rdma_dev->transport == RDMA_TRANSPORT_RC) {
+            /* connected on the first import from a peer */
+            pthread_spin_init(&rdma_dev->dci[i].sq_lock, PTHREAD_PROCESS_PRIVATE);
+        } else if (create_dci(rdma_dev, &rdma_dev->dci[i])) {
+            goto clean_qp;
+        }
+    }
 
-    rdma_dev->hca_core_clock_kHz = device_attr_ex.hca_core_clock;
-    DEBUG_LOG("hca_core_clock = %d kHz\n", rdma_dev->hca_core_clock_kHz);
+    DEBUG_LOG("init AH cache\n");
+    kh_init_inplace(kh_ib_ah, &rdma_dev->ah_hash);
+    rdma_dev->ah_capacity = s_ah_cache_size;
+    rdma_dev->ah_entry = calloc(rdma_dev->ah_capacity, sizeof *rdma_dev->ah_entry);
+    if (!rdma_dev->ah_entry) {
+        fprintf(stderr, "AH cache memory allocation failed\n");
+        goto clean_qp;
+    }
+    pthread_spin_init(&rdma_dev->cq_lock, PTHREAD_PROCESS_PRIVATE);
+    pthread_mutex_init(&rdma_dev->ah_lock, NULL);
+    lat_hist_init(&rdma_dev->lat_submit_to_cqe);
+    lat_hist_init(&rdma_dev->lat_cqe_to_poll);
 
-    rdma_dev->min_wr_complete_latency = 0x8FFFFFFFFFFFFFFF;
-    rdma_dev->min_completion_latency = 0x8FFFFFFFFFFFFFFF;
-    rdma_dev->min_read_comp_latency = 0x8FFFFFFFFFFFFFFF;
-#endif /*PRINT_LATENCY*/
+    if (rdma_device_set_poll_batch(rdma_dev, COMP_ARRAY_SIZE)) {
+        goto clean_ah_cache;
+    }
+    
     
     return rdma_dev;
 
+clean_ah_cache:
+    free(rdma_dev->ah_entry);
+    pthread_spin_destroy(&rdma_dev->cq_lock);
+    pthread_mutex_destroy(&rdma_dev->ah_lock);
+
 clean_qp:
-    destroy_qp(rdma_dev->qp);
+    for (i = 0; rdma_dev->dci && i < rdma_dev->num_dcis; i++) {
+        destroy_qp(rdma_dev->dci[i].qp);
+    }
+    free(rdma_dev->dci);
+    free(rdma_dev->stash);
+    free(rdma_dev->wc);
+    free(rdma_dev->batch_events);
 
-clean_cq:
     if (rdma_dev->cq) {
-#ifdef PRINT_LATENCY
-        ibv_destroy_cq(ibv_cq_ex_to_cq(rdma_dev->cq));
-#else /*PRINT_LATENCY*/
         ibv_destroy_cq(rdma_dev->cq);
-#endif /*PRINT_LATENCY*/
     }
 
 clean_pd:
+    if (rdma_dev->rc_channel) {
+        rdma_destroy_event_channel(rdma_dev->rc_channel);
+    }
     if (rdma_dev->pd) {
         ibv_dealloc_pd(rdma_dev->pd);
     }
@@ -885,55 +1472,135 @@ clean_rdma_dev:
     return NULL;
 }
 
+//============================================================================================
+void rdma_set_affinity(int comp_vector, int cpu)
+{
+    s_comp_vector = comp_vector;
+    s_poller_cpu  = cpu;
+}
+
+//============================================================================================
+void rdma_set_dci_pool(int num_dcis, enum rdma_dci_policy policy)
+{
+    s_num_dcis   = num_dcis < 1 ? 1 : num_dcis > MAX_DCIS ? MAX_DCIS : num_dcis;
+    s_dci_policy = policy;
+}
+
+//============================================================================================
+void rdma_set_transport(enum rdma_transport transport, int max_rc_peers)
+{
+    s_transport    = transport;
+    s_max_rc_peers = max_rc_peers < 1 ? RC_MAX_PEERS_DEFAULT : max_rc_peers > MAX_DCIS ? MAX_DCIS : max_rc_peers;
+}
+
+//============================================================================================
+void rdma_set_ah_cache_size(int max_ahs)
+{
+    s_ah_cache_size = max_ahs < 1 ? AH_CACHE_DEFAULT_SIZE : max_ahs;
+}
+
+void rdma_device_get_ah_cache_stats(struct rdma_device *rdma_dev, struct rdma_ah_cache_stats *stats)
+{
+    pthread_mutex_lock(&rdma_dev->ah_lock);
+    *stats          = rdma_dev->ah_stats;
+    stats->entries  = kh_size(&rdma_dev->ah_hash);
+    stats->capacity = rdma_dev->ah_capacity;
+    pthread_mutex_unlock(&rdma_dev->ah_lock);
+}
+
+//============================================================================================
+int rdma_device_pin_thread(struct rdma_device *device)
+{
+    return nic_pin_thread(pthread_self(), device->poller_cpu);
+}
+
 //===========================================================================================
+/* DC names the target on every WR, an RC QP is connected to it already */
+static inline
+void wr_set_dest(struct rdma_exec_params *exec_params)
+{
+	if (exec_params->dci->mqpex) {
+		mlx5dv_wr_set_dc_addr(exec_params->dci->mqpex, exec_params->ah, exec_params->rem_dctn, DC_KEY);
+	}
+}
+
+//===========================================================================================
+/* A zero-length write-with-imm behind a READ. The fence holds it until the READ's data is back */
+static
+void post_read_notify(struct rdma_exec_params *exec_params)
+{
+	exec_params->dci->qpex->wr_flags = IBV_SEND_SIGNALED | IBV_SEND_FENCE;
+
+	DEBUG_LOG_FAST_PATH("RDMA Read notify: ibv_wr_rdma_write_imm: qpex=%p, notify_data=0x%x\n",
+			exec_params->dci->qpex, exec_params->notify_data);
+	ibv_wr_rdma_write_imm(exec_params->dci->qpex, exec_params->rem_buf_rkey, exec_params->rem_buf_addr,
+			      htonl(exec_params->notify_data));
+	ibv_wr_set_sge_list(exec_params->dci->qpex, 0, NULL);
+	wr_set_dest(exec_params);
+}
+
+//===========================================================================================
+/* the HCA's free running clock, in its cycles; 0 if it can't be read */
+static inline uint64_t read_hca_clock(struct rdma_device *rdma_dev)
+{
+	struct ibv_values_ex ts_values = {
+		.comp_mask = IBV_VALUES_MASK_RAW_CLOCK,
+		.raw_clock = {} /*struct timespec*/
+	};
+
+	if (ibv_query_rt_values_ex(rdma_dev->context, &ts_values)) {
+		return 0;
+	}
+	return ts_values.raw_clock.tv_nsec; /*the value in hca clocks*/
+}
+
+/* called with exec_params->dci->sq_lock held */
 static
-int rdma_exec_task(struct rdma_exec_params *exec_params) 
+int post_task(struct rdma_exec_params *exec_params) 
 {
 	int ret_val;
+	int is_read = exec_params->flags & RDMA_TASK_ATTR_RDMA_READ;
+	int notify = exec_params->flags & RDMA_TASK_ATTR_NOTIFY;
 	int required_wr = (exec_params->local_buf_iovcnt) ? (exec_params->local_buf_iovcnt + MAX_SEND_SGE - 1) / MAX_SEND_SGE : 1;
-	if (required_wr > exec_params->device->qp_available_wr) {
-		fprintf(stderr, "Required WR number %d is greater than available in QP WRs %d\n", 
-				required_wr, exec_params->device->qp_available_wr);
-		return 1;
+
+	if (notify && is_read) {
+		required_wr++;
+	}
+	if (required_wr > __atomic_load_n(&exec_params->dci->qp_available_wr, __ATOMIC_ACQUIRE)) {
+		/* not an error for a caller keeping the queue full, it polls and retries */
+		DEBUG_LOG_FAST_PATH("Required WR number %d is greater than available in QP WRs %d\n", 
+				required_wr, exec_params->dci->qp_available_wr);
+		return ENOSPC;
 	}
 	void (*ibv_wr_rdma_rw_post)(struct ibv_qp_ex *qp, uint32_t rkey, uint64_t remote_addr) = (exec_params->flags & RDMA_TASK_ATTR_RDMA_READ) 
 		? ibv_wr_rdma_read // client wants to send data to the server
 		: ibv_wr_rdma_write; // client wants to receive data from the server
 
 	/* RDMA Read/Write for DCI connect, this will create cqe->ts_start */
-	DEBUG_LOG_FAST_PATH("RDMA Read/Write: ibv_wr_start: qpex = %p\n", exec_params->device->qpex);
-	ibv_wr_start(exec_params->device->qpex);
-#ifdef PRINT_LATENCY
-	struct ibv_values_ex ts_values = {
-		.comp_mask = IBV_VALUES_MASK_RAW_CLOCK,
-		.raw_clock = {} /*struct timespec*/
-	};
-
-	ret_val = ibv_query_rt_values_ex(exec_params->device->context, &ts_values);
-	if (ret_val) {
-		fprintf(stderr, "ibv_query_rt_values_ex failed after ibv_wr_start call\n");
-		return 1;
-	}
-#endif /*PRINT_LATENCY*/
+	DEBUG_LOG_FAST_PATH("RDMA Read/Write: ibv_wr_start: qpex = %p\n", exec_params->dci->qpex);
+	ibv_wr_start(exec_params->dci->qpex);
 
-	// The following code should be atomic operation
-	int wr_id_idx = exec_params->device->app_wr_id_idx++;
-	if (exec_params->device->app_wr_id_idx >= SEND_Q_DEPTH) {
-		exec_params->device->app_wr_id_idx = 0;
+	int wr_id_idx = exec_params->dci->app_wr_id_idx++;
+	if (exec_params->dci->app_wr_id_idx >= SEND_Q_DEPTH) {
+		exec_params->dci->app_wr_id_idx = 0;
 	}
-	// end of atomic operation
 
-#ifdef PRINT_LATENCY
-	exec_params->device->latency[wr_id_idx].wr_start_ts = ts_values.raw_clock.tv_nsec; /*the value in hca clocks*/
-#endif /*PRINT_LATENCY*/
 
 	// update internal wr_id DB
-	exec_params->device->qp_available_wr -= required_wr;
-	exec_params->device->app_wr_id[wr_id_idx].num_wrs = required_wr;
-	exec_params->device->app_wr_id[wr_id_idx].wr_id = exec_params->wr_id;
-	exec_params->device->app_wr_id[wr_id_idx].flags = WR_ID_FLAGS_ACTIVE;
+	__atomic_sub_fetch(&exec_params->dci->qp_available_wr, required_wr, __ATOMIC_RELAXED);
+	exec_params->dci->app_wr_id[wr_id_idx].num_wrs = required_wr;
+	exec_params->dci->app_wr_id[wr_id_idx].wr_id = exec_params->wr_id;
+	exec_params->dci->app_wr_id[wr_id_idx].flags = WR_ID_FLAGS_ACTIVE;
+	uint32_t lat_every = __atomic_load_n(&exec_params->device->lat_every, __ATOMIC_RELAXED);
+	if (lat_every && ++exec_params->dci->lat_cnt >= lat_every) {
+		exec_params->dci->lat_cnt = 0;
+		exec_params->dci->app_wr_id[wr_id_idx].start_ts = read_hca_clock(exec_params->device);
+		if (exec_params->dci->app_wr_id[wr_id_idx].start_ts) {
+			exec_params->dci->app_wr_id[wr_id_idx].flags |= WR_ID_FLAGS_SAMPLED;
+		}
+	}
 
-	exec_params->device->qpex->wr_id = (uint64_t)wr_id_idx;
+	exec_params->dci->qpex->wr_id = (uint64_t)(exec_params->dci - exec_params->device->dci) * SEND_Q_DEPTH + wr_id_idx;
 
 	if (exec_params->local_buf_iovcnt) {
 		int i, start_i = 0;
@@ -943,12 +1610,19 @@ int rdma_exec_task(struct rdma_exec_params *exec_params)
 
 		while (num_sges_to_send > 0) {
 			int curr_iovcnt = mmin(MAX_SEND_SGE, num_sges_to_send);
-			exec_params->device->qpex->wr_flags = num_sges_to_send > MAX_SEND_SGE ? 0 : IBV_SEND_SIGNALED;
+			int last = num_sges_to_send <= MAX_SEND_SGE;
+			exec_params->dci->qpex->wr_flags = (last && !(notify && is_read)) ? IBV_SEND_SIGNALED : 0;
 
 			DEBUG_LOG_FAST_PATH("RDMA Read/Write: ibv_wr_rdma_%s: wr_id=0x%llx, qpex=%p, rkey=0x%lx, remote_buf=0x%llx\n",
 					exec_params->flags & RDMA_TASK_ATTR_RDMA_READ ? "read" : "write",
-					(long long unsigned int)exec_params->wr_id, exec_params->device->qpex, exec_params->rem_buf_rkey, (long long unsigned int)curr_rem_addr);
-			ibv_wr_rdma_rw_post(exec_params->device->qpex, exec_params->rem_buf_rkey, curr_rem_addr);
+					(long long unsigned int)exec_params->wr_id, exec_params->dci->qpex, exec_params->rem_buf_rkey, (long long unsigned int)curr_rem_addr);
+			if (last && notify && !is_read) {
+				/* the last chunk carries the notification, the writes before it land first */
+				ibv_wr_rdma_write_imm(exec_params->dci->qpex, exec_params->rem_buf_rkey, curr_rem_addr,
+						      htonl(exec_params->notify_data));
+			} else {
+				ibv_wr_rdma_rw_post(exec_params->dci->qpex, exec_params->rem_buf_rkey, curr_rem_addr);
+			}
 		
 			for (i = 0; i < curr_iovcnt; i++) {
 				sg_list[i].addr   = (uint64_t)exec_params->local_buf_iovec[start_i + i].iov_base;
@@ -958,70 +1632,220 @@ int rdma_exec_task(struct rdma_exec_params *exec_params)
 			}
 		
 			DEBUG_LOG_FAST_PATH("RDMA Read/Write: ibv_wr_set_sge_list(qpex=%p, num_sge=%lu, sg_list=%p), start_i=%d, num_sges_to_send=%d, sg[0].length=%u\n",
-				exec_params->device->qpex, (size_t)curr_iovcnt, (void*)sg_list, start_i, num_sges_to_send, sg_list[0].length);
-			ibv_wr_set_sge_list(exec_params->device->qpex, (size_t)curr_iovcnt, sg_list);
+				exec_params->dci->qpex, (size_t)curr_iovcnt, (void*)sg_list, start_i, num_sges_to_send, sg_list[0].length);
+			ibv_wr_set_sge_list(exec_params->dci->qpex, (size_t)curr_iovcnt, sg_list);
 			num_sges_to_send -= curr_iovcnt;
 			start_i += curr_iovcnt;
 
 
 			DEBUG_LOG_FAST_PATH("RDMA Read/Write: mlx5dv_wr_set_dc_addr: mqpex=%p, ah=%p, rem_dctn=0x%06lx\n",
-				exec_params->device->mqpex, exec_params->ah, exec_params->rem_dctn);
-			mlx5dv_wr_set_dc_addr(exec_params->device->mqpex, exec_params->ah, exec_params->rem_dctn, DC_KEY);
+				exec_params->dci->mqpex, exec_params->ah, exec_params->rem_dctn);
+			wr_set_dest(exec_params);
 		}
 	} else {
-		exec_params->device->qpex->wr_flags = IBV_SEND_SIGNALED;
+		exec_params->dci->qpex->wr_flags = (notify && is_read) ? 0 : IBV_SEND_SIGNALED;
 
 		DEBUG_LOG_FAST_PATH("RDMA Read/Write: ibv_wr_rdma_%s: wr_id=0x%llx, qpex=%p, rkey=0x%lx, remote_buf=0x%llx\n",
 				exec_params->flags & RDMA_TASK_ATTR_RDMA_READ ? "read" : "write",
-				(long long unsigned int)exec_params->wr_id, exec_params->device->qpex, exec_params->rem_buf_rkey, (unsigned long long)exec_params->rem_buf_addr);
+				(long long unsigned int)exec_params->wr_id, exec_params->dci->qpex, exec_params->rem_buf_rkey, (unsigned long long)exec_params->rem_buf_addr);
 
-		ibv_wr_rdma_rw_post(exec_params->device->qpex, exec_params->rem_buf_rkey, exec_params->rem_buf_addr);
+		if (notify && !is_read) {
+			ibv_wr_rdma_write_imm(exec_params->dci->qpex, exec_params->rem_buf_rkey, exec_params->rem_buf_addr,
+					      htonl(exec_params->notify_data));
+		} else {
+			ibv_wr_rdma_rw_post(exec_params->dci->qpex, exec_params->rem_buf_rkey, exec_params->rem_buf_addr);
+		}
 		
 		DEBUG_LOG_FAST_PATH("RDMA Read/Write: ibv_wr_set_sge: qpex=%p, lkey=0x%x, local_buf=0x%llx, size=%u\n",
-				exec_params->device->qpex, exec_params->local_buf_mr_lkey,
+				exec_params->dci->qpex, exec_params->local_buf_mr_lkey,
 				(unsigned long long)exec_params->local_buf_addr, exec_params->rem_buf_size);
-		ibv_wr_set_sge(exec_params->device->qpex, exec_params->local_buf_mr_lkey, (uintptr_t)exec_params->local_buf_addr, exec_params->rem_buf_size);
+		ibv_wr_set_sge(exec_params->dci->qpex, exec_params->local_buf_mr_lkey, (uintptr_t)exec_params->local_buf_addr, exec_params->rem_buf_size);
 
 		DEBUG_LOG_FAST_PATH("RDMA Read/Write: mlx5dv_wr_set_dc_addr: mqpex=%p, ah=%p, rem_dctn=0x%06lx\n",
-				exec_params->device->mqpex, exec_params->ah, exec_params->rem_dctn);
-		mlx5dv_wr_set_dc_addr(exec_params->device->mqpex, exec_params->ah, exec_params->rem_dctn, DC_KEY);
+				exec_params->dci->mqpex, exec_params->ah, exec_params->rem_dctn);
+		wr_set_dest(exec_params);
+	}
+
+	if (notify && is_read) {
+		post_read_notify(exec_params);
 	}
 
 	/* ring DB */
-	DEBUG_LOG_FAST_PATH("ibv_wr_complete: qpex=%p, required_wr=%d\n", exec_params->device->qpex, required_wr);
-	ret_val = ibv_wr_complete(exec_params->device->qpex);
+	DEBUG_LOG_FAST_PATH("ibv_wr_complete: qpex=%p, required_wr=%d\n", exec_params->dci->qpex, required_wr);
+	ret_val = ibv_wr_complete(exec_params->dci->qpex);
 	if (ret_val) {
 		DEBUG_LOG_FAST_PATH("FAILURE: ibv_wr_complete (error=%d\n", ret_val);
 		return ret_val;
 	}
- #ifdef PRINT_LATENCY
-	ret_val = ibv_query_rt_values_ex(exec_params->device->context, &ts_values);
-	if (ret_val) {
-		fprintf(stderr, "ibv_query_rt_values_ex failed after ibv_wr_start call\n");
-		return 1;
+	return ret_val;
+}
+
+/*
+ * Pick the DCI for a target: by the DCT number, so a target's tasks stay in order
+ * on one DCI, the submitting thread's own one, or the one with the most free WRs.
+ * DCIs in error are skipped, the hash (or the thread) moves to the next healthy one.
+ * Returns NULL if every DCI is in error.
+ */
+static
+struct rdma_dci *select_dci(struct rdma_device *device, unsigned long rem_dctn)
+{
+	struct rdma_dci *dci, *best = NULL;
+	int i, n = device->num_dcis;
+
+	if (device->dci_policy == RDMA_DCI_POLICY_PER_THREAD) {
+		if (t_dci_dev != device) {
+			t_dci_dev = device;
+			t_dci_idx = __atomic_fetch_add(&device->next_thread_dci, 1, __ATOMIC_RELAXED) % n;
+		}
+		rem_dctn = t_dci_idx;
+	}
+	if (device->dci_policy != RDMA_DCI_POLICY_LEAST_LOADED) {
+		for (i = 0; i < n; i++) {
+			dci = &device->dci[(rem_dctn + i) % n];
+			if (!__atomic_load_n(&dci->in_error, __ATOMIC_RELAXED)) {
+				return dci;
+			}
+		}
+		return NULL;
+	}
+	for (i = 0; i < n; i++) {
+		dci = &device->dci[i];
+		if (__atomic_load_n(&dci->in_error, __ATOMIC_RELAXED)) {
+			continue;
+		}
+		if (!best || __atomic_load_n(&dci->qp_available_wr, __ATOMIC_RELAXED) >
+			     __atomic_load_n(&best->qp_available_wr, __ATOMIC_RELAXED)) {
+			best = dci;
+		}
+	}
+	return best;
+}
+
+static
+int rdma_exec_task(struct rdma_exec_params *exec_params)
+{
+	int ret_val;
+
+	if (exec_params->device->transport == RDMA_TRANSPORT_RC) {
+		/* the remote buffer's own connection, there is no other way to its peer */
+		if (!__atomic_load_n(&exec_params->dci->qp, __ATOMIC_ACQUIRE) &&
+		    rc_reconnect(exec_params->device, exec_params->dci)) {
+			return EIO;
+		}
+		pthread_spin_lock(&exec_params->dci->sq_lock);
+		ret_val = exec_params->dci->in_error || !exec_params->dci->qp ? EIO : post_task(exec_params);
+		pthread_spin_unlock(&exec_params->dci->sq_lock);
+		return ret_val;
 	}
-	exec_params->device->latency[wr_id_idx].wr_complete_ts = ts_values.raw_clock.tv_nsec; /*the value in hca clocks*/
-#endif /*PRINT_LATENCY*/
+	do {
+		exec_params->dci = select_dci(exec_params->device, exec_params->rem_dctn);
+		if (!exec_params->dci) {
+			DEBUG_LOG_FAST_PATH("All %d DCIs are in error, reset the device\n", exec_params->device->num_dcis);
+			return EIO;
+		}
+		pthread_spin_lock(&exec_params->dci->sq_lock);
+		/* it may have failed since it was selected */
+		ret_val = exec_params->dci->in_error ? EAGAIN : post_task(exec_params);
+		pthread_spin_unlock(&exec_params->dci->sq_lock);
+	} while (ret_val == EAGAIN);
+
 	return ret_val;
 }
 //===========================================================================================
 
-int rdma_reset_device(struct rdma_device *device)
+static int poll_completions(struct rdma_device *rdma_dev, struct rdma_completion_event *event,
+                            uint32_t num_entries, struct rdma_dci *only);
+static void ah_cache_put(struct rdma_device *rdma_dev, int ah_idx);
+
+/* the DCI is about to get all its WRs back: its stashed events keep their place, not their WRs */
+static void stash_forget_wrs(struct rdma_device *device, struct rdma_dci *dci)
 {
-	if (!is_server(device)) {
-		fprintf(stderr, "Method \"rdma_reset_device()\" could be executed only by server side!\n");
-		return EOPNOTSUPP;
+	int i;
+
+	pthread_spin_lock(&device->cq_lock);
+	for (i = 0; i < device->stash_cnt; i++) {
+		if (device->stash[i].dci == dci) {
+			device->stash[i].num_wrs = 0;
+		}
 	}
+	pthread_spin_unlock(&device->cq_lock);
+}
+
+/*
+ * Without a flush marker: the DCI is in error, so every WR outstanding on it
+ * completes with a flush. Poll its own completions until all its WRs are back,
+ * counting those of its events still in the stash.
+ */
+static void drain_dci(struct rdma_device *device, struct rdma_dci *dci)
+{
+	struct rdma_completion_event rdma_comp_ev[COMP_ARRAY_SIZE];
+	int i, stashed_wrs;
+
+	pthread_spin_lock(&device->cq_lock);
+	do {
+		poll_completions(device, rdma_comp_ev, COMP_ARRAY_SIZE, dci);
+		for (i = 0, stashed_wrs = 0; i < device->stash_cnt; i++) {
+			if (device->stash[i].dci == dci) {
+				stashed_wrs += device->stash[i].num_wrs;
+			}
+		}
+	} while (__atomic_load_n(&dci->qp_available_wr, __ATOMIC_ACQUIRE) + stashed_wrs < SEND_Q_DEPTH);
+	pthread_spin_unlock(&device->cq_lock);
+}
+
+/*
+ * Move the DCI to error, flush its outstanding WRs and take it back to RTS. The
+ * flush is over when a marker posted behind them completes, or, when there is
+ * no room or no AH for one, once all the DCI's WRs are back. Only
+ * its own completions are dropped, the other DCIs' go to the stash for
+ * rdma_poll_completions(). It is marked in error meanwhile, so submitters use
+ * the other DCIs. An RC connection is flushed the same way and then dropped,
+ * the next task on it connects again.
+ */
+static int reset_dci(struct rdma_device *device, struct rdma_dci *dci)
+{
 	struct ibv_qp_attr      qp_attr;
 	enum ibv_qp_attr_mask   attr_mask;
+	int                     ret_val = 0;
+	int                     ah_idx;
+	struct ibv_ah          *ah = NULL;
 	memset(&qp_attr, 0, sizeof qp_attr);
-	
+
+	if (device->transport == RDMA_TRANSPORT_RC) {
+		/* the connection is the flush marker's destination, nothing to pick */
+		pthread_mutex_lock(&device->rc_lock);
+		if (!dci->qp) {
+			pthread_mutex_unlock(&device->rc_lock);
+			return 0;
+		}
+	} else {
+		/* any peer's AH will do to post the flush marker, pinned until it is posted */
+		pthread_mutex_lock(&device->ah_lock);
+		for (ah_idx = 0; ah_idx < device->ah_used && !device->ah_entry[ah_idx].ah; ah_idx++)
+			;
+		if (ah_idx < device->ah_used) {
+			ah = device->ah_entry[ah_idx].ah;
+			device->ah_entry[ah_idx].refcnt++;
+		}
+		pthread_mutex_unlock(&device->ah_lock);
+	}
+
+	pthread_spin_lock(&dci->sq_lock);
+	__atomic_store_n(&dci->in_error, 1, __ATOMIC_RELAXED);
+
 	/* - - - - - - - Modify QP to ERR - - - - - - - */
 	qp_attr.qp_state = IBV_QPS_ERR;
 	attr_mask = IBV_QP_STATE;
 	DEBUG_LOG("ibv_modify_qp(qp = %p, qp_attr.qp_state = %d, attr_mask = 0x%x)\n",
-                      device->qp, qp_attr.qp_state, attr_mask);
-	if (ibv_modify_qp(device->qp, &qp_attr, attr_mask)) {
+                      dci->qp, qp_attr.qp_state, attr_mask);
+	if (ibv_modify_qp(dci->qp, &qp_attr, attr_mask)) {
+		pthread_spin_unlock(&dci->sq_lock);
+		if (ah) {
+			ah_cache_put(device, ah_idx);
+		}
+		if (device->transport == RDMA_TRANSPORT_RC) {
+			pthread_mutex_unlock(&device->rc_lock);
+		}
 		fprintf(stderr, "Failed to modify QP to ERR\n");
 		return 1;
 	}
@@ -1029,87 +1853,135 @@ int rdma_reset_device(struct rdma_device *device)
 	/* - - - - - - - FLUSH WORK COMPLETIONS - - - - - - - */
 	struct rdma_exec_params exec_params;
 	memset(&exec_params, 0, sizeof exec_params);
-	khiter_t ah_itr = 0;
-	for (ah_itr = kh_begin(&device->ah_hash); ah_itr != kh_end(&device->ah_hash); ++ah_itr) {
-		if (kh_exist(&device->ah_hash, ah_itr) && kh_value(&device->ah_hash, ah_itr) != NULL) {
-			exec_params.ah = kh_value(&device->ah_hash, ah_itr);
-		}
-	}
-	if (exec_params.ah) {
+	exec_params.ah = ah;
+	if (exec_params.ah || !dci->mqpex) {
 		exec_params.wr_id = WR_ID_FLUSH_MARKER;
 		exec_params.device = device;
+		exec_params.dci = dci;
 
-		DEBUG_LOG_FAST_PATH("Posting FLUSH MARKER on queue\n");
-		rdma_exec_task(&exec_params);
+		DEBUG_LOG_FAST_PATH("Posting FLUSH MARKER on DCI %d\n", (int)(dci - device->dci));
+		ret_val = post_task(&exec_params);
+	}
+	pthread_spin_unlock(&dci->sq_lock);
+	if (ah) {
+		ah_cache_put(device, ah_idx); /* the WQE carries its own copy of the address */
+	}
 
+	if (!(exec_params.ah || !dci->mqpex) || ret_val) {
+		/* no marker: its slots would be cleared under CQEs still to come */
+		DEBUG_LOG_FAST_PATH("No flush marker on DCI %d (%d), draining it\n", (int)(dci - device->dci), ret_val);
+		drain_dci(device, dci);
+		ret_val = 0;
+	} else {
 		DEBUG_LOG_FAST_PATH("Flushing Work Completions\n");
 		struct rdma_completion_event rdma_comp_ev[COMP_ARRAY_SIZE];
 		int flushed = 0;
+
+		pthread_spin_lock(&device->cq_lock);
 		do {
-			int i, reported_ev = 0;
-			reported_ev = rdma_poll_completions(device, &rdma_comp_ev[reported_ev], COMP_ARRAY_SIZE);
+			int i, reported_ev;
+			reported_ev = poll_completions(device, rdma_comp_ev, COMP_ARRAY_SIZE, dci);
 			for (i = 0; !flushed && i < reported_ev; i++) {
 				flushed = rdma_comp_ev[i].wr_id == WR_ID_FLUSH_MARKER;
 			}
 		} while (!flushed);
+		pthread_spin_unlock(&device->cq_lock);
 		DEBUG_LOG_FAST_PATH("Finished Work Completions flushing\n");
 	}
+	stash_forget_wrs(device, dci);
+
+	if (device->transport == RDMA_TRANSPORT_RC) {
+		/* the peer's end went to error too: drop the connection, the next task reconnects */
+		rc_disconnect(device, dci);
+		pthread_mutex_unlock(&device->rc_lock);
+		return 0;
+	}
 
-	/* - - - - - - - RESET RDMA_DEVICE MEMBERS - - - - - - - */
-	memset(device->app_wr_id, 0, sizeof(device->app_wr_id));
-	device->app_wr_id_idx = 0;
-	device->qp_available_wr = SEND_Q_DEPTH;
+	pthread_spin_lock(&dci->sq_lock);
+	/* - - - - - - - RESET RDMA_DCI MEMBERS - - - - - - - */
+	memset(dci->app_wr_id, 0, sizeof(dci->app_wr_id));
+	dci->app_wr_id_idx = 0;
+	__atomic_store_n(&dci->qp_available_wr, SEND_Q_DEPTH, __ATOMIC_RELAXED);
 	/* - - - - - - - Modify QP to RESET - - - - - - - */
 	qp_attr.qp_state = IBV_QPS_RESET;
 	attr_mask = IBV_QP_STATE;
 	DEBUG_LOG("ibv_modify_qp(qp = %p, qp_attr.qp_state = %d, attr_mask = 0x%x)\n",
-                    device->qp, qp_attr.qp_state, attr_mask);
-	if (ibv_modify_qp(device->qp, &qp_attr, attr_mask)) {
+                    dci->qp, qp_attr.qp_state, attr_mask);
+	if (ibv_modify_qp(dci->qp, &qp_attr, attr_mask)) {
+		pthread_spin_unlock(&dci->sq_lock);
 		fprintf(stderr, "Failed to modify QP to RESET\n");
 		return 1;
 	}
-	DEBUG_LOG ("ibv_modify_qp to state %d completed.\n", qp_attr.qp_state, device->qp->qp_num);
+	DEBUG_LOG ("ibv_modify_qp to state %d completed: qp_num = 0x%x\n", qp_attr.qp_state, dci->qp->qp_num);
 
 	/* - - - - - - - Modify QP to RTS (RESET->INIT->RTR->RTS) - - - - - - - */
-	return modify_source_qp_rst2rts(device);
+	ret_val = modify_source_qp_rst2rts(device, dci);
+	if (!ret_val) {
+		__atomic_store_n(&dci->in_error, 0, __ATOMIC_RELAXED);
+	}
+	pthread_spin_unlock(&dci->sq_lock);
+
+	return ret_val;
+}
+
+int rdma_reset_device(struct rdma_device *device)
+{
+	int i, failed = 0, ret_val = 0;
+
+	if (!is_server(device)) {
+		fprintf(stderr, "Method \"rdma_reset_device()\" could be executed only by server side!\n");
+		return EOPNOTSUPP;
+	}
+	for (i = 0; i < device->num_dcis; i++) {
+		failed += __atomic_load_n(&device->dci[i].in_error, __ATOMIC_RELAXED);
+	}
+	if (!failed && device->transport == RDMA_TRANSPORT_RC) {
+		return 0; /* the connections are healthy, or dropped and reconnected on their next task */
+	}
+	/* only the DCIs which reported an error, all of them if none did */
+	for (i = 0; i < device->num_dcis; i++) {
+		if (!failed || __atomic_load_n(&device->dci[i].in_error, __ATOMIC_RELAXED)) {
+			DEBUG_LOG("Resetting DCI %d\n", i);
+			ret_val |= reset_dci(device, &device->dci[i]);
+		}
+	}
+	return ret_val;
 }
 
 //============================================================================================
 void rdma_close_device(struct rdma_device *rdma_dev)
 {
-    int ret_val;
-    struct ibv_ah *ah;
+    int i, ret_val;
 
     if (rdma_dev->rdma_buff_cnt > 0) {
         fprintf(stderr, "The number of attached RDMA buffers is not zero (%d). Can't close device.\n",
                 rdma_dev->rdma_buff_cnt);
         return;
     }
-#ifdef PRINT_LATENCY
-    if (rdma_dev->measure_index) {
-        DEBUG_LOG("PRINT_LATENCY: %6lu wr-s, wr_sent latency: min %8lu, max %8lu, avg %8lu (nSec)\n",
-                  rdma_dev->measure_index,
-                  rdma_dev->min_wr_complete_latency * 1000000 / rdma_dev->hca_core_clock_kHz,
-                  rdma_dev->max_wr_complete_latency * 1000000 / rdma_dev->hca_core_clock_kHz,
-                  rdma_dev->wr_complete_latency_sum / rdma_dev->measure_index * 1000000 / rdma_dev->hca_core_clock_kHz);
-
-        DEBUG_LOG("PRINT_LATENCY:   completion latency        : min %8lu, max %8lu, avg %8lu (nSec)\n",
-                  rdma_dev->min_completion_latency * 1000000 / rdma_dev->hca_core_clock_kHz,
-                  rdma_dev->max_completion_latency * 1000000 / rdma_dev->hca_core_clock_kHz,
-                  rdma_dev->completion_latency_sum / rdma_dev->measure_index * 1000000 / rdma_dev->hca_core_clock_kHz);
-
-        DEBUG_LOG("PRINT_LATENCY:   read_comp latency         : min %8lu, max %8lu, avg %8lu (nSec)\n",
-                  rdma_dev->min_read_comp_latency * 1000000 / rdma_dev->hca_core_clock_kHz,
-                  rdma_dev->max_read_comp_latency * 1000000 / rdma_dev->hca_core_clock_kHz,
-                  rdma_dev->read_comp_latency_sum / rdma_dev->measure_index * 1000000 / rdma_dev->hca_core_clock_kHz);
-
-        fflush(stdout);
+    if (rdma_dev->remote_buff_cnt > 0) {
+        fprintf(stderr, "The number of imported remote buffers is not zero (%d). Can't close device.\n",
+                rdma_dev->remote_buff_cnt);
+        return;
     }
-#endif /*PRINT_LATENCY*/
+    rc_stop_listen(rdma_dev);
     ret_val = destroy_qp(rdma_dev->qp);
     if (ret_val) {
         return;
     }
+    for (i = 0; rdma_dev->dci && i < rdma_dev->num_dcis; i++) {
+        if (rdma_dev->transport == RDMA_TRANSPORT_RC) {
+            rc_disconnect(rdma_dev, &rdma_dev->dci[i]);
+        }
+        ret_val = destroy_qp(rdma_dev->dci[i].qp);
+        if (ret_val) {
+            return;
+        }
+        pthread_spin_destroy(&rdma_dev->dci[i].sq_lock);
+    }
+    free(rdma_dev->dci);
+    free(rdma_dev->stash);
+    free(rdma_dev->wc);
+    free(rdma_dev->batch_events);
 
     if (rdma_dev->srq) {
         DEBUG_LOG("ibv_destroy_srq(%p)\n", rdma_dev->srq);
@@ -1121,18 +1993,18 @@ void rdma_close_device(struct rdma_device *rdma_dev)
     }
     
     DEBUG_LOG("ibv_destroy_cq(%p)\n", rdma_dev->cq);
-#ifdef PRINT_LATENCY
-    ibv_destroy_cq(ibv_cq_ex_to_cq(rdma_dev->cq));
-#else /*PRINT_LATENCY*/
     ibv_destroy_cq(rdma_dev->cq);
-#endif /*PRINT_LATENCY*/
     if (ret_val) {
         fprintf(stderr, "Couldn't destroy CQ, error %d\n", ret_val);
         return;
     }
 
     DEBUG_LOG("destroy ibv_ah's\n");
-    kh_foreach_value(&rdma_dev->ah_hash, ah, ibv_destroy_ah(ah));
+    for (i = 0; i < rdma_dev->ah_used; i++) {
+        if (rdma_dev->ah_entry[i].ah) {
+            ibv_destroy_ah(rdma_dev->ah_entry[i].ah);
+        }
+    }
 
     DEBUG_LOG("ibv_dealloc_pd(%p)\n", rdma_dev->pd);
     ret_val = ibv_dealloc_pd(rdma_dev->pd);
@@ -1143,6 +2015,14 @@ void rdma_close_device(struct rdma_device *rdma_dev)
 
     DEBUG_LOG("destroy AH cache\n");
     kh_destroy_inplace(kh_ib_ah, &rdma_dev->ah_hash);
+    free(rdma_dev->ah_entry);
+
+    pthread_spin_destroy(&rdma_dev->cq_lock);
+    pthread_mutex_destroy(&rdma_dev->ah_lock);
+    if (rdma_dev->rc_channel) {
+        rdma_destroy_event_channel(rdma_dev->rc_channel);
+        pthread_mutex_destroy(&rdma_dev->rc_lock);
+    }
 
     close_ib_device(rdma_dev);
 
@@ -1152,10 +2032,29 @@ void rdma_close_device(struct rdma_device *rdma_dev)
 }
 
 //============================================================================================
-struct rdma_buffer *rdma_buffer_reg(struct rdma_device *rdma_dev, void *addr, size_t length)
+/* ODP capabilities of the DC transport the buffers are accessed over, 0 if not reported */
+static uint32_t dc_odp_caps(struct ibv_context *context)
+{
+    struct mlx5dv_context dv_ctx;
+
+    memset(&dv_ctx, 0, sizeof(dv_ctx));
+    dv_ctx.comp_mask = MLX5DV_CONTEXT_MASK_DC_ODP_CAPS;
+    if (mlx5dv_query_device(context, &dv_ctx) || !(dv_ctx.comp_mask & MLX5DV_CONTEXT_MASK_DC_ODP_CAPS)) {
+        return 0;
+    }
+    return dv_ctx.dc_odp_caps;
+}
+
+//============================================================================================
+struct rdma_buffer *rdma_buffer_reg(struct rdma_device *rdma_dev, void *addr, size_t length)
+{
+    return rdma_buffer_reg_mode(rdma_dev, addr, length, MR_MODE_PINNED);
+}
+
+//============================================================================================
+struct rdma_buffer *rdma_buffer_reg_mode(struct rdma_device *rdma_dev, void *addr, size_t length, int mr_mode)
 {
     struct rdma_buffer *rdma_buff;
-    int    ret_val;
 
     rdma_buff = calloc(1, sizeof *rdma_buff);
     if (!rdma_buff) {
@@ -1165,9 +2064,11 @@ struct rdma_buffer *rdma_buffer_reg(struct rdma_device *rdma_dev, void *addr, si
 
     enum ibv_access_flags access_flags = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE;
     /*In the case of local buffer we can use IBV_ACCESS_LOCAL_WRITE only flag*/
-    DEBUG_LOG("ibv_reg_mr(pd %p, buf %p, size = %lu, access_flags = 0x%08x\n",
-               rdma_dev->pd, addr, length, access_flags);
-    rdma_buff->mr = ibv_reg_mr(rdma_dev->pd, addr, length, access_flags);
+    DEBUG_LOG("ibv_reg_mr(pd %p, buf %p, size = %lu, access_flags = 0x%08x, mode %s\n",
+               rdma_dev->pd, addr, length, access_flags, mr_mode_name(mr_mode));
+    /* falls back to a pinned MR when the device can't do ODP over DC for these accesses */
+    rdma_buff->mr = odp_reg_mr_caps(rdma_dev->pd, addr, length, access_flags, mr_mode,
+                                    mr_mode == MR_MODE_PINNED ? 0 : dc_odp_caps(rdma_dev->context));
     if (!rdma_buff->mr) {
         fprintf(stderr, "Couldn't register GPU MR\n");
         goto clean_rdma_buff;
@@ -1178,6 +2079,7 @@ struct rdma_buffer *rdma_buffer_reg(struct rdma_device *rdma_dev, void *addr, si
     rdma_buff->buf_addr = addr;
     rdma_buff->buf_size = length;
     rdma_buff->rkey     = rdma_buff->mr->rkey; /*not used for local buffer case*/
+    rdma_buff->mr_mode  = mr_mode;
     rdma_buff->rdma_dev = rdma_dev;
     rdma_dev->rdma_buff_cnt++;
 
@@ -1198,7 +2100,10 @@ void rdma_buffer_dereg(struct rdma_buffer *rdma_buff)
 
     DEBUG_LOG("ibv_dereg_mr(%p)\n", rdma_buff->mr);
     if (rdma_buff->mr) {
-        ret_val = ibv_dereg_mr(rdma_buff->mr);
+        if (rdma_buff->mr_mode != MR_MODE_PINNED) {
+            odp_print_stats(rdma_buff->rdma_dev->context);
+        }
+        ret_val = odp_dereg_mr(rdma_buff->mr);
         if (ret_val) {
             fprintf(stderr, "Couldn't deregister MR, error %d\n", ret_val);
             return;
@@ -1248,301 +2153,688 @@ int rdma_buffer_get_desc_str(struct rdma_buffer *rdma_buff, char *desc_str, size
     }
     /*       addr             size     rkey     lid  dctn   g 
             "0102030405060708:01020304:01020304:0102:010203:1:" */
+    /* with RC, the dctn field is the rdma_cm port and g carries RDMA_BUF_DESC_RC in bit 1 */
+    int is_rc = rdma_buff->rdma_dev->transport == RDMA_TRANSPORT_RC;
     sprintf(desc_str, "%016llx:%08lx:%08x:%04x:%06x:%d:",
             (unsigned long long)rdma_buff->buf_addr,
             (unsigned long)rdma_buff->buf_size,
             rdma_buff->rkey,
             rdma_buff->rdma_dev->lid,
-            rdma_buff->rdma_dev->qp->qp_num /* dctn */,
-            rdma_buff->rdma_dev->is_global & 0x1);
+            is_rc ? rdma_buff->rdma_dev->rc_port : rdma_buff->rdma_dev->qp->qp_num /* dctn */,
+            (rdma_buff->rdma_dev->is_global & 0x1) | (is_rc ? RDMA_BUF_DESC_RC << 1 : 0));
     
     gid_to_wire_gid(&rdma_buff->rdma_dev->gid, desc_str + sizeof "0102030405060708:01020304:01020304:0102:010203:1");
     
     return strlen(desc_str) + 1; /*including the terminating null character*/
 }
 
+//============================================================================================
+int rdma_buffer_get_desc_bin(struct rdma_buffer *rdma_buff, struct rdma_buffer_desc *desc)
+{
+    memset(desc, 0, sizeof *desc);
+    desc->addr      = htobe64((uint64_t)rdma_buff->buf_addr);
+    desc->size      = htobe64((uint64_t)rdma_buff->buf_size);
+    desc->rkey      = htonl(rdma_buff->rkey);
+    desc->lid       = htons(rdma_buff->rdma_dev->lid);
+    desc->is_global = rdma_buff->rdma_dev->is_global & 0x1;
+    if (rdma_buff->rdma_dev->transport == RDMA_TRANSPORT_RC) {
+        desc->dctn  = htonl(rdma_buff->rdma_dev->rc_port);
+        desc->flags = RDMA_BUF_DESC_RC;
+    } else {
+        desc->dctn  = htonl(rdma_buff->rdma_dev->qp->qp_num);
+    }
+    memcpy(desc->gid, rdma_buff->rdma_dev->gid.raw, sizeof desc->gid);
+
+    return sizeof *desc;
+}
+
+/* called with ah_lock held: an entry to fill, evicting if the cache is full. -1 if every entry is pinned */
+static int ah_cache_victim(struct rdma_device *rdma_dev)
+{
+    struct ah_entry *e;
+    int              i;
+
+    if (rdma_dev->ah_used < rdma_dev->ah_capacity) {
+        return rdma_dev->ah_used;
+    }
+    /* two turns of the hand: the first may only clear reference bits */
+    for (i = 0; i < 2 * rdma_dev->ah_capacity; i++) {
+        e = &rdma_dev->ah_entry[rdma_dev->ah_hand];
+        rdma_dev->ah_hand = (rdma_dev->ah_hand + 1) % rdma_dev->ah_capacity;
+        if (!e->ah) {
+            return e - rdma_dev->ah_entry; /* left free by a failed ibv_create_ah() */
+        }
+        if (e->refcnt) {
+            continue;
+        }
+        if (e->referenced) {
+            e->referenced = 0;
+            continue;
+        }
+        DEBUG_LOG("evict AH %p (dlid=%d)\n", e->ah, e->key.lid);
+        kh_del(kh_ib_ah, &rdma_dev->ah_hash, kh_get(kh_ib_ah, &rdma_dev->ah_hash, e->key));
+        ibv_destroy_ah(e->ah);
+        e->ah = NULL;
+        rdma_dev->ah_stats.evictions++;
+        return e - rdma_dev->ah_entry;
+    }
+    return -1;
+}
+
+/* called with ah_lock held. Returns the entry's index in *p_idx, pinned for the caller */
 static int rdma_create_ah_cached(struct rdma_device *rdma_dev,
                  struct ibv_ah_attr *ah_attr,
-                 struct ibv_ah **p_ah)
+                 int *p_idx)
 {
-    int ret = -1;
-    khiter_t iter;
+    struct ah_key    key;
+    struct ah_entry *e;
+    khiter_t         iter;
+    int              idx, ret;
+
+    memset(&key, 0, sizeof key);
+    key.lid = ah_attr->dlid;
+    if (ah_attr->is_global) {
+        key.gid_prefix = ah_attr->grh.dgid.global.subnet_prefix;
+        key.gid_iid    = ah_attr->grh.dgid.global.interface_id;
+        key.sgid_index = ah_attr->grh.sgid_index;
+        key.tc         = ah_attr->grh.traffic_class;
+    }
 
     /* looking for existing AH with same attributes */
-    iter = kh_get(kh_ib_ah, &rdma_dev->ah_hash, *ah_attr);
-    if (iter == kh_end(&rdma_dev->ah_hash)) {
+    iter = kh_get(kh_ib_ah, &rdma_dev->ah_hash, key);
+    if (iter != kh_end(&rdma_dev->ah_hash)) {
+        idx = kh_value(&rdma_dev->ah_hash, iter);
+        rdma_dev->ah_entry[idx].referenced = 1;
+        rdma_dev->ah_entry[idx].refcnt++;
+        rdma_dev->ah_stats.hits++;
+        *p_idx = idx;
+        return 0;
+    }
+    rdma_dev->ah_stats.misses++;
 
-        /* new AH */
-        DEBUG_LOG("ibv_create_ah(dlid=%d port=%d is_global=%d, tc=%d)\n",
-            ah_attr->dlid, ah_attr->port_num, ah_attr->is_global, (ah_attr->grh.traffic_class >> 5));
-        *p_ah = ibv_create_ah(rdma_dev->pd, ah_attr);
+    idx = ah_cache_victim(rdma_dev);
+    if (idx < 0) {
+        fprintf(stderr, "AH cache is full, all %d entries are held by remote buffers\n", rdma_dev->ah_capacity);
+        return -1;
+    }
+    e = &rdma_dev->ah_entry[idx];
 
-        if (*p_ah == NULL) {
-            perror("ibv_create_ah");
-            goto out;
-        }
+    /* new AH */
+    DEBUG_LOG("ibv_create_ah(dlid=%d port=%d is_global=%d, tc=%d)\n",
+        ah_attr->dlid, ah_attr->port_num, ah_attr->is_global, (ah_attr->grh.traffic_class >> 5));
+    e->ah = ibv_create_ah(rdma_dev->pd, ah_attr);
+    if (e->ah == NULL) {
+        perror("ibv_create_ah");
+        return -1;
+    }
 
-        /* store AH in hash */
-        iter = kh_put(kh_ib_ah, &rdma_dev->ah_hash, *ah_attr, &ret);
+    /* store AH in hash */
+    iter = kh_put(kh_ib_ah, &rdma_dev->ah_hash, key, &ret);
 
-        /* failed to store - rollback */
-        if (iter == kh_end(&rdma_dev->ah_hash)) {
-            perror("rdma_create_ah_cached failed storing");
-            ibv_destroy_ah(*p_ah);
-            goto out;
-        }
+    /* failed to store - rollback */
+    if (iter == kh_end(&rdma_dev->ah_hash)) {
+        perror("rdma_create_ah_cached failed storing");
+        ibv_destroy_ah(e->ah);
+        e->ah = NULL;
+        return -1;
+    }
+    kh_value(&rdma_dev->ah_hash, iter) = idx;
 
-        kh_value(&rdma_dev->ah_hash, iter) = *p_ah;
-        ret = 0;
-    } else {
-        /* found existing AH */
-        *p_ah = kh_value(&rdma_dev->ah_hash, iter);
-        ret = 0;
+    e->key        = key;
+    e->refcnt     = 1;
+    e->referenced = 0; /* a peer seen once goes first */
+    if (idx == rdma_dev->ah_used) {
+        rdma_dev->ah_used++;
     }
+    *p_idx = idx;
+    return 0;
+}
 
-out:
-    return ret;
+static void ah_cache_put(struct rdma_device *rdma_dev, int ah_idx)
+{
+    pthread_mutex_lock(&rdma_dev->ah_lock);
+    rdma_dev->ah_entry[ah_idx].refcnt--;
+    pthread_mutex_unlock(&rdma_dev->ah_lock);
 }
 
 //============================================================================================
-static int buff_size_validation(struct rdma_task_attr *attr, unsigned long rem_buf_size)
+static int buff_size_validation(struct rdma_buffer *local_buf_rdma, struct iovec *local_buf_iovec,
+                                int local_buf_iovcnt, unsigned long rem_buf_size)
 {
     size_t  total_len = 0;
     int     i;
 
-    for (i = 0; i < attr->local_buf_iovcnt; i++) {
-        if ((attr->local_buf_iovec[i].iov_base < attr->local_buf_rdma->buf_addr) ||
-            (attr->local_buf_iovec[i].iov_base + attr->local_buf_iovec[i].iov_len >
-             attr->local_buf_rdma->buf_addr + attr->local_buf_rdma->buf_size)) {
+    for (i = 0; i < local_buf_iovcnt; i++) {
+        if ((local_buf_iovec[i].iov_base < local_buf_rdma->buf_addr) ||
+            (local_buf_iovec[i].iov_base + local_buf_iovec[i].iov_len >
+             local_buf_rdma->buf_addr + local_buf_rdma->buf_size)) {
 
             fprintf(stderr, "sge buffer %d (%p, %p) exceeds the local buffer bounary (%p, %p)\n", i,
-                    attr->local_buf_iovec[i].iov_base, attr->local_buf_iovec[i].iov_base + attr->local_buf_iovec[i].iov_len,
-                    attr->local_buf_rdma->buf_addr, attr->local_buf_rdma->buf_addr + attr->local_buf_rdma->buf_size);
+                    local_buf_iovec[i].iov_base, local_buf_iovec[i].iov_base + local_buf_iovec[i].iov_len,
+                    local_buf_rdma->buf_addr, local_buf_rdma->buf_addr + local_buf_rdma->buf_size);
             return 1;
         }
-        total_len += attr->local_buf_iovec[i].iov_len;
+        total_len += local_buf_iovec[i].iov_len;
         if (total_len > rem_buf_size) {
             fprintf(stderr, "The sum of sge buffers lengths (%lu) exceeded the remote buffer size %lu on iteration %d\n",
                     total_len, rem_buf_size, i);
             return 1;
         }
     }
-    if ((attr->local_buf_iovcnt) && (total_len != rem_buf_size)) {
+    if ((local_buf_iovcnt) && (total_len != rem_buf_size)) {
         fprintf(stderr, "WARN: The sum of sge buffers lengths (%lu) differs from the remote buffer size %lu\n",
                 total_len, rem_buf_size);
     }
-    if ((!attr->local_buf_iovcnt) && (rem_buf_size > attr->local_buf_rdma->buf_size)) {
+    if ((!local_buf_iovcnt) && (rem_buf_size > local_buf_rdma->buf_size)) {
         fprintf(stderr, "WARN: When not using sge list, the requested buffer size %lu is greater than allocated local size %lu\n",
-                rem_buf_size, attr->local_buf_rdma->buf_size);
+                rem_buf_size, local_buf_rdma->buf_size);
     }
     return 0;
 }
 
 //============================================================================================
-int rdma_submit_task(struct rdma_task_attr *attr)
+/*
+ * resolve the address handle of a remote buffer, the one step of an import which isn't parsing;
+ * with RC, its connection instead
+ */
+static int remote_buffer_resolve(struct rdma_device *rdma_dev, struct rdma_remote_buffer *remote_buf,
+                                 uint16_t rem_lid, int is_global, const union ibv_gid *rem_gid, int is_rc)
 {
-	struct rdma_exec_params exec_params = {};
+    /* Check if address handler corresponding to the given key is present in the hash table,
+       if yes - return it and if it is not, create ah and add it to the hash table */
+    struct ibv_ah_attr  ah_attr;
+    int                 ret_val;
+
+    memset(&ah_attr, 0, sizeof ah_attr);
+    ah_attr.is_global   = is_global;
+    ah_attr.dlid        = rem_lid;
+    ah_attr.port_num    = rdma_dev->ib_port;
+    
+    if (ah_attr.is_global) {
+        ah_attr.grh.hop_limit = 1;
+        ah_attr.grh.dgid = *rem_gid;
+        ah_attr.grh.sgid_index = rdma_dev->gidx;
+        ah_attr.grh.traffic_class = TC_PRIO << 5; // <<3 for dscp2prio, <<2 for ECN bits
+    }
+
+    remote_buf->rdma_dev = rdma_dev;
+
+    if (is_rc != (rdma_dev->transport == RDMA_TRANSPORT_RC)) {
+        fprintf(stderr, "The remote buffer was described for %s, this device uses %s\n",
+                is_rc ? "RC" : "DC", is_rc ? "DC" : "RC");
+        return 1;
+    }
+    if (is_rc) {
+        remote_buf->rc_peer = rc_peer_get(rdma_dev, rem_gid, remote_buf->dctn);
+        return remote_buf->rc_peer < 0;
+    }
+
+    pthread_mutex_lock(&rdma_dev->ah_lock);
+    ret_val = rdma_create_ah_cached(rdma_dev, &ah_attr, &remote_buf->ah_idx);
+    if (!ret_val) {
+        remote_buf->ah = rdma_dev->ah_entry[remote_buf->ah_idx].ah;
+    }
+    pthread_mutex_unlock(&rdma_dev->ah_lock);
+
+    return ret_val;
+}
+
+/* unpin what remote_buffer_resolve() pinned */
+static void remote_buffer_put(struct rdma_remote_buffer *remote_buf)
+{
+    if (remote_buf->rdma_dev->transport == RDMA_TRANSPORT_RC) {
+        rc_peer_put(remote_buf->rdma_dev, remote_buf->rc_peer);
+    } else {
+        ah_cache_put(remote_buf->rdma_dev, remote_buf->ah_idx);
+    }
+}
+
+/*
+ * Parse desc string, extracting remote buffer address, size, rkey, lid, dctn, and if global is true, also gid
+ */
+static int remote_buffer_parse_str(struct rdma_device *rdma_dev, const char *desc_str,
+                                   struct rdma_remote_buffer *remote_buf)
+{
+	unsigned long long      rem_addr = 0;
+	unsigned long           rem_size = 0, rem_rkey = 0, rem_dctn = 0;
 	uint16_t                rem_lid = 0;
 	int                     is_global = 0;
     	union ibv_gid           rem_gid;
-    	int                     ret_val;
 
-	exec_params.wr_id = attr->wr_id;
-	exec_params.device = attr->local_buf_rdma->rdma_dev;
-	exec_params.flags = attr->flags;
-	exec_params.local_buf_mr_lkey = (uint32_t)attr->local_buf_rdma->mr->lkey;
-	exec_params.local_buf_addr = attr->local_buf_rdma->buf_addr;
-	exec_params.local_buf_iovec = attr->local_buf_iovec;
-	exec_params.local_buf_iovcnt = attr->local_buf_iovcnt;
-	/*
-	 * Parse desc string, extracting remote buffer address, size, rkey, lid, dctn, and if global is true, also gid
-	 */
-	DEBUG_LOG_FAST_PATH("Starting to parse desc string: \"%s\"\n", attr->remote_buf_desc_str);
+	DEBUG_LOG_FAST_PATH("Starting to parse desc string: \"%s\"\n", desc_str);
 	/*   addr             size     rkey     lid  dctn   g gid                                              
 	 *  "0102030405060708:01020304:01020304:0102:010203:1:0102030405060708090a0b0c0d0e0f10"*/
-	sscanf(attr->remote_buf_desc_str, "%llx:%lx:%lx:%hx:%lx:%d",
-			&exec_params.rem_buf_addr, &exec_params.rem_buf_size,
-		       	&exec_params.rem_buf_rkey, &rem_lid,
-			&exec_params.rem_dctn, &is_global);
+	sscanf(desc_str, "%llx:%lx:%lx:%hx:%lx:%d",
+			&rem_addr, &rem_size, &rem_rkey, &rem_lid, &rem_dctn, &is_global);
 	memset(&rem_gid, 0, sizeof(rem_gid));
-	if (is_global) {
-		wire_gid_to_gid(attr->remote_buf_desc_str + sizeof "0102030405060708:01020304:01020304:0102:010203:1", &rem_gid);
+	if (is_global & 0x1) {
+		wire_gid_to_gid(desc_str + sizeof "0102030405060708:01020304:01020304:0102:010203:1", &rem_gid);
 	}
-	DEBUG_LOG_FAST_PATH("rem_buf_addr=0x%llx, rem_buf_size=%u, rem_buf_offset=%u, rem_buf_rkey=0x%lx, rem_lid=0x%hx, rem_dctn=0x%lx, is_global=%d\n",
-			exec_params.rem_buf_addr, exec_params.rem_buf_size, attr->remote_buf_offset, exec_params.rem_buf_rkey, rem_lid, exec_params.rem_dctn, is_global);
+	DEBUG_LOG_FAST_PATH("rem_buf_addr=0x%llx, rem_buf_size=%lu, rem_buf_rkey=0x%lx, rem_lid=0x%hx, rem_dctn=0x%lx, is_global=%d\n",
+			rem_addr, rem_size, rem_rkey, rem_lid, rem_dctn, is_global);
        	DEBUG_LOG_FAST_PATH("Rem GID: %02x%02x:%02x%02x:%02x%02x:%02x%02x:%02x%02x:%02x%02x:%02x%02x:%02x%02x\n",
                         rem_gid.raw[0],  rem_gid.raw[1],  rem_gid.raw[2],  rem_gid.raw[3],
                         rem_gid.raw[4],  rem_gid.raw[5],  rem_gid.raw[6],  rem_gid.raw[7], 
                         rem_gid.raw[8],  rem_gid.raw[9],  rem_gid.raw[10], rem_gid.raw[11],
                         rem_gid.raw[12], rem_gid.raw[13], rem_gid.raw[14], rem_gid.raw[15] );
-	DEBUG_LOG_FAST_PATH("rdma_task_attr_flags=%08x\n", exec_params.flags);
+
+	remote_buf->addr = rem_addr;
+	remote_buf->size = rem_size;
+	remote_buf->rkey = rem_rkey;
+	remote_buf->dctn = rem_dctn;
+
+	return remote_buffer_resolve(rdma_dev, remote_buf, rem_lid, is_global & 0x1, &rem_gid,
+				     !!(is_global & (RDMA_BUF_DESC_RC << 1)));
+}
+
+//============================================================================================
+struct rdma_remote_buffer *rdma_remote_buffer_import(struct rdma_device *rdma_dev,
+                                                     const struct rdma_buffer_desc *desc)
+{
+    struct rdma_remote_buffer *remote_buf;
+    union ibv_gid              rem_gid;
+
+    remote_buf = calloc(1, sizeof *remote_buf);
+    if (!remote_buf) {
+        fprintf(stderr, "remote_buf memory allocation failed\n");
+        return NULL;
+    }
+
+    remote_buf->addr = be64toh(desc->addr);
+    remote_buf->size = be64toh(desc->size);
+    remote_buf->rkey = ntohl(desc->rkey);
+    remote_buf->dctn = ntohl(desc->dctn);
+    memcpy(rem_gid.raw, desc->gid, sizeof rem_gid.raw);
+
+    DEBUG_LOG("import remote buffer: addr=0x%llx, size=%llu, rkey=0x%x, lid=0x%x, dctn=0x%06x, is_global=%d\n",
+              (unsigned long long)remote_buf->addr, (unsigned long long)remote_buf->size,
+              remote_buf->rkey, ntohs(desc->lid), remote_buf->dctn, desc->is_global);
+
+    if (remote_buffer_resolve(rdma_dev, remote_buf, ntohs(desc->lid), desc->is_global, &rem_gid,
+                              !!(desc->flags & RDMA_BUF_DESC_RC))) {
+        free(remote_buf);
+        return NULL;
+    }
+    __atomic_add_fetch(&rdma_dev->remote_buff_cnt, 1, __ATOMIC_RELAXED);
+
+    return remote_buf;
+}
+
+//============================================================================================
+struct rdma_remote_buffer *rdma_remote_buffer_import_str(struct rdma_device *rdma_dev,
+                                                         const char *desc_str, size_t desc_length)
+{
+    struct rdma_remote_buffer *remote_buf;
+
+    if (desc_length < BUFF_DESC_STRING_LENGTH) {
+        fprintf(stderr, "desc string size (%lu) is less than required (%lu) for a rdma_buffer description\n",
+                desc_length, BUFF_DESC_STRING_LENGTH);
+        return NULL;
+    }
+
+    remote_buf = calloc(1, sizeof *remote_buf);
+    if (!remote_buf) {
+        fprintf(stderr, "remote_buf memory allocation failed\n");
+        return NULL;
+    }
+
+    if (remote_buffer_parse_str(rdma_dev, desc_str, remote_buf)) {
+        free(remote_buf);
+        return NULL;
+    }
+    __atomic_add_fetch(&rdma_dev->remote_buff_cnt, 1, __ATOMIC_RELAXED);
+
+    return remote_buf;
+}
+
+//============================================================================================
+void rdma_remote_buffer_release(struct rdma_remote_buffer *remote_buf)
+{
+    /* the AH (or RC connection) stays for the next import from the same peer, now evictable */
+    remote_buffer_put(remote_buf);
+    __atomic_sub_fetch(&remote_buf->rdma_dev->remote_buff_cnt, 1, __ATOMIC_RELAXED);
+    free(remote_buf);
+}
+
+uint64_t rdma_remote_buffer_size(const struct rdma_remote_buffer *remote_buf)
+{
+    return remote_buf->size;
+}
+
+//============================================================================================
+static int submit_remote(struct rdma_remote_buffer *remote_buf, size_t remote_buf_offset, size_t length,
+                         struct rdma_buffer *local_buf_rdma, struct iovec *local_buf_iovec,
+                         int local_buf_iovcnt, uint32_t flags, uint32_t notify_data, uint64_t wr_id)
+{
+	struct rdma_exec_params exec_params = {};
+    	int                     ret_val;
+
+	exec_params.wr_id = wr_id;
+	exec_params.device = local_buf_rdma->rdma_dev;
+	exec_params.flags = flags;
+	exec_params.notify_data = notify_data;
+	exec_params.local_buf_mr_lkey = (uint32_t)local_buf_rdma->mr->lkey;
+	exec_params.local_buf_addr = local_buf_rdma->buf_addr;
+	exec_params.local_buf_iovec = local_buf_iovec;
+	exec_params.local_buf_iovcnt = local_buf_iovcnt;
+	exec_params.rem_buf_rkey = remote_buf->rkey;
+	exec_params.rem_dctn = remote_buf->dctn;
+	exec_params.ah = remote_buf->ah;
+	if (exec_params.device->transport == RDMA_TRANSPORT_RC) {
+		exec_params.dci = &exec_params.device->dci[remote_buf->rc_peer];
+	}
 
 	/* upadte the remote buffer addr and size acording to the requested start offset */
-	exec_params.rem_buf_addr += attr->remote_buf_offset;
-	exec_params.rem_buf_size -= attr->remote_buf_offset;
+	exec_params.rem_buf_addr = remote_buf->addr + remote_buf_offset;
+	exec_params.rem_buf_size = length ? length : remote_buf->size - remote_buf_offset;
+	DEBUG_LOG_FAST_PATH("rdma_task_attr_flags=%08x, rem_buf_offset=%lu, rem_buf_size=%u\n",
+			exec_params.flags, remote_buf_offset, exec_params.rem_buf_size);
 
 	/*
-	 * Pass attr->local_buf_iovec - local_buf_iovcnt elements and check that
+	 * Pass local_buf_iovec - local_buf_iovcnt elements and check that
 	 * the sum of local_buf_iovec[i].iov_len doesn't exceed rem_buf_size
 	 */
 	if (debug_fast_path) {
 		/* We do these validation code in debug mode only, because if something
 		 * is wrong in the fast path, the HW will give completion error */
-		ret_val = buff_size_validation(attr, exec_params.rem_buf_size);
+		ret_val = buff_size_validation(local_buf_rdma, local_buf_iovec, local_buf_iovcnt,
+					       exec_params.rem_buf_size);
 		if (ret_val) {
 			return ret_val;
 		}
 	}
-    
-    /* Check if address handler corresponding to the given key is present in the hash table,
-       if yes - return it and if it is not, create ah and add it to the hash table */
-    struct ibv_ah_attr  ah_attr;
 
-    memset(&ah_attr, 0, sizeof ah_attr);
-    ah_attr.is_global   = is_global;
-    ah_attr.dlid        = rem_lid;
-    ah_attr.port_num    = exec_params.device->ib_port;
-    
-    if (ah_attr.is_global) {
-        ah_attr.grh.hop_limit = 1;
-        ah_attr.grh.dgid = rem_gid;
-        ah_attr.grh.sgid_index = exec_params.device->gidx;
-        ah_attr.grh.traffic_class = TC_PRIO << 5; // <<3 for dscp2prio, <<2 for ECN bits
+	return rdma_exec_task(&exec_params);
+}
+
+//============================================================================================
+int rdma_submit_task(struct rdma_task_attr *attr)
+{
+	struct rdma_remote_buffer remote_buf = {};
+
+	int                       ret_val;
+
+	if (remote_buffer_parse_str(attr->local_buf_rdma->rdma_dev, attr->remote_buf_desc_str, &remote_buf)) {
+		return 1;
+	}
+
+	ret_val = submit_remote(&remote_buf, attr->remote_buf_offset, 0, attr->local_buf_rdma,
+				attr->local_buf_iovec, attr->local_buf_iovcnt, attr->flags, 0, attr->wr_id);
+	remote_buffer_put(&remote_buf);
+	return ret_val;
+}
+
+//============================================================================================
+int rdma_submit_remote_task(struct rdma_remote_task_attr *attr)
+{
+	return submit_remote(attr->remote_buf, attr->remote_buf_offset, attr->length, attr->local_buf_rdma,
+			     attr->local_buf_iovec, attr->local_buf_iovcnt, attr->flags, attr->notify_data, attr->wr_id);
+}
+
+//============================================================================================
+static inline uint64_t hca_cycles_to_ns(struct rdma_device *rdma_dev, uint64_t cycles)
+{
+    return (cycles & rdma_dev->ts_mask) * 1000000 / rdma_dev->hca_core_clock_kHz;
+}
+
+/* called with rdma_dev->cq_lock held, for a sampled task's successful CQE */
+static void record_latency(struct rdma_device *rdma_dev, uint64_t start_ts, uint64_t completion_ts)
+{
+    uint64_t now_ts = read_hca_clock(rdma_dev);
+
+    lat_hist_add(&rdma_dev->lat_submit_to_cqe, hca_cycles_to_ns(rdma_dev, completion_ts - start_ts));
+    if (now_ts) {
+        lat_hist_add(&rdma_dev->lat_cqe_to_poll, hca_cycles_to_ns(rdma_dev, now_ts - completion_ts));
     }
+}
 
-    if (rdma_create_ah_cached(exec_params.device, &ah_attr, &exec_params.ah)) {
-        return 1;
+/*
+ * Account the completion of a virtual wr_id on its DCI. A failed one puts the
+ * DCI in error. Returns 1 if the task's event was written to *event; with
+ * only set, the other DCIs' events go to the device's stash instead.
+ * cq_ex is set when the CQE is current on it, so a sampled task's completion
+ * timestamp can be read.
+ */
+static int complete_wr_id(struct rdma_device *rdma_dev, uint64_t cq_wr_id, int status,
+                          struct rdma_dci *only, struct rdma_completion_event *event,
+                          struct ibv_cq_ex *cq_ex)
+{
+    struct rdma_dci         *dci  = &rdma_dev->dci[cq_wr_id / SEND_Q_DEPTH];
+    struct wr_id_reported   *slot = &dci->app_wr_id[cq_wr_id % SEND_Q_DEPTH];
+
+    DEBUG_LOG_FAST_PATH("DCI %d: virtual wr_id %llu, original wr_id 0x%llx, num_wrs=%d, status %d\n",
+                        (int)(cq_wr_id / SEND_Q_DEPTH), (long long unsigned int)cq_wr_id,
+                        (long long unsigned int)slot->wr_id, slot->num_wrs, status);
+    if (status != IBV_WC_SUCCESS) {
+        __atomic_store_n(&dci->in_error, 1, __ATOMIC_RELAXED);
+    }
+    if (!(slot->flags & WR_ID_FLAGS_ACTIVE)) {
+        return 0;
+    }
+    if ((slot->flags & WR_ID_FLAGS_SAMPLED) && cq_ex && status == IBV_WC_SUCCESS) {
+        record_latency(rdma_dev, slot->start_ts, ibv_wc_read_completion_ts(cq_ex));
     }
-    ret_val = rdma_exec_task(&exec_params);
+    slot->flags = 0;
+    if (only && dci != only) {
+        struct stashed_event *stashed = &rdma_dev->stash[rdma_dev->stash_cnt++];
 
-    return ret_val;
+        stashed->dci     = dci;
+        stashed->num_wrs = slot->num_wrs; /* given back when it is handed out */
+        event = &stashed->event;
+    } else {
+        __atomic_add_fetch(&dci->qp_available_wr, slot->num_wrs, __ATOMIC_RELEASE);
+    }
+    event->wr_id  = slot->wr_id;
+    event->status = status;
+
+    return !only || dci == only;
 }
 
-//============================================================================================
-int rdma_poll_completions(struct rdma_device            *rdma_dev,
-                          struct rdma_completion_event  *event,
-                          uint32_t                      num_entries)
+/*
+ * poll_completions() while latency sampling is on: one CQE at a time through
+ * the extended CQ, so sampled tasks can read their completion timestamp
+ */
+static int poll_completions_ts(struct rdma_device            *rdma_dev,
+                               struct rdma_completion_event  *event,
+                               uint32_t                      num_entries,
+                               struct rdma_dci               *only)
 {
+    struct ibv_poll_cq_attr cq_attr = {};
     int    reported_entries = 0;
+    int    ret_val;
 
-    if (num_entries > COMP_ARRAY_SIZE) {
-        num_entries = COMP_ARRAY_SIZE; /* We don't returne more than 16 entries,
-                        If user needs more, he can call rdma_poll_completions again */
+    ret_val = ibv_start_poll(rdma_dev->cq_ex, &cq_attr);
+    if (ret_val) {
+        if (ret_val != ENOENT) {
+            perror("ibv_start_poll");
+        }
+        return 0;
+    }
+    do {
+        reported_entries += complete_wr_id(rdma_dev, rdma_dev->cq_ex->wr_id, rdma_dev->cq_ex->status, only,
+                                           &event[reported_entries], rdma_dev->cq_ex);
+        if (reported_entries == num_entries) {
+            break; /* the rest stays in the CQ for the next call */
+        }
+        ret_val = ibv_next_poll(rdma_dev->cq_ex);
+    } while (!ret_val);
+    if (ret_val && ret_val != ENOENT) {
+        perror("ibv_next_poll");
     }
+    ibv_end_poll(rdma_dev->cq_ex);
 
-    /* Polling completion queue */
-    //DEBUG_LOG_FAST_PATH("Polling completion queue: ibv_poll_cq\n");
-#ifdef PRINT_LATENCY
-    struct ibv_poll_cq_attr cq_attr = {};
-    uint64_t comp_ts;
-    int      ret_val;
+    return reported_entries;
+}
 
-    ret_val = ibv_start_poll(rdma_dev->cq, &cq_attr);
-    if ((ret_val) && (ret_val != ENOENT)) {
-        perror("ibv_start_poll");
-        return reported_entries; /*0*/
+/* called with rdma_dev->cq_lock held. With only set, reports that DCI's completions alone */
+static int poll_completions(struct rdma_device            *rdma_dev,
+                            struct rdma_completion_event  *event,
+                            uint32_t                      num_entries,
+                            struct rdma_dci               *only)
+{
+    int    reported_entries = 0;
+
+    /* first what a DCI reset polled for the others */
+    if (!only && rdma_dev->stash_cnt) {
+        int i;
+
+        reported_entries = mmin((int)num_entries, rdma_dev->stash_cnt);
+        for (i = 0; i < reported_entries; i++) {
+            event[i] = rdma_dev->stash[i].event;
+            __atomic_add_fetch(&rdma_dev->stash[i].dci->qp_available_wr, rdma_dev->stash[i].num_wrs,
+                               __ATOMIC_RELEASE);
+        }
+        rdma_dev->stash_cnt -= reported_entries;
+        memmove(rdma_dev->stash, rdma_dev->stash + reported_entries, rdma_dev->stash_cnt * sizeof *rdma_dev->stash);
+        return reported_entries;
+    }
+
+    if (rdma_dev->cq_ex && __atomic_load_n(&rdma_dev->lat_every, __ATOMIC_RELAXED)) {
+        return poll_completions_ts(rdma_dev, event, num_entries, only);
     }
+
+    /* Polling completion queue */
+    //DEBUG_LOG_FAST_PATH("Polling completion queue: ibv_poll_cq\n");
+    struct ibv_wc *wc = rdma_dev->wc;
+    int    i, wcn, chunk;
     
-    while (ret_val != ENOENT) {
-        uint64_t cq_wr_id = rdma_dev->cq->wr_id;
-        DEBUG_LOG_FAST_PATH("virtual wr_id %llu, original wr_id 0x%llx, num_wrs=%d\n",
-                            (long long unsigned int)cq_wr_id,
-                            (long long unsigned int)rdma_dev->app_wr_id[cq_wr_id].wr_id,
-                            rdma_dev->app_wr_id[cq_wr_id].num_wrs);
-        if (rdma_dev->app_wr_id[cq_wr_id].flags & WR_ID_FLAGS_ACTIVE) {
-		rdma_dev->app_wr_id[wc[i].wr_id].flags = 0;
-		rdma_dev->qp_available_wr += rdma_dev->app_wr_id[cq_wr_id].num_wrs;
-        	event[reported_entries].wr_id  = rdma_dev->app_wr_id[cq_wr_id].wr_id;
-        	event[reported_entries].status = rdma_dev->cq->status;
-        	reported_entries++;
-	}
-        
-        rdma_dev->latency[cq_wr_id].completion_ts = ibv_wc_read_completion_ts(rdma_dev->cq);
-        
-        struct ibv_values_ex ts_values = {
-            .comp_mask = IBV_VALUES_MASK_RAW_CLOCK,
-            .raw_clock = {} /*struct timespec*/
-        };
-
-        ret_val = ibv_query_rt_values_ex(rdma_dev->context, &ts_values);
-        if (ret_val) {
-            fprintf(stderr, "ibv_query_rt_values_ex failed after ibv_wr_start call\n");
-            ts_values.raw_clock.tv_nsec = 0;
+    while (reported_entries < num_entries) {
+        /* a batch at a time, and never more than there is room for */
+        chunk = mmin(num_entries - reported_entries, rdma_dev->poll_batch);
+        wcn = ibv_poll_cq(rdma_dev->cq, chunk, wc);
+        if (wcn < 0) {
+            fprintf(stderr, "poll CQ failed %d\n", wcn);
+            break;
         }
-        rdma_dev->latency[cq_wr_id].read_comp_ts = ts_values.raw_clock.tv_nsec;
-
-        uint64_t    wr_complete_latency = rdma_dev->latency[cq_wr_id].wr_complete_ts - rdma_dev->latency[cq_wr_id].wr_start_ts;
-        uint64_t    completion_latency  = rdma_dev->latency[cq_wr_id].completion_ts  - rdma_dev->latency[cq_wr_id].wr_start_ts;
-        uint64_t    read_comp_latency   = rdma_dev->latency[cq_wr_id].read_comp_ts   - rdma_dev->latency[cq_wr_id].completion_ts;
-        
-        rdma_dev->measure_index++;
-        rdma_dev->wr_complete_latency_sum += wr_complete_latency;
-        rdma_dev->completion_latency_sum  += completion_latency;
-        rdma_dev->read_comp_latency_sum   += read_comp_latency;
-
-        rdma_dev->min_wr_complete_latency = (wr_complete_latency < rdma_dev->min_wr_complete_latency)?
-                                            wr_complete_latency: rdma_dev->min_wr_complete_latency;
-        rdma_dev->min_completion_latency  = (completion_latency < rdma_dev->min_completion_latency)?
-                                            completion_latency: rdma_dev->min_completion_latency;
-        rdma_dev->min_read_comp_latency   = (read_comp_latency < rdma_dev->min_read_comp_latency)?
-                                            read_comp_latency: rdma_dev->min_read_comp_latency;
-        
-        rdma_dev->max_wr_complete_latency = (wr_complete_latency > rdma_dev->max_wr_complete_latency)?
-                                            wr_complete_latency: rdma_dev->max_wr_complete_latency;
-        rdma_dev->max_completion_latency  = (completion_latency > rdma_dev->max_completion_latency)?
-                                            completion_latency: rdma_dev->max_completion_latency;
-        rdma_dev->max_read_comp_latency   = (read_comp_latency > rdma_dev->max_read_comp_latency)?
-                                            read_comp_latency: rdma_dev->max_read_comp_latency;
-        
-        DEBUG_LOG_FAST_PATH("PRINT_LATENCY: wr_id = %6lu, wr_sent latency: current %8lu, min %8lu, max %8lu, avg %8lu (nSec)\n",
-			cq_wr_id,
-			wr_complete_latency * 1000000 / rdma_dev->hca_core_clock_kHz,
-			rdma_dev->min_wr_complete_latency * 1000000 / rdma_dev->hca_core_clock_kHz,
-			rdma_dev->max_wr_complete_latency * 1000000 / rdma_dev->hca_core_clock_kHz,
-			rdma_dev->wr_complete_latency_sum / rdma_dev->measure_index * 1000000 / rdma_dev->hca_core_clock_kHz);
-
-        DEBUG_LOG_FAST_PATH("PRINT_LATENCY:   completion latency           : current %8lu, min %8lu, max %8lu, avg %8lu (nSec)\n",
-			completion_latency * 1000000 / rdma_dev->hca_core_clock_kHz,
-			rdma_dev->min_completion_latency * 1000000 / rdma_dev->hca_core_clock_kHz,
-			rdma_dev->max_completion_latency * 1000000 / rdma_dev->hca_core_clock_kHz,
-			rdma_dev->completion_latency_sum / rdma_dev->measure_index * 1000000 / rdma_dev->hca_core_clock_kHz);
-        
-        DEBUG_LOG_FAST_PATH("PRINT_LATENCY:   read_comp latency            : current %8lu, min %8lu, max %8lu, avg %8lu (nSec)\n",
-			read_comp_latency * 1000000 / rdma_dev->hca_core_clock_kHz,
-			rdma_dev->min_read_comp_latency * 1000000 / rdma_dev->hca_core_clock_kHz,
-			rdma_dev->max_read_comp_latency * 1000000 / rdma_dev->hca_core_clock_kHz,
-			rdma_dev->read_comp_latency_sum / rdma_dev->measure_index * 1000000 / rdma_dev->hca_core_clock_kHz);
-
-        ret_val = ibv_next_poll(rdma_dev->cq);
-        if ((ret_val) && (ret_val != ENOENT)) {
-            perror("ibv_start_poll");
-            return reported_entries;
+    
+        for (i = 0; i < wcn; ++i) {
+            reported_entries += complete_wr_id(rdma_dev, wc[i].wr_id, wc[i].status, only,
+                                               &event[reported_entries], NULL);
+        }
+        if (wcn < chunk) {
+            break; /* the CQ is empty */
         }
     }
-    ibv_end_poll(rdma_dev->cq);
-#else /*PRINT_LATENCY*/
+    return reported_entries;
+}
+
+int rdma_poll_completions(struct rdma_device            *rdma_dev,
+                          struct rdma_completion_event  *event,
+                          uint32_t                      num_entries)
+{
+    int    reported_entries;
+
+    pthread_spin_lock(&rdma_dev->cq_lock);
+    reported_entries = poll_completions(rdma_dev, event, num_entries, NULL);
+    pthread_spin_unlock(&rdma_dev->cq_lock);
+
+    return reported_entries;
+}
+
+//============================================================================================
+int rdma_device_set_poll_batch(struct rdma_device *rdma_dev, uint32_t batch)
+{
+    struct ibv_wc                *wc;
+    struct rdma_completion_event *batch_events;
+
+    if (!batch || batch > rdma_dev->cq_depth) {
+        return EINVAL;
+    }
+    wc = malloc(batch * sizeof *wc);
+    batch_events = malloc(batch * sizeof *batch_events);
+    if (!wc || !batch_events) {
+        free(wc);
+        free(batch_events);
+        return ENOMEM;
+    }
+
+    pthread_spin_lock(&rdma_dev->cq_lock);
+    free(rdma_dev->wc);
+    free(rdma_dev->batch_events);
+    rdma_dev->wc           = wc;
+    rdma_dev->batch_events = batch_events;
+    rdma_dev->poll_batch   = batch;
+    pthread_spin_unlock(&rdma_dev->cq_lock);
+
+    return 0;
+}
+
+int rdma_device_set_latency_sampling(struct rdma_device *rdma_dev, uint32_t every)
+{
+    if (every && !rdma_dev->cq_ex) {
+        return ENOTSUP;
+    }
+    __atomic_store_n(&rdma_dev->lat_every, every, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+void rdma_device_print_latency(struct rdma_device *rdma_dev, FILE *f, int reset)
+{
+    pthread_spin_lock(&rdma_dev->cq_lock);
+    lat_hist_print(f, "submit -> CQE", &rdma_dev->lat_submit_to_cqe, "nSec");
+    lat_hist_print(f, "CQE -> poll", &rdma_dev->lat_cqe_to_poll, "nSec");
+    if (reset) {
+        lat_hist_init(&rdma_dev->lat_submit_to_cqe);
+        lat_hist_init(&rdma_dev->lat_cqe_to_poll);
+    }
+    pthread_spin_unlock(&rdma_dev->cq_lock);
+}
+
+void rdma_device_set_completion_cb(struct rdma_device *rdma_dev, rdma_completion_cb cb, void *ctx)
+{
+    pthread_spin_lock(&rdma_dev->cq_lock);
+    rdma_dev->comp_cb     = cb;
+    rdma_dev->comp_cb_ctx = ctx;
+    pthread_spin_unlock(&rdma_dev->cq_lock);
+}
+
+int rdma_process_completions(struct rdma_device *rdma_dev)
+{
+    int    reported_entries;
+
+    pthread_spin_lock(&rdma_dev->cq_lock);
+    reported_entries = poll_completions(rdma_dev, rdma_dev->batch_events, rdma_dev->poll_batch, NULL);
+    if (reported_entries && rdma_dev->comp_cb) {
+        rdma_dev->comp_cb(rdma_dev->comp_cb_ctx, rdma_dev->batch_events, reported_entries);
+    }
+    pthread_spin_unlock(&rdma_dev->cq_lock);
+
+    return reported_entries;
+}
+
+//============================================================================================
+int rdma_poll_notifications(struct rdma_device  *rdma_dev,
+                            uint32_t            *notify_data,
+                            uint32_t            num_entries)
+{
     struct ibv_wc wc[COMP_ARRAY_SIZE];
     int    i, wcn;
-    
+
+    if (num_entries > COMP_ARRAY_SIZE) {
+        num_entries = COMP_ARRAY_SIZE;
+    }
+
     wcn = ibv_poll_cq(rdma_dev->cq, num_entries, wc);
     if (wcn < 0) {
         fprintf(stderr, "poll CQ failed %d\n", wcn);
         return 0;
     }
-    
+
     for (i = 0; i < wcn; ++i) {
-        DEBUG_LOG_FAST_PATH("cqe idx %d: virtual wr_id %llu, original wr_id 0x%llx, num_wrs=%d\n",
-                            i, (long long unsigned int)wc[i].wr_id,
-                            (long long unsigned int)rdma_dev->app_wr_id[wc[i].wr_id].wr_id,
-                            rdma_dev->app_wr_id[wc[i].wr_id].num_wrs);
-        if (rdma_dev->app_wr_id[wc[i].wr_id].flags & WR_ID_FLAGS_ACTIVE) {
-		rdma_dev->app_wr_id[wc[i].wr_id].flags = 0;
-		rdma_dev->qp_available_wr += rdma_dev->app_wr_id[wc[i].wr_id].num_wrs;
-		event[reported_entries].wr_id  = rdma_dev->app_wr_id[wc[i].wr_id].wr_id;
-  		event[reported_entries].status = wc[i].status;
-		reported_entries++;
-	}
+        if (wc[i].status != IBV_WC_SUCCESS) {
+            fprintf(stderr, "FAILURE: notification status \"%s\" (%d)\n",
+                    ibv_wc_status_str(wc[i].status), wc[i].status);
+            return -1;
+        }
+        notify_data[i] = ntohl(wc[i].imm_data);
+        DEBUG_LOG_FAST_PATH("notification idx %d: notify_data 0x%x, byte_len %u\n", i, notify_data[i], wc[i].byte_len);
     }
-#endif /*PRINT_LATENCY*/
-    return reported_entries;
+
+    /* give the SRQ back what was consumed */
+    if (wcn && post_notify_recvs(rdma_dev, wcn)) {
+        return -1;
+    }
+
+    return wcn;
 }
@@ -33,6 +33,7 @@
 #ifndef _GPU_DIRECT_RDMA_ACCESS_H_
 #define _GPU_DIRECT_RDMA_ACCESS_H_
 
+#include <stdio.h>
 #include <sys/uio.h> /* This file defines `struct iovec'  */
 
 #include <infiniband/verbs.h>
@@ -56,6 +57,31 @@ struct rdma_device;
  */
 struct rdma_buffer;
 
+/*
+ * rdma_remote_buffer is a remote buffer description imported once on the
+ * local device, with its rkey, DCT number and address handle (or RC
+ * connection) resolved
+ */
+struct rdma_remote_buffer;
+
+/*
+ * Binary form of a rdma_buffer description, as sent on the wire.
+ * All fields are in network byte order. With RDMA_BUF_DESC_RC in flags,
+ * dctn holds the rdma_cm port its owner accepts RC connections on.
+ */
+#define RDMA_BUF_DESC_RC    0x1
+
+struct rdma_buffer_desc {
+    uint64_t    addr;
+    uint64_t    size;
+    uint32_t    rkey;
+    uint32_t    dctn;
+    uint16_t    lid;
+    uint8_t     is_global;
+    uint8_t     flags;
+    uint8_t     gid[16];
+} __attribute__((packed));
+
 struct rdma_open_dev_attr {
     const char      *ib_devname;
     int             ib_port;
@@ -64,8 +90,12 @@ struct rdma_open_dev_attr {
 
 enum rdma_task_attr_flags {
         RDMA_TASK_ATTR_RDMA_READ = 1 << 0,
+        RDMA_TASK_ATTR_NOTIFY    = 1 << 1, /* deliver notify_data to the remote side, see rdma_poll_notifications() */
 };
 
+/* receives the client's SRQ keeps posted: no more notifying tasks may be in flight towards it */
+#define NOTIFY_RECV_DEPTH 256
+
 struct rdma_task_attr {
         char                    *remote_buf_desc_str;
         size_t                   remote_buf_desc_length;
@@ -76,6 +106,18 @@ struct rdma_task_attr {
         uint32_t                 flags; /* Use enum rdma_task_attr_flags */
         uint64_t                 wr_id;
 };
+
+struct rdma_remote_task_attr {
+        struct rdma_remote_buffer *remote_buf;
+        size_t                   remote_buf_offset;
+        size_t                   length;    /* 0 - up to the end of the remote buffer */
+        struct rdma_buffer      *local_buf_rdma;
+        struct iovec            *local_buf_iovec;
+        int                      local_buf_iovcnt;
+        uint32_t                 flags;     /* Use enum rdma_task_attr_flags */
+        uint32_t                 notify_data;
+        uint64_t                 wr_id;
+};
 /*
  * Open a RDMA device and allocated requiered resources.
  * find the capable RDMA device based on the 'addr' as an ip address
@@ -91,7 +133,80 @@ struct rdma_device *rdma_open_device_client(struct sockaddr *addr);
 struct rdma_device *rdma_open_device_server(struct sockaddr *addr);
 
 /*
- * Reset device from failed state back to an operations state 
+ * Select the CQ completion vector and the polling CPU used by the following
+ * rdma_open_device_*() calls. A value of -1 (default) picks a CPU local to the
+ * NIC's NUMA node (from sysfs) and the completion vector matching that CPU.
+ */
+void rdma_set_affinity(int comp_vector, int cpu);
+
+enum rdma_transport {
+	RDMA_TRANSPORT_AUTO, /* DC on mlx5 devices, RC on the others */
+	RDMA_TRANSPORT_DC,
+	RDMA_TRANSPORT_RC,
+};
+
+/*
+ * Select the transport of the following rdma_open_device_*() calls; both
+ * sides must end up on the same one. With RC, the client accepts rdma_cm
+ * connections and its buffer descriptions name the port it listens on. The
+ * server connects one RC QP per client, on the first import of one of its
+ * buffers, and reaches it at the IP address its GID carries (RoCE). At most
+ * max_rc_peers (default 16) are connected at once: a new peer replaces one
+ * no remote buffer handle uses. Tasks and completions behave as with DC.
+ */
+void rdma_set_transport(enum rdma_transport transport, int max_rc_peers);
+
+enum rdma_dci_policy {
+	RDMA_DCI_POLICY_HASH,         /* by DCT number: a target's tasks stay in order on one DCI */
+	RDMA_DCI_POLICY_LEAST_LOADED, /* the DCI with the most free send WRs */
+	RDMA_DCI_POLICY_PER_THREAD,   /* each submitting thread on a DCI of its own, in the order they first submit */
+};
+
+/*
+ * Size the DCI pool of the following rdma_open_device_server() calls (default
+ * one DCI, at most 64) and how tasks are spread over it. Each DCI has its own
+ * send queue and lock, so targets on different DCIs don't serialize behind one
+ * another. With RDMA_DCI_POLICY_PER_THREAD and at least as many DCIs as
+ * submitting threads, no two threads ever post on the same DCI. A DCI whose
+ * completion fails is skipped until rdma_reset_device() resets it; the others
+ * keep running.
+ */
+void rdma_set_dci_pool(int num_dcis, enum rdma_dci_policy policy);
+
+/*
+ * Bound the AH cache of the following rdma_open_device_*() calls to max_ahs
+ * address handles (default 1024). When it is full, importing a new peer
+ * evicts a cached AH in CLOCK order. AHs held by a remote buffer handle are
+ * not evicted until it is released.
+ */
+void rdma_set_ah_cache_size(int max_ahs);
+
+struct rdma_ah_cache_stats {
+	uint64_t	hits;
+	uint64_t	misses;
+	uint64_t	evictions;
+	uint32_t	entries;
+	uint32_t	capacity;
+};
+
+void rdma_device_get_ah_cache_stats(struct rdma_device *device, struct rdma_ah_cache_stats *stats);
+
+/*
+ * Pin the calling thread (the one calling rdma_poll_completions) to the
+ * device's polling CPU
+ *
+ * returns: 0 on success, or the pthread_setaffinity_np error
+ */
+int rdma_device_pin_thread(struct rdma_device *device);
+
+/*
+ * Reset device from failed state back to an operations state
+ * Only the DCIs which had a failed completion are reset, all of them if none
+ * had (with RC, none then: a healthy connection is left alone, and a dropped
+ * one connects again on its next task). Their outstanding tasks are dropped;
+ * the other DCIs' completions polled meanwhile are kept for
+ * rdma_poll_completions(). Other threads may keep submitting and polling, but
+ * only one thread may reset at a time.
  */
 int rdma_reset_device(struct rdma_device *device);
 
@@ -106,6 +221,15 @@ void rdma_close_device(struct rdma_device *device);
 struct rdma_buffer *rdma_buffer_reg(struct rdma_device *device, void *addr, size_t length);
 void rdma_buffer_dereg(struct rdma_buffer *buffer);
 
+/*
+ * register an applciation buffer in the given mode, one of MR_MODE_PINNED, MR_MODE_ODP or
+ * MR_MODE_IMPLICIT_ODP (see odp_mr.h). A mode the device doesn't support over DC falls back
+ * to pinned. GPU memory must use MR_MODE_PINNED. ODP page-fault counters are printed on dereg
+ *
+ * returns: a pointer to the registered buffer or NULL on error
+ */
+struct rdma_buffer *rdma_buffer_reg_mode(struct rdma_device *device, void *addr, size_t length, int mr_mode);
+
 /*
  * Get a rdma_buffer address description string representations
  *
@@ -119,6 +243,29 @@ void rdma_buffer_dereg(struct rdma_buffer *buffer);
  */
 int rdma_buffer_get_desc_str(struct rdma_buffer *rdma_buff, char *desc_str, size_t desc_length);
 
+/*
+ * Get the binary description of a rdma_buffer, the compact alternative to
+ * rdma_buffer_get_desc_str()
+ *
+ * returns: sizeof(struct rdma_buffer_desc)
+ */
+int rdma_buffer_get_desc_bin(struct rdma_buffer *rdma_buff, struct rdma_buffer_desc *desc);
+
+/*
+ * Import a remote buffer description, given as a binary descriptor or as a
+ * description string, on the device which will access it. The address
+ * handle is created (or found in the device's AH cache) here, so tasks
+ * submitted with the returned handle don't parse or look up anything.
+ *
+ * returns: a pointer to the remote buffer handle or NULL on error
+ */
+struct rdma_remote_buffer *rdma_remote_buffer_import(struct rdma_device *device,
+                                                     const struct rdma_buffer_desc *desc);
+struct rdma_remote_buffer *rdma_remote_buffer_import_str(struct rdma_device *device,
+                                                         const char *desc_str, size_t desc_length);
+void rdma_remote_buffer_release(struct rdma_remote_buffer *remote_buf);
+uint64_t rdma_remote_buffer_size(const struct rdma_remote_buffer *remote_buf);
+
 /*
  * Issue a RDMA WRITE operation from a local buffer to a remote buffer, 
  * or a RDMA READ operation from remote buffer to a local buffer,
@@ -133,10 +280,24 @@ int rdma_buffer_get_desc_str(struct rdma_buffer *rdma_buff, char *desc_str, size
  * On completion of the RDMA operation, the status and wr_id will be reported
  * from rdma_poll_completions()
  *
- * returns: 0 on success, or the value of errno on failure
+ * Several threads may submit tasks on the same device concurrently, and
+ * concurrently with threads polling its completions.
+ *
+ * returns: 0 on success, or the value of errno on failure. ENOSPC means the
+ * send queue is full: poll completions and submit again. EIO means every DCI
+ * is in error: reset the device.
  */
 int rdma_submit_task(struct rdma_task_attr *attr);
 
+/*
+ * Same as rdma_submit_task(), for a remote buffer imported with
+ * rdma_remote_buffer_import(). Accesses attr->length bytes (the rest of the
+ * remote buffer if 0) starting at remote_buf_offset.
+ *
+ * returns: 0 on success, or the value of errno on failure
+ */
+int rdma_submit_remote_task(struct rdma_remote_task_attr *attr);
+
 enum rdma_completion_status {
 	RDMA_STATUS_SUCCESS,
 	RDMA_STATUS_ERR_LAST,
@@ -150,6 +311,9 @@ struct rdma_completion_event {
 /*
  * Return rdma operations which have completed.
  * the event will hold the requets id (wr_id) and the status of the operation.
+ * Thread-safe: any thread may poll, each completion is reported to one of them.
+ * The CQ is read in batches of the device's poll batch size until num_entries
+ * are reported or it is empty.
  *
  * returns: number of reported events in the event array (<= num_entries)
  */
@@ -157,6 +321,61 @@ int rdma_poll_completions(struct rdma_device *device,
 		struct rdma_completion_event *event,
 		uint32_t num_entries);
 
+/*
+ * Set how many work completions one read of the CQ takes (default 16, at most
+ * the CQ depth). This is also the array size rdma_process_completions() hands
+ * to the callback.
+ *
+ * returns: 0 on success, or the value of errno on failure
+ */
+int rdma_device_set_poll_batch(struct rdma_device *device, uint32_t batch);
+
+/*
+ * Sample the latency of one in every `every` tasks (0 - off, the default).
+ * The HCA clock is read at submit and the sampled task's CQE carries its
+ * completion timestamp. Submit -> CQE and CQE -> poll go into log-linear
+ * histograms, in nSec through the HCA's core clock. The overhead is a clock
+ * read per sampled task, and polling one CQE at a time while sampling is on.
+ *
+ * returns: 0 on success, ENOTSUP if the device's CQ has no completion timestamps
+ */
+int rdma_device_set_latency_sampling(struct rdma_device *device, uint32_t every);
+
+/*
+ * Print the latency histograms' percentiles to f, and with reset set start them over
+ */
+void rdma_device_print_latency(struct rdma_device *device, FILE *f, int reset);
+
+typedef void (*rdma_completion_cb)(void *ctx, const struct rdma_completion_event *events, int num_events);
+
+/*
+ * Register the callback of rdma_process_completions(), NULL to remove it
+ */
+void rdma_device_set_completion_cb(struct rdma_device *device, rdma_completion_cb cb, void *ctx);
+
+/*
+ * Poll up to one batch of completions and pass them to the registered callback
+ * as one contiguous array, without copying them out to the caller. The callback
+ * runs with the device's polling lock held: it may submit tasks but must not
+ * poll the same device.
+ *
+ * returns: number of completions delivered
+ */
+int rdma_process_completions(struct rdma_device *device);
+
+/*
+ * Client side: return the notify_data of tasks submitted by the server with
+ * RDMA_TASK_ATTR_NOTIFY which have completed on this device. A write carries
+ * it as the immediate data of its last WR, a read is followed by a fenced
+ * zero-length write-with-imm. Either way one completion on the client means
+ * the data is in place (write) or free to reuse (read).
+ *
+ * returns: number of reported values in notify_data (<= num_entries), or -1 on a failed completion
+ */
+int rdma_poll_notifications(struct rdma_device *device,
+		uint32_t *notify_data,
+		uint32_t num_entries);
+
 #ifdef __cplusplus
 }
 #endif
@@ -54,6 +54,7 @@
 #endif //HAVE_CUDA
 
 #include "gpu_mem_util.h"
+#include "hugepage_alloc.h"
 
 extern int debug;
 extern int debug_fast_path;
@@ -225,6 +226,48 @@ static int free_gpu(void *gpu_buff)
 }
 #endif //HAVE_CUDA
 
+/*
+ * CPU work buffers are hugepage mappings; munmap needs the mapped length and
+ * page size, so remember them until work_buffer_free()
+ */
+#define MAX_CPU_BUFFERS 16
+static struct hugebuf cpu_buffers[MAX_CPU_BUFFERS];
+
+static void *cpu_buffer_alloc(size_t length)
+{
+    int i;
+
+    for (i = 0; i < MAX_CPU_BUFFERS; i++) {
+        if (!cpu_buffers[i].addr)
+            break;
+    }
+    if (i == MAX_CPU_BUFFERS) {
+        fprintf(stderr, "Too many CPU work buffers (max %d)\n", MAX_CPU_BUFFERS);
+        return NULL;
+    }
+
+    if (hugebuf_alloc(&cpu_buffers[i], length)) {
+        return NULL;
+    }
+    DEBUG_LOG("memory buffer(%p) of %zu bytes backed by %zu byte pages\n",
+              cpu_buffers[i].addr, length, cpu_buffers[i].page_size);
+
+    return cpu_buffers[i].addr;
+}
+
+static void cpu_buffer_free(void *buff)
+{
+    int i;
+
+    for (i = 0; i < MAX_CPU_BUFFERS; i++) {
+        if (cpu_buffers[i].addr == buff) {
+            hugebuf_free(&cpu_buffers[i]);
+            return;
+        }
+    }
+    fprintf(stderr, "Unknown CPU work buffer %p\n", buff);
+}
+
 /****************************************************************************************
  * Memory allocation on CPU or GPU according to HAVE_CUDA pre-compile option and use_cuda flag
  * Return value: Allocated buffer pointer (if success), NULL (if error)
@@ -245,14 +288,12 @@ void *work_buffer_alloc(size_t length, int use_cuda, const char *bdf)
             return NULL;
         }
     } else {
-        /* Mem allocation on CPU */
-        int page_size = sysconf(_SC_PAGESIZE);
-        buff = memalign(page_size, length);
+        /* Mem allocation on CPU, hugepage backed when available */
+        buff = cpu_buffer_alloc(length);
         if (!buff) {
             fprintf(stderr, "Couldn't allocate work buffer on CPU.\n");
             return NULL;
         }
-        DEBUG_LOG("memory buffer(%p) allocated\n", buff);
     }
     return buff;
 }
@@ -270,7 +311,7 @@ void work_buffer_free(void *buff, int use_cuda)
 #endif //HAVE_CUDA
     } else {
         DEBUG_LOG("free memory buffer(%p)\n", buff);
-        free(buff);
+        cpu_buffer_free(buff);
     }
 }
 
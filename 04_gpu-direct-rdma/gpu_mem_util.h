@@ -38,7 +38,8 @@ extern "C" {
 #endif
 
 /*
- * Memory allocation on CPU or GPU according to HAVE_CUDA pre-compile option and use_cuda flag
+ * Memory allocation on CPU or GPU according to HAVE_CUDA pre-compile option and use_cuda flag.
+ * CPU buffers are pre-faulted and backed by hugepages when available (see hugepage_alloc.h)
  *
  * returns: a pointer to the allocated buffer or NULL on error
  */
@@ -44,14 +44,23 @@
 #include <getopt.h>
 #include <arpa/inet.h>
 #include <time.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/epoll.h>
 
 #include "utils.h"
 #include "gpu_mem_util.h"
+#include "odp_mr.h"
 #include "gpu_direct_rdma_access.h"
 
 #define MAX_SGES 512
 #define ACK_MSG "rdma_task completed"
 #define PACKAGE_TYPES 2
+#define MAX_STREAM_THREADS 64
+#define DESC_STRING_LENGTH (sizeof "0102030405060708:01020304:01020304:0102:010203:1:0102030405060708090a0b0c0d0e0f10")
+
+enum payload_t { RDMA_BUF_DESC, TASK_ATTRS, RDMA_BUF_DESC_BIN, STREAM_ATTRS };
 
 extern int debug;
 extern int debug_fast_path;
@@ -72,6 +81,17 @@ struct user_params {
     int                 num_sges;
     int                     use_cuda;
     char                   *bdf;
+    int                 cpu;
+    int                 comp_vector;
+    int                 num_dcis;
+    int                 least_loaded;
+    int                 dci_per_thread;
+    int                 multi_client;
+    int                 poll_batch;
+    int                 lat_every;
+    int                 ah_cache_size;
+    int                 rc;
+    int                 rc_peers;
     struct sockaddr     hostaddr;
 };
 
@@ -83,12 +103,10 @@ void sigint_handler(int dummy)
 }
 
 /****************************************************************************************
- * Open temporary socket connection on the server side, listening to the client.
- * Accepting connection from the client and closing temporary socket.
- * If success, return the accepted socket file descriptor ID
+ * Open a socket bound to port and listening, with room for backlog pending connections
  * Return value: socket fd - success, -1 - error
  ****************************************************************************************/
-static int open_server_socket(int port)
+static int open_listen_socket(int port, int backlog)
 {
     struct addrinfo *res, *t;
     struct addrinfo hints = {
@@ -98,7 +116,6 @@ static int open_server_socket(int port)
     };
     char   *service;
     int     ret_val;
-    int     sockfd;
     int     tmp_sockfd = -1;
 
     ret_val = asprintf(&service, "%d", port);
@@ -134,7 +151,25 @@ static int open_server_socket(int port)
         return -1;
     }
 
-    listen(tmp_sockfd, 1);
+    listen(tmp_sockfd, backlog);
+    return tmp_sockfd;
+}
+
+/****************************************************************************************
+ * Open temporary socket connection on the server side, listening to the client.
+ * Accepting connection from the client and closing temporary socket.
+ * If success, return the accepted socket file descriptor ID
+ * Return value: socket fd - success, -1 - error
+ ****************************************************************************************/
+static int open_server_socket(int port)
+{
+    int     sockfd;
+    int     tmp_sockfd;
+
+    tmp_sockfd = open_listen_socket(port, 1);
+    if (tmp_sockfd < 0) {
+        return -1;
+    }
     sockfd = accept(tmp_sockfd, NULL, 0);
     close(tmp_sockfd);
     if (sockfd < 0) {
@@ -145,6 +180,596 @@ static int open_server_socket(int port)
     return sockfd;
 }
 
+/****************************************************************************************
+ * Stream mode: the client sent its buffer description once, split into depth slots. Keep
+ * up to depth tasks in flight, each on a slot no other task in flight uses (task k on slot
+ * k % depth while they complete in order), each one notifying the client
+ * through RDMA (RDMA_TASK_ATTR_NOTIFY) instead of a TCP ack. The tasks in flight share the
+ * local buffer, nothing looks at the data.
+ *
+ * With threads > 1 that many threads submit on the same device: each claims the next task
+ * number and a place among the depth in flight, and polls completions for whoever posted
+ * them. The run time then shows how submission scales with threads. Completions come in
+ * batches through the device's completion callback rather than copied out per call. A
+ * task's wr_id carries its slot in the upper 32 bits and its number in the lower ones.
+ ****************************************************************************************/
+struct stream_ctx {
+    struct rdma_device                  *rdma_dev;
+    const struct rdma_remote_task_attr  *task_attr;
+    int                                  iters;
+    int                                  depth;
+    unsigned long                        slot;      /* the client's buffer / depth */
+    int                                  next;      /* next task number to submit */
+    int                                  in_flight;
+    int                                  completed;
+    int                                  failed;
+    uint8_t                              slot_busy[NOTIFY_RECV_DEPTH];
+};
+
+/* rdma_process_completions() callback, one thread at a time */
+static void stream_completions(void *arg, const struct rdma_completion_event *events, int num_events)
+{
+    struct stream_ctx *ctx = arg;
+    int    i;
+
+    for (i = 0; i < num_events; ++i) {
+        if (events[i].status != RDMA_STATUS_SUCCESS) {
+            fprintf(stderr, "FAILURE: status \"%s\" (%d) for wr_id %d\n",
+                    ibv_wc_status_str(events[i].status),
+                    events[i].status, (int)(uint32_t) events[i].wr_id);
+            __atomic_store_n(&ctx->failed, 1, __ATOMIC_RELAXED);
+        }
+        /* free before in_flight drops, so whoever takes that place finds a slot */
+        __atomic_store_n(&ctx->slot_busy[events[i].wr_id >> 32], 0, __ATOMIC_RELEASE);
+    }
+    __atomic_sub_fetch(&ctx->in_flight, num_events, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&ctx->completed, num_events, __ATOMIC_RELAXED);
+}
+
+/*
+ * A slot no task in flight uses, searched from hint. The caller holds a place among the
+ * depth in flight, so one is free; without the lock of a shared free list.
+ */
+static int stream_claim_slot(struct stream_ctx *ctx, int hint)
+{
+    int i, slot;
+
+    for (i = 0; ; i++) {
+        slot = (hint + i) % ctx->depth;
+        if (!__atomic_exchange_n(&ctx->slot_busy[slot], 1, __ATOMIC_ACQUIRE)) {
+            return slot;
+        }
+    }
+}
+
+static void *stream_worker(void *arg)
+{
+    struct stream_ctx *ctx = arg;
+    struct rdma_remote_task_attr task_attr = *ctx->task_attr;
+    int    pending = -1; /* task number claimed but not submitted yet */
+    int    slot = 0;     /* and its slot */
+    int    ret_val;
+
+    while (__atomic_load_n(&ctx->completed, __ATOMIC_RELAXED) < ctx->iters &&
+           !__atomic_load_n(&ctx->failed, __ATOMIC_RELAXED) && keep_running) {
+        while (1) {
+            if (pending < 0) {
+                if (__atomic_add_fetch(&ctx->in_flight, 1, __ATOMIC_RELAXED) > ctx->depth) {
+                    __atomic_sub_fetch(&ctx->in_flight, 1, __ATOMIC_RELAXED);
+                    break;
+                }
+                pending = __atomic_fetch_add(&ctx->next, 1, __ATOMIC_RELAXED);
+                if (pending >= ctx->iters) {
+                    __atomic_sub_fetch(&ctx->in_flight, 1, __ATOMIC_RELAXED);
+                    pending = -1;
+                    break;
+                }
+                slot = stream_claim_slot(ctx, pending % ctx->depth);
+            }
+            task_attr.remote_buf_offset = slot * ctx->slot;
+            task_attr.wr_id             = ((uint64_t)slot << 32) | (uint32_t)pending;
+            task_attr.notify_data       = pending;
+            ret_val = rdma_submit_remote_task(&task_attr);
+            if (ret_val == ENOSPC) {
+                break; /* out of send WRs, the completions will free some; retry pending then */
+            }
+            if (ret_val) {
+                __atomic_store_n(&ctx->failed, 1, __ATOMIC_RELAXED);
+                return NULL;
+            }
+            pending = -1;
+        }
+
+        rdma_process_completions(ctx->rdma_dev);
+    }
+    return NULL;
+}
+
+/*
+ * Slot size of a client streaming depth tasks into remote_buf, 0 if it can't: each task
+ * in flight notifies through one of the client's NOTIFY_RECV_DEPTH receives.
+ */
+static unsigned long stream_slot(struct rdma_remote_buffer *remote_buf, int depth)
+{
+    if (depth > NOTIFY_RECV_DEPTH) {
+        fprintf(stderr, "FAILURE: %d tasks in flight, the client has %d notification receives\n",
+                depth, NOTIFY_RECV_DEPTH);
+        return 0;
+    }
+    if (rdma_remote_buffer_size(remote_buf) < (uint64_t)depth) {
+        fprintf(stderr, "FAILURE: remote buffer of %lu bytes can't hold %d slots\n",
+                (unsigned long)rdma_remote_buffer_size(remote_buf), depth);
+        return 0;
+    }
+    return rdma_remote_buffer_size(remote_buf) / depth;
+}
+
+/* Return value: 0 - success, 1 - error */
+static int stream_tasks(struct rdma_device *rdma_dev, struct rdma_remote_task_attr *task_attr,
+                        int iters, int depth, int threads, unsigned long size)
+{
+    struct stream_ctx ctx = {
+        .rdma_dev  = rdma_dev,
+        .task_attr = task_attr,
+        .iters     = iters,
+        .depth     = depth,
+        .slot      = stream_slot(task_attr->remote_buf, depth),
+    };
+    pthread_t tids[MAX_STREAM_THREADS];
+    int    i, started;
+
+    if (!ctx.slot) {
+        return 1;
+    }
+    task_attr->flags |= RDMA_TASK_ATTR_NOTIFY;
+    task_attr->length = size < ctx.slot ? size : ctx.slot; /* no more than the local buffer holds */
+    rdma_device_set_completion_cb(rdma_dev, stream_completions, &ctx);
+
+    /* the calling thread, pinned next to the NIC, is submitter 0 */
+    for (started = 0; started < threads - 1; started++) {
+        if (pthread_create(&tids[started], NULL, stream_worker, &ctx)) {
+            fprintf(stderr, "FAILURE: Couldn't start submitter thread %d\n", started + 1);
+            ctx.failed = 1;
+            break;
+        }
+    }
+    if (!ctx.failed) {
+        stream_worker(&ctx);
+    }
+    for (i = 0; i < started; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    rdma_device_set_completion_cb(rdma_dev, NULL, NULL);
+    return ctx.failed || ctx.completed < iters;
+}
+
+/* Split the local buffer into num_sges 64 byte aligned portions */
+static void prepare_sg_list(struct iovec *buf_iovec, void *buff, struct user_params *usr_par)
+{
+    size_t  portion_size;
+    int     i;
+
+    memset(buf_iovec, 0, MAX_SGES * sizeof *buf_iovec);
+    portion_size = (usr_par->size / usr_par->num_sges) & 0xFFFFFFC0; /* 64 byte aligned */
+    for (i = 0; i < usr_par->num_sges; i++) {
+        buf_iovec[i].iov_base = buff + (i * portion_size);
+        buf_iovec[i].iov_len  = portion_size;
+    }
+}
+
+/****************************************************************************************
+ * Multi-client mode (-M): one thread serves every connected client. epoll watches the
+ * listening socket and the clients' sockets, and each client's requests (the same packages
+ * as in the single-client loop) are parsed as they arrive. Tasks of all clients go to the
+ * shared DCI(s) in round robin, one task per ready client per round, so a client streaming
+ * deep never starves one doing a task at a time. The completion's wr_id carries the client
+ * index in bits 40-47, the stream slot in bits 32-39 and the task number below.
+ ****************************************************************************************/
+#define MAX_CLIENTS     256
+#define CLIENT_RX_SIZE  512
+
+struct mc_client {
+    int                           sockfd;
+    int                           idx;
+    struct timeval                start;
+    uint8_t                       rx[CLIENT_RX_SIZE];
+    size_t                        rx_len;
+    /* the request being parsed */
+    char                          desc[DESC_STRING_LENGTH];
+    uint8_t                       desc_type;
+    uint16_t                      desc_size;
+    int                           got_desc;
+    int                           got_flags;
+    uint32_t                      flags; /* Use enum rdma_task_attr_flags */
+    /* the last imported description */
+    struct rdma_remote_buffer    *remote_buf;
+    char                          imported_desc[DESC_STRING_LENGTH];
+    uint16_t                      imported_size;
+    struct rdma_remote_task_attr  task_attr;
+    int                           stream_iters; /* 0 - a TCP ack per task */
+    int                           depth;        /* tasks in flight at most */
+    unsigned long                 slot;         /* of the client's buffer, per task in flight */
+    uint8_t                       slot_busy[NOTIFY_RECV_DEPTH];
+    uint32_t                      retry[NOTIFY_RECV_DEPTH]; /* task numbers flushed by another's failure */
+    int                           retry_cnt;    /* counted in pending too */
+    int                           io_failed;    /* EIO since the last reset: a second one drops the client */
+    int                           pending;      /* requested, not submitted yet */
+    int                           submitted;
+    int                           in_flight;
+    int                           completed;
+    int                           closing;      /* gone, freed when nothing is in flight */
+};
+
+struct mc_server {
+    struct rdma_device           *rdma_dev;
+    struct rdma_buffer           *rdma_buff;
+    struct user_params           *usr_par;
+    struct iovec                 *buf_iovec;
+    int                           epfd;
+    struct mc_client             *clients[MAX_CLIENTS];
+    int                           num_clients;
+    int                           rr_next;      /* first client of the next round */
+    int                           in_flight;
+    int                           failed;       /* a task failed: submit nothing until all drain, then reset */
+};
+
+static void mc_client_close(struct mc_server *srv, struct mc_client *c)
+{
+    if (!c->closing) {
+        epoll_ctl(srv->epfd, EPOLL_CTL_DEL, c->sockfd, NULL);
+        close(c->sockfd);
+        c->closing = 1;
+        c->pending = 0;
+        if (c->completed) {
+            printf("Client %d: ", c->idx);
+            print_run_time(c->start, srv->usr_par->size, c->completed);
+        }
+    }
+    if (c->in_flight) {
+        return; /* its completions still map to this slot */
+    }
+    if (c->remote_buf) {
+        rdma_remote_buffer_release(c->remote_buf);
+    }
+    srv->clients[c->idx] = NULL;
+    srv->num_clients--;
+    if (!srv->num_clients) {
+        struct rdma_ah_cache_stats ah_stats;
+
+        rdma_device_get_ah_cache_stats(srv->rdma_dev, &ah_stats);
+        printf("AH cache: %u/%u entries, %lu hits, %lu misses, %lu evictions\n",
+               ah_stats.entries, ah_stats.capacity, (unsigned long)ah_stats.hits,
+               (unsigned long)ah_stats.misses, (unsigned long)ah_stats.evictions);
+        if (srv->usr_par->lat_every) {
+            rdma_device_print_latency(srv->rdma_dev, stdout, 1);
+        }
+    }
+    printf("Client %d disconnected, %d connected\n", c->idx, srv->num_clients);
+    free(c);
+}
+
+static void mc_accept(struct mc_server *srv, int listenfd)
+{
+    struct epoll_event ev = { .events = EPOLLIN };
+    struct mc_client  *c;
+    int                sockfd, i;
+
+    while ((sockfd = accept4(listenfd, NULL, NULL, SOCK_NONBLOCK)) >= 0) {
+        for (i = 0; i < MAX_CLIENTS && srv->clients[i]; i++)
+            ;
+        c = i < MAX_CLIENTS ? calloc(1, sizeof *c) : NULL;
+        if (!c) {
+            fprintf(stderr, "Refusing a client, %d connected\n", srv->num_clients);
+            close(sockfd);
+            continue;
+        }
+        c->sockfd = sockfd;
+        c->idx    = i;
+        c->depth  = 1;
+        gettimeofday(&c->start, NULL);
+        ev.data.ptr = c;
+        if (epoll_ctl(srv->epfd, EPOLL_CTL_ADD, sockfd, &ev)) {
+            perror("epoll_ctl");
+            close(sockfd);
+            free(c);
+            continue;
+        }
+        srv->clients[i] = c;
+        srv->num_clients++;
+        printf("Client %d connected, %d connected\n", i, srv->num_clients);
+    }
+}
+
+/* A request is complete: import the description if it changed and queue its task(s) */
+static int mc_request(struct mc_server *srv, struct mc_client *c)
+{
+    if (!c->remote_buf || c->desc_size != c->imported_size || memcmp(c->desc, c->imported_desc, c->desc_size)) {
+        if (c->in_flight) {
+            fprintf(stderr, "Client %d: new description with tasks in flight\n", c->idx);
+            return 1;
+        }
+        if (c->remote_buf) {
+            rdma_remote_buffer_release(c->remote_buf);
+        }
+        c->remote_buf = (c->desc_type == RDMA_BUF_DESC_BIN)
+            ? rdma_remote_buffer_import(srv->rdma_dev, (struct rdma_buffer_desc *)c->desc)
+            : rdma_remote_buffer_import_str(srv->rdma_dev, c->desc, c->desc_size);
+        if (!c->remote_buf) {
+            return 1;
+        }
+        memcpy(c->imported_desc, c->desc, c->desc_size);
+        c->imported_size = c->desc_size;
+    }
+
+    memset(&c->task_attr, 0, sizeof c->task_attr);
+    c->task_attr.remote_buf     = c->remote_buf;
+    c->task_attr.local_buf_rdma = srv->rdma_buff;
+    c->task_attr.flags          = c->flags;
+    if (srv->usr_par->num_sges) {
+        c->task_attr.local_buf_iovcnt = srv->usr_par->num_sges;
+        c->task_attr.local_buf_iovec  = srv->buf_iovec;
+    }
+    if (c->stream_iters) {
+        c->slot = stream_slot(c->remote_buf, c->depth);
+        if (!c->slot) {
+            return 1;
+        }
+        c->task_attr.flags |= RDMA_TASK_ATTR_NOTIFY;
+        c->task_attr.length = srv->usr_par->size < c->slot ? srv->usr_par->size : c->slot;
+        c->pending = c->stream_iters;
+        printf("Client %d: streaming %d tasks, %d in flight\n", c->idx, c->stream_iters, c->depth);
+    } else {
+        c->pending++;
+    }
+    c->got_desc = c->got_flags = 0;
+    return 0;
+}
+
+/* Consume the complete payloads received so far. Return value: 0 - success, 1 - error */
+static int mc_parse(struct mc_server *srv, struct mc_client *c)
+{
+    size_t   off = 0;
+    uint8_t  pl_type;
+    uint16_t pl_size;
+    int      threads;
+
+    while (c->rx_len - off >= sizeof pl_type + sizeof pl_size) {
+        const char *pl = (const char *)c->rx + off + sizeof pl_type + sizeof pl_size;
+
+        pl_type = c->rx[off];
+        memcpy(&pl_size, c->rx + off + sizeof pl_type, sizeof pl_size);
+        if (pl_size > CLIENT_RX_SIZE - sizeof pl_type - sizeof pl_size) {
+            fprintf(stderr, "Client %d: payload of %u bytes\n", c->idx, pl_size);
+            return 1;
+        }
+        if (c->rx_len - off - sizeof pl_type - sizeof pl_size < pl_size) {
+            break;
+        }
+        switch (pl_type) {
+            case RDMA_BUF_DESC:
+            case RDMA_BUF_DESC_BIN:
+                if (pl_size != (pl_type == RDMA_BUF_DESC_BIN ? sizeof(struct rdma_buffer_desc) : sizeof c->desc)) {
+                    fprintf(stderr, "Client %d: unexpected RDMA data size %u\n", c->idx, pl_size);
+                    return 1;
+                }
+                memcpy(c->desc, pl, pl_size);
+                c->desc_type = pl_type;
+                c->desc_size = pl_size;
+                c->got_desc  = 1;
+                break;
+            case TASK_ATTRS:
+                if (sscanf(pl, "%08x", &c->flags) != 1) {
+                    return 1;
+                }
+                c->got_flags = 1;
+                break;
+            case STREAM_ATTRS:
+                /* the submitter threads of the single-client mode don't apply here */
+                if (sscanf(pl, "%x:%x:%x", &c->stream_iters, &c->depth, &threads) < 1) {
+                    return 1;
+                }
+                if (c->depth < 1) {
+                    c->depth = 1;
+                }
+                break;
+            default:
+                fprintf(stderr, "Client %d: unknown payload type %u\n", c->idx, pl_type);
+                return 1;
+        }
+        off += sizeof pl_type + sizeof pl_size + pl_size;
+        if (c->got_desc && c->got_flags && mc_request(srv, c)) {
+            return 1;
+        }
+    }
+    c->rx_len -= off;
+    memmove(c->rx, c->rx + off, c->rx_len);
+    return 0;
+}
+
+static void mc_receive(struct mc_server *srv, struct mc_client *c)
+{
+    ssize_t r_size;
+
+    while ((r_size = recv(c->sockfd, c->rx + c->rx_len, CLIENT_RX_SIZE - c->rx_len, 0)) > 0) {
+        c->rx_len += r_size;
+        if (mc_parse(srv, c)) {
+            mc_client_close(srv, c);
+            return;
+        }
+    }
+    if (r_size == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+        mc_client_close(srv, c);
+    }
+}
+
+/*
+ * Submit one task of every client which has one pending and room in its depth, starting
+ * where the last round stopped. A stream task flushed by another's failure goes again
+ * under its own number. Returns the number submitted, -1 when the send queue is full.
+ * A client whose task can't be posted (EIO) is skipped until the device is reset, and
+ * dropped if that happens again.
+ */
+static int mc_submit_round(struct mc_server *srv)
+{
+    int      n, slot, submitted = 0, ret_val;
+    uint32_t task;
+
+    for (n = 0; n < MAX_CLIENTS; n++) {
+        int               i = (srv->rr_next + n) % MAX_CLIENTS;
+        struct mc_client *c = srv->clients[i];
+
+        if (!c || !c->pending || c->in_flight >= c->depth) {
+            continue;
+        }
+        slot = 0;
+        task = c->retry_cnt ? c->retry[c->retry_cnt - 1] : (uint32_t)c->submitted;
+        if (c->stream_iters) {
+            /* one is free below depth: tasks on different DCIs complete out of order */
+            for (slot = task % c->depth; c->slot_busy[slot]; slot = (slot + 1) % c->depth)
+                ;
+            c->task_attr.remote_buf_offset = slot * c->slot;
+            c->task_attr.notify_data       = task;
+        }
+        c->task_attr.wr_id = ((uint64_t)c->idx << 40) | ((uint64_t)slot << 32) | task;
+        ret_val = rdma_submit_remote_task(&c->task_attr);
+        if (ret_val == ENOSPC) {
+            srv->rr_next = i; /* its turn comes first when WRs are back */
+            return -1;
+        }
+        if (ret_val == EIO && !c->io_failed) {
+            c->io_failed = 1;
+            srv->failed  = 1; /* reset what is in error once everything in flight is reported */
+            continue;
+        }
+        if (ret_val) {
+            fprintf(stderr, "FAILURE: client %d: couldn't submit task %u (%d)\n", c->idx, task, ret_val);
+            mc_client_close(srv, c);
+            continue;
+        }
+        c->io_failed = 0;
+        c->slot_busy[slot] = c->stream_iters != 0;
+        if (c->retry_cnt) {
+            c->retry_cnt--;
+        } else {
+            c->submitted++;
+        }
+        c->pending--;
+        c->in_flight++;
+        srv->in_flight++;
+        submitted++;
+    }
+    srv->rr_next = (srv->rr_next + 1) % MAX_CLIENTS;
+    return submitted;
+}
+
+static void mc_complete(struct mc_server *srv)
+{
+    struct rdma_completion_event rdma_comp_ev[16];
+    int    i, reported_ev;
+
+    reported_ev = rdma_poll_completions(srv->rdma_dev, rdma_comp_ev, 16);
+    for (i = 0; i < reported_ev; ++i) {
+        struct mc_client *c = srv->clients[rdma_comp_ev[i].wr_id >> 40];
+
+        srv->in_flight--;
+        c->in_flight--;
+        c->slot_busy[(rdma_comp_ev[i].wr_id >> 32) & 0xff] = 0;
+        if ((int)rdma_comp_ev[i].status == IBV_WC_WR_FLUSH_ERR) {
+            /* another task failed on the same DCI: this one goes again after the reset */
+            srv->failed = 1;
+            if (c->closing) {
+                mc_client_close(srv, c);
+            } else {
+                if (c->stream_iters) {
+                    c->retry[c->retry_cnt++] = (uint32_t)rdma_comp_ev[i].wr_id;
+                }
+                c->pending++;
+            }
+            continue;
+        }
+        if ((int)rdma_comp_ev[i].status != IBV_WC_SUCCESS) {
+            /* the task that failed: only its own client goes */
+            fprintf(stderr, "FAILURE: client %d: status \"%s\" (%d) for task %u\n", c->idx,
+                    ibv_wc_status_str(rdma_comp_ev[i].status), rdma_comp_ev[i].status,
+                    (uint32_t)rdma_comp_ev[i].wr_id);
+            srv->failed = 1;
+            mc_client_close(srv, c);
+            continue;
+        }
+        c->completed++;
+        if (c->closing) {
+            mc_client_close(srv, c);
+        } else if (!c->stream_iters && write(c->sockfd, ACK_MSG, sizeof(ACK_MSG)) != sizeof(ACK_MSG)) {
+            fprintf(stderr, "FAILURE: client %d: couldn't send ack (errno=%d '%m')\n", c->idx, errno);
+            mc_client_close(srv, c);
+        }
+    }
+}
+
+/* Return value: 0 - success, 1 - error */
+static int serve_clients(struct rdma_device *rdma_dev, struct rdma_buffer *rdma_buff,
+                         struct user_params *usr_par, struct iovec *buf_iovec)
+{
+    struct mc_server   srv = {
+        .rdma_dev  = rdma_dev,
+        .rdma_buff = rdma_buff,
+        .usr_par   = usr_par,
+        .buf_iovec = buf_iovec,
+    };
+    struct epoll_event ev = { .events = EPOLLIN }, events[64];
+    int                listenfd, n, i;
+
+    listenfd = open_listen_socket(usr_par->port, MAX_CLIENTS);
+    if (listenfd < 0) {
+        return 1;
+    }
+    fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK);
+    srv.epfd = epoll_create1(0);
+    ev.data.ptr = NULL; /* the listening socket */
+    if (srv.epfd < 0 || epoll_ctl(srv.epfd, EPOLL_CTL_ADD, listenfd, &ev)) {
+        perror("epoll");
+        close(listenfd);
+        return 1;
+    }
+    printf("Serving clients on port %d...\n", usr_par->port);
+
+    while (keep_running) {
+        /* don't sleep while there is RDMA work */
+        n = epoll_wait(srv.epfd, events, 64, srv.in_flight ? 0 : 100);
+        for (i = 0; i < n; i++) {
+            if (!events[i].data.ptr) {
+                mc_accept(&srv, listenfd);
+            } else {
+                mc_receive(&srv, events[i].data.ptr);
+            }
+        }
+
+        while (!srv.failed && mc_submit_round(&srv) > 0)
+            ;
+        if (srv.in_flight) {
+            mc_complete(&srv);
+        }
+        if (srv.failed && !srv.in_flight) {
+            /* every task of the failed DCI(s) has been reported: reset them */
+            rdma_reset_device(rdma_dev);
+            srv.failed = 0;
+        }
+    }
+
+    for (i = 0; i < MAX_CLIENTS; i++) {
+        if (srv.clients[i]) {
+            mc_client_close(&srv, srv.clients[i]);
+        }
+    }
+    /* drain what is still in flight before the buffers go away */
+    while (srv.in_flight && srv.num_clients) {
+        mc_complete(&srv);
+    }
+    close(srv.epfd);
+    close(listenfd);
+    return 0;
+}
+
 static void usage(const char *argv0)
 {
     printf("Usage:\n");
@@ -152,6 +777,7 @@ static void usage(const char *argv0)
     printf("\n");
     printf("Options:\n");
     printf("  -P, --persistent          server waits for additional client connections after tranfer is completed\n");
+    printf("  -M, --multi-client        serve many clients at once (epoll), their tasks sharing the DCI(s) in round robin\n");
     printf("  -a, --addr=<ipaddr>       ip address of the local host net device <ipaddr v4> (mandatory)\n");
     printf("  -p, --port=<port>         listen on/connect to port <port> (default 18515)\n");
     printf("  -s, --size=<size>         size of message to exchange (default 4096)\n");
@@ -159,6 +785,16 @@ static void usage(const char *argv0)
     printf("  -u, --use-cuda=<BDF>      use CUDA pacage (work with GPU memoty),\n"
            "                            BDF corresponding to CUDA device, for example, \"3e:02.0\"\n");
     printf("  -l, --sg_list-len=<length> number of sge-s to send in sg_list (default 0 - old mode)\n");
+    printf("  -c, --cpu=<cpu>           pin the polling thread to <cpu> (default: a CPU on the NIC's NUMA node)\n");
+    printf("  -v, --comp-vector=<vec>   CQ completion vector (default: the one matching the polling CPU)\n");
+    printf("  -d, --dcis=<n>            number of DCIs to spread the targets over (default 1, max 64)\n");
+    printf("  -b, --poll-batch=<n>      work completions read from the CQ at once (default 16)\n");
+    printf("  -S, --lat-sample=<n>      sample the latency of 1 in <n> tasks into histograms (default 0 - off)\n");
+    printf("  -A, --ah-cache=<n>        address handles cached for the clients' GIDs/LIDs (default 1024)\n");
+    printf("  -R, --rc                  use RC connections instead of DC (default: DC on mlx5 devices, RC otherwise)\n");
+    printf("  -r, --rc-peers=<n>        RC connections kept open to clients at once (default 16, max 64)\n");
+    printf("  -L, --least-loaded        send each task on the DCI with the most free WRs (default: hash by DCT number)\n");
+    printf("  -t, --dci-per-thread      each submitter thread posts on a DCI of its own (give -d at least the client's -T)\n");
     printf("  -D, --debug-mask=<mask>   debug bitmask: bit 0 - debug print enable,\n"
            "                                           bit 1 - fast path debug print enable\n");
 }
@@ -170,23 +806,37 @@ static int parse_command_line(int argc, char *argv[], struct user_params *usr_pa
     usr_par->port       = 18515;
     usr_par->size       = 4096;
     usr_par->iters      = 1000;
+    usr_par->cpu        = -1;
+    usr_par->comp_vector = -1;
+    usr_par->num_dcis   = 1;
 
     while (1) {
         int c;
 
         static struct option long_options[] = {
             { .name = "persistent",    .has_arg = 0, .val = 'P' },
+            { .name = "multi-client",  .has_arg = 0, .val = 'M' },
             { .name = "addr",          .has_arg = 1, .val = 'a' },
             { .name = "port",          .has_arg = 1, .val = 'p' },
             { .name = "size",          .has_arg = 1, .val = 's' },
             { .name = "iters",         .has_arg = 1, .val = 'n' },
             { .name = "sg_list-len",   .has_arg = 1, .val = 'l' },
             { .name = "use-cuda",      .has_arg = 1, .val = 'u' },
+            { .name = "cpu",           .has_arg = 1, .val = 'c' },
+            { .name = "comp-vector",   .has_arg = 1, .val = 'v' },
+            { .name = "dcis",          .has_arg = 1, .val = 'd' },
+            { .name = "least-loaded",  .has_arg = 0, .val = 'L' },
+            { .name = "dci-per-thread", .has_arg = 0, .val = 't' },
+            { .name = "poll-batch",    .has_arg = 1, .val = 'b' },
+            { .name = "lat-sample",    .has_arg = 1, .val = 'S' },
+            { .name = "ah-cache",      .has_arg = 1, .val = 'A' },
+            { .name = "rc",            .has_arg = 0, .val = 'R' },
+            { .name = "rc-peers",      .has_arg = 1, .val = 'r' },
             { .name = "debug-mask",    .has_arg = 1, .val = 'D' },
             { 0 }
         };
 
-        c = getopt_long(argc, argv, "Pa:p:s:n:u:l:D:",
+        c = getopt_long(argc, argv, "PMa:p:s:n:u:l:c:v:d:Ltb:S:A:Rr:D:",
                         long_options, NULL);
         
         if (c == -1)
@@ -198,6 +848,10 @@ static int parse_command_line(int argc, char *argv[], struct user_params *usr_pa
             usr_par->persistent = 1;
             break;
 
+        case 'M':
+            usr_par->multi_client = 1;
+            break;
+
         case 'a':
             get_addr(optarg, (struct sockaddr *) &usr_par->hostaddr);
             break;
@@ -232,6 +886,58 @@ static int parse_command_line(int argc, char *argv[], struct user_params *usr_pa
             usr_par->num_sges = strtol(optarg, NULL, 0);
             break;
 
+        case 'c':
+            usr_par->cpu = strtol(optarg, NULL, 0);
+            break;
+
+        case 'v':
+            usr_par->comp_vector = strtol(optarg, NULL, 0);
+            break;
+
+        case 'd':
+            usr_par->num_dcis = strtol(optarg, NULL, 0);
+            if (usr_par->num_dcis < 1 || usr_par->num_dcis > 64) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+
+        case 'L':
+            usr_par->least_loaded = 1;
+            break;
+
+        case 't':
+            usr_par->dci_per_thread = 1;
+            break;
+
+        case 'b':
+            usr_par->poll_batch = strtol(optarg, NULL, 0);
+            break;
+
+        case 'S':
+            usr_par->lat_every = strtol(optarg, NULL, 0);
+            break;
+
+        case 'A':
+            usr_par->ah_cache_size = strtol(optarg, NULL, 0);
+            if (usr_par->ah_cache_size < 1) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+
+        case 'R':
+            usr_par->rc = 1;
+            break;
+
+        case 'r':
+            usr_par->rc_peers = strtol(optarg, NULL, 0);
+            if (usr_par->rc_peers < 1 || usr_par->rc_peers > 64) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+
         case 'D':
             debug           = (strtol(optarg, NULL, 0) >> 0) & 1; /*bit 0*/
             debug_fast_path = (strtol(optarg, NULL, 0) >> 1) & 1; /*bit 1*/
@@ -260,6 +966,12 @@ int main(int argc, char *argv[])
     int                     ret_val = 0;
     int                     sockfd;
     struct iovec            buf_iovec[MAX_SGES];
+    struct rdma_remote_buffer *remote_buf = NULL;
+    char                    imported_desc[DESC_STRING_LENGTH];
+    uint16_t                imported_size = 0;
+    int                     stream_iters;
+    int                     stream_depth;
+    int                     stream_threads;
 
     srand48(getpid() * time(NULL));
 
@@ -268,11 +980,31 @@ int main(int argc, char *argv[])
         return ret_val;
     }
 
+    rdma_set_affinity(usr_par.comp_vector, usr_par.cpu);
+    rdma_set_dci_pool(usr_par.num_dcis, usr_par.least_loaded ? RDMA_DCI_POLICY_LEAST_LOADED :
+                                        usr_par.dci_per_thread ? RDMA_DCI_POLICY_PER_THREAD : RDMA_DCI_POLICY_HASH);
+    if (usr_par.ah_cache_size) {
+        rdma_set_ah_cache_size(usr_par.ah_cache_size);
+    }
+    if (usr_par.rc || usr_par.rc_peers) {
+        rdma_set_transport(usr_par.rc ? RDMA_TRANSPORT_RC : RDMA_TRANSPORT_AUTO, usr_par.rc_peers);
+    }
     rdma_dev = rdma_open_device_server(&usr_par.hostaddr); // 与client端的rdma_open_device_client()完全一样
     if (!rdma_dev) {
         ret_val = 1;
         return ret_val;
     }
+    rdma_device_pin_thread(rdma_dev); /* this thread polls the CQ */
+    if (usr_par.poll_batch && rdma_device_set_poll_batch(rdma_dev, usr_par.poll_batch)) {
+        fprintf(stderr, "FAILURE: Poll batch %d is out of range\n", usr_par.poll_batch);
+        ret_val = 1;
+        goto clean_device;
+    }
+    if (usr_par.lat_every && rdma_device_set_latency_sampling(rdma_dev, usr_par.lat_every)) {
+        fprintf(stderr, "FAILURE: Latency sampling needs CQ completion timestamps, not supported by the device\n");
+        ret_val = 1;
+        goto clean_device;
+    }
     
     /* Local memory buffer allocation */
     /* On the server side, we allocate buffer on CPU and not on GPU */
@@ -291,7 +1023,9 @@ int main(int argc, char *argv[])
     /* RDMA buffer registration */
     struct rdma_buffer *rdma_buff;
 
-    rdma_buff = rdma_buffer_reg(rdma_dev, buff, usr_par.size);
+    /* CPU buffers may use on-demand paging (RDMA_MR_MODE=odp|implicit), GPU memory is always pinned */
+    rdma_buff = rdma_buffer_reg_mode(rdma_dev, buff, usr_par.size,
+                                     usr_par.use_cuda ? MR_MODE_PINNED : mr_mode_from_env());
     if (!rdma_buff) {
         ret_val = 1;
         goto clean_mem_buff;
@@ -301,6 +1035,19 @@ int main(int argc, char *argv[])
     act.sa_handler = sigint_handler;
     sigaction(SIGINT, &act, NULL);
 
+    if (usr_par.num_sges > MAX_SGES) {
+        fprintf(stderr, "WARN: num_sges %d is too big (max=%d)\n", usr_par.num_sges, MAX_SGES);
+        ret_val = 1;
+        goto clean_rdma_buff;
+    }
+    if (usr_par.multi_client) {
+        if (usr_par.num_sges) {
+            prepare_sg_list(buf_iovec, buff, &usr_par);
+        }
+        ret_val = serve_clients(rdma_dev, rdma_buff, &usr_par, buf_iovec);
+        goto clean_rdma_buff;
+    }
+
 sock_listen:
     printf("Listening to remote client...\n");
     sockfd = open_server_socket(usr_par.port);
@@ -308,6 +1055,9 @@ sock_listen:
         goto clean_rdma_buff;
     }
     printf("Connection accepted.\n");
+    stream_iters = 0;
+    stream_depth = 1;
+    stream_threads = 1;
 
     if (gettimeofday(&start, NULL)) {
         perror("gettimeofday");
@@ -321,9 +1071,10 @@ sock_listen:
     for (cnt = 0; cnt < usr_par.iters && keep_running; cnt++) {
 
         int                            r_size;
-        char                           desc_str[sizeof "0102030405060708:01020304:01020304:0102:010203:1:0102030405060708090a0b0c0d0e0f10"];
-        char                           ackmsg[sizeof ACK_MSG];
-        struct rdma_task_attr          task_attr;
+        char                           desc[DESC_STRING_LENGTH];
+        uint8_t                        desc_type = RDMA_BUF_DESC;
+        uint16_t                       desc_size = 0;
+        struct rdma_remote_task_attr   task_attr;
         int                            i;
         uint32_t                       flags; /* Use enum rdma_task_attr_flags */
         // payload attrs
@@ -335,17 +1086,25 @@ sock_listen:
             r_size = recv(sockfd, &pl_type, sizeof(pl_type), MSG_WAITALL);
             r_size = recv(sockfd, &pl_size, sizeof(pl_size), MSG_WAITALL);
             switch (pl_type) {
-                case 0: // RDMA_BUF_DESC
+                case RDMA_BUF_DESC:
+                case RDMA_BUF_DESC_BIN:
                     /* Receiving RDMA data (address, size, rkey etc.) from socket as a triger to start RDMA Read/Write operation */
-                    DEBUG_LOG_FAST_PATH("Iteration %d: Waiting to Receive message of size %lu\n", cnt, sizeof desc_str);   
-                    r_size = recv(sockfd, desc_str, pl_size * sizeof(char), MSG_WAITALL);
-                    if (r_size != sizeof desc_str) {
+                    DEBUG_LOG_FAST_PATH("Iteration %d: Waiting to Receive message of size %u\n", cnt, pl_size);
+                    if (pl_size != (pl_type == RDMA_BUF_DESC_BIN ? sizeof(struct rdma_buffer_desc) : sizeof desc)) {
+                        fprintf(stderr, "FAILURE: Unexpected RDMA data size %u for iteration %d\n", pl_size, cnt);
+                        ret_val = 1;
+                        goto clean_socket;
+                    }
+                    r_size = recv(sockfd, desc, pl_size, MSG_WAITALL);
+                    if (r_size != pl_size) {
                         fprintf(stderr, "FAILURE: Couldn't receive RDMA data for iteration %d (errno=%d '%m')\n", cnt, errno);
                         ret_val = 1;
                         goto clean_socket;
                     }
+                    desc_type = pl_type;
+                    desc_size = pl_size;
                     break;
-                case 1: // TASK_ATTRS
+                case TASK_ATTRS:
                     /* Receiving rw attr flags */;
                     int s = pl_size * sizeof(char);
                     char t[16];
@@ -357,13 +1116,47 @@ sock_listen:
                     }
                     sscanf(t, "%08x", &flags);
                     break;
+                case STREAM_ATTRS: {
+                    /* Receiving the number of tasks to stream, how many may be in flight and
+                       how many threads submit them, sent ahead of the PACKAGE_TYPES */
+                    char st[24];
+                    if (pl_size > sizeof st || recv(sockfd, st, pl_size, MSG_WAITALL) != pl_size) {
+                        fprintf(stderr, "FAILURE: Couldn't receive stream attrs (errno=%d '%m')\n", errno);
+                        ret_val = 1;
+                        goto clean_socket;
+                    }
+                    sscanf(st, "%x:%x:%x", &stream_iters, &stream_depth, &stream_threads);
+                    if (stream_depth < 1) {
+                        stream_depth = 1;
+                    }
+                    if (stream_threads < 1 || stream_threads > MAX_STREAM_THREADS) {
+                        stream_threads = 1;
+                    }
+                    i--;
+                    break;
+                }
             }
         }
         
-        DEBUG_LOG_FAST_PATH("Received message \"%s\"\n", desc_str);
+        /* The client sends the same description every iteration: import it once,
+           and again only if it changes */
+        if (!remote_buf || desc_size != imported_size || memcmp(desc, imported_desc, desc_size)) {
+            if (remote_buf) {
+                rdma_remote_buffer_release(remote_buf);
+            }
+            remote_buf = (desc_type == RDMA_BUF_DESC_BIN)
+                ? rdma_remote_buffer_import(rdma_dev, (struct rdma_buffer_desc *)desc)
+                : rdma_remote_buffer_import_str(rdma_dev, desc, desc_size);
+            if (!remote_buf) {
+                ret_val = 1;
+                goto clean_socket;
+            }
+            memcpy(imported_desc, desc, desc_size);
+            imported_size = desc_size;
+        }
+
         memset(&task_attr, 0, sizeof task_attr);
-        task_attr.remote_buf_desc_str      = desc_str;
-        task_attr.remote_buf_desc_length   = sizeof desc_str;
+        task_attr.remote_buf               = remote_buf;
         task_attr.local_buf_rdma           = rdma_buff;
         task_attr.flags                    = flags;
         task_attr.wr_id                    = cnt;// * expected_comp_events;
@@ -372,23 +1165,26 @@ sock_listen:
         SDEBUG_LOG_FAST_PATH ((char*)buff, "Read iteration N %d", cnt);
         /* Prepare send sg_list */
         if (usr_par.num_sges) {
-            if (usr_par.num_sges > MAX_SGES) {
-                fprintf(stderr, "WARN: num_sges %d is too big (max=%d)\n", usr_par.num_sges, MAX_SGES);
-                ret_val = 1;
-                goto clean_socket;
-            }
-	    memset(buf_iovec, 0, sizeof buf_iovec);
 	    task_attr.local_buf_iovcnt = usr_par.num_sges;
 	    task_attr.local_buf_iovec  = buf_iovec;
-
-            size_t  portion_size;
-            portion_size = (usr_par.size / usr_par.num_sges) & 0xFFFFFFC0; /* 64 byte aligned */
-            for (i = 0; i < usr_par.num_sges; i++) {
-                buf_iovec[i].iov_base = buff + (i * portion_size);
-                buf_iovec[i].iov_len  = portion_size;
+            prepare_sg_list(buf_iovec, buff, &usr_par);
+        }
+        if (stream_iters) {
+            /* the rest of the run is RDMA only */
+            printf("Streaming %d tasks, %d in flight, %d submitter thread(s)\n",
+                   stream_iters, stream_depth, stream_threads);
+            ret_val = stream_tasks(rdma_dev, &task_attr, stream_iters, stream_depth, stream_threads,
+                                   usr_par.size);
+            if (ret_val) {
+                if (usr_par.persistent && keep_running) {
+                    rdma_reset_device(rdma_dev);
+                }
+                goto clean_socket;
             }
+            break;
         }
-        ret_val = rdma_submit_task(&task_attr);
+
+        ret_val = rdma_submit_remote_task(&task_attr);
         if (ret_val) {
             goto clean_socket;
         }
@@ -425,12 +1221,19 @@ sock_listen:
     }
     /****************************************************************************************************/
 
-    ret_val = print_run_time(start, usr_par.size, usr_par.iters);
+    ret_val = print_run_time(start, usr_par.size, stream_iters ? stream_iters : usr_par.iters);
     if (ret_val) {
         goto clean_socket;
     }
+    if (usr_par.lat_every) {
+        rdma_device_print_latency(rdma_dev, stdout, 1);
+    }
 
 clean_socket:
+    if (remote_buf) {
+        rdma_remote_buffer_release(remote_buf);
+        remote_buf = NULL;
+    }
     close(sockfd);
     if (usr_par.persistent && keep_running)
         goto sock_listen;
@@ -81,6 +81,7 @@ int print_run_time(struct timeval start, unsigned long size, int iters)
            bytes, usec / 1000000., bytes / (1024.0 * 1024) / (usec / 1000000.) );
     printf("%d iters in %.2f seconds = %.2f usec/iter\n",
            iters, usec / 1000000., usec / iters);
+    printf("%.0f iters/sec\n", iters / (usec / 1000000.));
     return 0;
 
 }
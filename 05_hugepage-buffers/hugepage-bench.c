@@ -0,0 +1,301 @@
+#define _GNU_SOURCE
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <infiniband/verbs.h>
+
+#include "hugepage_alloc.h"
+
+/*
+ * Registration cost and random-access bandwidth of a buffer backed by 4 KiB,
+ * 2 MiB and 1 GiB pages. For each page size the buffer is mmap'ed and
+ * pre-faulted, registered, and then read at random offsets with RDMA READs
+ * over an RC QP connected to itself, which stresses the NIC's translation cache
+ * the way a remote reader scattered over the region would.
+ */
+
+#define TEST_NZ(x) do { if ( (x)) die("error: " #x " failed (returned non-zero)." ); } while (0)
+#define TEST_Z(x)  do { if (!(x)) die("error: " #x " failed (returned zero/null)."); } while (0)
+
+struct options {
+  const char *device;
+  int port;
+  int gid_index;
+  size_t size;
+  size_t access;
+  long ops;
+  int depth;
+};
+
+struct loopback {
+  struct ibv_context *ctx;
+  struct ibv_pd *pd;
+  struct ibv_cq *cq;
+  struct ibv_qp *qp;
+
+  char *local;
+  struct ibv_mr *local_mr;
+};
+
+static void die(const char *reason)
+{
+  fprintf(stderr, "%s\n", reason);
+  exit(EXIT_FAILURE);
+}
+
+static double elapsed_ms(const struct timespec *from, const struct timespec *to)
+{
+  return (to->tv_sec - from->tv_sec) * 1e3 + (to->tv_nsec - from->tv_nsec) / 1e6;
+}
+
+static struct ibv_context * open_device(const char *name)
+{
+  struct ibv_device **list;
+  struct ibv_context *ctx = NULL;
+  int n;
+
+  TEST_Z(list = ibv_get_device_list(&n));
+
+  for (int i = 0; i < n; i++) {
+    if (!name || !strcmp(ibv_get_device_name(list[i]), name)) {
+      ctx = ibv_open_device(list[i]);
+      break;
+    }
+  }
+
+  ibv_free_device_list(list);
+
+  if (!ctx)
+    die("no matching RDMA device.");
+
+  return ctx;
+}
+
+/* connect the RC QP to itself so RDMA READs target the local registered buffer */
+static void connect_loopback(struct loopback *lb, const struct options *opt, int rd_atomic)
+{
+  struct ibv_port_attr port;
+  struct ibv_qp_attr attr;
+  union ibv_gid gid;
+
+  TEST_NZ(ibv_query_port(lb->ctx, opt->port, &port));
+
+  memset(&attr, 0, sizeof(attr));
+  attr.qp_state = IBV_QPS_INIT;
+  attr.port_num = opt->port;
+  attr.qp_access_flags = IBV_ACCESS_REMOTE_READ;
+  TEST_NZ(ibv_modify_qp(lb->qp, &attr, IBV_QP_STATE | IBV_QP_PKEY_INDEX | IBV_QP_PORT | IBV_QP_ACCESS_FLAGS));
+
+  memset(&attr, 0, sizeof(attr));
+  attr.qp_state = IBV_QPS_RTR;
+  attr.path_mtu = port.active_mtu;
+  attr.dest_qp_num = lb->qp->qp_num;
+  attr.max_dest_rd_atomic = rd_atomic;
+  attr.min_rnr_timer = 12;
+  attr.ah_attr.dlid = port.lid;
+  attr.ah_attr.port_num = opt->port;
+
+  if (port.link_layer == IBV_LINK_LAYER_ETHERNET) {
+    TEST_NZ(ibv_query_gid(lb->ctx, opt->port, opt->gid_index, &gid));
+    attr.ah_attr.is_global = 1;
+    attr.ah_attr.grh.dgid = gid;
+    attr.ah_attr.grh.sgid_index = opt->gid_index;
+    attr.ah_attr.grh.hop_limit = 1;
+  }
+
+  TEST_NZ(ibv_modify_qp(lb->qp, &attr, IBV_QP_STATE | IBV_QP_AV | IBV_QP_PATH_MTU | IBV_QP_DEST_QPN |
+                        IBV_QP_RQ_PSN | IBV_QP_MAX_DEST_RD_ATOMIC | IBV_QP_MIN_RNR_TIMER));
+
+  memset(&attr, 0, sizeof(attr));
+  attr.qp_state = IBV_QPS_RTS;
+  attr.timeout = 14;
+  attr.retry_cnt = 7;
+  attr.rnr_retry = 7;
+  attr.max_rd_atomic = rd_atomic;
+  TEST_NZ(ibv_modify_qp(lb->qp, &attr, IBV_QP_STATE | IBV_QP_TIMEOUT | IBV_QP_RETRY_CNT |
+                        IBV_QP_RNR_RETRY | IBV_QP_SQ_PSN | IBV_QP_MAX_QP_RD_ATOMIC));
+}
+
+static void build_loopback(struct loopback *lb, const struct options *opt)
+{
+  struct ibv_qp_init_attr qp_attr;
+  struct ibv_device_attr dev_attr;
+  int rd_atomic;
+
+  lb->ctx = open_device(opt->device);
+  TEST_NZ(ibv_query_device(lb->ctx, &dev_attr));
+
+  TEST_Z(lb->pd = ibv_alloc_pd(lb->ctx));
+  TEST_Z(lb->cq = ibv_create_cq(lb->ctx, opt->depth, NULL, NULL, 0));
+
+  memset(&qp_attr, 0, sizeof(qp_attr));
+  qp_attr.send_cq = lb->cq;
+  qp_attr.recv_cq = lb->cq;
+  qp_attr.qp_type = IBV_QPT_RC;
+  qp_attr.cap.max_send_wr = opt->depth;
+  qp_attr.cap.max_recv_wr = 1;
+  qp_attr.cap.max_send_sge = 1;
+  qp_attr.cap.max_recv_sge = 1;
+  TEST_Z(lb->qp = ibv_create_qp(lb->pd, &qp_attr));
+
+  rd_atomic = opt->depth < dev_attr.max_qp_rd_atom ? opt->depth : dev_attr.max_qp_rd_atom;
+  connect_loopback(lb, opt, rd_atomic);
+
+  TEST_Z(lb->local = malloc((size_t)opt->depth * opt->access));
+  TEST_Z(lb->local_mr = ibv_reg_mr(lb->pd, lb->local, (size_t)opt->depth * opt->access, IBV_ACCESS_LOCAL_WRITE));
+}
+
+static void post_read(struct loopback *lb, struct ibv_mr *mr, const struct options *opt, int slot, uint64_t *rng)
+{
+  struct ibv_send_wr wr, *bad_wr = NULL;
+  struct ibv_sge sge;
+  uint64_t offset;
+
+  /* xorshift64, offsets aligned to the access size */
+  *rng ^= *rng << 13;
+  *rng ^= *rng >> 7;
+  *rng ^= *rng << 17;
+  offset = (*rng % (opt->size / opt->access)) * opt->access;
+
+  memset(&wr, 0, sizeof(wr));
+  wr.wr_id = slot;
+  wr.opcode = IBV_WR_RDMA_READ;
+  wr.sg_list = &sge;
+  wr.num_sge = 1;
+  wr.send_flags = IBV_SEND_SIGNALED;
+  wr.wr.rdma.remote_addr = (uintptr_t)mr->addr + offset;
+  wr.wr.rdma.rkey = mr->rkey;
+
+  sge.addr = (uintptr_t)(lb->local + (size_t)slot * opt->access);
+  sge.length = opt->access;
+  sge.lkey = lb->local_mr->lkey;
+
+  TEST_NZ(ibv_post_send(lb->qp, &wr, &bad_wr));
+}
+
+/* keeps opt->depth random reads in flight until opt->ops have completed; returns elapsed ms */
+static double random_reads(struct loopback *lb, struct ibv_mr *mr, const struct options *opt)
+{
+  struct ibv_wc wc[16];
+  struct timespec start, end;
+  uint64_t rng = 0x9e3779b97f4a7c15ULL;
+  long posted = 0, completed = 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  for (; posted < opt->depth && posted < opt->ops; posted++)
+    post_read(lb, mr, opt, posted, &rng);
+
+  while (completed < opt->ops) {
+    int n = ibv_poll_cq(lb->cq, 16, wc);
+
+    if (n < 0)
+      die("ibv_poll_cq failed.");
+
+    for (int i = 0; i < n; i++) {
+      if (wc[i].status != IBV_WC_SUCCESS) {
+        fprintf(stderr, "read failed: %s\n", ibv_wc_status_str(wc[i].status));
+        exit(EXIT_FAILURE);
+      }
+
+      completed++;
+      if (posted < opt->ops) {
+        post_read(lb, mr, opt, wc[i].wr_id, &rng);
+        posted++;
+      }
+    }
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  return elapsed_ms(&start, &end);
+}
+
+static void run_page_size(struct loopback *lb, const struct options *opt, size_t page_size, const char *name)
+{
+  struct timespec t0, t1, t2;
+  struct hugebuf hb;
+  struct ibv_mr *mr;
+  double read_ms;
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  if (hugebuf_alloc_pages(&hb, opt->size, page_size)) {
+    printf("%-6s %12s\n", name, "unavailable");
+    return;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+
+  TEST_Z(mr = ibv_reg_mr(lb->pd, hb.addr, opt->size, IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ));
+  clock_gettime(CLOCK_MONOTONIC, &t2);
+
+  read_ms = random_reads(lb, mr, opt);
+
+  printf("%-6s %12.3f %12.3f %12.0f %12.2f\n", name,
+         elapsed_ms(&t0, &t1), elapsed_ms(&t1, &t2),
+         opt->ops / (read_ms / 1e3),
+         opt->ops * opt->access / (read_ms / 1e3) / 1e6);
+
+  ibv_dereg_mr(mr);
+  hugebuf_free(&hb);
+}
+
+static void usage(const char *argv0)
+{
+  fprintf(stderr, "usage: %s [-d <device>] [-i <port>] [-g <gid index>] [-s <buffer bytes>]\n"
+                  "          [-b <access bytes>] [-n <reads>] [-q <reads in flight>]\n", argv0);
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+  struct options opt = {
+    .device = NULL,
+    .port = 1,
+    .gid_index = 0,
+    .size = HUGEPAGE_1G,
+    .access = 64,
+    .ops = 1000000,
+    .depth = 16,
+  };
+  struct loopback lb;
+  int op;
+
+  while ((op = getopt(argc, argv, "d:i:g:s:b:n:q:")) != -1) {
+    switch (op) {
+    case 'd': opt.device = optarg; break;
+    case 'i': opt.port = atoi(optarg); break;
+    case 'g': opt.gid_index = atoi(optarg); break;
+    case 's': opt.size = strtoull(optarg, NULL, 0); break;
+    case 'b': opt.access = strtoull(optarg, NULL, 0); break;
+    case 'n': opt.ops = atol(optarg); break;
+    case 'q': opt.depth = atoi(optarg); break;
+    default: usage(argv[0]);
+    }
+  }
+
+  if (opt.access == 0 || opt.size < opt.access || opt.ops < 1 || opt.depth < 1)
+    usage(argv[0]);
+
+  memset(&lb, 0, sizeof(lb));
+  build_loopback(&lb, &opt);
+
+  printf("%zu byte buffer on %s, %ld random %zu byte reads, %d in flight\n",
+         opt.size, ibv_get_device_name(lb.ctx->device), opt.ops, opt.access, opt.depth);
+  printf("%-6s %12s %12s %12s %12s\n", "pages", "alloc (ms)", "reg (ms)", "reads/s", "bw (MB/s)");
+
+  run_page_size(&lb, &opt, hugebuf_base_page_size(), "4k");
+  run_page_size(&lb, &opt, HUGEPAGE_2M, "2m");
+  run_page_size(&lb, &opt, HUGEPAGE_1G, "1g");
+
+  ibv_dereg_mr(lb.local_mr);
+  free(lb.local);
+  ibv_destroy_qp(lb.qp);
+  ibv_destroy_cq(lb.cq);
+  ibv_dealloc_pd(lb.pd);
+  ibv_close_device(lb.ctx);
+
+  return 0;
+}
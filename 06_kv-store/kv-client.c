@@ -0,0 +1,400 @@
+#define _GNU_SOURCE
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+#include "kv-common.h"
+
+const int TIMEOUT_IN_MS = 500; /* ms */
+
+struct client {
+  struct rdma_event_channel *ec;
+  struct rdma_cm_id *id;
+  struct ibv_pd *pd;
+  struct ibv_cq *cq;
+  struct ibv_qp *qp;
+
+  struct kv_request *req;
+  struct kv_reply *reply;
+  struct kv_bucket *buckets; /* landing area for the two candidate buckets */
+  struct ibv_mr *req_mr;
+  struct ibv_mr *reply_mr;
+  struct ibv_mr *buckets_mr;
+
+  uint64_t table_addr;
+  uint32_t table_rkey;
+  uint32_t table_buckets;
+
+  long torn_reads;
+};
+
+struct phase {
+  const char *name;
+  int one_sided;
+  double *get_us;
+  double *put_us;
+  long gets;
+  long puts;
+  long misses;
+};
+
+static void usage(const char *argv0);
+
+static double elapsed_us(const struct timespec *from, const struct timespec *to)
+{
+  return (to->tv_sec - from->tv_sec) * 1e6 + (to->tv_nsec - from->tv_nsec) / 1e3;
+}
+
+static void wait_event(struct client *c, enum rdma_cm_event_type expected, char *pdata, struct rdma_cm_event *copy)
+{
+  struct rdma_cm_event *event = NULL;
+
+  TEST_NZ(rdma_get_cm_event(c->ec, &event));
+  kv_copy_cm_event(copy, event, pdata, KV_MAX_PRIVATE_DATA);
+  rdma_ack_cm_event(event);
+
+  if (copy->event != expected) {
+    fprintf(stderr, "unexpected event %s, wanted %s\n", rdma_event_str(copy->event), rdma_event_str(expected));
+    exit(EXIT_FAILURE);
+  }
+}
+
+static void build_client(struct client *c)
+{
+  struct ibv_qp_init_attr qp_attr;
+
+  TEST_Z(c->pd = ibv_alloc_pd(c->id->verbs));
+  TEST_Z(c->cq = ibv_create_cq(c->id->verbs, 16, NULL, NULL, 0)); /* busy-polled */
+
+  memset(&qp_attr, 0, sizeof(qp_attr));
+  qp_attr.send_cq = c->cq;
+  qp_attr.recv_cq = c->cq;
+  qp_attr.qp_type = IBV_QPT_RC;
+  qp_attr.cap.max_send_wr = 4;
+  qp_attr.cap.max_recv_wr = 4;
+  qp_attr.cap.max_send_sge = 1;
+  qp_attr.cap.max_recv_sge = 1;
+  TEST_NZ(rdma_create_qp(c->id, c->pd, &qp_attr));
+  c->qp = c->id->qp;
+
+  TEST_Z(c->req = calloc(1, sizeof(struct kv_request)));
+  TEST_Z(c->reply = calloc(1, sizeof(struct kv_reply)));
+  TEST_NZ(posix_memalign((void **)&c->buckets, 64, 2 * sizeof(struct kv_bucket)));
+
+  TEST_Z(c->req_mr = ibv_reg_mr(c->pd, c->req, sizeof(struct kv_request), 0));
+  TEST_Z(c->reply_mr = ibv_reg_mr(c->pd, c->reply, sizeof(struct kv_reply), IBV_ACCESS_LOCAL_WRITE));
+  TEST_Z(c->buckets_mr = ibv_reg_mr(c->pd, c->buckets, 2 * sizeof(struct kv_bucket), IBV_ACCESS_LOCAL_WRITE));
+}
+
+static void connect_client(struct client *c, const char *host, const char *port)
+{
+  struct addrinfo *addr;
+  struct rdma_cm_event event;
+  struct rdma_conn_param cm_params;
+  struct ibv_device_attr dev_attr;
+  char pdata[KV_MAX_PRIVATE_DATA];
+  const struct kv_table_desc *desc;
+
+  TEST_NZ(getaddrinfo(host, port, NULL, &addr));
+  TEST_Z(c->ec = rdma_create_event_channel());
+  TEST_NZ(rdma_create_id(c->ec, &c->id, NULL, RDMA_PS_TCP));
+  TEST_NZ(rdma_resolve_addr(c->id, NULL, addr->ai_addr, TIMEOUT_IN_MS));
+  freeaddrinfo(addr);
+  wait_event(c, RDMA_CM_EVENT_ADDR_RESOLVED, pdata, &event);
+
+  build_client(c);
+
+  TEST_NZ(rdma_resolve_route(c->id, TIMEOUT_IN_MS));
+  wait_event(c, RDMA_CM_EVENT_ROUTE_RESOLVED, pdata, &event);
+
+  TEST_NZ(ibv_query_device(c->id->verbs, &dev_attr));
+
+  memset(&cm_params, 0, sizeof(cm_params));
+  /* a GET keeps two READs in flight */
+  cm_params.initiator_depth = dev_attr.max_qp_init_rd_atom < 2 ? dev_attr.max_qp_init_rd_atom : 2;
+  cm_params.responder_resources = 0;
+  cm_params.rnr_retry_count = 7; /* infinite retry */
+  TEST_NZ(rdma_connect(c->id, &cm_params));
+  wait_event(c, RDMA_CM_EVENT_ESTABLISHED, pdata, &event);
+
+  if (event.param.conn.private_data_len < sizeof(*desc))
+    die("connect_client: server sent no table descriptor.");
+
+  desc = (const struct kv_table_desc *)event.param.conn.private_data;
+  c->table_addr = be64toh(desc->addr);
+  c->table_rkey = be32toh(desc->rkey);
+  c->table_buckets = be32toh(desc->buckets);
+
+  printf("connected. table of %u buckets at 0x%llx.\n", c->table_buckets, (unsigned long long)c->table_addr);
+}
+
+static void poll_one(struct client *c)
+{
+  struct ibv_wc wc;
+  int n;
+
+  while ((n = ibv_poll_cq(c->cq, 1, &wc)) == 0)
+    ;
+
+  if (n < 0 || wc.status != IBV_WC_SUCCESS) {
+    fprintf(stderr, "poll_one: %s\n", n < 0 ? "ibv_poll_cq failed" : ibv_wc_status_str(wc.status));
+    exit(EXIT_FAILURE);
+  }
+}
+
+/* one request/reply round trip; the reply lands in c->reply */
+static int rpc(struct client *c, enum kv_op op, uint64_t key, const char *value)
+{
+  struct ibv_recv_wr rwr, *bad_rwr = NULL;
+  struct ibv_send_wr wr, *bad_wr = NULL;
+  struct ibv_sge rsge, sge;
+
+  memset(&rwr, 0, sizeof(rwr));
+  rwr.sg_list = &rsge;
+  rwr.num_sge = 1;
+  rsge.addr = (uintptr_t)c->reply;
+  rsge.length = sizeof(struct kv_reply);
+  rsge.lkey = c->reply_mr->lkey;
+  TEST_NZ(ibv_post_recv(c->qp, &rwr, &bad_rwr));
+
+  c->req->op = op;
+  c->req->key = key;
+  if (value)
+    memcpy(c->req->value, value, KV_VALUE_SIZE);
+
+  memset(&wr, 0, sizeof(wr));
+  wr.opcode = IBV_WR_SEND;
+  wr.sg_list = &sge;
+  wr.num_sge = 1;
+  wr.send_flags = IBV_SEND_SIGNALED;
+  sge.addr = (uintptr_t)c->req;
+  sge.length = sizeof(struct kv_request);
+  sge.lkey = c->req_mr->lkey;
+  TEST_NZ(ibv_post_send(c->qp, &wr, &bad_wr));
+
+  poll_one(c); /* send */
+  poll_one(c); /* reply */
+
+  return c->reply->status;
+}
+
+/*
+ * Both candidate buckets in one round trip: two READs, only the second
+ * signaled. A hit is final. A miss is not: the server copies a displaced
+ * item into its new bucket before clearing the old one, but the first READ
+ * can land before the copy and the second after the clear. So a miss is
+ * only trusted once two reads in a row return identical buckets. Every
+ * slot write bumps the slot's version, so identical buckets mean neither
+ * changed between the two reads. A key present throughout would then have
+ * sat in one bucket, unchanged, across the other's READ.
+ */
+static int get_one_sided(struct client *c, uint64_t key, char *value)
+{
+  struct ibv_send_wr wr[2], *bad_wr = NULL;
+  struct ibv_sge sge[2];
+  struct kv_bucket missed[2]; /* what the last clean miss saw */
+  int have_missed = 0;
+  uint32_t b[2];
+
+  kv_buckets(key, c->table_buckets, &b[0], &b[1]);
+
+  memset(wr, 0, sizeof(wr));
+  for (int i = 0; i < 2; i++) {
+    wr[i].next = (i == 0) ? &wr[1] : NULL;
+    wr[i].opcode = IBV_WR_RDMA_READ;
+    wr[i].sg_list = &sge[i];
+    wr[i].num_sge = 1;
+    wr[i].send_flags = (i == 1) ? IBV_SEND_SIGNALED : 0;
+    wr[i].wr.rdma.remote_addr = c->table_addr + (uint64_t)b[i] * sizeof(struct kv_bucket);
+    wr[i].wr.rdma.rkey = c->table_rkey;
+
+    sge[i].addr = (uintptr_t)&c->buckets[i];
+    sge[i].length = sizeof(struct kv_bucket);
+    sge[i].lkey = c->buckets_mr->lkey;
+  }
+
+  while (1) {
+    int torn = 0;
+
+    TEST_NZ(ibv_post_send(c->qp, wr, &bad_wr));
+    poll_one(c);
+
+    for (int i = 0; i < 2; i++) {
+      for (int s = 0; s < KV_BUCKET_SLOTS; s++) {
+        const struct kv_slot *slot = &c->buckets[i].slots[s];
+
+        if (!kv_slot_valid(slot)) {
+          torn = 1;
+          continue;
+        }
+
+        if (slot->key == key) {
+          memcpy(value, slot->value, KV_VALUE_SIZE);
+          return KV_OK;
+        }
+      }
+    }
+
+    /* a torn slot may be the key being written or moved */
+    if (torn) {
+      c->torn_reads++;
+      continue;
+    }
+
+    if (have_missed && !memcmp(missed, c->buckets, sizeof(missed)))
+      return KV_NOT_FOUND;
+
+    memcpy(missed, c->buckets, sizeof(missed));
+    have_missed = 1;
+  }
+}
+
+static void make_value(uint64_t key, uint64_t round, char *value)
+{
+  memset(value, 0, KV_VALUE_SIZE);
+  snprintf(value, KV_VALUE_SIZE, "key %llu round %llu", (unsigned long long)key, (unsigned long long)round);
+}
+
+static uint64_t next_rand(uint64_t *rng)
+{
+  /* xorshift64 */
+  *rng ^= *rng << 13;
+  *rng ^= *rng >> 7;
+  *rng ^= *rng << 17;
+  return *rng;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+
+  return (x > y) - (x < y);
+}
+
+static double percentile(const double *sorted, long n, double p)
+{
+  long i = (long)(p / 100.0 * (n - 1) + 0.5);
+
+  return n ? sorted[i] : 0;
+}
+
+static void report_latency(const char *op, double *us, long n)
+{
+  if (!n)
+    return;
+
+  qsort(us, n, sizeof(double), compare_double);
+  printf("  %s: %ld ops, p50 %.2f us, p99 %.2f us, p99.9 %.2f us, max %.2f us\n", op, n,
+         percentile(us, n, 50), percentile(us, n, 99), percentile(us, n, 99.9), us[n - 1]);
+}
+
+static void run_phase(struct client *c, struct phase *p, long ops, long keys, int put_pct)
+{
+  struct timespec start, end, t0, t1;
+  uint64_t rng = 0x9e3779b97f4a7c15ULL;
+  char value[KV_VALUE_SIZE];
+  long torn_before = c->torn_reads;
+  double secs;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  for (long i = 0; i < ops; i++) {
+    uint64_t key = next_rand(&rng) % keys + 1;
+    int is_put = (int)(next_rand(&rng) % 100) < put_pct;
+    int status;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    if (is_put) {
+      make_value(key, i, value);
+      status = rpc(c, KV_PUT, key, value);
+    } else if (p->one_sided) {
+      status = get_one_sided(c, key, value);
+    } else {
+      status = rpc(c, KV_GET, key, NULL);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    if (is_put)
+      p->put_us[p->puts++] = elapsed_us(&t0, &t1);
+    else
+      p->get_us[p->gets++] = elapsed_us(&t0, &t1);
+
+    if (status != KV_OK)
+      p->misses++;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  secs = elapsed_us(&start, &end) / 1e6;
+
+  printf("%s: %.0f ops/s, %ld misses, %ld torn reads retried\n", p->name, ops / secs, p->misses,
+         c->torn_reads - torn_before);
+  report_latency("get", p->get_us, p->gets);
+  report_latency("put", p->put_us, p->puts);
+}
+
+int main(int argc, char **argv)
+{
+  struct client c;
+  struct phase phases[2] = {
+    { .name = "one-sided get (RDMA READ)", .one_sided = 1 },
+    { .name = "two-sided get (SEND/RECV RPC)", .one_sided = 0 },
+  };
+  char value[KV_VALUE_SIZE];
+  long keys = 100000, ops = 1000000, full = 0;
+  int put_pct = 0;
+  int op;
+
+  while ((op = getopt(argc, argv, "k:n:u:")) != -1) {
+    switch (op) {
+    case 'k': keys = atol(optarg); break;
+    case 'n': ops = atol(optarg); break;
+    case 'u': put_pct = atoi(optarg); break;
+    default: usage(argv[0]);
+    }
+  }
+
+  if (argc - optind != 2 || keys < 1 || ops < 1 || put_pct < 0 || put_pct > 100)
+    usage(argv[0]);
+
+  memset(&c, 0, sizeof(c));
+  connect_client(&c, argv[optind], argv[optind + 1]);
+
+  for (long k = 1; k <= keys; k++) {
+    make_value(k, 0, value);
+    if (rpc(&c, KV_PUT, k, value) == KV_FULL)
+      full++;
+  }
+  printf("loaded %ld keys (%ld rejected, table full).\n", keys - full, full);
+
+  for (int i = 0; i < 2; i++) {
+    TEST_Z(phases[i].get_us = malloc(ops * sizeof(double)));
+    TEST_Z(phases[i].put_us = malloc(ops * sizeof(double)));
+
+    run_phase(&c, &phases[i], ops, keys, put_pct);
+
+    free(phases[i].get_us);
+    free(phases[i].put_us);
+  }
+
+  rdma_disconnect(c.id);
+  rdma_destroy_qp(c.id);
+  ibv_dereg_mr(c.req_mr);
+  ibv_dereg_mr(c.reply_mr);
+  ibv_dereg_mr(c.buckets_mr);
+  free(c.req);
+  free(c.reply);
+  free(c.buckets);
+  ibv_destroy_cq(c.cq);
+  ibv_dealloc_pd(c.pd);
+  rdma_destroy_id(c.id);
+  rdma_destroy_event_channel(c.ec);
+
+  return 0;
+}
+
+void usage(const char *argv0)
+{
+  fprintf(stderr, "usage: %s [-k <keys>] [-n <ops per phase>] [-u <put %%>] <server-address> <server-port>\n", argv0);
+  exit(1);
+}
@@ -0,0 +1,149 @@
+#ifndef KV_COMMON_H
+#define KV_COMMON_H
+
+/*
+ * Layout and wire format of the one-sided key-value store.
+ *
+ * The server keeps a bucketized cuckoo hash table in one registered region:
+ * every key lives in one of two candidate buckets, and each bucket is four
+ * cache-line slots. Clients GET by reading both candidate buckets with RDMA
+ * READs and scanning them locally. PUTs are SEND/RECV RPCs applied by the
+ * server, which also serves GETs over RPC as the two-sided baseline.
+ *
+ * A slot is written under a version: odd while the server is writing it,
+ * even once done, with a checksum over version, key and value stored last.
+ * A reader that sees an odd version or a bad checksum caught a torn write
+ * and reads again.
+ */
+
+#include <endian.h>
+#include <netdb.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <rdma/rdma_cma.h>
+
+#define TEST_NZ(x) do { if ( (x)) die("error: " #x " failed (returned non-zero)." ); } while (0)
+#define TEST_Z(x)  do { if (!(x)) die("error: " #x " failed (returned zero/null)."); } while (0)
+
+#define KV_VALUE_SIZE 48
+#define KV_BUCKET_SLOTS 4
+#define KV_MAX_PRIVATE_DATA 256
+
+struct kv_slot {
+  uint32_t version;
+  uint32_t checksum;
+  uint64_t key;          /* 0 = empty */
+  char value[KV_VALUE_SIZE];
+} __attribute__((aligned(64)));
+
+struct kv_bucket {
+  struct kv_slot slots[KV_BUCKET_SLOTS];
+};
+
+/* the server's accept private data (big endian) */
+struct kv_table_desc {
+  uint64_t addr;
+  uint32_t rkey;
+  uint32_t buckets;
+};
+
+enum kv_op {
+  KV_GET,
+  KV_PUT
+};
+
+enum kv_status {
+  KV_OK,
+  KV_NOT_FOUND,
+  KV_FULL
+};
+
+struct kv_request {
+  uint32_t op;
+  uint32_t reserved;
+  uint64_t key;
+  char value[KV_VALUE_SIZE];
+};
+
+struct kv_reply {
+  uint32_t status;
+  uint32_t reserved;
+  uint64_t key;
+  char value[KV_VALUE_SIZE];
+};
+
+static inline void die(const char *reason)
+{
+  fprintf(stderr, "%s\n", reason);
+  exit(EXIT_FAILURE);
+}
+
+static inline uint64_t kv_mix(uint64_t x)
+{
+  /* splitmix64 finalizer */
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return x;
+}
+
+static inline void kv_buckets(uint64_t key, uint32_t buckets, uint32_t *b1, uint32_t *b2)
+{
+  *b1 = kv_mix(key) % buckets;
+  *b2 = kv_mix(key ^ 0x9e3779b97f4a7c15ULL) % buckets;
+
+  if (*b2 == *b1)
+    *b2 = (*b1 + 1) % buckets;
+}
+
+/* FNV-1a over version, key and value */
+static inline uint32_t kv_checksum(uint32_t version, uint64_t key, const char *value)
+{
+  uint32_t h = 2166136261u;
+  const unsigned char *p;
+
+  p = (const unsigned char *)&version;
+  for (size_t i = 0; i < sizeof(version); i++)
+    h = (h ^ p[i]) * 16777619u;
+
+  p = (const unsigned char *)&key;
+  for (size_t i = 0; i < sizeof(key); i++)
+    h = (h ^ p[i]) * 16777619u;
+
+  p = (const unsigned char *)value;
+  for (size_t i = 0; i < KV_VALUE_SIZE; i++)
+    h = (h ^ p[i]) * 16777619u;
+
+  return h;
+}
+
+/* never-written slots are all zero and count as valid empties */
+static inline int kv_slot_valid(const struct kv_slot *slot)
+{
+  if (slot->version == 0)
+    return slot->key == 0;
+
+  return !(slot->version & 1) && slot->checksum == kv_checksum(slot->version, slot->key, slot->value);
+}
+
+/* rdma_ack_cm_event() frees the private data, so keep a copy */
+static inline void kv_copy_cm_event(struct rdma_cm_event *dst, struct rdma_cm_event *src, void *pdata, size_t len)
+{
+  memcpy(dst, src, sizeof(*src));
+
+  if ((src->event == RDMA_CM_EVENT_CONNECT_REQUEST || src->event == RDMA_CM_EVENT_ESTABLISHED) &&
+      src->param.conn.private_data) {
+    if (len > src->param.conn.private_data_len)
+      len = src->param.conn.private_data_len;
+
+    memcpy(pdata, src->param.conn.private_data, len);
+    dst->param.conn.private_data = pdata;
+    dst->param.conn.private_data_len = len;
+  }
+}
+
+#endif
@@ -0,0 +1,466 @@
+#define _GNU_SOURCE
+#include <getopt.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "kv-common.h"
+#include "hugepage_alloc.h"
+#include "nic_affinity.h"
+
+#define RECV_DEPTH 16
+#define MAX_KICKS 64
+
+struct context {
+  struct ibv_context *ctx;
+  struct ibv_pd *pd;
+  struct ibv_cq *cq;
+  struct ibv_comp_channel *comp_channel;
+
+  pthread_t cq_poller_thread;
+  int max_qp_rd_atom;
+};
+
+struct connection {
+  struct rdma_cm_id *id;
+  struct ibv_qp *qp;
+
+  struct kv_request *recv_msgs; /* RECV_DEPTH requests, reply i answers request i */
+  struct kv_reply *send_msgs;
+  struct ibv_mr *recv_mr;
+  struct ibv_mr *send_mr;
+  int next_recv;
+};
+
+/* a table slot on a displacement path */
+struct kick {
+  uint32_t bucket;
+  int slot;
+};
+
+static void build_connection(struct rdma_cm_id *id);
+static void build_context(struct ibv_context *verbs);
+static void destroy_connection(struct connection *conn);
+static int on_connect_request(struct rdma_cm_event *event);
+static void on_completion(struct ibv_wc *wc);
+static int on_disconnect(struct rdma_cm_id *id);
+static int on_event(struct rdma_cm_event *event);
+static void * poll_cq(void *);
+static void post_receive(struct connection *conn, int i);
+static void usage(const char *argv0);
+
+static struct context *s_ctx = NULL;
+static struct hugebuf s_table_mem;
+static struct kv_bucket *s_table = NULL;
+static uint32_t s_buckets = 1 << 16;
+static struct ibv_mr *s_table_mr = NULL;
+static struct kv_table_desc s_desc; /* wire format, must outlive rdma_accept() */
+
+int main(int argc, char **argv)
+{
+  struct sockaddr_in6 addr;
+  struct rdma_cm_event *event = NULL;
+  struct rdma_cm_id *listener = NULL;
+  struct rdma_event_channel *ec = NULL;
+  uint16_t port = 0;
+  int op;
+
+  while ((op = getopt(argc, argv, "b:p:")) != -1) {
+    switch (op) {
+    case 'b': s_buckets = strtoul(optarg, NULL, 0); break;
+    case 'p': port = atoi(optarg); break;
+    default: usage(argv[0]);
+    }
+  }
+
+  if (s_buckets < 2)
+    usage(argv[0]);
+
+  TEST_NZ(hugebuf_alloc(&s_table_mem, (size_t)s_buckets * sizeof(struct kv_bucket)));
+  s_table = s_table_mem.addr;
+  memset(s_table, 0, (size_t)s_buckets * sizeof(struct kv_bucket));
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin6_family = AF_INET6;
+  addr.sin6_port = htons(port);
+
+  TEST_Z(ec = rdma_create_event_channel());
+  TEST_NZ(rdma_create_id(ec, &listener, NULL, RDMA_PS_TCP));
+  TEST_NZ(rdma_bind_addr(listener, (struct sockaddr *)&addr));
+  TEST_NZ(rdma_listen(listener, 10)); /* backlog=10 is arbitrary */
+
+  port = ntohs(rdma_get_src_port(listener));
+
+  printf("listening on port %d, %u buckets of %d slots (%zu bytes).\n",
+         port, s_buckets, KV_BUCKET_SLOTS, (size_t)s_buckets * sizeof(struct kv_bucket));
+
+  while (rdma_get_cm_event(ec, &event) == 0) {
+    struct rdma_cm_event event_copy;
+    char pdata[KV_MAX_PRIVATE_DATA];
+
+    kv_copy_cm_event(&event_copy, event, pdata, sizeof(pdata));
+    rdma_ack_cm_event(event);
+
+    if (on_event(&event_copy))
+      break;
+  }
+
+  rdma_destroy_id(listener);
+  rdma_destroy_event_channel(ec);
+
+  return 0;
+}
+
+/* write a slot under its version so one-sided readers can tell a torn copy */
+static void slot_write(struct kv_slot *slot, uint64_t key, const char *value)
+{
+  uint32_t version = slot->version + 1;
+
+  __atomic_store_n(&slot->version, version, __ATOMIC_RELAXED); /* odd: in progress */
+  __atomic_thread_fence(__ATOMIC_RELEASE); /* keeps the payload stores below after it */
+
+  slot->key = key;
+  memmove(slot->value, value, KV_VALUE_SIZE);
+  slot->checksum = kv_checksum(version + 1, key, slot->value);
+
+  __atomic_store_n(&slot->version, version + 1, __ATOMIC_RELEASE);
+}
+
+static int find_slot(uint32_t bucket, uint64_t key)
+{
+  for (int i = 0; i < KV_BUCKET_SLOTS; i++)
+    if (s_table[bucket].slots[i].key == key)
+      return i;
+
+  return -1;
+}
+
+static uint32_t alt_bucket(uint64_t key, uint32_t bucket)
+{
+  uint32_t b1, b2;
+
+  kv_buckets(key, s_buckets, &b1, &b2);
+
+  return bucket == b1 ? b2 : b1;
+}
+
+/*
+ * Cuckoo insert. A displacement path is found first without touching the
+ * table, then applied from its free end backwards: each item is copied into
+ * its new slot before its old one is overwritten, so concurrent readers
+ * always find every key in one of its buckets.
+ */
+static int table_put(uint64_t key, const char *value)
+{
+  struct kick path[MAX_KICKS];
+  uint32_t b1, b2, bucket;
+  int slot, len = 0;
+
+  kv_buckets(key, s_buckets, &b1, &b2);
+
+  if ((slot = find_slot(b1, key)) >= 0) {
+    slot_write(&s_table[b1].slots[slot], key, value);
+    return KV_OK;
+  }
+
+  if ((slot = find_slot(b2, key)) >= 0) {
+    slot_write(&s_table[b2].slots[slot], key, value);
+    return KV_OK;
+  }
+
+  if ((slot = find_slot(b1, 0)) >= 0) {
+    slot_write(&s_table[b1].slots[slot], key, value);
+    return KV_OK;
+  }
+
+  if ((slot = find_slot(b2, 0)) >= 0) {
+    slot_write(&s_table[b2].slots[slot], key, value);
+    return KV_OK;
+  }
+
+  bucket = (rand() & 1) ? b1 : b2;
+
+  while (len < MAX_KICKS) {
+    struct kv_slot *victim;
+    uint32_t next;
+    int dup = 0;
+
+    slot = rand() % KV_BUCKET_SLOTS;
+    for (int i = 0; i < len; i++)
+      dup |= (path[i].bucket == bucket && path[i].slot == slot);
+    if (dup)
+      break;
+
+    path[len].bucket = bucket;
+    path[len].slot = slot;
+    len++;
+
+    victim = &s_table[bucket].slots[slot];
+    next = alt_bucket(victim->key, bucket);
+
+    if ((slot = find_slot(next, 0)) >= 0) {
+      /* apply: shift every victim one step along the path, starting at the free slot */
+      struct kv_slot *dst = &s_table[next].slots[slot];
+
+      for (int i = len - 1; i >= 0; i--) {
+        struct kv_slot *src = &s_table[path[i].bucket].slots[path[i].slot];
+
+        slot_write(dst, src->key, src->value);
+        dst = src;
+      }
+
+      slot_write(dst, key, value);
+      return KV_OK;
+    }
+
+    bucket = next;
+  }
+
+  return KV_FULL;
+}
+
+static int table_get(uint64_t key, char *value)
+{
+  uint32_t b1, b2;
+  int slot;
+
+  kv_buckets(key, s_buckets, &b1, &b2);
+
+  if ((slot = find_slot(b1, key)) >= 0) {
+    memcpy(value, s_table[b1].slots[slot].value, KV_VALUE_SIZE);
+    return KV_OK;
+  }
+
+  if ((slot = find_slot(b2, key)) >= 0) {
+    memcpy(value, s_table[b2].slots[slot].value, KV_VALUE_SIZE);
+    return KV_OK;
+  }
+
+  return KV_NOT_FOUND;
+}
+
+void build_connection(struct rdma_cm_id *id)
+{
+  struct connection *conn;
+  struct ibv_qp_init_attr qp_attr;
+
+  build_context(id->verbs);
+
+  memset(&qp_attr, 0, sizeof(qp_attr));
+  qp_attr.send_cq = s_ctx->cq;
+  qp_attr.recv_cq = s_ctx->cq;
+  qp_attr.qp_type = IBV_QPT_RC;
+  qp_attr.cap.max_send_wr = RECV_DEPTH;
+  qp_attr.cap.max_recv_wr = RECV_DEPTH;
+  qp_attr.cap.max_send_sge = 1;
+  qp_attr.cap.max_recv_sge = 1;
+
+  TEST_NZ(rdma_create_qp(id, s_ctx->pd, &qp_attr));
+
+  id->context = conn = (struct connection *)calloc(1, sizeof(struct connection));
+
+  conn->id = id;
+  conn->qp = id->qp;
+
+  TEST_Z(conn->recv_msgs = calloc(RECV_DEPTH, sizeof(struct kv_request)));
+  TEST_Z(conn->send_msgs = calloc(RECV_DEPTH, sizeof(struct kv_reply)));
+  TEST_Z(conn->recv_mr = ibv_reg_mr(s_ctx->pd, conn->recv_msgs, RECV_DEPTH * sizeof(struct kv_request),
+                                    IBV_ACCESS_LOCAL_WRITE));
+  TEST_Z(conn->send_mr = ibv_reg_mr(s_ctx->pd, conn->send_msgs, RECV_DEPTH * sizeof(struct kv_reply), 0));
+
+  for (int i = 0; i < RECV_DEPTH; i++)
+    post_receive(conn, i);
+}
+
+void build_context(struct ibv_context *verbs)
+{
+  struct ibv_device_attr dev_attr;
+  int comp_vector = -1, cpu = -1;
+
+  if (s_ctx) {
+    if (s_ctx->ctx != verbs)
+      die("cannot handle events in more than one context.");
+
+    return;
+  }
+
+  s_ctx = (struct context *)malloc(sizeof(struct context));
+
+  s_ctx->ctx = verbs;
+
+  TEST_NZ(ibv_query_device(s_ctx->ctx, &dev_attr));
+  s_ctx->max_qp_rd_atom = dev_attr.max_qp_rd_atom;
+
+  nic_resolve_affinity(s_ctx->ctx, &comp_vector, &cpu);
+
+  TEST_Z(s_ctx->pd = ibv_alloc_pd(s_ctx->ctx));
+  TEST_Z(s_ctx->comp_channel = ibv_create_comp_channel(s_ctx->ctx));
+  TEST_Z(s_ctx->cq = ibv_create_cq(s_ctx->ctx, 1024, NULL, s_ctx->comp_channel, comp_vector));
+  TEST_NZ(ibv_req_notify_cq(s_ctx->cq, 0));
+
+  TEST_Z(s_table_mr = ibv_reg_mr(s_ctx->pd, s_table, (size_t)s_buckets * sizeof(struct kv_bucket),
+                                 IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ));
+
+  s_desc.addr = htobe64((uintptr_t)s_table);
+  s_desc.rkey = htobe32(s_table_mr->rkey);
+  s_desc.buckets = htobe32(s_buckets);
+
+  TEST_NZ(pthread_create(&s_ctx->cq_poller_thread, NULL, poll_cq, NULL));
+  nic_pin_thread(s_ctx->cq_poller_thread, cpu);
+}
+
+void destroy_connection(struct connection *conn)
+{
+  rdma_destroy_qp(conn->id);
+
+  ibv_dereg_mr(conn->send_mr);
+  ibv_dereg_mr(conn->recv_mr);
+  free(conn->send_msgs);
+  free(conn->recv_msgs);
+
+  rdma_destroy_id(conn->id);
+
+  free(conn);
+}
+
+int on_connect_request(struct rdma_cm_event *event)
+{
+  struct rdma_cm_id *id = event->id;
+  struct rdma_conn_param cm_params;
+
+  printf("received connection request.\n");
+  build_connection(id);
+
+  memset(&cm_params, 0, sizeof(cm_params));
+  cm_params.private_data = &s_desc;
+  cm_params.private_data_len = sizeof(s_desc);
+  /*
+   * The client issues the READs; serve as many as it asked for, up to the
+   * device limit. The event is in our view: its responder_resources is the
+   * client's initiator_depth.
+   */
+  cm_params.responder_resources = event->param.conn.responder_resources;
+  if (cm_params.responder_resources > s_ctx->max_qp_rd_atom)
+    cm_params.responder_resources = s_ctx->max_qp_rd_atom;
+  cm_params.initiator_depth = 0;
+  cm_params.rnr_retry_count = 7; /* infinite retry */
+
+  TEST_NZ(rdma_accept(id, &cm_params));
+
+  return 0;
+}
+
+/* all table updates happen here, on the poller thread */
+void on_completion(struct ibv_wc *wc)
+{
+  struct connection *conn = (struct connection *)(uintptr_t)wc->wr_id;
+  struct ibv_send_wr wr, *bad_wr = NULL;
+  struct ibv_sge sge;
+  struct kv_request *req;
+  struct kv_reply *reply;
+  int i;
+
+  if (wc->status != IBV_WC_SUCCESS) {
+    if (wc->status == IBV_WC_WR_FLUSH_ERR)
+      return; /* receives flushed by a disconnect */
+    die("on_completion: status is not IBV_WC_SUCCESS.");
+  }
+
+  if (!(wc->opcode & IBV_WC_RECV))
+    return;
+
+  /* receives complete in the order they were posted and each is re-posted in place */
+  i = conn->next_recv;
+  conn->next_recv = (i + 1) % RECV_DEPTH;
+
+  req = &conn->recv_msgs[i];
+  reply = &conn->send_msgs[i];
+
+  reply->key = req->key;
+  if (wc->byte_len < sizeof(*req) || req->key == 0)
+    reply->status = KV_NOT_FOUND;
+  else if (req->op == KV_PUT)
+    reply->status = table_put(req->key, req->value);
+  else
+    reply->status = table_get(req->key, reply->value);
+
+  post_receive(conn, i);
+
+  memset(&wr, 0, sizeof(wr));
+
+  wr.wr_id = (uintptr_t)conn;
+  wr.opcode = IBV_WR_SEND;
+  wr.sg_list = &sge;
+  wr.num_sge = 1;
+  wr.send_flags = IBV_SEND_SIGNALED;
+
+  sge.addr = (uintptr_t)reply;
+  sge.length = sizeof(*reply);
+  sge.lkey = conn->send_mr->lkey;
+
+  TEST_NZ(ibv_post_send(conn->qp, &wr, &bad_wr));
+}
+
+int on_disconnect(struct rdma_cm_id *id)
+{
+  printf("peer disconnected.\n");
+
+  destroy_connection((struct connection *)id->context);
+  return 0;
+}
+
+int on_event(struct rdma_cm_event *event)
+{
+  int r = 0;
+
+  if (event->event == RDMA_CM_EVENT_CONNECT_REQUEST)
+    r = on_connect_request(event);
+  else if (event->event == RDMA_CM_EVENT_ESTABLISHED)
+    printf("connection established.\n");
+  else if (event->event == RDMA_CM_EVENT_DISCONNECTED)
+    r = on_disconnect(event->id);
+  else
+    die("on_event: unknown event.");
+
+  return r;
+}
+
+void * poll_cq(void *ctx)
+{
+  struct ibv_cq *cq;
+  struct ibv_wc wc[16];
+  int n;
+
+  while (1) {
+    TEST_NZ(ibv_get_cq_event(s_ctx->comp_channel, &cq, &ctx));
+    ibv_ack_cq_events(cq, 1);
+    TEST_NZ(ibv_req_notify_cq(cq, 0));
+
+    while ((n = ibv_poll_cq(cq, 16, wc)) > 0)
+      for (int i = 0; i < n; i++)
+        on_completion(&wc[i]);
+  }
+
+  return NULL;
+}
+
+void post_receive(struct connection *conn, int i)
+{
+  struct ibv_recv_wr wr, *bad_wr = NULL;
+  struct ibv_sge sge;
+
+  wr.wr_id = (uintptr_t)conn;
+  wr.next = NULL;
+  wr.sg_list = &sge;
+  wr.num_sge = 1;
+
+  sge.addr = (uintptr_t)&conn->recv_msgs[i];
+  sge.length = sizeof(struct kv_request);
+  sge.lkey = conn->recv_mr->lkey;
+
+  TEST_NZ(ibv_post_recv(conn->qp, &wr, &bad_wr));
+}
+
+void usage(const char *argv0)
+{
+  fprintf(stderr, "usage: %s [-b <buckets>] [-p <port>]\n", argv0);
+  exit(1);
+}
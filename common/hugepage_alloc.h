@@ -0,0 +1,140 @@
+#ifndef HUGEPAGE_ALLOC_H
+#define HUGEPAGE_ALLOC_H
+
+/*
+ * Buffer allocator shared by the samples for memory that gets registered.
+ *
+ * Buffers are mmap'ed from 1 GiB or 2 MiB hugepages (MAP_HUGETLB) when the kernel
+ * has some reserved (/proc/sys/vm/nr_hugepages or the per-size pools under
+ * /sys/kernel/mm/hugepages). Pinning a region then walks one page per 2 MiB or
+ * 1 GiB instead of one per 4 KiB, and the NIC needs far fewer translation entries
+ * for random access. Mappings are pre-faulted with MAP_POPULATE, except buffers
+ * registered for on-demand paging (see odp_mr.h), which are left to fault in on
+ * first access. If no hugepages are available the allocator falls back to
+ * ordinary pages.
+ *
+ * The environment variable HUGEPAGE_SIZE=4k|2m|1g caps the page size tried.
+ * By default, the largest page size that fits in the buffer is tried first.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+#endif
+
+#define HUGEPAGE_2M (2UL << 20)
+#define HUGEPAGE_1G (1UL << 30)
+
+struct hugebuf {
+  void *addr;
+  size_t length;    /* requested length */
+  size_t mapped;    /* length rounded up to page_size, what gets munmap'ed */
+  size_t page_size; /* page size actually backing the buffer */
+};
+
+static inline size_t hugebuf_base_page_size(void)
+{
+  return (size_t)sysconf(_SC_PAGESIZE);
+}
+
+/* page size limit from HUGEPAGE_SIZE, 0 if unset */
+static inline size_t hugebuf_env_page_size(void)
+{
+  const char *env = getenv("HUGEPAGE_SIZE");
+
+  if (!env || !*env)
+    return 0;
+  if (!strcasecmp(env, "1g"))
+    return HUGEPAGE_1G;
+  if (!strcasecmp(env, "2m"))
+    return HUGEPAGE_2M;
+
+  return hugebuf_base_page_size();
+}
+
+static inline int hugebuf_map(struct hugebuf *hb, size_t length, size_t page_size, int populate)
+{
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS | (populate ? MAP_POPULATE : 0);
+  size_t mapped = (length + page_size - 1) & ~(page_size - 1);
+  void *addr;
+
+  if (page_size == HUGEPAGE_1G)
+    flags |= MAP_HUGETLB | MAP_HUGE_1GB;
+  else if (page_size == HUGEPAGE_2M)
+    flags |= MAP_HUGETLB | MAP_HUGE_2MB;
+  else if (page_size != hugebuf_base_page_size())
+    return -1;
+
+  addr = mmap(NULL, mapped, PROT_READ | PROT_WRITE, flags, -1, 0);
+  if (addr == MAP_FAILED)
+    return -1;
+
+  hb->addr = addr;
+  hb->length = length;
+  hb->mapped = mapped;
+  hb->page_size = page_size;
+
+  return 0;
+}
+
+/* map exactly page_size pages, pre-faulted, no fallback; returns 0 on success */
+static inline int hugebuf_alloc_pages(struct hugebuf *hb, size_t length, size_t page_size)
+{
+  return hugebuf_map(hb, length, page_size, 1);
+}
+
+/*
+ * Allocate a buffer of at least length bytes. Tries 1 GiB pages,
+ * then 2 MiB pages, skipping sizes larger than the buffer or than HUGEPAGE_SIZE.
+ * Falls back to base pages. The buffer is pre-faulted if populate is set.
+ * Returns 0 on success.
+ */
+static inline int hugebuf_alloc_ex(struct hugebuf *hb, size_t length, int populate)
+{
+  static const size_t sizes[] = { HUGEPAGE_1G, HUGEPAGE_2M };
+  static int warned = 0;
+  size_t limit = hugebuf_env_page_size();
+
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    if (sizes[i] > length || (limit && sizes[i] > limit))
+      continue;
+
+    if (hugebuf_map(hb, length, sizes[i], populate) == 0)
+      return 0;
+  }
+
+  if (length >= HUGEPAGE_2M && !limit && !warned) {
+    fprintf(stderr, "hugebuf: no hugepages available for a %zu byte buffer, using %zu byte pages\n",
+            length, hugebuf_base_page_size());
+    warned = 1;
+  }
+
+  return hugebuf_map(hb, length, hugebuf_base_page_size(), populate);
+}
+
+static inline int hugebuf_alloc(struct hugebuf *hb, size_t length)
+{
+  return hugebuf_alloc_ex(hb, length, 1);
+}
+
+static inline void hugebuf_free(struct hugebuf *hb)
+{
+  if (hb->addr)
+    munmap(hb->addr, hb->mapped);
+
+  hb->addr = NULL;
+}
+
+#endif
@@ -0,0 +1,103 @@
+#ifndef LAT_HIST_H
+#define LAT_HIST_H
+
+/*
+ * Log-linear latency histogram, shared by the samples. Values below
+ * 2^LAT_HIST_SUB_BITS get a bucket each. Above that, every power of two is
+ * split into 2^LAT_HIST_SUB_BITS equal buckets, so a bucket is never wider
+ * than 1/8 of its value. 512 counters cover the whole uint64_t range, and
+ * adding a value is a count-leading-zeros and an increment.
+ *
+ * Percentiles are reported as the lower bound of the bucket they fall in,
+ * which is within 12.5% of the true value.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define LAT_HIST_SUB_BITS 3
+#define LAT_HIST_BUCKETS  (64 << LAT_HIST_SUB_BITS)
+
+struct lat_hist {
+  uint64_t count;
+  uint64_t sum;
+  uint64_t min;
+  uint64_t max;
+  uint64_t bucket[LAT_HIST_BUCKETS];
+};
+
+static inline void lat_hist_init(struct lat_hist *h)
+{
+  memset(h, 0, sizeof(*h));
+  h->min = UINT64_MAX;
+}
+
+static inline int lat_hist_bucket(uint64_t v)
+{
+  int shift;
+
+  if (v < (1 << LAT_HIST_SUB_BITS))
+    return v;
+
+  shift = 63 - __builtin_clzll(v) - LAT_HIST_SUB_BITS;
+  return ((shift + 1) << LAT_HIST_SUB_BITS) + ((v >> shift) & ((1 << LAT_HIST_SUB_BITS) - 1));
+}
+
+static inline uint64_t lat_hist_bucket_low(int b)
+{
+  int shift = (b >> LAT_HIST_SUB_BITS) - 1;
+
+  if (shift < 0)
+    return b;
+
+  return (uint64_t)((1 << LAT_HIST_SUB_BITS) + (b & ((1 << LAT_HIST_SUB_BITS) - 1))) << shift;
+}
+
+static inline void lat_hist_add(struct lat_hist *h, uint64_t v)
+{
+  h->bucket[lat_hist_bucket(v)]++;
+  h->count++;
+  h->sum += v;
+  if (v < h->min)
+    h->min = v;
+  if (v > h->max)
+    h->max = v;
+}
+
+/* p in [0, 1] */
+static inline uint64_t lat_hist_percentile(const struct lat_hist *h, double p)
+{
+  uint64_t rank = (uint64_t)(p * h->count), seen = 0;
+
+  if (!h->count)
+    return 0;
+  if (rank >= h->count)
+    return h->max;
+
+  for (int b = 0; b < LAT_HIST_BUCKETS; b++) {
+    seen += h->bucket[b];
+    if (seen > rank) {
+      uint64_t low = lat_hist_bucket_low(b);
+      return low < h->min ? h->min : low;
+    }
+  }
+
+  return h->max;
+}
+
+static inline void lat_hist_print(FILE *f, const char *name, const struct lat_hist *h, const char *unit)
+{
+  if (!h->count) {
+    fprintf(f, "%-24s no samples\n", name);
+    return;
+  }
+
+  fprintf(f, "%-24s %8lu samples  min %8lu  p50 %8lu  p90 %8lu  p99 %8lu  p99.9 %8lu  max %8lu  avg %8lu %s\n",
+          name, (unsigned long)h->count, (unsigned long)h->min,
+          (unsigned long)lat_hist_percentile(h, 0.50), (unsigned long)lat_hist_percentile(h, 0.90),
+          (unsigned long)lat_hist_percentile(h, 0.99), (unsigned long)lat_hist_percentile(h, 0.999),
+          (unsigned long)h->max, (unsigned long)(h->sum / h->count), unit);
+}
+
+#endif
@@ -0,0 +1,235 @@
+#ifndef NIC_AFFINITY_H
+#define NIC_AFFINITY_H
+
+/*
+ * Completion-vector and CPU affinity helpers shared by the samples.
+ *
+ * The NIC's NUMA node and local CPUs come from the same sysfs entries that
+ * map_pci_nic_gpu.sh walks: /sys/class/infiniband/<dev>/device/{numa_node,local_cpulist}.
+ * Pollers are pinned to a CPU local to the NIC and each CQ gets the completion
+ * vector whose interrupt is routed to that CPU (per /proc/interrupts and
+ * /proc/irq/<n>/smp_affinity_list), so interrupt, poller and application
+ * don't end up on random cores of the wrong socket.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <infiniband/verbs.h>
+
+static inline int nic_read_sysfs(struct ibv_context *verbs, const char *file, char *buf, size_t size)
+{
+  char path[512];
+  FILE *f;
+
+  snprintf(path, sizeof(path), "%s/device/%s", verbs->device->ibdev_path, file);
+
+  if (!(f = fopen(path, "r")))
+    return -1;
+
+  if (!fgets(buf, size, f)) {
+    fclose(f);
+    return -1;
+  }
+
+  fclose(f);
+  buf[strcspn(buf, "\n")] = '\0';
+
+  return 0;
+}
+
+/* NUMA node the NIC hangs off, -1 if unknown (single node or no sysfs) */
+static inline int nic_numa_node(struct ibv_context *verbs)
+{
+  char buf[16];
+
+  if (nic_read_sysfs(verbs, "numa_node", buf, sizeof(buf)))
+    return -1;
+
+  return atoi(buf);
+}
+
+/* parse a "0-15,32-47" style list; returns the count */
+static inline int nic_parse_cpulist(const char *buf, cpu_set_t *set)
+{
+  const char *p = buf;
+
+  CPU_ZERO(set);
+
+  while (*p) {
+    char *end;
+    long lo = strtol(p, &end, 10), hi = lo;
+
+    if (end == p)
+      break;
+
+    if (*end == '-')
+      hi = strtol(end + 1, &end, 10);
+
+    for (; lo <= hi && lo < CPU_SETSIZE; lo++)
+      CPU_SET(lo, set);
+
+    p = (*end == ',') ? end + 1 : end;
+  }
+
+  return CPU_COUNT(set);
+}
+
+/* CPUs local to the NIC; returns the count */
+static inline int nic_local_cpus(struct ibv_context *verbs, cpu_set_t *set)
+{
+  char buf[1024];
+
+  CPU_ZERO(set);
+
+  if (nic_read_sysfs(verbs, "local_cpulist", buf, sizeof(buf)))
+    return 0;
+
+  return nic_parse_cpulist(buf, set);
+}
+
+/*
+ * The completion vector whose IRQ is routed to cpu, -1 if none is. The NIC's
+ * completion IRQs show up in /proc/interrupts as "<name>_comp<vector>@pci:<bdf>"
+ * (mlx5) and their routing in /proc/irq/<irq>/smp_affinity_list.
+ */
+static inline int nic_irq_comp_vector(struct ibv_context *verbs, int cpu)
+{
+  char path[PATH_MAX], link[PATH_MAX], line[4096], buf[1024];
+  const char *bdf;
+  ssize_t len;
+  int vector = -1;
+  FILE *f;
+
+  snprintf(path, sizeof(path), "%s/device", verbs->device->ibdev_path);
+  if ((len = readlink(path, link, sizeof(link) - 1)) < 0)
+    return -1;
+
+  link[len] = '\0';
+  bdf = strrchr(link, '/') ? strrchr(link, '/') + 1 : link;
+
+  if (!(f = fopen("/proc/interrupts", "r")))
+    return -1;
+
+  while (vector < 0 && fgets(line, sizeof(line), f)) {
+    char *comp = strstr(line, "_comp"), *at;
+    cpu_set_t set;
+    FILE *irq;
+    int n;
+
+    if (!comp || !(at = strstr(comp, "@pci:")) || strncmp(at + 5, bdf, strlen(bdf)))
+      continue;
+
+    snprintf(path, sizeof(path), "/proc/irq/%d/smp_affinity_list", atoi(line));
+    if (!(irq = fopen(path, "r")))
+      continue;
+
+    if (fgets(buf, sizeof(buf), irq)) {
+      buf[strcspn(buf, "\n")] = '\0';
+      n = atoi(comp + 5);
+
+      if (nic_parse_cpulist(buf, &set) && CPU_ISSET(cpu, &set) && n < verbs->num_comp_vectors)
+        vector = n;
+    }
+
+    fclose(irq);
+  }
+
+  fclose(f);
+
+  return vector;
+}
+
+/*
+ * Pick the poller CPU: the highest-numbered CPU local to the NIC (CPU 0 tends
+ * to carry housekeeping work), restricted to CPUs we are allowed to run on.
+ * Returns -1 when nothing usable is known, leaving the scheduler in charge.
+ */
+static inline int nic_pick_cpu(struct ibv_context *verbs)
+{
+  cpu_set_t local, allowed;
+  int cpu;
+
+  if (!nic_local_cpus(verbs, &local))
+    return -1;
+
+  if (!sched_getaffinity(0, sizeof(allowed), &allowed))
+    CPU_AND(&local, &local, &allowed);
+
+  for (cpu = CPU_SETSIZE - 1; cpu >= 0; cpu--)
+    if (CPU_ISSET(cpu, &local))
+      return cpu;
+
+  return -1;
+}
+
+/*
+ * The vector whose IRQ is routed to cpu. Without /proc access, fall back on how
+ * mlx5 spreads them, vector i on cpumask_local_spread(i, node): the i-th CPU
+ * local to the NIC, so the CPU's index within the local CPU list.
+ */
+static inline int nic_comp_vector(struct ibv_context *verbs, int cpu)
+{
+  cpu_set_t local;
+  int vector, index = 0, c;
+
+  if (verbs->num_comp_vectors <= 0 || cpu < 0)
+    return 0;
+
+  if ((vector = nic_irq_comp_vector(verbs, cpu)) >= 0)
+    return vector;
+
+  if (!nic_local_cpus(verbs, &local) || !CPU_ISSET(cpu, &local))
+    return 0;
+
+  for (c = 0; c < cpu; c++)
+    index += CPU_ISSET(c, &local) ? 1 : 0;
+
+  return index % verbs->num_comp_vectors;
+}
+
+static inline int nic_pin_thread(pthread_t thread, int cpu)
+{
+  cpu_set_t set;
+  int ret;
+
+  if (cpu < 0)
+    return 0;
+
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+
+  /* not fatal: containers and cgroups may forbid it */
+  if ((ret = pthread_setaffinity_np(thread, sizeof(set), &set)))
+    fprintf(stderr, "warning: couldn't pin poller to cpu %d (error %d)\n", cpu, ret);
+
+  return ret;
+}
+
+/*
+ * Resolve the requested (comp_vector, cpu) pair, -1 meaning "choose for me",
+ * and report the outcome once so the placement is visible in benchmark logs.
+ */
+static inline void nic_resolve_affinity(struct ibv_context *verbs, int *comp_vector, int *cpu)
+{
+  if (*cpu < 0)
+    *cpu = nic_pick_cpu(verbs);
+
+  if (*comp_vector < 0)
+    *comp_vector = nic_comp_vector(verbs, *cpu);
+  else if (verbs->num_comp_vectors > 0)
+    *comp_vector %= verbs->num_comp_vectors;
+
+  printf("%s: numa node %d, poller cpu %d, comp vector %d of %d\n",
+      ibv_get_device_name(verbs->device), nic_numa_node(verbs), *cpu, *comp_vector, verbs->num_comp_vectors);
+}
+
+#endif
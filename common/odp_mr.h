@@ -0,0 +1,295 @@
+#ifndef ODP_MR_H
+#define ODP_MR_H
+
+/*
+ * Memory registration with a per-buffer choice between pinned and on-demand
+ * paging (ODP) memory regions, shared by the samples.
+ *
+ *   MR_MODE_PINNED        plain ibv_reg_mr(); every page is pinned up front
+ *   MR_MODE_ODP           IBV_ACCESS_ON_DEMAND on the buffer; pages are faulted
+ *                         in by the NIC on first access and can be reclaimed
+ *   MR_MODE_IMPLICIT_ODP  one implicit ODP MR per PD and access mask covering
+ *                         the whole address space; buffers share its keys
+ *
+ * The device's ODP capabilities are checked (ibv_query_device_ex) against the
+ * operations the access flags allow. A mode the device can't do degrades to the
+ * next one down, ending at pinned. The samples pick the mode for their data
+ * buffers from RDMA_MR_MODE=pinned|odp|implicit. Control-message buffers stay
+ * pinned.
+ *
+ * Register with odp_reg_mr() and release with odp_dereg_mr(). The returned MR's
+ * addr/length always describe the caller's buffer, even for implicit ODP, so it
+ * can be advertised to the peer as usual. The one source file of a program
+ * that registers through here defines the odp_implicit table.
+ */
+
+#include <dirent.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <infiniband/verbs.h>
+
+enum mr_mode {
+  MR_MODE_PINNED = 0,
+  MR_MODE_ODP,
+  MR_MODE_IMPLICIT_ODP
+};
+
+/* RC caps are checked unless a caller passes its transport's caps (e.g. DC) */
+#define ODP_RC_CAPS UINT32_MAX
+
+#define ODP_MAX_IMPLICIT 8
+
+struct odp_mr {
+  struct ibv_mr mr;    /* handed out to the caller */
+  struct ibv_mr *real; /* pinned/explicit ODP MR, or the shared implicit MR */
+  int implicit;
+};
+
+struct odp_implicit_mr {
+  struct ibv_pd *pd;
+  int access;
+  struct ibv_mr *mr;
+  int refs;
+};
+
+/* the implicit MRs in use; defined once by the file of each program that calls odp_reg_mr() */
+extern struct odp_implicit_mr odp_implicit[ODP_MAX_IMPLICIT];
+
+static inline const char * mr_mode_name(int mode)
+{
+  return mode == MR_MODE_IMPLICIT_ODP ? "implicit odp" : mode == MR_MODE_ODP ? "odp" : "pinned";
+}
+
+static inline int mr_mode_from_env(void)
+{
+  const char *env = getenv("RDMA_MR_MODE");
+
+  if (env && !strcasecmp(env, "odp"))
+    return MR_MODE_ODP;
+  if (env && !strcasecmp(env, "implicit"))
+    return MR_MODE_IMPLICIT_ODP;
+
+  return MR_MODE_PINNED;
+}
+
+/* ODP transport capabilities the access flags need on top of send/recv */
+static inline uint32_t odp_caps_needed(int access)
+{
+  uint32_t caps = IBV_ODP_SUPPORT_SEND | IBV_ODP_SUPPORT_RECV;
+
+  if (access & IBV_ACCESS_REMOTE_WRITE)
+    caps |= IBV_ODP_SUPPORT_WRITE;
+  if (access & IBV_ACCESS_REMOTE_READ)
+    caps |= IBV_ODP_SUPPORT_READ;
+  if (access & IBV_ACCESS_REMOTE_ATOMIC)
+    caps |= IBV_ODP_SUPPORT_ATOMIC;
+
+  return caps;
+}
+
+/* the best mode, no better than requested, that the device supports for this access */
+static inline int odp_supported_mode(struct ibv_context *ctx, int access, int mode, uint32_t transport_caps)
+{
+  static int reported = 0;
+  struct ibv_device_attr_ex attr;
+  uint32_t needed = odp_caps_needed(access);
+  int supported = MR_MODE_PINNED;
+
+  if (mode == MR_MODE_PINNED)
+    return mode;
+
+  memset(&attr, 0, sizeof(attr));
+  if (ibv_query_device_ex(ctx, NULL, &attr) == 0) {
+    if (transport_caps == ODP_RC_CAPS)
+      transport_caps = attr.odp_caps.per_transport_caps.rc_odp_caps;
+
+    if ((attr.odp_caps.general_caps & IBV_ODP_SUPPORT) && (transport_caps & needed) == needed)
+      supported = (attr.odp_caps.general_caps & IBV_ODP_SUPPORT_IMPLICIT) ? MR_MODE_IMPLICIT_ODP : MR_MODE_ODP;
+
+    if (!reported) {
+      printf("odp: %s general caps 0x%llx (odp %s, implicit %s), transport caps 0x%x\n",
+             ibv_get_device_name(ctx->device), (unsigned long long)attr.odp_caps.general_caps,
+             (attr.odp_caps.general_caps & IBV_ODP_SUPPORT) ? "yes" : "no",
+             (attr.odp_caps.general_caps & IBV_ODP_SUPPORT_IMPLICIT) ? "yes" : "no",
+             transport_caps);
+      reported = 1;
+    }
+  }
+
+  if (supported < mode) {
+    printf("odp: %s registration not supported for access 0x%x, using %s\n",
+           mr_mode_name(mode), access, mr_mode_name(supported));
+    return supported;
+  }
+
+  return mode;
+}
+
+static inline struct ibv_mr * odp_get_implicit(struct ibv_pd *pd, int access)
+{
+  struct odp_implicit_mr *slot = NULL;
+
+  for (int i = 0; i < ODP_MAX_IMPLICIT; i++) {
+    if (odp_implicit[i].mr && odp_implicit[i].pd == pd && odp_implicit[i].access == access) {
+      odp_implicit[i].refs++;
+      return odp_implicit[i].mr;
+    }
+    if (!odp_implicit[i].mr && !slot)
+      slot = &odp_implicit[i];
+  }
+
+  if (!slot)
+    return NULL;
+
+  slot->mr = ibv_reg_mr(pd, NULL, SIZE_MAX, access | IBV_ACCESS_ON_DEMAND);
+  if (!slot->mr)
+    return NULL;
+
+  slot->pd = pd;
+  slot->access = access;
+  slot->refs = 1;
+
+  return slot->mr;
+}
+
+static inline void odp_put_implicit(struct ibv_mr *mr)
+{
+  for (int i = 0; i < ODP_MAX_IMPLICIT; i++) {
+    if (odp_implicit[i].mr == mr) {
+      if (--odp_implicit[i].refs == 0) {
+        ibv_dereg_mr(mr);
+        odp_implicit[i].mr = NULL;
+      }
+      return;
+    }
+  }
+}
+
+/*
+ * Register [addr, addr + length) in the given mode, degrading to what the
+ * device supports. transport_caps is ODP_RC_CAPS or the ODP caps of the
+ * transport the buffer is used on. Returns NULL on failure.
+ */
+static inline struct ibv_mr * odp_reg_mr_caps(struct ibv_pd *pd, void *addr, size_t length, int access,
+                                              int mode, uint32_t transport_caps)
+{
+  struct odp_mr *omr;
+  struct ibv_mr *real = NULL;
+
+  mode = odp_supported_mode(pd->context, access, mode, transport_caps);
+
+  if (mode == MR_MODE_IMPLICIT_ODP && !(real = odp_get_implicit(pd, access))) {
+    printf("odp: implicit odp registration failed, trying explicit odp\n");
+    mode = MR_MODE_ODP;
+  }
+
+  if (mode == MR_MODE_ODP && !(real = ibv_reg_mr(pd, addr, length, access | IBV_ACCESS_ON_DEMAND))) {
+    printf("odp: odp registration failed, falling back to pinned\n");
+    mode = MR_MODE_PINNED;
+  }
+
+  if (mode == MR_MODE_PINNED && !(real = ibv_reg_mr(pd, addr, length, access)))
+    return NULL;
+
+  if (!(omr = (struct odp_mr *)calloc(1, sizeof(*omr)))) {
+    if (mode == MR_MODE_IMPLICIT_ODP)
+      odp_put_implicit(real);
+    else
+      ibv_dereg_mr(real);
+    return NULL;
+  }
+
+  omr->mr = *real;
+  omr->mr.addr = addr;
+  omr->mr.length = length;
+  omr->real = real;
+  omr->implicit = (mode == MR_MODE_IMPLICIT_ODP);
+
+  return &omr->mr;
+}
+
+static inline struct ibv_mr * odp_reg_mr(struct ibv_pd *pd, void *addr, size_t length, int access, int mode)
+{
+  return odp_reg_mr_caps(pd, addr, length, access, mode, ODP_RC_CAPS);
+}
+
+static inline int odp_dereg_mr(struct ibv_mr *mr)
+{
+  struct odp_mr *omr;
+  int ret = 0;
+
+  if (!mr)
+    return 0;
+
+  omr = (struct odp_mr *)((char *)mr - offsetof(struct odp_mr, mr));
+
+  if (omr->implicit)
+    odp_put_implicit(omr->real);
+  else
+    ret = ibv_dereg_mr(omr->real);
+
+  free(omr);
+
+  return ret;
+}
+
+/*
+ * Page-fault counters: the process's minor/major faults, plus the driver's ODP
+ * counters from debugfs when mounted and readable
+ * (/sys/kernel/debug/mlx5/<pci>/odp_stats/). Per-MR fault counts are also
+ * available with `rdma stat show mr`.
+ */
+static inline void odp_print_stats(struct ibv_context *ctx)
+{
+  char path[PATH_MAX], link[256], buf[64];
+  struct rusage ru;
+  struct dirent *ent;
+  const char *pci;
+  ssize_t n;
+  DIR *dir;
+
+  getrusage(RUSAGE_SELF, &ru);
+  printf("odp: process page faults: %ld minor, %ld major\n", ru.ru_minflt, ru.ru_majflt);
+
+  snprintf(path, sizeof(path), "%s/device", ctx->device->ibdev_path);
+  if ((n = readlink(path, link, sizeof(link) - 1)) < 0)
+    return;
+  link[n] = '\0';
+  pci = strrchr(link, '/') ? strrchr(link, '/') + 1 : link;
+
+  snprintf(path, sizeof(path), "/sys/kernel/debug/mlx5/%s/odp_stats", pci);
+  if (!(dir = opendir(path))) {
+    printf("odp: no driver odp counters (debugfs not mounted or not readable)\n");
+    return;
+  }
+
+  while ((ent = readdir(dir))) {
+    char file[PATH_MAX + 256];
+    FILE *f;
+
+    if (ent->d_name[0] == '.')
+      continue;
+
+    snprintf(file, sizeof(file), "%s/%s", path, ent->d_name);
+    if (!(f = fopen(file, "r")))
+      continue;
+
+    if (fgets(buf, sizeof(buf), f)) {
+      buf[strcspn(buf, "\n")] = '\0';
+      printf("odp: %s = %s\n", ent->d_name, buf);
+    }
+
+    fclose(f);
+  }
+
+  closedir(dir);
+}
+
+#endif